@@ -28,12 +28,34 @@
  */
 
 #include "server.h"
+#include "sha1.h"
+
+#include <ctype.h>
 
 /* =============================================================================
  * Global state for ACLs
  * ==========================================================================*/
 
 rax *Users; /* Table mapping usernames to user structures. */
+user *DefaultUser;  /* Global reference to the default user.
+                       Every new connection is associated to it, if no
+                       AUTH or HELLO is used to authenticate with a
+                       different user. */
+
+/* Command categories that can be used with +@<category> and -@<category>.
+ * Every category simply selects all the commands having the specified
+ * flag in the command table. */
+struct ACLCategoryItem {
+    const char *name;
+    uint64_t flag;
+} ACLCommandCategories[] = {
+    {"read", CMD_READONLY},
+    {"write", CMD_WRITE},
+    {"admin", CMD_ADMIN},
+    {"pubsub", CMD_PUBSUB},
+    {"fast", CMD_FAST},
+    {NULL,0} /* Terminator. */
+};
 
 /* =============================================================================
  * Helper functions for the rest of the ACL implementation
@@ -85,29 +107,512 @@ int time_independent_strcmp(char *a, char *b) {
  * Low level ACL API
  * ==========================================================================*/
 
+/* Method for passwords/pattern comparison used for the user->passwords list
+ * so that we can search for items with listSearchKey(). */
+int ACLListMatchSds(void *a, void *b) {
+    return sdscmp(a,b) == 0;
+}
+
+/* Method to free list elements from ACL users password/patterns lists. */
+void ACLListFreeSds(void *item) {
+    sdsfree(item);
+}
+
+/* Method to duplicate list elements from ACL users password/patterns lists. */
+void *ACLListDupSds(void *item) {
+    return sdsdup(item);
+}
+
+/* Create a user that is not stored in the Users radix tree. This is
+ * used as a scratch area by ACL SETUSER, in order to validate all the
+ * rules before touching the real user. */
+user *ACLCreateUnlinkedUser(void) {
+    user *u = zmalloc(sizeof(*u));
+    u->name = sdsempty();
+    u->flags = 0;
+    u->allowed_subcommands = NULL;
+    u->passwords = listCreate();
+    u->patterns = listCreate(); /* Just created users cannot access to any key,
+                                   however if the "~*" directive was enabled
+                                   to match all the keys, the user will be
+                                   flagged with the ALLKEYS flag. */
+    listSetMatchMethod(u->passwords,ACLListMatchSds);
+    listSetFreeMethod(u->passwords,ACLListFreeSds);
+    listSetDupMethod(u->passwords,ACLListDupSds);
+    listSetMatchMethod(u->patterns,ACLListMatchSds);
+    listSetFreeMethod(u->patterns,ACLListFreeSds);
+    listSetDupMethod(u->patterns,ACLListDupSds);
+    u->key_prefixes = NULL;
+    u->key_prefix_lens = NULL;
+    u->key_prefix_lens_count = 0;
+    u->key_globs = NULL;
+    memset(u->allowed_commands,0,sizeof(u->allowed_commands));
+    return u;
+}
+
 /* Create a new user with the specified name, store it in the list
  * of users (the Users global radix tree), and returns a reference to
  * the structure representing the user.
  *
  * If the user with such name already exists NULL is returned. */
-user *ACLcreateUser(const char *name, size_t namelen) {
+user *ACLCreateUser(const char *name, size_t namelen) {
     if (raxFind(Users,(unsigned char*)name,namelen) != raxNotFound) return NULL;
-    user *u = zmalloc(sizeof(*u));
-    u->flags = 0;
-    u->allowed_subcommands = NULL;
-    u->passwords = listCreate();
-    u->patterns = NULL; /* Just created users cannot access to any key, however
-                           if the "~*" directive was enabled to match all the
-                           keys, the user will be flagged with the ALLKEYS
-                           flag. */
-    memset(u->allowed_commands,0,sizeof(u->allowed_commands));
+    user *u = ACLCreateUnlinkedUser();
+    sdsfree(u->name);
+    u->name = sdsnewlen(name,namelen);
     raxInsert(Users,(unsigned char*)name,namelen,u,NULL);
     return u;
 }
 
+/* Release the compiled key patterns of the user, without touching the
+ * user->patterns list. */
+void ACLFreeKeyMatcher(user *u) {
+    if (u->key_prefixes) raxFree(u->key_prefixes);
+    if (u->key_globs) listRelease(u->key_globs);
+    zfree(u->key_prefix_lens);
+    u->key_prefixes = NULL;
+    u->key_prefix_lens = NULL;
+    u->key_prefix_lens_count = 0;
+    u->key_globs = NULL;
+}
+
+/* Release the memory used by the user structure. Note that this function
+ * will not remove the user from the Users global radix tree. */
+void ACLFreeUser(user *u) {
+    sdsfree(u->name);
+    listRelease(u->passwords);
+    listRelease(u->patterns);
+    ACLFreeKeyMatcher(u);
+    zfree(u);
+}
+
+/* Set the specified command bit for the specified user to 'value' (0 or 1).
+ * If the bit overflows the user internal represetation, no operation
+ * is performed. */
+void ACLSetUserCommandBit(user *u, unsigned long id, int value) {
+    if (id >= USER_MAX_COMMAND_BIT) return;
+    uint64_t bit = 1ULL << (id % 64);
+    if (value)
+        u->allowed_commands[id/64] |= bit;
+    else
+        u->allowed_commands[id/64] &= ~bit;
+}
+
+/* Check if the specified command bit is set for the specified user.
+ * The function returns 1 is the bit is set or 0 if it is not.
+ * Note that this function does not check the ALLCOMMANDS flag of the user
+ * but just the lowlevel bitmask.
+ *
+ * If the bit overflows the user internal represetation, zero is returned
+ * in order to disallow the execution of the command in such edge case. */
+int ACLGetUserCommandBit(user *u, unsigned long id) {
+    if (id >= USER_MAX_COMMAND_BIT) return 0;
+    return (u->allowed_commands[id/64] & (1ULL << (id % 64))) != 0;
+}
+
+/* Set or clear the command bit of every command having the specified
+ * flag in the command table. If 'flag' is zero, all the commands are
+ * selected. */
+void ACLSetUserCommandBitsForFlag(user *u, uint64_t flag, int value) {
+    dictIterator *di = dictGetIterator(server.orig_commands);
+    dictEntry *de;
+    while ((de = dictNext(di)) != NULL) {
+        struct redisCommand *cmd = dictGetVal(de);
+        if (flag == 0 || (cmd->flags & flag))
+            ACLSetUserCommandBit(u,cmd->id,value);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Return the command flag associated with the category name, or zero
+ * if there is no such category. */
+uint64_t ACLGetCommandCategoryFlagByName(const char *name) {
+    for (int j = 0; ACLCommandCategories[j].name != NULL; j++) {
+        if (!strcasecmp(name,ACLCommandCategories[j].name))
+            return ACLCommandCategories[j].flag;
+    }
+    return 0;
+}
+
+/* Add the key pattern 'pat' to the compiled key matcher of the user.
+ * See the comment in the user structure for how patterns are stored. */
+void ACLCompileKeyPattern(user *u, sds pat) {
+    size_t len = sdslen(pat), prefixlen = len;
+    uint64_t kind = ACL_KEY_EXACT;
+
+    for (size_t j = 0; j < len; j++) {
+        char c = pat[j];
+        if (c == '*' && j == len-1) {
+            kind = ACL_KEY_PREFIX;
+            prefixlen = j;
+        } else if (c == '*' || c == '?' || c == '[' || c == '\\') {
+            kind = 0;
+            break;
+        }
+    }
+
+    if (kind == 0) {
+        if (u->key_globs == NULL) {
+            u->key_globs = listCreate();
+            listSetFreeMethod(u->key_globs,ACLListFreeSds);
+        }
+        listAddNodeTail(u->key_globs,sdsdup(pat));
+        return;
+    }
+
+    if (u->key_prefixes == NULL) u->key_prefixes = raxNew();
+    void *old = raxFind(u->key_prefixes,(unsigned char*)pat,prefixlen);
+    uint64_t flags = (old == raxNotFound) ? 0 : (uint64_t)(uintptr_t)old;
+    raxInsert(u->key_prefixes,(unsigned char*)pat,prefixlen,
+              (void*)(uintptr_t)(flags|kind),NULL);
+
+    /* Remember the new length, keeping the array sorted. */
+    size_t j = 0;
+    while (j < u->key_prefix_lens_count && u->key_prefix_lens[j] < prefixlen)
+        j++;
+    if (j < u->key_prefix_lens_count && u->key_prefix_lens[j] == prefixlen)
+        return;
+    u->key_prefix_lens = zrealloc(u->key_prefix_lens,
+        sizeof(size_t)*(u->key_prefix_lens_count+1));
+    memmove(u->key_prefix_lens+j+1,u->key_prefix_lens+j,
+        sizeof(size_t)*(u->key_prefix_lens_count-j));
+    u->key_prefix_lens[j] = prefixlen;
+    u->key_prefix_lens_count++;
+}
+
+/* Return 1 if the user is allowed to mention the specified key, otherwise
+ * zero is returned. */
+int ACLUserCanAccessKey(user *u, const char *key, size_t keylen) {
+    if (u->flags & USER_FLAG_ALLKEYS) return 1;
+
+    for (size_t j = 0; j < u->key_prefix_lens_count; j++) {
+        size_t len = u->key_prefix_lens[j];
+        if (len > keylen) break;
+        void *v = raxFind(u->key_prefixes,(unsigned char*)key,len);
+        if (v == raxNotFound) continue;
+        uint64_t flags = (uint64_t)(uintptr_t)v;
+        if (flags & ACL_KEY_PREFIX) return 1;
+        if ((flags & ACL_KEY_EXACT) && len == keylen) return 1;
+    }
+
+    if (u->key_globs) {
+        listIter li;
+        listNode *ln;
+        listRewind(u->key_globs,&li);
+        while((ln = listNext(&li))) {
+            sds pat = listNodeValue(ln);
+            if (stringmatchlen(pat,sdslen(pat),key,keylen,0)) return 1;
+        }
+    }
+    return 0;
+}
+
+/* Return the SHA1 hash of the password as an SDS string of 40 lowercase
+ * hex chars. Users only store password hashes, so that ACL LIST and
+ * ACL GETUSER never show passwords in clear text. */
+sds ACLHashPassword(unsigned char *cleartext, size_t len) {
+    SHA1_CTX ctx;
+    unsigned char hash[20];
+    char hex[40];
+    char *cset = "0123456789abcdef";
+
+    SHA1Init(&ctx);
+    SHA1Update(&ctx,cleartext,len);
+    SHA1Final(hash,&ctx);
+    for (int j = 0; j < 20; j++) {
+        hex[j*2] = cset[(hash[j]&0xF0)>>4];
+        hex[j*2+1] = cset[hash[j]&0xF];
+    }
+    return sdsnewlen(hex,sizeof(hex));
+}
+
+/* Return C_OK if 'hash' looks like a hash returned by ACLHashPassword(). */
+int ACLCheckPasswordHash(unsigned char *hash, size_t len) {
+    if (len != 40) return C_ERR;
+    for (size_t j = 0; j < len; j++) {
+        if (!isxdigit(hash[j])) return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Set user properties according to the string "op". The following
+ * is a description of what different strings will do:
+ *
+ * on           Enable the user: it is possible to authenticate as this user.
+ * off          Disable the user: it's no longer possible to authenticate
+ *              with this user, however the already authenticated connections
+ *              will still work.
+ * +<command>   Allow the execution of that command
+ * -<command>   Disallow the execution of that command
+ * +@<category> Allow the execution of all the commands in such category.
+ *              Valid categories are: all, read, write, admin, pubsub, fast.
+ * -@<category> Like +@<category> but removes all the commands in the
+ *              category instead of adding them.
+ * allcommands  Alias for +@all.
+ * nocommands   Alias for -@all.
+ * ~<pattern>   Add a pattern of keys that can be mentioned as part of
+ *              commands. For instance ~* allows all the keys. The pattern
+ *              is a glob-style pattern like the one of KEYS.
+ *              It is possible to specify multiple patterns.
+ * allkeys      Alias for ~*.
+ * resetkeys    Flush the list of allowed keys patterns.
+ * ><password>  Add this password to the list of valid password for the user.
+ *              For example >mypass will add "mypass" to the list.
+ *              This directive clears the "nopass" flag (see later).
+ *              Only the SHA1 hash of the password is stored.
+ * #<hash>      Add this password hash to the list of valid passwords: this
+ *              is the form used by ACL LIST, so that its output can be used
+ *              to recreate the user without showing the passwords.
+ * <<password>  Remove this password from the list of valid passwords.
+ * !<hash>      Remove this password hash from the list of valid passwords.
+ * nopass       All the set passwords of the user are removed, and the user
+ *              is flagged as requiring no password: it means that every
+ *              password will work against this user.
+ * resetpass    Flush the list of allowed passwords. Moreover removes the
+ *              "nopass" status.
+ * reset        Performs the following actions: resetpass, resetkeys, off,
+ *              -@all. The user returns to the same state it has immediately
+ *              after its creation.
+ *
+ * The 'op' string must be null terminated. The 'oplen' argument should
+ * specify the length of the 'op' string in case the caller requires to pass
+ * binary data (for instance the >password form may use a binary password).
+ * Otherwise the field can be set to -1 and the function will use strlen()
+ * to determine the length.
+ *
+ * The function returns C_OK if the action to perform was understood because
+ * the 'op' string made sense. Otherwise C_ERR is returned if the operation
+ * is unknown or has some syntax error, and errno is set to:
+ *
+ *  EINVAL: The specified opcode is not understood.
+ *  ENOENT: The command name or command category provided with + or - is not
+ *          known.
+ *  ENODEV: The password to remove with < does not exist.
+ */
+int ACLSetUser(user *u, const char *op, ssize_t oplen) {
+    if (oplen == -1) oplen = strlen(op);
+    if (!strcasecmp(op,"on")) {
+        u->flags |= USER_FLAG_ENABLED;
+    } else if (!strcasecmp(op,"off")) {
+        u->flags &= ~USER_FLAG_ENABLED;
+    } else if (!strcasecmp(op,"allkeys") ||
+               !strcasecmp(op,"~*"))
+    {
+        u->flags |= USER_FLAG_ALLKEYS;
+        listEmpty(u->patterns);
+        ACLFreeKeyMatcher(u);
+    } else if (!strcasecmp(op,"resetkeys")) {
+        u->flags &= ~USER_FLAG_ALLKEYS;
+        listEmpty(u->patterns);
+        ACLFreeKeyMatcher(u);
+    } else if (!strcasecmp(op,"allcommands") ||
+               !strcasecmp(op,"+@all"))
+    {
+        u->flags |= USER_FLAG_ALLCOMMANDS;
+        memset(u->allowed_commands,255,sizeof(u->allowed_commands));
+    } else if (!strcasecmp(op,"nocommands") ||
+               !strcasecmp(op,"-@all"))
+    {
+        u->flags &= ~USER_FLAG_ALLCOMMANDS;
+        memset(u->allowed_commands,0,sizeof(u->allowed_commands));
+    } else if (!strcasecmp(op,"nopass")) {
+        u->flags |= USER_FLAG_NOPASS;
+        listEmpty(u->passwords);
+    } else if (!strcasecmp(op,"resetpass")) {
+        u->flags &= ~USER_FLAG_NOPASS;
+        listEmpty(u->passwords);
+    } else if (!strcasecmp(op,"reset")) {
+        serverAssert(ACLSetUser(u,"resetpass",-1) == C_OK);
+        serverAssert(ACLSetUser(u,"resetkeys",-1) == C_OK);
+        serverAssert(ACLSetUser(u,"off",-1) == C_OK);
+        serverAssert(ACLSetUser(u,"-@all",-1) == C_OK);
+    } else if (op[0] == '>' || op[0] == '#') {
+        sds newpass;
+        if (op[0] == '>') {
+            if (oplen-1 > CONFIG_AUTHPASS_MAX_LEN) {
+                errno = EINVAL;
+                return C_ERR;
+            }
+            newpass = ACLHashPassword((unsigned char*)op+1,oplen-1);
+        } else {
+            if (ACLCheckPasswordHash((unsigned char*)op+1,oplen-1) == C_ERR) {
+                errno = EBADMSG;
+                return C_ERR;
+            }
+            newpass = sdsnewlen(op+1,oplen-1);
+            sdstolower(newpass);
+        }
+        listNode *ln = listSearchKey(u->passwords,newpass);
+        /* Avoid re-adding the same password multiple times. */
+        if (ln == NULL)
+            listAddNodeTail(u->passwords,newpass);
+        else
+            sdsfree(newpass);
+        u->flags &= ~USER_FLAG_NOPASS;
+    } else if (op[0] == '<' || op[0] == '!') {
+        sds delpass;
+        if (op[0] == '<') {
+            delpass = ACLHashPassword((unsigned char*)op+1,oplen-1);
+        } else {
+            if (ACLCheckPasswordHash((unsigned char*)op+1,oplen-1) == C_ERR) {
+                errno = EBADMSG;
+                return C_ERR;
+            }
+            delpass = sdsnewlen(op+1,oplen-1);
+            sdstolower(delpass);
+        }
+        listNode *ln = listSearchKey(u->passwords,delpass);
+        sdsfree(delpass);
+        if (ln) {
+            listDelNode(u->passwords,ln);
+        } else {
+            errno = ENODEV;
+            return C_ERR;
+        }
+    } else if (op[0] == '~') {
+        if (u->flags & USER_FLAG_ALLKEYS) return C_OK;
+        sds newpat = sdsnewlen(op+1,oplen-1);
+        if (listSearchKey(u->patterns,newpat) == NULL) {
+            listAddNodeTail(u->patterns,newpat);
+            ACLCompileKeyPattern(u,newpat);
+        } else {
+            sdsfree(newpat);
+        }
+    } else if ((op[0] == '+' || op[0] == '-') && op[1] == '@') {
+        uint64_t flag = ACLGetCommandCategoryFlagByName(op+2);
+        if (flag == 0) {
+            errno = ENOENT;
+            return C_ERR;
+        }
+        if (op[0] == '-') u->flags &= ~USER_FLAG_ALLCOMMANDS;
+        ACLSetUserCommandBitsForFlag(u,flag,op[0] == '+');
+    } else if (op[0] == '+' || op[0] == '-') {
+        struct redisCommand *cmd = lookupCommandByCString((char*)op+1);
+        if (cmd == NULL) {
+            errno = ENOENT;
+            return C_ERR;
+        }
+        if (op[0] == '-') u->flags &= ~USER_FLAG_ALLCOMMANDS;
+        ACLSetUserCommandBit(u,cmd->id,op[0] == '+');
+    } else {
+        errno = EINVAL;
+        return C_ERR;
+    }
+    return C_OK;
+}
+
+/* Return a description of the error that occurred in ACLSetUser() according to
+ * the errno value set by the function on error. */
+char *ACLSetUserStringError(void) {
+    char *errmsg = "Wrong format";
+    if (errno == ENOENT)
+        errmsg = "Unknown command or category name in ACL";
+    else if (errno == EINVAL)
+        errmsg = "Syntax error";
+    else if (errno == ENODEV)
+        errmsg = "The password you are trying to remove from the user does "
+                 "not exist";
+    else if (errno == EBADMSG)
+        errmsg = "The password hash must be exactly 40 characters and "
+                 "contain only hexadecimal characters";
+    return errmsg;
+}
+
+/* Copy the ACL rules of the user 'src' into the user 'dst'. The name of
+ * 'dst' is retained. This is used by ACL SETUSER in order to apply all the
+ * rules to a scratch user first, so that the operation is atomic. */
+void ACLCopyUser(user *dst, user *src) {
+    listRelease(dst->passwords);
+    listRelease(dst->patterns);
+    ACLFreeKeyMatcher(dst);
+    dst->passwords = listDup(src->passwords);
+    dst->patterns = listDup(src->patterns);
+    dst->flags = src->flags;
+    memcpy(dst->allowed_commands,src->allowed_commands,
+           sizeof(dst->allowed_commands));
+
+    listIter li;
+    listNode *ln;
+    listRewind(dst->patterns,&li);
+    while((ln = listNext(&li))) ACLCompileKeyPattern(dst,listNodeValue(ln));
+}
+
+/* Create the default user, this has special permissions. */
+user *ACLCreateDefaultUser(void) {
+    user *new = ACLCreateUser("default",7);
+    ACLSetUser(new,"+@all",-1);
+    ACLSetUser(new,"~*",-1);
+    ACLSetUser(new,"on",-1);
+    ACLSetUser(new,"nopass",-1);
+    return new;
+}
+
 /* Initialization of the ACL subsystem. */
 void ACLInit(void) {
     Users = raxNew();
+    DefaultUser = ACLCreateDefaultUser();
+    ACLUpdateDefaultUserPassword(server.requirepass);
+}
+
+/* The "requirepass" option is just a way to set the password of the
+ * default user: this function is called every time it changes. */
+void ACLUpdateDefaultUserPassword(char *password) {
+    ACLSetUser(DefaultUser,"resetpass",-1);
+    if (password) {
+        sds aclop = sdscatlen(sdsnew(">"), password, strlen(password));
+        ACLSetUser(DefaultUser,aclop,sdslen(aclop));
+        sdsfree(aclop);
+    } else {
+        ACLSetUser(DefaultUser,"nopass",-1);
+    }
+}
+
+/* Return true if connections must authenticate before running commands:
+ * this happens when the default user has passwords, or when it is disabled,
+ * since in both cases it is not possible to implicitly be the default user
+ * without calling AUTH. */
+int ACLDefaultUserRequiresAuth(void) {
+    return !(DefaultUser->flags & USER_FLAG_NOPASS) ||
+           !(DefaultUser->flags & USER_FLAG_ENABLED);
+}
+
+/* Called when the default user is modified by ACL SETUSER, so that the
+ * "requirepass" option, used by CONFIG GET, CONFIG REWRITE and the
+ * protected mode check, keeps describing the default user. Only hashes are
+ * stored by the user, so 'lastpass' is the last cleartext password set by
+ * the command, if any. */
+void ACLUpdateRequirePass(sds lastpass) {
+    if (DefaultUser->flags & USER_FLAG_NOPASS ||
+        listLength(DefaultUser->passwords) == 0)
+    {
+        zfree(server.requirepass);
+        server.requirepass = NULL;
+        return;
+    }
+
+    /* Use the last password set, if it is still valid. Otherwise retain
+     * the current one if it still works: if it does not, and we don't know
+     * any valid password in clear text, the option is unset. */
+    sds hashed;
+    if (lastpass) {
+        hashed = ACLHashPassword((unsigned char*)lastpass,sdslen(lastpass));
+        if (listSearchKey(DefaultUser->passwords,hashed)) {
+            zfree(server.requirepass);
+            server.requirepass = zstrdup(lastpass);
+            sdsfree(hashed);
+            return;
+        }
+        sdsfree(hashed);
+    }
+    if (server.requirepass) {
+        hashed = ACLHashPassword((unsigned char*)server.requirepass,
+                                 strlen(server.requirepass));
+        if (listSearchKey(DefaultUser->passwords,hashed) == NULL) {
+            zfree(server.requirepass);
+            server.requirepass = NULL;
+        }
+        sdsfree(hashed);
+    }
 }
 
 /* Check the username and password pair and return C_OK if they are valid,
@@ -117,20 +622,39 @@ void ACLInit(void) {
  *  ENONENT: if the specified user does not exist at all.
  */
 int ACLCheckUserCredentials(robj *username, robj *password) {
-    /* For now only the "default" user is allowed. When the RCP1 ACLs
-     * will be implemented multiple usernames will be supproted. */
-    if (username != NULL && strcmp(username->ptr,"default")) {
+    user *u = ACLGetUserByName(username->ptr,sdslen(username->ptr));
+    if (u == NULL) {
         errno = ENOENT;
         return C_ERR;
     }
 
-    /* For now we just compare the password with the system wide one. */
-    if (!time_independent_strcmp(password->ptr, server.requirepass)) {
-        return C_OK;
-    } else {
+    /* Disabled users can't login. */
+    if ((u->flags & USER_FLAG_ENABLED) == 0) {
         errno = EINVAL;
         return C_ERR;
     }
+
+    /* If the user is configured to don't require any password, we
+     * are already fine here. */
+    if (u->flags & USER_FLAG_NOPASS) return C_OK;
+
+    /* Check all the user passwords for at least one to match. */
+    listIter li;
+    listNode *ln;
+    sds hashed = ACLHashPassword(password->ptr,sdslen(password->ptr));
+    listRewind(u->passwords,&li);
+    while((ln = listNext(&li))) {
+        sds thispass = listNodeValue(ln);
+        if (!time_independent_strcmp(hashed, thispass)) {
+            sdsfree(hashed);
+            return C_OK;
+        }
+    }
+    sdsfree(hashed);
+
+    /* If we reached this point, no password matched. */
+    errno = EINVAL;
+    return C_ERR;
 }
 
 /* For ACL purposes, every user has a bitmap with the commands that such
@@ -157,6 +681,399 @@ user *ACLGetUserByName(const char *name, size_t namelen) {
     return myuser;
 }
 
+/* Check if the command ready to be executed in the client 'c', and already
+ * referenced by c->cmd, can be executed by this client according to the
+ * ACls associated to the client user c->user.
+ *
+ * If the user can execute the command ACL_OK is returned, otherwise
+ * ACL_DENIED_CMD or ACL_DENIED_KEY is returned: the first in case the
+ * command cannot be executed because the user is not allowed to run such
+ * command, the second if the command is denied because the user is trying
+ * to access keys that are not among the specified patterns.
+ *
+ * The command check is a single bit test in the user bitmap, indexed by the
+ * command ID assigned at command table creation. Keys are only extracted
+ * when the user is not flagged with ALLKEYS. */
+int ACLCheckCommandPerm(client *c) {
+    user *u = c->user;
+    uint64_t id = c->cmd->id;
+
+    /* If there is no associated user, the connection can run anything. */
+    if (u == NULL) return ACL_OK;
+
+    /* We have to always allow AUTH and HELLO, otherwise a client could not
+     * switch to a different user. */
+    if (c->cmd->proc == authCommand || c->cmd->proc == helloCommand)
+        return ACL_OK;
+
+    /* Check if the user can execute this command. */
+    if (!(u->flags & USER_FLAG_ALLCOMMANDS) && !ACLGetUserCommandBit(u,id))
+        return ACL_DENIED_CMD;
+
+    /* Check if the user can execute commands explicitly touching the keys
+     * mentioned in the command arguments. */
+    if (!(u->flags & USER_FLAG_ALLKEYS) &&
+        (c->cmd->getkeys_proc || c->cmd->firstkey))
+    {
+        int numkeys;
+        int *keyidx = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+        for (int j = 0; j < numkeys; j++) {
+            robj *key = c->argv[keyidx[j]];
+            if (!sdsEncodedObject(key) ||
+                !ACLUserCanAccessKey(u,key->ptr,sdslen(key->ptr)))
+            {
+                getKeysFreeResult(keyidx);
+                return ACL_DENIED_KEY;
+            }
+        }
+        getKeysFreeResult(keyidx);
+    }
+
+    /* If we survived all the above checks, the user can execute the
+     * command. */
+    return ACL_OK;
+}
+
 /* =============================================================================
  * ACL related commands
  * ==========================================================================*/
+
+/* Describe the commands the user 'u' can run, as a sequence of rules
+ * accepted by ACL SETUSER, like "-@all +get +set". */
+sds ACLDescribeUserCommandRules(user *u) {
+    if (u->flags & USER_FLAG_ALLCOMMANDS) return sdsnew("+@all");
+
+    sds rules = sdsnew("-@all");
+    dictIterator *di = dictGetIterator(server.orig_commands);
+    dictEntry *de;
+    while ((de = dictNext(di)) != NULL) {
+        struct redisCommand *cmd = dictGetVal(de);
+        if (ACLGetUserCommandBit(u,cmd->id))
+            rules = sdscatprintf(rules," +%s",cmd->name);
+    }
+    dictReleaseIterator(di);
+    return rules;
+}
+
+/* Emit the list of rules of the user 'u' in the same format accepted by
+ * ACL SETUSER, so that the output can be used to recreate the user. */
+sds ACLDescribeUser(user *u) {
+    sds res = sdsempty();
+    res = sdscat(res,(u->flags & USER_FLAG_ENABLED) ? "on" : "off");
+    if (u->flags & USER_FLAG_NOPASS) res = sdscat(res," nopass");
+
+    listIter li;
+    listNode *ln;
+    listRewind(u->passwords,&li);
+    while((ln = listNext(&li))) {
+        sds thispass = listNodeValue(ln);
+        res = sdscatlen(res," #",2);
+        res = sdscatsds(res,thispass);
+    }
+
+    if (u->flags & USER_FLAG_ALLKEYS) {
+        res = sdscat(res," ~*");
+    } else {
+        listRewind(u->patterns,&li);
+        while((ln = listNext(&li))) {
+            sds thispat = listNodeValue(ln);
+            res = sdscatlen(res," ~",2);
+            res = sdscatsds(res,thispat);
+        }
+    }
+
+    sds rules = ACLDescribeUserCommandRules(u);
+    res = sdscatlen(res," ",1);
+    res = sdscatsds(res,rules);
+    sdsfree(rules);
+    return res;
+}
+
+/* ACL -- show and modify the configuration of ACL users.
+ * ACL SETUSER <username> ... acl rules ...
+ * ACL GETUSER <username>
+ * ACL DELUSER <username> [...]
+ * ACL USERS
+ * ACL LIST
+ * ACL WHOAMI
+ */
+void aclCommand(client *c) {
+    char *sub = c->argv[1]->ptr;
+    if (!strcasecmp(sub,"setuser") && c->argc >= 3) {
+        sds username = c->argv[2]->ptr;
+        user *u = ACLGetUserByName(username,sdslen(username));
+
+        /* Apply the rules to a scratch user so that the operation is
+         * atomic: either all the rules are valid, or the user is not
+         * touched at all. */
+        user *tempu = ACLCreateUnlinkedUser();
+        if (u) ACLCopyUser(tempu,u);
+
+        for (int j = 3; j < c->argc; j++) {
+            sds op = c->argv[j]->ptr;
+            if (ACLSetUser(tempu,op,sdslen(op)) != C_OK) {
+                addReplyErrorFormat(c,
+                    "Error in ACL SETUSER modifier '%s': %s",
+                    op, ACLSetUserStringError());
+                ACLFreeUser(tempu);
+                return;
+            }
+        }
+
+        if (u == NULL) u = ACLCreateUser(username,sdslen(username));
+        ACLCopyUser(u,tempu);
+        ACLFreeUser(tempu);
+        if (u == DefaultUser) {
+            sds lastpass = NULL;
+            for (int j = c->argc-1; j >= 3; j--) {
+                sds op = c->argv[j]->ptr;
+                if (op[0] == '>') {
+                    lastpass = sdsnewlen(op+1,sdslen(op)-1);
+                    break;
+                }
+            }
+            ACLUpdateRequirePass(lastpass);
+            sdsfree(lastpass);
+        }
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(sub,"deluser") && c->argc >= 3) {
+        int deleted = 0;
+        for (int j = 2; j < c->argc; j++) {
+            sds username = c->argv[j]->ptr;
+            if (!strcmp(username,"default")) {
+                addReplyError(c,"The 'default' user cannot be removed");
+                return;
+            }
+        }
+        for (int j = 2; j < c->argc; j++) {
+            sds username = c->argv[j]->ptr;
+            user *u;
+            if (raxRemove(Users,(unsigned char*)username,sdslen(username),
+                          (void**)&u))
+            {
+                /* Disconnect every client authenticated as this user,
+                 * otherwise they would reference freed memory. */
+                listIter li;
+                listNode *ln;
+                listRewind(server.clients,&li);
+                while ((ln = listNext(&li)) != NULL) {
+                    client *cl = listNodeValue(ln);
+                    if (cl->user == u) {
+                        cl->user = DefaultUser;
+                        cl->authenticated = 0;
+                        if (cl != c) freeClientAsync(cl);
+                    }
+                }
+                ACLFreeUser(u);
+                deleted++;
+            }
+        }
+        addReplyLongLong(c,deleted);
+    } else if (!strcasecmp(sub,"getuser") && c->argc == 3) {
+        user *u = ACLGetUserByName(c->argv[2]->ptr,sdslen(c->argv[2]->ptr));
+        if (u == NULL) {
+            addReplyNull(c);
+            return;
+        }
+
+        addReplyMapLen(c,4);
+
+        /* Flags */
+        addReplyBulkCString(c,"flags");
+        void *deflen = addReplyDeferredLen(c);
+        int numflags = 0;
+        if (u->flags & USER_FLAG_ENABLED) {
+            addReplyBulkCString(c,"on");
+            numflags++;
+        } else {
+            addReplyBulkCString(c,"off");
+            numflags++;
+        }
+        if (u->flags & USER_FLAG_ALLKEYS) {
+            addReplyBulkCString(c,"allkeys");
+            numflags++;
+        }
+        if (u->flags & USER_FLAG_ALLCOMMANDS) {
+            addReplyBulkCString(c,"allcommands");
+            numflags++;
+        }
+        if (u->flags & USER_FLAG_NOPASS) {
+            addReplyBulkCString(c,"nopass");
+            numflags++;
+        }
+        setDeferredSetLen(c,deflen,numflags);
+
+        /* Passwords: only the hashes are stored. */
+        listIter li;
+        listNode *ln;
+        addReplyBulkCString(c,"passwords");
+        addReplyArrayLen(c,listLength(u->passwords));
+        listRewind(u->passwords,&li);
+        while((ln = listNext(&li))) {
+            sds thispass = listNodeValue(ln);
+            addReplyBulkCBuffer(c,thispass,sdslen(thispass));
+        }
+
+        /* Commands */
+        addReplyBulkCString(c,"commands");
+        addReplyBulkSds(c,ACLDescribeUserCommandRules(u));
+
+        /* Key patterns */
+        addReplyBulkCString(c,"keys");
+        if (u->flags & USER_FLAG_ALLKEYS) {
+            addReplyArrayLen(c,1);
+            addReplyBulkCBuffer(c,"*",1);
+        } else {
+            addReplyArrayLen(c,listLength(u->patterns));
+            listRewind(u->patterns,&li);
+            while((ln = listNext(&li))) {
+                sds thispat = listNodeValue(ln);
+                addReplyBulkCBuffer(c,thispat,sdslen(thispat));
+            }
+        }
+    } else if ((!strcasecmp(sub,"users") || !strcasecmp(sub,"list")) &&
+               c->argc == 2)
+    {
+        int justnames = !strcasecmp(sub,"users");
+        addReplyArrayLen(c,raxSize(Users));
+        raxIterator ri;
+        raxStart(&ri,Users);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri)) {
+            user *u = ri.data;
+            if (justnames) {
+                addReplyBulkCBuffer(c,ri.key,ri.key_len);
+            } else {
+                sds config = sdsnew("user ");
+                config = sdscatsds(config,u->name);
+                config = sdscatlen(config," ",1);
+                sds descr = ACLDescribeUser(u);
+                config = sdscatsds(config,descr);
+                sdsfree(descr);
+                addReplyBulkSds(c,config);
+            }
+        }
+        raxStop(&ri);
+    } else if (!strcasecmp(sub,"whoami") && c->argc == 2) {
+        if (c->user != NULL) {
+            addReplyBulkCBuffer(c,c->user->name,sdslen(c->user->name));
+        } else {
+            addReplyNull(c);
+        }
+    } else if (!strcasecmp(sub,"help")) {
+        const char *help[] = {
+"SETUSER <username> [attribs ...] -- Create or modify a user.",
+"GETUSER <username>               -- Get the user details.",
+"DELUSER <username> [...]         -- Delete a list of users.",
+"USERS                            -- List all the registered usernames.",
+"LIST                             -- Show users in the config file format.",
+"WHOAMI                           -- Return the current connection username.",
+NULL
+        };
+        addReplyHelp(c,help);
+    } else {
+        addReplyErrorFormat(c,"Unknown subcommand or wrong number of arguments for '%s'. Try ACL HELP",
+            (char*)c->argv[1]->ptr);
+    }
+}
+
+#ifdef REDIS_TEST
+#define aclTestAssert(_e) ((_e)?(void)0:(_aclTestAssert(#_e,__FILE__,__LINE__),exit(1)))
+static void _aclTestAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static int aclTestCanAccess(user *u, char *key) {
+    return ACLUserCanAccessKey(u,key,strlen(key));
+}
+
+static int aclTestAuth(char *username, char *password) {
+    robj *user = createStringObject(username,strlen(username));
+    robj *pass = createStringObject(password,strlen(password));
+    int retval = ACLCheckUserCredentials(user,pass);
+    decrRefCount(user);
+    decrRefCount(pass);
+    return retval;
+}
+
+int aclTest(int argc, char **argv) {
+    user *u;
+    sds descr;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    ACLInit();
+
+    printf("Compiled key patterns: ");
+    {
+        u = ACLCreateUser("alice",5);
+        aclTestAssert(ACLSetUser(u,"~object:*",-1) == C_OK);
+        aclTestAssert(ACLSetUser(u,"~exact",-1) == C_OK);
+        aclTestAssert(ACLSetUser(u,"~user:*:name",-1) == C_OK);
+        aclTestAssert(aclTestCanAccess(u,"object:1"));
+        aclTestAssert(aclTestCanAccess(u,"object:"));
+        aclTestAssert(!aclTestCanAccess(u,"object"));
+        aclTestAssert(aclTestCanAccess(u,"exact"));
+        aclTestAssert(!aclTestCanAccess(u,"exactly"));
+        aclTestAssert(!aclTestCanAccess(u,"exac"));
+        aclTestAssert(aclTestCanAccess(u,"user:10:name"));
+        aclTestAssert(!aclTestCanAccess(u,"user:10:mail"));
+        aclTestAssert(ACLSetUser(u,"resetkeys",-1) == C_OK);
+        aclTestAssert(!aclTestCanAccess(u,"object:1"));
+        aclTestAssert(ACLSetUser(u,"allkeys",-1) == C_OK);
+        aclTestAssert(aclTestCanAccess(u,"anything"));
+        printf("OK\n");
+    }
+
+    printf("Passwords are stored and shown only as hashes: ");
+    {
+        aclTestAssert(ACLSetUser(u,"on",-1) == C_OK);
+        aclTestAssert(ACLSetUser(u,">secret",-1) == C_OK);
+        aclTestAssert(aclTestAuth("alice","secret") == C_OK);
+        aclTestAssert(aclTestAuth("alice","wrong") == C_ERR);
+        descr = ACLDescribeUser(u);
+        aclTestAssert(strstr(descr,"secret") == NULL);
+        aclTestAssert(strstr(descr," #") != NULL);
+
+        /* The "#<hash>" form emitted by ACL LIST recreates the user. */
+        sds hashed = ACLHashPassword((unsigned char*)"secret",6);
+        sds op = sdscatsds(sdsnew("#"),hashed);
+        user *copy = ACLCreateUser("bob",3);
+        aclTestAssert(ACLSetUser(copy,"on",-1) == C_OK);
+        aclTestAssert(ACLSetUser(copy,op,sdslen(op)) == C_OK);
+        aclTestAssert(aclTestAuth("bob","secret") == C_OK);
+        op[0] = '!';
+        aclTestAssert(ACLSetUser(copy,op,sdslen(op)) == C_OK);
+        aclTestAssert(aclTestAuth("bob","secret") == C_ERR);
+        aclTestAssert(ACLSetUser(copy,"#nothex",-1) == C_ERR);
+        aclTestAssert(ACLSetUser(copy,"<secret",-1) == C_ERR);
+        sdsfree(op);
+        sdsfree(hashed);
+        sdsfree(descr);
+
+        aclTestAssert(ACLSetUser(u,"<secret",-1) == C_OK);
+        aclTestAssert(aclTestAuth("alice","secret") == C_ERR);
+        aclTestAssert(ACLSetUser(u,"off",-1) == C_OK);
+        aclTestAssert(ACLSetUser(u,"nopass",-1) == C_OK);
+        aclTestAssert(aclTestAuth("alice","anything") == C_ERR);
+        printf("OK\n");
+    }
+
+    printf("A disabled default user requires AUTH: ");
+    {
+        aclTestAssert(!ACLDefaultUserRequiresAuth());
+        aclTestAssert(ACLSetUser(DefaultUser,"off",-1) == C_OK);
+        aclTestAssert(ACLDefaultUserRequiresAuth());
+        aclTestAssert(aclTestAuth("default","") == C_ERR);
+        aclTestAssert(ACLSetUser(DefaultUser,"on",-1) == C_OK);
+        ACLUpdateDefaultUserPassword("foobar");
+        aclTestAssert(ACLDefaultUserRequiresAuth());
+        aclTestAssert(aclTestAuth("default","foobar") == C_OK);
+        ACLUpdateDefaultUserPassword(NULL);
+        aclTestAssert(!ACLDefaultUserRequiresAuth());
+        printf("OK\n");
+    }
+    return 0;
+}
+#endif
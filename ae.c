@@ -32,6 +32,7 @@
 
 // AE 事件库实现
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -52,6 +53,9 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
+    #ifdef HAVE_IO_URING
+    #include "ae_io_uring.c"
+    #else
     #ifdef HAVE_EPOLL
     #include "ae_epoll.c"
     #else
@@ -61,6 +65,7 @@
         #include "ae_select.c"
         #endif
     #endif
+    #endif
 #endif
 
 // 创建事件循环管理器
@@ -78,7 +83,10 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     // 初始化执行最后一次时间
     eventLoop->lastTime = time(NULL);
     // 初始化时间事件结构
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventTable = NULL;
+    eventLoop->timeEventCount = 0;
+    eventLoop->timeEventSize = 0;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -140,7 +148,13 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 
 // 删除事件处理器
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
     aeApiFree(eventLoop);
+    for (j = 0; j < eventLoop->timeEventCount; j++)
+        zfree(eventLoop->timeEventHeap[j]);
+    zfree(eventLoop->timeEventHeap);
+    zfree(eventLoop->timeEventTable);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
     zfree(eventLoop);
@@ -235,6 +249,141 @@ static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
     *ms = when_ms;
 }
 
+/* ----------------------------- Timers heap ------------------------------
+ * Time events are kept in a binary min-heap ordered by fire time, so that
+ * the nearest timer is always the first element, and inserting, deleting
+ * or rescheduling a timer is O(log(N)). Every event remembers its position
+ * in the heap. A small hash table, indexed by the event ID, makes
+ * aeDeleteTimeEvent() O(1) to locate the event.
+ * ------------------------------------------------------------------------- */
+
+#define AE_TIMERS_INITIAL_SIZE 16
+
+// 比较两个时间事件的执行时间，同时到达的按照创建顺序
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    if (a->when_sec != b->when_sec) return a->when_sec < b->when_sec;
+    if (a->when_ms != b->when_ms) return a->when_ms < b->when_ms;
+    return a->seq < b->seq;
+}
+
+static void aeTimerHeapSet(aeEventLoop *eventLoop, int index, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[index] = te;
+    te->index = index;
+}
+
+static void aeTimerHeapSiftUp(aeEventLoop *eventLoop, int index) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[index];
+
+    while (index > 0) {
+        int parent = (index-1)/2;
+        if (!aeTimeEventBefore(te,eventLoop->timeEventHeap[parent])) break;
+        aeTimerHeapSet(eventLoop,index,eventLoop->timeEventHeap[parent]);
+        index = parent;
+    }
+    aeTimerHeapSet(eventLoop,index,te);
+}
+
+static void aeTimerHeapSiftDown(aeEventLoop *eventLoop, int index) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[index];
+    int count = eventLoop->timeEventCount;
+
+    while (1) {
+        int child = index*2+1;
+        if (child >= count) break;
+        if (child+1 < count &&
+            aeTimeEventBefore(eventLoop->timeEventHeap[child+1],
+                              eventLoop->timeEventHeap[child])) child++;
+        if (!aeTimeEventBefore(eventLoop->timeEventHeap[child],te)) break;
+        aeTimerHeapSet(eventLoop,index,eventLoop->timeEventHeap[child]);
+        index = child;
+    }
+    aeTimerHeapSet(eventLoop,index,te);
+}
+
+/* Restore the heap property after the fire time of 'te' changed. */
+static void aeTimerHeapUpdate(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimerHeapSiftUp(eventLoop,te->index);
+    aeTimerHeapSiftDown(eventLoop,te->index);
+}
+
+static void aeTimerHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int index = te->index;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventCount];
+
+    te->index = -1;
+    if (last == te) return;
+    aeTimerHeapSet(eventLoop,index,last);
+    aeTimerHeapUpdate(eventLoop,last);
+}
+
+// 根据 id 在哈希表中查找时间事件
+static aeTimeEvent **aeTimerTableBucket(aeEventLoop *eventLoop, long long id) {
+    return &eventLoop->timeEventTable[id & (eventLoop->timeEventSize-1)];
+}
+
+static void aeTimerTableRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeEvent **p = aeTimerTableBucket(eventLoop,te->id);
+
+    while (*p != te) p = &(*p)->next;
+    *p = te->next;
+}
+
+/* Make room for one more event in the heap and the ID table, that always
+ * have the same size. */
+static void aeTimerGrow(aeEventLoop *eventLoop) {
+    if (eventLoop->timeEventCount == eventLoop->timeEventSize) {
+        aeTimeEvent **oldtable = eventLoop->timeEventTable;
+        int oldsize = eventLoop->timeEventSize, j;
+        int size = oldsize ? oldsize*2 : AE_TIMERS_INITIAL_SIZE;
+
+        eventLoop->timeEventHeap = zrealloc(eventLoop->timeEventHeap,
+                                            sizeof(aeTimeEvent*)*size);
+        eventLoop->timeEventTable = zcalloc(sizeof(aeTimeEvent*)*size);
+        eventLoop->timeEventSize = size;
+        for (j = 0; j < oldsize; j++) {
+            aeTimeEvent *e = oldtable[j], *next;
+            while (e) {
+                aeTimeEvent **bucket = aeTimerTableBucket(eventLoop,e->id);
+                next = e->next;
+                e->next = *bucket;
+                *bucket = e;
+                e = next;
+            }
+        }
+        zfree(oldtable);
+    }
+}
+
+/* Insert an event in the heap. Events taken out of the heap while
+ * processTimeEvents() runs their callbacks are put back with this function
+ * as well: meanwhile the callbacks may have created new timers using the
+ * slots they left free, so we always have to check the heap size. */
+static void aeTimerHeapInsert(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimerGrow(eventLoop);
+    eventLoop->timeEventHeap[eventLoop->timeEventCount] = te;
+    te->index = eventLoop->timeEventCount++;
+    aeTimerHeapSiftUp(eventLoop,te->index);
+}
+
+/* Add the event both to the heap and to the ID table. */
+static void aeTimerAdd(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeEvent **bucket;
+
+    aeTimerGrow(eventLoop);
+    bucket = aeTimerTableBucket(eventLoop,te->id);
+    te->next = *bucket;
+    *bucket = te;
+    aeTimerHeapInsert(eventLoop,te);
+}
+
+/* Free an event already removed from the heap and the ID table, calling
+ * its finalizer. */
+static void aeTimerFree(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
+}
+
 // 创建时间事件
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
@@ -247,34 +396,39 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
     te->id = id;
+    te->seq = id;
     // 获取事件执行时间
     aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
     // 时间到达需要执行的操作
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    // 头部插入
-    te->prev = NULL;
-    te->next = eventLoop->timeEventHead;
-    if (te->next)
-        te->next->prev = te;
-    eventLoop->timeEventHead = te;
+    // 插入最小堆
+    aeTimerAdd(eventLoop,te);
     return id;
 }
 
 // 删除时间事件
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            // 设置一下 id 为 AE_DELETED_EVENT_ID(-1)即可
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
-    }
-    return AE_ERR; /* NO event with the specified ID found */
+    aeTimeEvent *te;
+
+    if (id < 0 || eventLoop->timeEventSize == 0) return AE_ERR;
+    te = *aeTimerTableBucket(eventLoop,id);
+    while(te && te->id != id) te = te->next;
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+
+    /* The event may be running right now, so it is not freed here: it is
+     * just marked as deleted and moved at the top of the heap, so that
+     * processTimeEvents() will free it calling its finalizer ASAP. Events
+     * out of the heap are being processed by processTimeEvents(), that
+     * will take care of them. */
+    aeTimerTableRemove(eventLoop,te);
+    te->id = AE_DELETED_EVENT_ID;
+    te->when_sec = 0;
+    te->when_ms = 0;
+    if (te->index != -1) aeTimerHeapSiftUp(eventLoop,te->index);
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
@@ -282,36 +436,22 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
-// 寻找最进要执行的时间事件，返回快要执行的事件
+ * Since timers are in a min-heap, this is O(1). */
+// 寻找最进要执行的时间事件，即堆顶
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        // 依次比较秒和微秒数即可
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    if (eventLoop->timeEventCount == 0) return NULL;
+    return eventLoop->timeEventHeap[0];
 }
 
 /* Process time events */
 // 时间事件执行器
 static int processTimeEvents(aeEventLoop *eventLoop) {
-    int processed = 0;
+    int processed = 0, j;
     aeTimeEvent *te;
     long long maxId;
     time_t now = time(NULL);
+    aeTimeEvent *skipped = NULL;
 
     /* If the system clock is moved to the future, and then set back to the
      * right value, time events may be delayed in a random way. Often this
@@ -320,73 +460,71 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
      * Here we try to detect system clock skews, and force all the time
      * events to be processed ASAP when this happens: the idea is that
      * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
+     * indefinitely, and practice suggests it is. The heap is rebuilt
+     * since the order of the events changed. */
     if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+        for (j = 0; j < eventLoop->timeEventCount; j++)
+            eventLoop->timeEventHeap[j]->when_sec = 0;
+        for (j = eventLoop->timeEventCount/2-1; j >= 0; j--)
+            aeTimerHeapSiftDown(eventLoop,j);
     }
     // 更新时间
     eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
     // 最大时间事件 ID
     maxId = eventLoop->timeEventNextId-1;
-    while(te) {
+    while((te = aeSearchNearestTimer(eventLoop)) != NULL) {
         long now_sec, now_ms;
         long long id;
+        int retval;
 
         /* Remove events scheduled for deletion. */
         // 当前事件被删除
         if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (te->prev)
-                te->prev->next = te->next;
-            else
-                eventLoop->timeEventHead = te->next;
-            if (te->next)
-                te->next->prev = te->prev;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            // 这里释放删除时间事件
-            zfree(te);
-            te = next;
+            aeTimerHeapRemove(eventLoop,te);
+            aeTimerFree(eventLoop,te);
             continue;
         }
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        // fd 出错，无效事件
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        // 当前时间
+        // 当前时间，堆顶还没到时间的话，其余的事件也都没到
         aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            // 时间到，执行
-            int retval;
-
-            id = te->id;
-            // 执行事务
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                // 循环执行时，返回执行时间间隔
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                // 执行一次就删除
-                te->id = AE_DELETED_EVENT_ID;
-            }
+        if (now_sec < te->when_sec ||
+            (now_sec == te->when_sec && now_ms < te->when_ms)) break;
+
+        /* Every event is processed at most once per iteration, and events
+         * created by time events in this iteration are not processed at
+         * all: in both cases the event is taken out of the heap, and added
+         * back once we are done. */
+        aeTimerHeapRemove(eventLoop,te);
+        te->skipnext = skipped;
+        skipped = te;
+        if (te->id > maxId) continue;
+
+        // 时间到，执行
+        id = te->id;
+        retval = te->timeProc(eventLoop, id, te->clientData);
+        processed++;
+        if (te->id == AE_DELETED_EVENT_ID) {
+            /* The callback deleted the event itself. No other event can be
+             * added to the skipped list meanwhile, so it is still the head. */
+            skipped = te->skipnext;
+            aeTimerFree(eventLoop,te);
+        } else if (retval != AE_NOMORE) {
+            // 循环执行时，返回执行时间间隔
+            aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
+        } else {
+            // 执行一次就删除
+            skipped = te->skipnext;
+            aeTimerTableRemove(eventLoop,te);
+            aeTimerFree(eventLoop,te);
         }
-        te = te->next;
+    }
+
+    /* Put back the events taken out of the heap in this iteration. */
+    while (skipped) {
+        te = skipped;
+        skipped = te->skipnext;
+        aeTimerHeapInsert(eventLoop,te);
     }
     // 返回执行事件个数
     return processed;
@@ -591,3 +729,110 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
+
+#ifdef REDIS_TEST
+#define AE_TEST_TIMERS AE_TIMERS_INITIAL_SIZE
+
+static void aeTestOk(void) {
+    printf("OK\n");
+}
+
+#define aeTestAssert(_e) ((_e)?(void)0:(_aeTestAssert(#_e,__FILE__,__LINE__),exit(1)))
+static void _aeTestAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static void aeTestCheckHeap(aeEventLoop *eventLoop) {
+    int j;
+
+    aeTestAssert(eventLoop->timeEventCount <= eventLoop->timeEventSize);
+    for (j = 0; j < eventLoop->timeEventCount; j++) {
+        aeTimeEvent *te = eventLoop->timeEventHeap[j];
+        aeTestAssert(te->index == j);
+        if (j > 0)
+            aeTestAssert(!aeTimeEventBefore(te,
+                eventLoop->timeEventHeap[(j-1)/2]));
+    }
+}
+
+static int aeTestFired;
+
+/* Fires once, and creates a new timer that is not due yet. */
+static int aeTestCreateTimerProc(aeEventLoop *eventLoop, long long id,
+                                 void *clientData)
+{
+    (void)id;
+    (void)clientData;
+    aeTestFired++;
+    aeCreateTimeEvent(eventLoop,100000,aeTestCreateTimerProc,NULL,NULL);
+    return 1000;
+}
+
+static int aeTestOnceProc(aeEventLoop *eventLoop, long long id,
+                          void *clientData)
+{
+    (void)eventLoop;
+    (void)id;
+    (void)clientData;
+    aeTestFired++;
+    return AE_NOMORE;
+}
+
+int aeTest(int argc, char **argv) {
+    aeEventLoop *el;
+    int j;
+
+    (void)argc;
+    (void)argv;
+
+    printf("Timers are fired in order, once per iteration: ");
+    {
+        el = aeCreateEventLoop(64);
+        aeTestFired = 0;
+        for (j = 0; j < 100; j++)
+            aeCreateTimeEvent(el,j%2 ? 0 : 100000,aeTestOnceProc,NULL,NULL);
+        aeTestCheckHeap(el);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        aeTestAssert(aeTestFired == 50);
+        aeTestAssert(el->timeEventCount == 50);
+        aeTestCheckHeap(el);
+        aeDeleteEventLoop(el);
+        aeTestOk();
+    }
+
+    printf("Callbacks creating timers while others are parked: ");
+    {
+        /* Fill the heap exactly with due timers: they are all taken out of
+         * the heap while they run, and every callback creates a new timer
+         * in the slots left free. Putting back the fired timers must grow
+         * the heap. */
+        el = aeCreateEventLoop(64);
+        aeTestFired = 0;
+        for (j = 0; j < AE_TEST_TIMERS; j++)
+            aeCreateTimeEvent(el,0,aeTestCreateTimerProc,NULL,NULL);
+        aeTestAssert(el->timeEventSize == AE_TEST_TIMERS);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        aeTestAssert(aeTestFired == AE_TEST_TIMERS);
+        aeTestAssert(el->timeEventCount == AE_TEST_TIMERS*2);
+        aeTestCheckHeap(el);
+        aeDeleteEventLoop(el);
+        aeTestOk();
+    }
+
+    printf("Deleting a parked timer from another callback: ");
+    {
+        el = aeCreateEventLoop(64);
+        aeTestFired = 0;
+        long long id = aeCreateTimeEvent(el,0,aeTestCreateTimerProc,NULL,NULL);
+        aeTestAssert(aeDeleteTimeEvent(el,id) == AE_OK);
+        aeTestAssert(aeDeleteTimeEvent(el,id) == AE_ERR);
+        aeProcessEvents(el,AE_TIME_EVENTS|AE_DONT_WAIT);
+        aeTestAssert(aeTestFired == 0);
+        aeTestAssert(el->timeEventCount == 0);
+        aeDeleteEventLoop(el);
+        aeTestOk();
+    }
+    return 0;
+}
+#endif
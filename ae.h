@@ -93,10 +93,12 @@ typedef struct aeFileEvent {
 } aeFileEvent;
 
 /* Time event structure */
-// 定时事件，每次都会全部遍历事件链表
+// 定时事件，保存在按执行时间排序的最小堆中
 typedef struct aeTimeEvent {
     // 全局 ID
     long long id; /* time event identifier. */
+    long long seq; /* Creation order, to fire in order events with the
+                      same time. Unlike 'id' it is not reset on deletion. */
     // 秒精确时间戳，记录时间事件到达时间
     long when_sec; /* seconds */
     // 毫秒精确时间戳，记录时间事件到达时间
@@ -107,10 +109,11 @@ typedef struct aeTimeEvent {
     aeEventFinalizerProc *finalizerProc;
     // 私有数据
     void *clientData;
-    // 前驱节点
-    struct aeTimeEvent *prev;
-    // 后继节点
-    struct aeTimeEvent *next;
+    // 在最小堆中的位置
+    int index; /* Position in the timers heap. */
+    // 哈希表中同一个桶的下一个事件
+    struct aeTimeEvent *next; /* Next event in the same ID table bucket. */
+    struct aeTimeEvent *skipnext; /* Used by processTimeEvents(). */
 } aeTimeEvent;
 
 /* A fired event */
@@ -132,8 +135,11 @@ typedef struct aeEventLoop {
     aeFileEvent *events; /* Registered events */
     // 待执行文件事件
     aeFiredEvent *fired; /* Fired events */
-    // 时间事件列表
-    aeTimeEvent *timeEventHead;
+    // 时间事件最小堆，以及 id 到时间事件的哈希表
+    aeTimeEvent **timeEventHeap; /* Min-heap of the time events. */
+    aeTimeEvent **timeEventTable; /* Time events by ID. */
+    int timeEventCount; /* Number of time events. */
+    int timeEventSize; /* Allocated slots of the heap and the table. */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -162,4 +168,8 @@ void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 
+#ifdef REDIS_TEST
+int aeTest(int argc, char **argv);
+#endif
+
 #endif
@@ -0,0 +1,546 @@
+/* Linux io_uring(7) based ae.c module, with epoll(2) fallback
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This backend uses io_uring poll requests: registrations, cancellations
+ * and the wait for new events are queued in the submission ring and handed
+ * to the kernel with a single io_uring_enter() call per event loop
+ * iteration, while with epoll every change to the interest set is a
+ * separate epoll_ctl() call.
+ *
+ * Note that this is still readiness based I/O: the reads and the writes are
+ * performed by the file event handlers as usual. Nor does it save many
+ * syscalls in the common case: replies are written directly by
+ * handleClientsWithPendingWrites() before sleeping, and the write handler
+ * is only installed when the socket buffer is full. On the other side
+ * every fd that fired must be re-armed, while an epoll registration stays
+ * in place. With 64 clients doing ping-pong on a local socket pair this
+ * backend was a few percent slower than epoll, so it is opt-in, and only
+ * useful where epoll_ctl() calls are especially costly.
+ *
+ * Poll requests are one-shot: when one completes the fd is re-armed at the
+ * next aeApiPoll() call (again as part of the same batch). Multishot poll
+ * is not used on purpose, since it only reports new wakeups and ae.c
+ * handlers rely on level triggered semantics (readQueryFromClient() reads
+ * at most PROTO_IOBUF_LEN bytes per event and expects to be called again
+ * if more data is pending). A one-shot poll checks the readiness of the
+ * fd when it is armed, so it behaves as a level triggered poll.
+ *
+ * If the kernel does not support io_uring, or the ring can't be created
+ * (for instance because of RLIMIT_MEMLOCK), the event loop falls back to
+ * plain epoll. */
+
+// io_uring 绑定，不可用时回退到 epoll
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* Max number of entries of the submission ring. When it is full we just
+ * flush it to the kernel, so this does not limit the number of fds. */
+#define AE_URING_MAX_ENTRIES 4096
+
+/* user_data of requests whose completion we are not interested in:
+ * poll removals and the timeout of aeApiPoll(). Poll requests use the
+ * fd in the low 32 bits and a generation number in the high ones. */
+#define AE_URING_IGNORE_DATA UINT64_MAX
+
+// 每个 fd 的 poll 状态
+typedef struct aeUringFd {
+    unsigned int gen;   /* Generation of the armed poll request. */
+    int armed;          /* Mask of the armed poll request, AE_NONE if none. */
+    int queued;         /* True if the fd is in the rearm list. */
+} aeUringFd;
+
+// 事件状态
+typedef struct aeApiState {
+    /* io_uring state. ringfd is -1 when we fell back to epoll. */
+    int ringfd;
+    void *sqring, *cqring;
+    size_t sqringsz, cqringsz;
+    struct io_uring_sqe *sqes;
+    size_t sqessz;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned sqentries;
+    unsigned queued;            /* SQEs filled but not yet submitted. */
+    struct __kernel_timespec ts;
+    aeUringFd *fds;
+    int *rearm;                 /* Fds to re-arm: their poll completed, or
+                                   the ring was full when arming them. */
+    int rearmlen;
+    /* epoll fallback state. */
+    int epfd;
+    struct epoll_event *events;
+} aeApiState;
+
+static int aeUringFallback = 0; /* Set if we had to fall back to epoll. */
+
+static int aeUringSetup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int aeUringEnter(int ringfd, unsigned tosubmit, unsigned mincomplete,
+                        unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ringfd, tosubmit, mincomplete,
+                         flags, NULL, 0);
+}
+
+static void aeUringUnmap(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqessz);
+    if (state->cqring && state->cqring != state->sqring)
+        munmap(state->cqring,state->cqringsz);
+    if (state->sqring) munmap(state->sqring,state->sqringsz);
+    state->sqes = NULL;
+    state->sqring = state->cqring = NULL;
+}
+
+/* Create the ring and map the submission/completion queues in memory.
+ * Return 0 on success, -1 if io_uring is not usable. */
+static int aeUringCreate(aeApiState *state, int setsize) {
+    struct io_uring_params p;
+    unsigned entries = setsize < AE_URING_MAX_ENTRIES ?
+                       (unsigned) setsize : AE_URING_MAX_ENTRIES;
+    char *sq, *cq;
+
+    memset(&p,0,sizeof(p));
+    state->ringfd = aeUringSetup(entries,&p);
+    if (state->ringfd == -1) return -1;
+
+    /* Without IORING_FEAT_NODROP (Linux 5.5) completions may be lost when
+     * the completion ring overflows, and a lost poll completion means the
+     * fd is never re-armed. Older kernels also lack IORING_OP_TIMEOUT. */
+    if (!(p.features & IORING_FEAT_NODROP)) goto err;
+
+    state->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    state->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqringsz > state->sqringsz)
+            state->sqringsz = state->cqringsz;
+        state->cqringsz = state->sqringsz;
+    }
+    state->sqring = mmap(NULL,state->sqringsz,PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE,state->ringfd,
+                         IORING_OFF_SQ_RING);
+    if (state->sqring == MAP_FAILED) {
+        state->sqring = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqring = state->sqring;
+    } else {
+        state->cqring = mmap(NULL,state->cqringsz,PROT_READ|PROT_WRITE,
+                             MAP_SHARED|MAP_POPULATE,state->ringfd,
+                             IORING_OFF_CQ_RING);
+        if (state->cqring == MAP_FAILED) {
+            state->cqring = NULL;
+            goto err;
+        }
+    }
+    state->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqessz,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    sq = state->sqring;
+    cq = state->cqring;
+    state->sqhead = (unsigned*)(sq + p.sq_off.head);
+    state->sqtail = (unsigned*)(sq + p.sq_off.tail);
+    state->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+    state->sqarray = (unsigned*)(sq + p.sq_off.array);
+    state->cqhead = (unsigned*)(cq + p.cq_off.head);
+    state->cqtail = (unsigned*)(cq + p.cq_off.tail);
+    state->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    state->sqentries = p.sq_entries;
+    state->queued = 0;
+    return 0;
+
+err:
+    aeUringUnmap(state);
+    close(state->ringfd);
+    state->ringfd = -1;
+    return -1;
+}
+
+/* Hand the queued SQEs to the kernel. 'mincomplete' and 'flags' are
+ * passed to io_uring_enter() so that the same call can also wait for
+ * completions. */
+static int aeUringSubmit(aeApiState *state, unsigned mincomplete,
+                         unsigned flags)
+{
+    int retval;
+
+    do {
+        retval = aeUringEnter(state->ringfd,state->queued,mincomplete,flags);
+    } while (retval == -1 && errno == EINTR && !(flags & IORING_ENTER_GETEVENTS));
+    if (retval >= 0) {
+        state->queued -= (unsigned) retval < state->queued ?
+                         (unsigned) retval : state->queued;
+    }
+    return retval;
+}
+
+/* Return a zeroed SQE to fill, flushing the ring to the kernel if it is
+ * full. The entry is published by aeUringCommit(). */
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned tail = *state->sqtail;
+    unsigned head = __atomic_load_n(state->sqhead,__ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= state->sqentries) {
+        if (aeUringSubmit(state,0,0) == -1) return NULL;
+        head = __atomic_load_n(state->sqhead,__ATOMIC_ACQUIRE);
+        if (tail - head >= state->sqentries) return NULL;
+    }
+    sqe = &state->sqes[tail & *state->sqmask];
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static void aeUringCommit(aeApiState *state, struct io_uring_sqe *sqe) {
+    unsigned tail = *state->sqtail;
+
+    state->sqarray[tail & *state->sqmask] = (unsigned)(sqe - state->sqes);
+    __atomic_store_n(state->sqtail,tail+1,__ATOMIC_RELEASE);
+    state->queued++;
+}
+
+// 为 fd 提交一个 one-shot poll 请求
+static int aeUringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    unsigned events = 0;
+
+    if (!sqe) return -1;
+    if (mask & AE_READABLE) events |= POLLIN;
+    if (mask & AE_WRITABLE) events |= POLLOUT;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = ((uint64_t)state->fds[fd].gen << 32) | (uint32_t)fd;
+    aeUringCommit(state,sqe);
+    state->fds[fd].armed = mask;
+    return 0;
+}
+
+/* Queue 'fd' so that the next aeApiPoll() arms it with its current mask. */
+static void aeUringQueueRearm(aeApiState *state, int fd) {
+    if (state->fds[fd].queued) return;
+    state->fds[fd].queued = 1;
+    state->rearm[state->rearmlen++] = fd;
+}
+
+/* Cancel the poll request armed for 'fd', if any. Bumping the generation
+ * makes sure a completion already posted for the old request is ignored. */
+static int aeUringDisarm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (state->fds[fd].armed == AE_NONE) {
+        state->fds[fd].gen++;
+        return 0;
+    }
+    sqe = aeUringGetSqe(state);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = ((uint64_t)state->fds[fd].gen << 32) | (uint32_t)fd;
+    sqe->user_data = AE_URING_IGNORE_DATA;
+    aeUringCommit(state,sqe);
+    state->fds[fd].armed = AE_NONE;
+    state->fds[fd].gen++;
+    return 0;
+}
+
+static int aeEpollCreate(aeEventLoop *eventLoop, aeApiState *state) {
+    state->events = zmalloc(sizeof(struct epoll_event)*eventLoop->setsize);
+    state->epfd = epoll_create(1024); /* 1024 is just a hint for the kernel */
+    if (state->epfd == -1) {
+        zfree(state->events);
+        state->events = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// 创建 io_uring 实例，失败时使用 epoll
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+
+    if (!state) return -1;
+    state->epfd = -1;
+    if (aeUringCreate(state,eventLoop->setsize) == -1) {
+        aeUringFallback = 1;
+        if (aeEpollCreate(eventLoop,state) == -1) {
+            zfree(state);
+            return -1;
+        }
+    } else {
+        state->fds = zcalloc(sizeof(aeUringFd)*eventLoop->setsize);
+        state->rearm = zmalloc(sizeof(int)*eventLoop->setsize);
+        state->rearmlen = 0;
+    }
+    eventLoop->apidata = state;
+    return 0;
+}
+
+// 调整事件槽大小
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) {
+        state->events = zrealloc(state->events,
+                                 sizeof(struct epoll_event)*setsize);
+        return 0;
+    }
+    /* ae.c only allows to shrink the set if no fd >= setsize is in use,
+     * but completions for such fds may still be in the rearm list. */
+    if (setsize > eventLoop->setsize) {
+        state->fds = zrealloc(state->fds,sizeof(aeUringFd)*setsize);
+        memset(state->fds+eventLoop->setsize,0,
+               sizeof(aeUringFd)*(setsize-eventLoop->setsize));
+    } else {
+        int j, k = 0;
+
+        for (j = 0; j < state->rearmlen; j++)
+            if (state->rearm[j] < setsize) state->rearm[k++] = state->rearm[j];
+        state->rearmlen = k;
+        state->fds = zrealloc(state->fds,sizeof(aeUringFd)*setsize);
+    }
+    state->rearm = zrealloc(state->rearm,sizeof(int)*setsize);
+    return 0;
+}
+
+// 释放 io_uring 实例（或 epoll 实例）
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd != -1) {
+        aeUringUnmap(state);
+        close(state->ringfd);
+        zfree(state->fds);
+        zfree(state->rearm);
+    } else {
+        close(state->epfd);
+        zfree(state->events);
+    }
+    zfree(state);
+}
+
+static int aeEpollAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event ee = {0}; /* avoid valgrind warning */
+    int op = eventLoop->events[fd].mask == AE_NONE ?
+            EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if (mask & AE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    return 0;
+}
+
+static void aeEpollDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    struct epoll_event ee = {0}; /* avoid valgrind warning */
+    int mask = eventLoop->events[fd].mask & (~delmask);
+
+    if (mask & AE_READABLE) ee.events |= EPOLLIN;
+    if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (mask != AE_NONE) {
+        epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee);
+    } else {
+        /* Note, Kernel < 2.6.9 requires a non null event pointer even for
+         * EPOLL_CTL_DEL. */
+        epoll_ctl(state->epfd,EPOLL_CTL_DEL,fd,&ee);
+    }
+}
+
+/* Add events. Unlike epoll_ctl() nothing is reported here if the fd is
+ * not valid: the error is returned by the poll request itself and the
+ * fd is reported as writable, like epoll does with EPOLLERR, so that the
+ * handler will see the error performing the I/O. */
+// 添加事件，请求只会在下一次 aeApiPoll 时批量提交
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) return aeEpollAddEvent(eventLoop,fd,mask);
+
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if (state->fds[fd].armed == mask) return 0;
+    if (aeUringDisarm(state,fd) == -1) return -1;
+    /* The old request is cancelled already: if the ring is full retry at
+     * the next aeApiPoll(), with the mask ae.c will have set by then. */
+    if (aeUringArm(state,fd,mask) == -1) aeUringQueueRearm(state,fd);
+    return 0;
+}
+
+// 删除事件
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+    int mask;
+
+    if (state->ringfd == -1) {
+        aeEpollDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+
+    mask = eventLoop->events[fd].mask & (~delmask);
+    if (state->fds[fd].armed == AE_NONE || state->fds[fd].armed == mask)
+        return; /* Not armed: it will be re-armed with the new mask. */
+    if (aeUringDisarm(state,fd) == -1) return;
+    if (mask != AE_NONE && aeUringArm(state,fd,mask) == -1)
+        aeUringQueueRearm(state,fd);
+}
+
+static int aeEpollPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    int retval, numevents = 0;
+
+    retval = epoll_wait(state->epfd,state->events,eventLoop->setsize,
+            tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1);
+    if (retval > 0) {
+        int j;
+
+        numevents = retval;
+        for (j = 0; j < numevents; j++) {
+            int mask = 0;
+            struct epoll_event *e = state->events+j;
+
+            if (e->events & EPOLLIN) mask |= AE_READABLE;
+            if (e->events & EPOLLOUT) mask |= AE_WRITABLE;
+            if (e->events & EPOLLERR) mask |= AE_WRITABLE;
+            if (e->events & EPOLLHUP) mask |= AE_WRITABLE;
+            eventLoop->fired[j].fd = e->data.fd;
+            eventLoop->fired[j].mask = mask;
+        }
+    }
+    return numevents;
+}
+
+/* Re-arm the fds whose one-shot poll completed in the previous call, queue
+ * the timeout, submit everything and wait for events with a single
+ * io_uring_enter() call, then collect the completions. */
+// 获取可执行事件
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head, tail, mincomplete = 1;
+    int j, k, numevents = 0;
+
+    if (state->ringfd == -1) return aeEpollPoll(eventLoop,tvp);
+
+    /* Fds that can't be armed because the ring is full (the kernel did not
+     * consume it) stay in the list. We don't block waiting for events in
+     * this case, since the fds still to arm could be the ready ones. */
+    for (j = 0, k = 0; j < state->rearmlen; j++) {
+        int fd = state->rearm[j];
+        int mask = eventLoop->events[fd].mask;
+
+        if (mask != AE_NONE && state->fds[fd].armed == AE_NONE &&
+            aeUringArm(state,fd,mask) == -1)
+        {
+            state->rearm[k++] = fd;
+        } else {
+            state->fds[fd].queued = 0;
+        }
+    }
+    state->rearmlen = k;
+
+    if (k || (tvp && tvp->tv_sec == 0 && tvp->tv_usec == 0)) {
+        mincomplete = 0;
+    } else if (tvp) {
+        /* The timeout completes either when it expires or as soon as one
+         * other request completes, so it never outlives this call for
+         * long. Its completion is ignored. */
+        struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+        if (sqe) {
+            state->ts.tv_sec = tvp->tv_sec;
+            state->ts.tv_nsec = tvp->tv_usec*1000LL;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)&state->ts;
+            sqe->len = 1;
+            sqe->off = 1;
+            sqe->user_data = AE_URING_IGNORE_DATA;
+            aeUringCommit(state,sqe);
+        } else {
+            mincomplete = 0;
+        }
+    }
+    if (aeUringSubmit(state,mincomplete,IORING_ENTER_GETEVENTS) == -1 &&
+        errno != EINTR && errno != EBUSY && errno != ETIME) return 0;
+
+    head = *state->cqhead;
+    tail = __atomic_load_n(state->cqtail,__ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqmask];
+        uint64_t data = cqe->user_data;
+        int fd, mask = 0;
+
+        head++;
+        if (data == AE_URING_IGNORE_DATA) continue;
+        fd = (int)(data & 0xffffffff);
+        if (fd >= eventLoop->setsize ||
+            state->fds[fd].gen != (unsigned int)(data >> 32)) continue;
+
+        /* The one-shot poll is consumed: queue the fd to re-arm it. */
+        state->fds[fd].armed = AE_NONE;
+        aeUringQueueRearm(state,fd);
+        if (cqe->res < 0) {
+            mask = AE_WRITABLE; /* Let the handler see the error. */
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqhead,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+// 返回当前正在使用的 poll 库的名字
+static char *aeApiName(void) {
+    return aeUringFallback ? "epoll" : "io_uring";
+}
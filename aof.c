@@ -261,6 +261,9 @@ int startAppendOnly(void) {
     if (server.rdb_child_pid != -1) {
         server.aof_rewrite_scheduled = 1;
         serverLog(LL_WARNING,"AOF was enabled but there is already a child process saving an RDB file on disk. An AOF background was scheduled to start when possible.");
+    } else if (server.scan_child_pid != -1) {
+        server.aof_rewrite_scheduled = 1;
+        serverLog(LL_WARNING,"AOF was enabled but there is already a child process serving a background SCAN. An AOF background was scheduled to start when possible.");
     } else {
         /* If there is a pending AOF rewrite, we need to switch it off and
          * start a new one: the old one cannot be reused because it is not
@@ -554,8 +557,10 @@ sds catAppendOnlyExpireAtCommand(sds buf, struct redisCommand *cmd, robj *key, r
     return buf;
 }
 
-void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
-    sds buf = sdsempty();
+/* Append the AOF representation of the command to 'buf', emitting a SELECT
+ * first if the DB is not the one of the last command appended, and
+ * translating relative expires into absolute PEXPIREAT commands. */
+static sds catAppendOnlyCommand(sds buf, struct redisCommand *cmd, int dictid, robj **argv, int argc) {
     robj *tmpargv[3];
 
     /* The DB this command was targeting is not the same as the last command
@@ -603,21 +608,38 @@ void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int a
          * for the replication itself. */
         buf = catAppendOnlyGenericCommand(buf,argc,argv);
     }
+    return buf;
+}
+
+void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc) {
+    /* While EXEC is running, just accumulate the protocol: the whole
+     * transaction is appended at once by execPropagateBatchEnd(). */
+    if (server.propagate_batch) {
+        server.propagate_batch_aof = catAppendOnlyCommand(
+            server.propagate_batch_aof,cmd,dictid,argv,argc);
+        return;
+    }
 
+    sds buf = catAppendOnlyCommand(sdsempty(),cmd,dictid,argv,argc);
+    feedAppendOnlyFileRaw(buf,sdslen(buf));
+    sdsfree(buf);
+}
+
+/* Append already encoded protocol to the AOF buffer and, if needed, to the
+ * AOF rewrite buffer. */
+void feedAppendOnlyFileRaw(const char *buf, size_t len) {
     /* Append to the AOF buffer. This will be flushed on disk just before
      * of re-entering the event loop, so before the client will get a
      * positive reply about the operation performed. */
     if (server.aof_state == AOF_ON)
-        server.aof_buf = sdscatlen(server.aof_buf,buf,sdslen(buf));
+        server.aof_buf = sdscatlen(server.aof_buf,buf,len);
 
     /* If a background append only file rewriting is in progress we want to
      * accumulate the differences between the child DB and the current one
      * in a buffer, so that when the child process will do its work we
      * can append the differences to the new append only file. */
     if (server.aof_child_pid != -1)
-        aofRewriteBufferAppend((unsigned char*)buf,sdslen(buf));
-
-    sdsfree(buf);
+        aofRewriteBufferAppend((unsigned char*)buf,len);
 }
 
 /* ----------------------------------------------------------------------------
@@ -636,8 +658,14 @@ struct client *createFakeClient(void) {
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_len_sum = 0;
+    c->last_memory_usage = 0;
     c->bufpos = 0;
     c->flags = 0;
+    c->resp = 2;
+    c->user = NULL; /* This client can do everything, also in scripts. */
+    c->client_tracking_redirection = 0;
+    c->client_tracking_prefixes = NULL;
     c->btype = BLOCKED_NONE;
     /* We set the fake client as a slave waiting for the synchronization
      * so that Redis will not try to send replies to this client. */
@@ -1238,7 +1266,7 @@ int rewriteModuleObject(rio *r, robj *key, robj *o) {
     moduleValue *mv = o->ptr;
     moduleType *mt = mv->type;
     moduleInitIOContext(io,mt,r);
-    mt->aof_rewrite(&io,key,mv->value);
+    moduleTypeRewriteValue(&io,key,mv);
     if (io.ctx) {
         moduleFreeContext(io.ctx);
         zfree(io.ctx);
@@ -1535,7 +1563,7 @@ int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
     long long start;
 
-    if (server.aof_child_pid != -1 || server.rdb_child_pid != -1) return C_ERR;
+    if (hasActiveChildProcess()) return C_ERR;
     if (aofCreatePipes() != C_OK) return C_ERR;
     openChildInfoPipe();
     start = ustime();
@@ -1594,7 +1622,7 @@ int rewriteAppendOnlyFileBackground(void) {
 void bgrewriteaofCommand(client *c) {
     if (server.aof_child_pid != -1) {
         addReplyError(c,"Background append only file rewriting already in progress");
-    } else if (server.rdb_child_pid != -1) {
+    } else if (server.rdb_child_pid != -1 || server.scan_child_pid != -1) {
         server.aof_rewrite_scheduled = 1;
         addReplyStatus(c,"Background append only file rewriting scheduled");
     } else if (rewriteAppendOnlyFileBackground() == C_OK) {
@@ -1608,7 +1636,7 @@ void aofRemoveTempFile(pid_t childpid) {
     char tmpfile[256];
 
     snprintf(tmpfile,256,"temp-rewriteaof-bg-%d.aof", (int) childpid);
-    unlink(tmpfile);
+    bioUnlinkFile(tmpfile,1);
 }
 
 /* Update the server.aof_current_size field explicitly using stat(2)
@@ -1751,7 +1779,7 @@ void backgroundRewriteDoneHandler(int exitcode, int bysignal) {
             server.aof_state = AOF_ON;
 
         /* Asynchronously close the overwritten AOF. */
-        if (oldfd != -1) bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)oldfd,NULL,NULL);
+        if (oldfd != -1) bioCloseFile(oldfd,0);
 
         serverLog(LL_VERBOSE,
             "Background AOF rewrite signal handler took %lldus", ustime()-now);
@@ -24,6 +24,12 @@
  * recently inserted to the most recently inserted (older jobs processed
  * first).
  *
+ * The exception is BIO_LAZY_FREE: its queue is served by a pool of
+ * server.lazyfree_threads threads, so jobs are started in order but may
+ * complete in any order, and jobs created with BIO_PRIORITY_HIGH (used
+ * when the memory is needed right now, that is, eviction) are queued
+ * before all the others.
+ *
  * Currently there is no way for the creator of the job to be notified about
  * the completion of the operation, this will only be added when/if needed.
  *
@@ -61,7 +67,11 @@
 #include "server.h"
 #include "bio.h"
 
-static pthread_t bio_threads[BIO_NUM_OPS];
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static pthread_t bio_threads[BIO_NUM_OPS][BIO_MAX_THREADS_PER_OP];
+static int bio_num_threads[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
 static pthread_cond_t bio_newjob_cond[BIO_NUM_OPS];
 static pthread_cond_t bio_step_cond[BIO_NUM_OPS];
@@ -74,10 +84,16 @@ static list *bio_jobs[BIO_NUM_OPS];
  * the sensible operation. This data is also useful for reporting. */
 static unsigned long long bio_pending[BIO_NUM_OPS];
 
+/* Queue latency stats, see bioGetStatsOfType(). Protected by bio_mutex. */
+static unsigned long long bio_processed[BIO_NUM_OPS];
+static unsigned long long bio_wait_usec[BIO_NUM_OPS];
+static unsigned long long bio_max_wait_usec[BIO_NUM_OPS];
+
 /* This structure represents a background Job. It is only used locally to this
  * file as the API does not expose the internals at all. */
 struct bio_job {
     time_t time; /* Time at which the job was created. */
+    long long ctime; /* Creation time in microseconds, for the stats. */
     /* Job specific arguments pointers. If we need to pass more than three
      * arguments we can just pass a pointer to a structure or alike. */
     void *arg1, *arg2, *arg3;
@@ -87,17 +103,24 @@ void *bioProcessBackgroundJobs(void *arg);
 void lazyfreeFreeObjectFromBioThread(robj *o);
 void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
 void lazyfreeFreeSlotsMapFromBioThread(zskiplist *sl);
+void lazyfreeFreeDictChunkFromBioThread(void *chunk);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
 #define REDIS_THREAD_STACK_SIZE (1024*1024*4)
 
+/* Files smaller than this are just unlinked synchronously by
+ * bioUnlinkFile(), and files bigger than BIO_TRUNCATE_STEP are truncated
+ * that many bytes at a time before the final close, when requested. */
+#define BIO_UNLINK_MIN_SIZE (1024*1024*16)
+#define BIO_TRUNCATE_STEP (1024*1024*64)
+
 /* Initialize the background system, spawning the thread. */
 void bioInit(void) {
     pthread_attr_t attr;
     pthread_t thread;
     size_t stacksize;
-    int j;
+    int j, i;
 
     /* Initialization of state vars and objects */
     for (j = 0; j < BIO_NUM_OPS; j++) {
@@ -106,7 +129,16 @@ void bioInit(void) {
         pthread_cond_init(&bio_step_cond[j],NULL);
         bio_jobs[j] = listCreate();
         bio_pending[j] = 0;
+        bio_processed[j] = 0;
+        bio_wait_usec[j] = 0;
+        bio_max_wait_usec[j] = 0;
+        bio_num_threads[j] = 1;
     }
+    bio_num_threads[BIO_LAZY_FREE] = server.lazyfree_threads;
+    if (bio_num_threads[BIO_LAZY_FREE] < 1)
+        bio_num_threads[BIO_LAZY_FREE] = 1;
+    if (bio_num_threads[BIO_LAZY_FREE] > BIO_MAX_THREADS_PER_OP)
+        bio_num_threads[BIO_LAZY_FREE] = BIO_MAX_THREADS_PER_OP;
 
     /* Set the stack size as by default it may be small in some system */
     pthread_attr_init(&attr);
@@ -120,28 +152,59 @@ void bioInit(void) {
      * responsible of. */
     for (j = 0; j < BIO_NUM_OPS; j++) {
         void *arg = (void*)(unsigned long) j;
-        if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
-            serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
-            exit(1);
+        for (i = 0; i < bio_num_threads[j]; i++) {
+            if (pthread_create(&thread,&attr,bioProcessBackgroundJobs,arg) != 0) {
+                serverLog(LL_WARNING,"Fatal: Can't initialize Background Jobs.");
+                exit(1);
+            }
+            bio_threads[j][i] = thread;
         }
-        bio_threads[j] = thread;
     }
 }
 
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3) {
+    bioCreateBackgroundJobWithPriority(type,BIO_PRIORITY_NORMAL,arg1,arg2,arg3);
+}
+
+/* Like bioCreateBackgroundJob() but jobs with BIO_PRIORITY_HIGH are put
+ * at the head of the queue, so that they are the next ones picked by the
+ * threads of the given type. */
+void bioCreateBackgroundJobWithPriority(int type, int priority, void *arg1,
+                                        void *arg2, void *arg3)
+{
     struct bio_job *job = zmalloc(sizeof(*job));
 
     job->time = time(NULL);
+    job->ctime = ustime();
     job->arg1 = arg1;
     job->arg2 = arg2;
     job->arg3 = arg3;
     pthread_mutex_lock(&bio_mutex[type]);
-    listAddNodeTail(bio_jobs[type],job);
+    if (priority == BIO_PRIORITY_HIGH)
+        listAddNodeHead(bio_jobs[type],job);
+    else
+        listAddNodeTail(bio_jobs[type],job);
     bio_pending[type]++;
     pthread_cond_signal(&bio_newjob_cond[type]);
     pthread_mutex_unlock(&bio_mutex[type]);
 }
 
+/* Shrink an unlinked file a step at a time, so that when the last
+ * reference is closed the filesystem has little left to release: freeing
+ * the extents of a multi GB file in a single operation can stall other
+ * I/O on some filesystems. Files still linked somewhere are left alone. */
+static void bioTruncateFile(int fd) {
+    struct stat st;
+    off_t size;
+
+    if (fstat(fd,&st) == -1 || st.st_nlink != 0) return;
+    size = st.st_size;
+    while (size > BIO_TRUNCATE_STEP) {
+        size -= BIO_TRUNCATE_STEP;
+        if (ftruncate(fd,size) == -1) return;
+    }
+}
+
 void *bioProcessBackgroundJobs(void *arg) {
     struct bio_job *job;
     unsigned long type = (unsigned long) arg;
@@ -170,21 +233,32 @@ void *bioProcessBackgroundJobs(void *arg) {
 
     while(1) {
         listNode *ln;
+        long long wait;
 
         /* The loop always starts with the lock hold. */
         if (listLength(bio_jobs[type]) == 0) {
             pthread_cond_wait(&bio_newjob_cond[type],&bio_mutex[type]);
             continue;
         }
-        /* Pop the job from the queue. */
+        /* Pop the job from the queue. The job is removed from the list
+         * before processing it since other threads may be serving the
+         * same queue: bio_pending still accounts for it until we are done. */
         ln = listFirst(bio_jobs[type]);
         job = ln->value;
+        listDelNode(bio_jobs[type],ln);
+        wait = ustime() - job->ctime;
+        if (wait < 0) wait = 0;
+        bio_processed[type]++;
+        bio_wait_usec[type] += wait;
+        if ((unsigned long long)wait > bio_max_wait_usec[type])
+            bio_max_wait_usec[type] = wait;
         /* It is now possible to unlock the background system as we know have
          * a stand alone job structure to process.*/
         pthread_mutex_unlock(&bio_mutex[type]);
 
         /* Process the job accordingly to its type. */
         if (type == BIO_CLOSE_FILE) {
+            if (job->arg2) bioTruncateFile((long)job->arg1);
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
             redis_fsync((long)job->arg1);
@@ -192,11 +266,14 @@ void *bioProcessBackgroundJobs(void *arg) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
              * arg2 & arg3 -> free two dictionaries (a Redis DB).
+             * only arg2 -> free a range of buckets of a dictionary.
              * only arg3 -> free the skiplist. */
             if (job->arg1)
                 lazyfreeFreeObjectFromBioThread(job->arg1);
             else if (job->arg2 && job->arg3)
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
+            else if (job->arg2)
+                lazyfreeFreeDictChunkFromBioThread(job->arg2);
             else if (job->arg3)
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
         } else {
@@ -207,7 +284,6 @@ void *bioProcessBackgroundJobs(void *arg) {
         /* Lock again before reiterating the loop, if there are no longer
          * jobs to process we'll block again in pthread_cond_wait(). */
         pthread_mutex_lock(&bio_mutex[type]);
-        listDelNode(bio_jobs[type],ln);
         bio_pending[type]--;
 
         /* Unblock threads blocked on bioWaitStepOfType() if any. */
@@ -224,6 +300,55 @@ unsigned long long bioPendingJobsOfType(int type) {
     return val;
 }
 
+/* Fill 'stats' with the queue stats of the specified job type: number of
+ * threads, pending and processed jobs, and the average and max time jobs
+ * waited in the queue before a thread picked them. */
+void bioGetStatsOfType(int type, bioStats *stats) {
+    pthread_mutex_lock(&bio_mutex[type]);
+    stats->threads = bio_num_threads[type];
+    stats->pending = bio_pending[type];
+    stats->processed = bio_processed[type];
+    stats->avg_wait_usec = bio_processed[type] ?
+                           bio_wait_usec[type] / bio_processed[type] : 0;
+    stats->max_wait_usec = bio_max_wait_usec[type];
+    pthread_mutex_unlock(&bio_mutex[type]);
+}
+
+/* Unlink 'filename' without blocking on the release of its blocks: the
+ * file is opened before unlinking it, so that the actual deletion only
+ * happens when the descriptor is closed, which is done by a bio thread.
+ * If 'truncate' is true the bio thread also truncates the file
+ * progressively before closing it: only use it for files nobody else
+ * has open, like temp files, since readers would see it shrinking.
+ *
+ * Returns the same as unlink(2). */
+int bioUnlinkFile(const char *filename, int truncate) {
+    struct stat st;
+    int fd, retval;
+
+    fd = open(filename,(truncate ? O_RDWR : O_RDONLY)|O_NONBLOCK);
+    if (fd == -1) return unlink(filename);
+    if (fstat(fd,&st) == 0 && st.st_size < BIO_UNLINK_MIN_SIZE) {
+        close(fd);
+        return unlink(filename);
+    }
+    retval = unlink(filename);
+    if (retval == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    bioCloseFile(fd,truncate);
+    return 0;
+}
+
+/* Close 'fd' in a bio thread, see bioUnlinkFile() for 'truncate'. */
+void bioCloseFile(int fd, int truncate) {
+    bioCreateBackgroundJob(BIO_CLOSE_FILE,(void*)(long)fd,
+                           truncate ? (void*)1 : NULL,NULL);
+}
+
 /* If there are pending jobs for the specified type, the function blocks
  * and waits that the next job was processed. Otherwise the function
  * does not block and returns ASAP.
@@ -251,17 +376,19 @@ unsigned long long bioWaitStepOfType(int type) {
  * Currently Redis does this only on crash (for instance on SIGSEGV) in order
  * to perform a fast memory check without other threads messing with memory. */
 void bioKillThreads(void) {
-    int err, j;
+    int err, j, i;
 
     for (j = 0; j < BIO_NUM_OPS; j++) {
-        if (pthread_cancel(bio_threads[j]) == 0) {
-            if ((err = pthread_join(bio_threads[j],NULL)) != 0) {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d can be joined: %s",
-                        j, strerror(err));
-            } else {
-                serverLog(LL_WARNING,
-                    "Bio thread for job type #%d terminated",j);
+        for (i = 0; i < bio_num_threads[j]; i++) {
+            if (pthread_cancel(bio_threads[j][i]) == 0) {
+                if ((err = pthread_join(bio_threads[j][i],NULL)) != 0) {
+                    serverLog(LL_WARNING,
+                        "Bio thread #%d for job type #%d can be joined: %s",
+                            i, j, strerror(err));
+                } else {
+                    serverLog(LL_WARNING,
+                        "Bio thread #%d for job type #%d terminated",i,j);
+                }
             }
         }
     }
@@ -27,10 +27,24 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* Queue stats of a job type, see bioGetStatsOfType(). */
+typedef struct bioStats {
+    int threads;
+    unsigned long long pending;
+    unsigned long long processed;
+    unsigned long long avg_wait_usec;
+    unsigned long long max_wait_usec;
+} bioStats;
+
 /* Exported API */
 void bioInit(void);
 void bioCreateBackgroundJob(int type, void *arg1, void *arg2, void *arg3);
+void bioCreateBackgroundJobWithPriority(int type, int priority, void *arg1,
+                                        void *arg2, void *arg3);
 unsigned long long bioPendingJobsOfType(int type);
+void bioGetStatsOfType(int type, bioStats *stats);
+int bioUnlinkFile(const char *filename, int truncate);
+void bioCloseFile(int fd, int truncate);
 unsigned long long bioWaitStepOfType(int type);
 time_t bioOlderJobOfType(int type);
 void bioKillThreads(void);
@@ -40,3 +54,10 @@ void bioKillThreads(void);
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
 #define BIO_NUM_OPS       3
+
+/* Max number of threads serving the same job type. */
+#define BIO_MAX_THREADS_PER_OP 64
+
+/* Job priorities */
+#define BIO_PRIORITY_NORMAL 0
+#define BIO_PRIORITY_HIGH   1
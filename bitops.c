@@ -759,7 +759,7 @@ void bitopCommand(client *c) {
         setKey(c->db,targetkey,o);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
-    } else if (dbDelete(c->db,targetkey)) {
+    } else if (dbDeleteReplaced(c->db,targetkey)) {
         signalModifiedKey(c->db,targetkey);
         notifyKeyspaceEvent(NOTIFY_GENERIC,"del",targetkey,c->db->id);
     }
@@ -73,6 +73,8 @@ void clusterCloseAllSlots(void);
 void clusterSetNodeAsMaster(clusterNode *n);
 void clusterDelNode(clusterNode *delnode);
 sds representClusterNodeFlags(sds ci, uint16_t flags);
+void clusterRedirectBlockedClients(void);
+void clusterFastFailoverNodeSuspected(clusterNode *node);
 uint64_t clusterGetMaxEpoch(void);
 int clusterBumpConfigEpochWithoutConsensus(void);
 void moduleCallClusterReceivers(const char *sender_id, uint64_t module_id, uint8_t type, const unsigned char *payload, uint32_t len);
@@ -605,8 +607,14 @@ void freeClusterLink(clusterLink *link) {
     }
     sdsfree(link->sndbuf);
     sdsfree(link->rcvbuf);
-    if (link->node)
+    if (link->node) {
+        /* A link that never got a PONG: if the node is really down the
+         * connection is usually refused ASAP, so many of those in a row
+         * are a strong hint, used by the fast failover path. */
+        if (link->node->pong_received < link->ctime)
+            link->node->link_failures++;
         link->node->link = NULL;
+    }
     close(link->fd);
     zfree(link);
 }
@@ -717,6 +725,7 @@ clusterNode *createClusterNode(char *nodename, int flags) {
     node->orphaned_time = 0;
     node->repl_offset_time = 0;
     node->repl_offset = 0;
+    node->link_failures = 0;
     listSetFreeMethod(node->fail_reports,zfree);
     return node;
 }
@@ -1621,6 +1630,10 @@ void clusterUpdateSlotsConfigWith(clusterNode *sender, uint64_t senderConfigEpoc
         for (j = 0; j < dirty_slots_count; j++)
             delKeysInSlot(dirty_slots[j]);
     }
+
+    /* Clients blocked on keys of slots we no longer serve would otherwise
+     * wait for clientsCron() to notice it: redirect them now. */
+    if (newmaster || dirty_slots_count) clusterRedirectBlockedClients();
 }
 
 /* When this function is called, there is a packet to process starting
@@ -1864,6 +1877,7 @@ int clusterProcessPacket(clusterLink *link) {
         if (link->node && type == CLUSTERMSG_TYPE_PONG) {
             link->node->pong_received = mstime();
             link->node->ping_sent = 0;
+            link->node->link_failures = 0;
 
             /* The PFAIL condition can be reversed without external
              * help if it is momentary (that is, if it does not
@@ -2835,6 +2849,27 @@ int clusterGetSlaveRank(void) {
     return rank;
 }
 
+/* Return the number of other slaves of our master that are able to failover
+ * and have exactly our same replication offset. When we have rank zero and
+ * there are no ties, no other slave can win the election against us, so the
+ * fast failover path can skip the random delay used to avoid split votes. */
+int clusterGetSlaveRankTies(void) {
+    long long myoffset;
+    int j, ties = 0;
+    clusterNode *master;
+
+    serverAssert(nodeIsSlave(myself));
+    master = myself->slaveof;
+    if (master == NULL) return 0;
+
+    myoffset = replicationGetSlaveOffset();
+    for (j = 0; j < master->numslaves; j++)
+        if (master->slaves[j] != myself &&
+            !nodeCantFailover(master->slaves[j]) &&
+            master->slaves[j]->repl_offset == myoffset) ties++;
+    return ties;
+}
+
 /* This function is called by clusterHandleSlaveFailover() in order to
  * let the slave log why it is not able to failover. Sometimes there are
  * not the conditions, but since the failover function is called again and
@@ -2950,6 +2985,8 @@ void clusterHandleSlaveFailover(void) {
     int manual_failover = server.cluster->mf_end != 0 &&
                           server.cluster->mf_can_start;
     mstime_t auth_timeout, auth_retry_time;
+    mstime_t rank_delay = server.cluster_fast_failover ?
+                          CLUSTER_FAST_FAILOVER_RANK_DELAY : 1000;
 
     server.cluster->todo_before_sleep &= ~CLUSTER_TODO_HANDLE_FAILOVER;
 
@@ -3016,17 +3053,33 @@ void clusterHandleSlaveFailover(void) {
     /* If the previous failover attempt timedout and the retry time has
      * elapsed, we can setup a new one. */
     if (auth_age > auth_retry_time) {
-        server.cluster->failover_auth_time = mstime() +
-            500 + /* Fixed delay of 500 milliseconds, let FAIL msg propagate. */
-            random() % 500; /* Random delay between 0 and 500 milliseconds. */
         server.cluster->failover_auth_count = 0;
         server.cluster->failover_auth_sent = 0;
         server.cluster->failover_auth_rank = clusterGetSlaveRank();
+        if (server.cluster_fast_failover) {
+            /* Offsets are pushed to the other slaves as soon as our master
+             * is suspected (see clusterFastFailoverNodeSuspected()), so
+             * the rank is usually final at this point: the best slave
+             * starts almost immediately, and the random delay is only
+             * needed to break ties. */
+            server.cluster->failover_auth_time = mstime() +
+                CLUSTER_FAST_FAILOVER_DELAY;
+            if (server.cluster->failover_auth_rank != 0 ||
+                clusterGetSlaveRankTies() != 0)
+            {
+                server.cluster->failover_auth_time +=
+                    random() % CLUSTER_FAST_FAILOVER_DELAY;
+            }
+        } else {
+            server.cluster->failover_auth_time = mstime() +
+                500 + /* Fixed delay of 500 milliseconds, let FAIL msg propagate. */
+                random() % 500; /* Random delay between 0 and 500 milliseconds. */
+        }
         /* We add another delay that is proportional to the slave rank.
          * Specifically 1 second * rank. This way slaves that have a probably
          * less updated replication offset, are penalized. */
         server.cluster->failover_auth_time +=
-            server.cluster->failover_auth_rank * 1000;
+            server.cluster->failover_auth_rank * rank_delay;
         /* However if this is a manual failover, no delay is needed. */
         if (server.cluster->mf_end) {
             server.cluster->failover_auth_time = mstime();
@@ -3056,7 +3109,7 @@ void clusterHandleSlaveFailover(void) {
         int newrank = clusterGetSlaveRank();
         if (newrank > server.cluster->failover_auth_rank) {
             long long added_delay =
-                (newrank - server.cluster->failover_auth_rank) * 1000;
+                (newrank - server.cluster->failover_auth_rank) * rank_delay;
             server.cluster->failover_auth_time += added_delay;
             server.cluster->failover_auth_rank = newrank;
             serverLog(LL_WARNING,
@@ -3304,6 +3357,33 @@ void clusterHandleManualFailover(void) {
  * CLUSTER cron job
  * -------------------------------------------------------------------------- */
 
+/* Called by clusterCron() when cluster-fast-failover flagged 'node' as
+ * PFAIL. Instead of waiting for the random pings of the next seconds to
+ * carry our failure report, we ping all the masters right now, so that
+ * the FAIL quorum is reached ASAP. If the suspected node is our master,
+ * we also push our replication offset to the other slaves, so that every
+ * slave already knows its rank when the election starts. */
+void clusterFastFailoverNodeSuspected(clusterNode *node) {
+    dictIterator *di;
+    dictEntry *de;
+
+    /* Make sure the node is included in the gossip sections. */
+    server.cluster->stats_pfail_nodes++;
+
+    di = dictGetSafeIterator(server.cluster->nodes);
+    while((de = dictNext(di)) != NULL) {
+        clusterNode *n = dictGetVal(de);
+
+        if (n == myself || n == node || n->link == NULL) continue;
+        if (!nodeIsMaster(n) || nodeInHandshake(n)) continue;
+        clusterSendPing(n->link, CLUSTERMSG_TYPE_PING);
+    }
+    dictReleaseIterator(di);
+
+    if (nodeIsSlave(myself) && myself->slaveof == node)
+        clusterBroadcastPong(CLUSTER_BROADCAST_LOCAL_SLAVES);
+}
+
 /* This is executed 10 times every second */
 void clusterCron(void) {
     dictIterator *di;
@@ -3541,7 +3621,15 @@ void clusterCron(void) {
          * code at all. */
         delay = now - node->ping_sent;
 
-        if (delay > server.cluster_node_timeout) {
+        /* With cluster-fast-failover, a node whose connections keep
+         * being refused is flagged without waiting for the node timeout:
+         * this only happens when the host is reachable but nobody is
+         * listening, while network partitions still take the slow path. */
+        if (delay > server.cluster_node_timeout ||
+            (server.cluster_fast_failover &&
+             node->link_failures >= CLUSTER_FAST_FAIL_LINK_FAILURES &&
+             delay > CLUSTER_FAST_FAIL_MIN_DELAY))
+        {
             /* Timeout reached. Set the node as possibly failing if it is
              * not already in this state. */
             if (!(node->flags & (CLUSTER_NODE_PFAIL|CLUSTER_NODE_FAIL))) {
@@ -3549,6 +3637,8 @@ void clusterCron(void) {
                     node->name);
                 node->flags |= CLUSTER_NODE_PFAIL;
                 update_state = 1;
+                if (server.cluster_fast_failover)
+                    clusterFastFailoverNodeSuspected(node);
             }
         }
     }
@@ -4921,7 +5011,7 @@ void restoreCommand(client *c) {
     }
 
     /* Remove the old key if needed. */
-    if (replace) dbDelete(c->db,c->argv[1]);
+    if (replace) dbDeleteReplaced(c->db,c->argv[1]);
 
     /* Create the key and set the TTL if any */
     dbAdd(c->db,c->argv[1],obj);
@@ -5705,3 +5795,21 @@ int clusterRedirectBlockedClientIfNeeded(client *c) {
     }
     return 0;
 }
+
+/* Call clusterRedirectBlockedClientIfNeeded() for all the blocked clients.
+ * This is used when the slots configuration changes, so that clients
+ * blocked on slots we lost are redirected immediately. */
+void clusterRedirectBlockedClients(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        if (c->flags & CLIENT_BLOCKED &&
+            clusterRedirectBlockedClientIfNeeded(c))
+        {
+            unblockClient(c);
+        }
+    }
+}
@@ -25,6 +25,11 @@
 #define CLUSTER_MF_TIMEOUT 5000 /* Milliseconds to do a manual failover. */
 #define CLUSTER_MF_PAUSE_MULT 2 /* Master pause manual failover mult. */
 #define CLUSTER_SLAVE_MIGRATION_DELAY 5000 /* Delay for slave migration. */
+#define CLUSTER_DEFAULT_FAST_FAILOVER 0 /* Use the fast failover path. */
+#define CLUSTER_FAST_FAIL_LINK_FAILURES 3 /* Refused links to flag PFAIL. */
+#define CLUSTER_FAST_FAIL_MIN_DELAY 250 /* Min ms without PONG to flag PFAIL. */
+#define CLUSTER_FAST_FAILOVER_DELAY 50 /* Election delay with fast failover. */
+#define CLUSTER_FAST_FAILOVER_RANK_DELAY 200 /* Per rank delay, fast failover. */
 
 /* Redirection errors returned by getNodeByQuery(). */
 #define CLUSTER_REDIR_NONE 0          /* Node can serve the request. */
@@ -138,6 +143,8 @@ typedef struct clusterNode {
     int cport;                  /* Latest known cluster port of this node. */
     clusterLink *link;          /* TCP/IP link with this node */
     list *fail_reports;         /* List of nodes signaling this as failing */
+    int link_failures;          /* Consecutive links to this node closed
+                                   before receiving any PONG. */
 } clusterNode;
 
 typedef struct clusterState {
@@ -30,6 +30,7 @@
 
 #include "server.h"
 #include "cluster.h"
+#include "bio.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -315,6 +316,15 @@ void loadServerConfigFromString(char *config) {
             }
         } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
             server.maxmemory = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"maxmemory-clients") && argc == 2) {
+            server.maxmemory_clients = memtoll(argv[1],NULL);
+        } else if (!strcasecmp(argv[0],"tracking-table-max-keys") &&
+                   argc == 2)
+        {
+            server.tracking_table_max_keys = strtoll(argv[1], NULL, 10);
+            if (server.tracking_table_max_keys < 0) {
+                err = "Invalid tracking table max keys"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
             server.maxmemory_policy =
                 configEnumGetValue(maxmemory_policy_enum,argv[1]);
@@ -436,10 +446,25 @@ void loadServerConfigFromString(char *config) {
             if ((server.lazyfree_lazy_expire = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"lazyfree-threads") && argc == 2) {
+            server.lazyfree_threads = atoi(argv[1]);
+            if (server.lazyfree_threads < 1 ||
+                server.lazyfree_threads > BIO_MAX_THREADS_PER_OP)
+            {
+                err = "Invalid number of lazyfree threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lazyfree-lazy-server-del") && argc == 2){
             if ((server.lazyfree_lazy_server_del = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"lazyfree-lazy-overwrite") && argc == 2){
+            if ((server.lazyfree_lazy_overwrite = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"key-index") && argc == 2) {
+            if ((server.key_index = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if ((!strcasecmp(argv[0],"slave-lazy-flush") ||
                     !strcasecmp(argv[0],"replica-lazy-flush")) && argc == 2)
         {
@@ -532,6 +557,16 @@ void loadServerConfigFromString(char *config) {
                 goto loaderr;
             }
             server.requirepass = argv[1][0] ? zstrdup(argv[1]) : NULL;
+            ACLUpdateDefaultUserPassword(server.requirepass);
+        } else if (!strcasecmp(argv[0],"user") && argc >= 2) {
+            user *u = ACLGetUserByName(argv[1],sdslen(argv[1]));
+            if (u == NULL) u = ACLCreateUser(argv[1],sdslen(argv[1]));
+            for (int j = 2; j < argc; j++) {
+                if (ACLSetUser(u,argv[j],sdslen(argv[j])) != C_OK) {
+                    err = ACLSetUserStringError();
+                    goto loaderr;
+                }
+            }
         } else if (!strcasecmp(argv[0],"pidfile") && argc == 2) {
             zfree(server.pidfile);
             server.pidfile = zstrdup(argv[1]);
@@ -692,6 +727,12 @@ void loadServerConfigFromString(char *config) {
                 err = "argument must be 'yes' or 'no'";
                 goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-fast-failover") && argc == 2) {
+            server.cluster_fast_failover = yesnotoi(argv[1]);
+            if (server.cluster_fast_failover == -1) {
+                err = "argument must be 'yes' or 'no'";
+                goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"lua-time-limit") && argc == 2) {
             server.lua_time_limit = strtoll(argv[1],NULL,10);
         } else if (!strcasecmp(argv[0],"lua-replicate-commands") && argc == 2) {
@@ -769,6 +810,12 @@ void loadServerConfigFromString(char *config) {
             if (server.repl_min_slaves_max_lag < 0) {
                 err = "Invalid value for min-replicas-max-lag."; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"notify-keyspace-prefixes") &&
+                   argc == 2)
+        {
+            if (setNotifyKeyspacePrefixes(argv[1]) == C_ERR) {
+                err = "Invalid list of prefixes"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"notify-keyspace-events") && argc == 2) {
             int flags = keyspaceEventsStringToFlags(argv[1]);
 
@@ -921,6 +968,7 @@ void configSetCommand(client *c) {
         if (sdslen(o->ptr) > CONFIG_AUTHPASS_MAX_LEN) goto badfmt;
         zfree(server.requirepass);
         server.requirepass = ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
+        ACLUpdateDefaultUserPassword(server.requirepass);
     } config_set_special_field("masterauth") {
         zfree(server.masterauth);
         server.masterauth = ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
@@ -1051,6 +1099,8 @@ void configSetCommand(client *c) {
             server.client_obuf_limits[class].soft_limit_seconds = soft_seconds;
         }
         sdsfreesplitres(v,vlen);
+    } config_set_special_field("notify-keyspace-prefixes") {
+        if (setNotifyKeyspacePrefixes(o->ptr) == C_ERR) goto badfmt;
     } config_set_special_field("notify-keyspace-events") {
         int flags = keyspaceEventsStringToFlags(o->ptr);
 
@@ -1076,6 +1126,8 @@ void configSetCommand(client *c) {
       "cluster-slave-no-failover",server.cluster_slave_no_failover) {
     } config_set_bool_field(
       "cluster-replica-no-failover",server.cluster_slave_no_failover) {
+    } config_set_bool_field(
+      "cluster-fast-failover",server.cluster_fast_failover) {
     } config_set_bool_field(
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
@@ -1121,6 +1173,11 @@ void configSetCommand(client *c) {
       "lazyfree-lazy-expire",server.lazyfree_lazy_expire) {
     } config_set_bool_field(
       "lazyfree-lazy-server-del",server.lazyfree_lazy_server_del) {
+    } config_set_bool_field(
+      "lazyfree-lazy-overwrite",server.lazyfree_lazy_overwrite) {
+    } config_set_bool_field(
+      "key-index",server.key_index) {
+        keyIndexSetEnabled(server.key_index);
     } config_set_bool_field(
       "slave-lazy-flush",server.repl_slave_lazy_flush) {
     } config_set_bool_field(
@@ -1228,6 +1285,8 @@ void configSetCommand(client *c) {
       "cluster-slave-validity-factor",server.cluster_slave_validity_factor,0,INT_MAX) {
     } config_set_numerical_field(
       "cluster-replica-validity-factor",server.cluster_slave_validity_factor,0,INT_MAX) {
+    } config_set_numerical_field(
+      "tracking-table-max-keys",server.tracking_table_max_keys,0,LLONG_MAX) {
     } config_set_numerical_field(
       "hz",server.config_hz,0,INT_MAX) {
         /* Hz is more an hint from the user, so we accept values out of range
@@ -1243,6 +1302,8 @@ void configSetCommand(client *c) {
 
     /* Memory fields.
      * config_set_memory_field(name,var) */
+    } config_set_memory_field("maxmemory-clients",server.maxmemory_clients) {
+        evictClients();
     } config_set_memory_field("maxmemory",server.maxmemory) {
         if (server.maxmemory) {
             if (server.maxmemory < zmalloc_used_memory()) {
@@ -1334,6 +1395,8 @@ void configGetCommand(client *c) {
     config_get_string_field("dbfilename",server.rdb_filename);
     config_get_string_field("requirepass",server.requirepass);
     config_get_string_field("masterauth",server.masterauth);
+    config_get_string_field("notify-keyspace-prefixes",
+                            server.notify_keyspace_prefixes);
     config_get_string_field("cluster-announce-ip",server.cluster_announce_ip);
     config_get_string_field("unixsocket",server.unixsocket);
     config_get_string_field("logfile",server.logfile);
@@ -1343,6 +1406,8 @@ void configGetCommand(client *c) {
 
     /* Numerical values */
     config_get_numerical_field("maxmemory",server.maxmemory);
+    config_get_numerical_field("maxmemory-clients",server.maxmemory_clients);
+    config_get_numerical_field("tracking-table-max-keys",server.tracking_table_max_keys);
     config_get_numerical_field("proto-max-bulk-len",server.proto_max_bulk_len);
     config_get_numerical_field("client-query-buffer-limit",server.client_max_querybuf_len);
     config_get_numerical_field("maxmemory-samples",server.maxmemory_samples);
@@ -1391,6 +1456,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-announce-bus-port",server.cluster_announce_bus_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
+    config_get_numerical_field("lazyfree-threads",server.lazyfree_threads);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-ping-replica-period",server.repl_ping_slave_period);
     config_get_numerical_field("repl-timeout",server.repl_timeout);
@@ -1421,6 +1487,8 @@ void configGetCommand(client *c) {
             server.cluster_slave_no_failover);
     config_get_bool_field("cluster-replica-no-failover",
             server.cluster_slave_no_failover);
+    config_get_bool_field("cluster-fast-failover",
+            server.cluster_fast_failover);
     config_get_bool_field("no-appendfsync-on-rewrite",
             server.aof_no_fsync_on_rewrite);
     config_get_bool_field("slave-serve-stale-data",
@@ -1461,6 +1529,9 @@ void configGetCommand(client *c) {
             server.lazyfree_lazy_expire);
     config_get_bool_field("lazyfree-lazy-server-del",
             server.lazyfree_lazy_server_del);
+    config_get_bool_field("lazyfree-lazy-overwrite",
+            server.lazyfree_lazy_overwrite);
+    config_get_bool_field("key-index",server.key_index);
     config_get_bool_field("slave-lazy-flush",
             server.repl_slave_lazy_flush);
     config_get_bool_field("replica-lazy-flush",
@@ -2147,6 +2218,7 @@ int rewriteConfig(char *path) {
     rewriteConfigSlaveofOption(state,"replicaof");
     rewriteConfigStringOption(state,"replica-announce-ip",server.slave_announce_ip,CONFIG_DEFAULT_SLAVE_ANNOUNCE_IP);
     rewriteConfigStringOption(state,"masterauth",server.masterauth,NULL);
+    rewriteConfigStringOption(state,"notify-keyspace-prefixes",server.notify_keyspace_prefixes,NULL);
     rewriteConfigStringOption(state,"cluster-announce-ip",server.cluster_announce_ip,NULL);
     rewriteConfigYesNoOption(state,"replica-serve-stale-data",server.repl_serve_stale_data,CONFIG_DEFAULT_SLAVE_SERVE_STALE_DATA);
     rewriteConfigYesNoOption(state,"replica-read-only",server.repl_slave_ro,CONFIG_DEFAULT_SLAVE_READ_ONLY);
@@ -2164,6 +2236,8 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"requirepass",server.requirepass,NULL);
     rewriteConfigNumericalOption(state,"maxclients",server.maxclients,CONFIG_DEFAULT_MAX_CLIENTS);
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
+    rewriteConfigBytesOption(state,"maxmemory-clients",server.maxmemory_clients,CONFIG_DEFAULT_MAXMEMORY_CLIENTS);
+    rewriteConfigNumericalOption(state,"tracking-table-max-keys",server.tracking_table_max_keys,CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS);
     rewriteConfigBytesOption(state,"proto-max-bulk-len",server.proto_max_bulk_len,CONFIG_DEFAULT_PROTO_MAX_BULK_LEN);
     rewriteConfigBytesOption(state,"client-query-buffer-limit",server.client_max_querybuf_len,PROTO_MAX_QUERYBUF_LEN);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
@@ -2187,6 +2261,7 @@ int rewriteConfig(char *path) {
     rewriteConfigStringOption(state,"cluster-config-file",server.cluster_configfile,CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     rewriteConfigYesNoOption(state,"cluster-require-full-coverage",server.cluster_require_full_coverage,CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE);
     rewriteConfigYesNoOption(state,"cluster-replica-no-failover",server.cluster_slave_no_failover,CLUSTER_DEFAULT_SLAVE_NO_FAILOVER);
+    rewriteConfigYesNoOption(state,"cluster-fast-failover",server.cluster_fast_failover,CLUSTER_DEFAULT_FAST_FAILOVER);
     rewriteConfigNumericalOption(state,"cluster-node-timeout",server.cluster_node_timeout,CLUSTER_DEFAULT_NODE_TIMEOUT);
     rewriteConfigNumericalOption(state,"cluster-migration-barrier",server.cluster_migration_barrier,CLUSTER_DEFAULT_MIGRATION_BARRIER);
     rewriteConfigNumericalOption(state,"cluster-replica-validity-factor",server.cluster_slave_validity_factor,CLUSTER_DEFAULT_SLAVE_VALIDITY);
@@ -2217,6 +2292,9 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"lazyfree-lazy-eviction",server.lazyfree_lazy_eviction,CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-expire",server.lazyfree_lazy_expire,CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE);
     rewriteConfigYesNoOption(state,"lazyfree-lazy-server-del",server.lazyfree_lazy_server_del,CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL);
+    rewriteConfigYesNoOption(state,"lazyfree-lazy-overwrite",server.lazyfree_lazy_overwrite,CONFIG_DEFAULT_LAZYFREE_LAZY_OVERWRITE);
+    rewriteConfigYesNoOption(state,"key-index",server.key_index,CONFIG_DEFAULT_KEY_INDEX);
+    rewriteConfigNumericalOption(state,"lazyfree-threads",server.lazyfree_threads,CONFIG_DEFAULT_LAZYFREE_THREADS);
     rewriteConfigYesNoOption(state,"replica-lazy-flush",server.repl_slave_lazy_flush,CONFIG_DEFAULT_SLAVE_LAZY_FLUSH);
     rewriteConfigYesNoOption(state,"dynamic-hz",server.dynamic_hz,CONFIG_DEFAULT_DYNAMIC_HZ);
 
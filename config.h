@@ -78,6 +78,13 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* io_uring is opt-in (make USE_IO_URING=yes) since it needs Linux >= 5.5
+ * headers at build time. At runtime it falls back to epoll if the kernel
+ * does not support it. */
+#if defined(__linux__) && defined(USE_IO_URING)
+#define HAVE_IO_URING 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
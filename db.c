@@ -33,6 +33,7 @@
 
 #include <signal.h>
 #include <ctype.h>
+#include <sys/wait.h>
 
 /*-----------------------------------------------------------------------------
  * C-level DB API
@@ -210,6 +211,7 @@ void dbAdd(redisDb *db, robj *key, robj *val) {
         signalKeyAsReady(db, key);
     // 开启了集群模式，将键保存到槽里面
     if (server.cluster_enabled) slotToKeyAdd(key);
+    keyIndexAdd(db,key);
 }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
@@ -233,7 +235,7 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     // 设置新值
     dictSetVal(db->dict, de, val);
 
-    if (server.lazyfree_lazy_server_del) {
+    if (server.lazyfree_lazy_server_del || server.lazyfree_lazy_overwrite) {
         freeObjAsync(old);
         dictSetVal(db->dict, &auxentry, NULL);
     }
@@ -334,6 +336,7 @@ int dbSyncDelete(redisDb *db, robj *key) {
     if (dictDelete(db->dict,key->ptr) == DICT_OK) {
         // 开启了集群模式，从槽中删除给定的键
         if (server.cluster_enabled) slotToKeyDel(key);
+        keyIndexDel(db,key);
         return 1;
     } else {
         // 不存在
@@ -351,6 +354,16 @@ int dbDelete(redisDb *db, robj *key) {
                                              dbSyncDelete(db,key);
 }
 
+/* Like dbDelete() but used when the key is deleted only to be replaced by
+ * a new value, like the destination key of RENAME or SUNIONSTORE: the old
+ * value is freed asynchronously, if big enough, also when
+ * lazyfree-lazy-overwrite is set, as dbOverwrite() does. */
+// 目标键被替换时删除旧值，大对象交给后台线程释放
+int dbDeleteReplaced(redisDb *db, robj *key) {
+    return (server.lazyfree_lazy_server_del || server.lazyfree_lazy_overwrite) ?
+           dbAsyncDelete(db,key) : dbSyncDelete(db,key);
+}
+
 /* Prepare the string object stored at 'key' to be modified destructively
  * to implement commands like SETBIT or APPEND.
  *
@@ -436,6 +449,7 @@ long long emptyDb(int dbnum, int flags, void(callback)(void*)) {
             dictEmpty(server.db[j].dict,callback);
             dictEmpty(server.db[j].expires,callback);
         }
+        keyIndexFlush(&server.db[j],async);
     }
     // 集群情况，移除槽记录
     if (server.cluster_enabled) {
@@ -471,10 +485,12 @@ int selectDb(client *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+    trackingInvalidateKey(key);
 }
 // 每当一个数据库被清空，会被调用
 void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
+    trackingInvalidateKeysOnFlush(dbid);
 }
 
 /*-----------------------------------------------------------------------------
@@ -535,7 +551,7 @@ void flushallCommand(client *c) {
     // 如果正在保存新的 RDB，取消保存操作
     if (server.rdb_child_pid != -1) {
         kill(server.rdb_child_pid,SIGUSR1);
-        rdbRemoveTempFile(server.rdb_child_pid);
+        rdbRemoveTempFile(server.rdb_child_pid,0);
     }
     // 更新 RDB 文件
     if (server.saveparamslen > 0) {
@@ -635,7 +651,19 @@ void keysCommand(client *c) {
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
-    void *replylen = addReplyDeferredLen(c);
+    void *replylen;
+
+    /* Patterns with a literal prefix are served by the key index, if any,
+     * walking just the keys with such prefix. */
+    if (c->db->key_index) {
+        size_t prefixlen = patternPrefixLen(pattern,plen);
+        if (prefixlen) {
+            keysCommandByPrefix(c,pattern,prefixlen);
+            return;
+        }
+    }
+
+    replylen = addReplyDeferredLen(c);
     // 遍历整个数据库，返回（名字）和模式匹配的键
     di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && pattern[1] == '\0');
@@ -658,27 +686,69 @@ void keysCommand(client *c) {
     setDeferredArrayLen(c,replylen,numkeys);
 }
 
+/* Return the name of the type of the object 'o', as reported by TYPE. */
+char *getObjectTypeName(robj *o) {
+    char *type;
+
+    if (o == NULL) {
+        type = "none";
+    } else {
+        switch(o->type) {
+        case OBJ_STRING: type = "string"; break;
+        case OBJ_LIST: type = "list"; break;
+        case OBJ_SET: type = "set"; break;
+        case OBJ_ZSET: type = "zset"; break;
+        case OBJ_HASH: type = "hash"; break;
+        case OBJ_STREAM: type = "stream"; break;
+        case OBJ_MODULE: {
+            moduleValue *mv = o->ptr;
+            type = mv->type->name;
+        }; break;
+        default: type = "unknown"; break;
+        }
+    }
+    return type;
+}
+
+/* State shared between scanGenericCommand() and scanCallback(). The MATCH
+ * and TYPE filters are applied by the callback itself while traversing the
+ * buckets, so that elements that are going to be discarded don't need to
+ * be turned into objects and accumulated first. */
+typedef struct scanData {
+    list *keys;     /* Elements collected so far. */
+    robj *o;        /* Object we are scanning, NULL for the keyspace. */
+    sds pat;        /* MATCH pattern, or NULL if every element matches. */
+    sds type;       /* TYPE filter (keyspace only), or NULL. */
+} scanData;
+
 /* This callback is used by scanGenericCommand in order to collect elements
  * returned by the dictionary iterator into a list. */
 void scanCallback(void *privdata, const dictEntry *de) {
-    void **pd = (void**) privdata;
-    list *keys = pd[0];
-    robj *o = pd[1];
+    scanData *data = privdata;
+    list *keys = data->keys;
+    robj *o = data->o;
     robj *key, *val = NULL;
+    sds sdskey = dictGetKey(de);
+
+    /* Filter the element if it does not match the pattern. For hashes and
+     * sorted sets only the field is matched. */
+    if (data->pat && !stringmatchlen(data->pat, sdslen(data->pat),
+                                     sdskey, sdslen(sdskey), 0))
+        return;
+
+    /* Filter the key if its value is not of the requested type. */
+    if (data->type && strcasecmp(data->type,getObjectTypeName(dictGetVal(de))))
+        return;
 
     if (o == NULL) {
-        sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey, sdslen(sdskey));
     } else if (o->type == OBJ_SET) {
-        sds keysds = dictGetKey(de);
-        key = createStringObject(keysds,sdslen(keysds));
+        key = createStringObject(sdskey,sdslen(sdskey));
     } else if (o->type == OBJ_HASH) {
-        sds sdskey = dictGetKey(de);
         sds sdsval = dictGetVal(de);
         key = createStringObject(sdskey,sdslen(sdskey));
         val = createStringObject(sdsval,sdslen(sdsval));
     } else if (o->type == OBJ_ZSET) {
-        sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
         val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
     } else {
@@ -727,7 +797,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     list *keys = listCreate();
     listNode *node, *nextnode;
     long count = 10;
-    sds pat = NULL;
+    int count_given = 0, async = 0;
+    sds pat = NULL, typename = NULL;
     int patlen = 0, use_pattern = 0;
     dict *ht;
 
@@ -756,6 +827,7 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
                 goto cleanup;
             }
 
+            count_given = 1;
             i += 2;
         } else if (!strcasecmp(c->argv[i]->ptr, "match") && j >= 2) {
             pat = c->argv[i+1]->ptr;
@@ -766,12 +838,39 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
             use_pattern = !(pat[0] == '*' && patlen == 1);
 
             i += 2;
+        } else if (!strcasecmp(c->argv[i]->ptr, "type") && o == NULL && j >= 2) {
+            typename = c->argv[i+1]->ptr;
+            i += 2;
+        } else if (!strcasecmp(c->argv[i]->ptr, "async") && o == NULL) {
+            async = 1;
+            i++;
         } else {
             addReply(c,shared.syntaxerr);
             goto cleanup;
         }
     }
 
+    /* The whole keyspace is iterated by a background job: the cursor makes
+     * no sense in this mode, since the job is not resumable. */
+    if (async) {
+        if (cursor != 0) {
+            addReplyError(c,"SCAN ASYNC must be called with cursor 0");
+            goto cleanup;
+        }
+        scanJobStart(c, use_pattern ? pat : NULL, typename,
+                     count_given ? count : SCAN_JOB_DEFAULT_BATCH);
+        goto cleanup;
+    }
+
+    /* Use the ordered key index if the pattern has a literal prefix and
+     * all the matching keys fit in this call, see scanKeyIndex(). */
+    if (o == NULL && cursor == 0 && c->db->key_index && use_pattern) {
+        size_t prefixlen = patternPrefixLen(pat,patlen);
+        if (prefixlen &&
+            scanKeyIndex(c,pat,prefixlen,typename,count) == C_OK)
+            goto cleanup;
+    }
+
     /* Step 2: Iterate the collection.
      *
      * Note that if the object is encoded with a ziplist, intset, or any other
@@ -796,20 +895,31 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     }
 
     if (ht) {
-        void *privdata[2];
+        scanData data;
+        long long start = ustime();
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
-         * sparsely populated) we avoid to block too much time at the cost
-         * of returning no or very few elements. */
+         * sparsely populated) or the filters match very few elements, we
+         * avoid to block too much time at the cost of returning no or very
+         * few elements. */
         long maxiterations = count*10;
-
-        /* We pass two pointers to the callback: the list to which it will
-         * add new elements, and the object containing the dictionary so that
-         * it is possible to fetch more data in a type-dependent way. */
-        privdata[0] = keys;
-        privdata[1] = o;
+        long iterations = 0;
+
+        /* The callback gets the list to which it will add new elements, the
+         * object containing the dictionary so that it is possible to fetch
+         * more data in a type-dependent way, and the filters to apply. */
+        data.keys = keys;
+        data.o = o;
+        data.pat = use_pattern ? pat : NULL;
+        data.type = typename;
         do {
-            cursor = dictScan(ht, cursor, scanCallback, NULL, privdata);
+            cursor = dictScan(ht, cursor, scanCallback, NULL, &data);
+
+            /* Also stop when the time budget of this call is over, whatever
+             * the COUNT is. Checking the clock at every bucket would cost
+             * more than the bucket itself, so we do it from time to time. */
+            if ((++iterations & SCAN_TIME_CHECK_MASK) == 0 &&
+                ustime()-start > SCAN_TIME_BUDGET_USEC) break;
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
@@ -838,7 +948,9 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         serverPanic("Not handled encoding in SCAN.");
     }
 
-    /* Step 3: Filter elements. */
+    /* Step 3: Filter elements. Elements coming from a hash table were
+     * already filtered by the pattern during the traversal. */
+    if (ht) use_pattern = 0;
     node = listFirst(keys);
     while (node) {
         robj *kobj = listNodeValue(node);
@@ -901,6 +1013,311 @@ cleanup:
     listRelease(keys);
 }
 
+/*-----------------------------------------------------------------------------
+ * Background SCAN
+ *
+ * SCAN 0 [MATCH pattern] [TYPE type] [COUNT count] ASYNC iterates the whole
+ * keyspace of the selected DB in a forked child, so the main thread is never
+ * blocked, however large the keyspace is and however sparse the matches.
+ * The child filters the keys and writes them into a pipe in batches of COUNT
+ * keys, already encoded as RESP3 push messages:
+ *
+ *     >2 "scan" [key1, key2, ...]
+ *
+ * The parent forwards every complete batch to the client as soon as it is
+ * read from the pipe, and when the job is over it sends:
+ *
+ *     >2 "scan-done" <number of keys>
+ *
+ * or "scan-error" followed by the reason if the job failed. The command
+ * itself replies +OK ASAP and the client can go on sending commands, so
+ * this mode requires RESP3. Only a single job can run at a time.
+ *
+ * Since the child works on a snapshot of the dataset, every key that
+ * existed for the whole duration of the fork is reported exactly once.
+ *----------------------------------------------------------------------------*/
+
+/* Every batch written in the pipe is prefixed by this header. A header with
+ * count set to SCAN_JOB_DONE and no payload marks the successful end of the
+ * job, so that the parent can tell it from a child that died. */
+typedef struct scanJobHeader {
+    uint32_t len;       /* Bytes of protocol following the header. */
+    uint32_t count;     /* Number of keys in the batch. */
+} scanJobHeader;
+
+#define SCAN_JOB_DONE UINT32_MAX
+#define SCAN_JOB_MAX_PENDING (32*1024*1024) /* Stop reading from the pipe
+                                               when the client output
+                                               buffer is bigger than that. */
+
+/* Write 'len' bytes to the pipe, blocking if needed: the child has nothing
+ * better to do while the parent is busy forwarding the previous batches. */
+static int scanJobWrite(int fd, const char *p, size_t len) {
+    while (len) {
+        ssize_t nwritten = write(fd,p,len);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            return C_ERR;
+        }
+        p += nwritten;
+        len -= nwritten;
+    }
+    return C_OK;
+}
+
+/* Send the 'count' keys accumulated in 'batch' as a single push message. */
+static int scanJobFlushBatch(int fd, sds batch, uint32_t count) {
+    scanJobHeader hdr;
+    char buf[64];
+    int buflen;
+
+    buflen = snprintf(buf,sizeof(buf),">2\r\n$4\r\nscan\r\n*%u\r\n",count);
+    hdr.len = buflen+sdslen(batch);
+    hdr.count = count;
+    if (scanJobWrite(fd,(char*)&hdr,sizeof(hdr)) == C_ERR ||
+        scanJobWrite(fd,buf,buflen) == C_ERR ||
+        scanJobWrite(fd,batch,sdslen(batch)) == C_ERR) return C_ERR;
+    return C_OK;
+}
+
+/* Body of the child process: iterate the keyspace of 'db' writing the keys
+ * matching the filters to 'fd'. */
+static int scanJobRunChild(int fd, redisDb *db, sds pat, sds type, long batchsize) {
+    dictIterator *di = dictGetSafeIterator(db->dict);
+    dictEntry *de;
+    sds batch = sdsempty();
+    uint32_t count = 0;
+    scanJobHeader hdr;
+    int retval = C_OK;
+
+    while((de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        robj keyobj;
+
+        if (pat && !stringmatchlen(pat,sdslen(pat),key,sdslen(key),0))
+            continue;
+        if (type && strcasecmp(type,getObjectTypeName(dictGetVal(de))))
+            continue;
+        initStaticStringObject(keyobj,key);
+        if (keyIsExpired(db,&keyobj)) continue;
+
+        batch = sdscatfmt(batch,"$%u\r\n",(unsigned int)sdslen(key));
+        batch = sdscatlen(batch,key,sdslen(key));
+        batch = sdscatlen(batch,"\r\n",2);
+        if ((long)++count == batchsize) {
+            if (scanJobFlushBatch(fd,batch,count) == C_ERR) {
+                retval = C_ERR;
+                break;
+            }
+            sdsclear(batch);
+            count = 0;
+        }
+    }
+    dictReleaseIterator(di);
+
+    if (retval == C_OK && count)
+        retval = scanJobFlushBatch(fd,batch,count);
+    sdsfree(batch);
+
+    if (retval == C_OK) {
+        hdr.len = 0;
+        hdr.count = SCAN_JOB_DONE;
+        retval = scanJobWrite(fd,(char*)&hdr,sizeof(hdr));
+    }
+    return retval;
+}
+
+/* Terminate the job on the parent side: tell the client how it ended, if
+ * it is still connected, and release the pipe. The child, if still alive,
+ * will get an error writing to the pipe and exit, and will be reaped by
+ * serverCron() as usually. */
+static void scanJobFinish(char *err) {
+    client *c = lookupClientByID(server.scan_client_id);
+
+    if (c) {
+        addReplyPushLen(c,2);
+        if (err) {
+            addReplyBulkCString(c,"scan-error");
+            addReplyBulkCString(c,err);
+        } else {
+            addReplyBulkCString(c,"scan-done");
+            addReplyLongLong(c,server.scan_matched);
+        }
+    }
+    if (!server.scan_paused)
+        aeDeleteFileEvent(server.el,server.scan_pipe_fd,AE_READABLE);
+    close(server.scan_pipe_fd);
+    server.scan_pipe_fd = -1;
+    server.scan_paused = 0;
+    server.scan_client_id = 0;
+    sdsfree(server.scan_buf);
+    server.scan_buf = NULL;
+}
+
+/* Read handler of the pipe: forward the complete batches to the client. */
+void scanJobReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[PROTO_IOBUF_LEN];
+    client *c = lookupClientByID(server.scan_client_id);
+    scanJobHeader hdr;
+    ssize_t nread;
+    size_t pos = 0;
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    nread = read(fd,buf,sizeof(buf));
+    if (nread == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (nread > 0) server.scan_buf = sdscatlen(server.scan_buf,buf,nread);
+
+    while (sdslen(server.scan_buf)-pos >= sizeof(hdr)) {
+        memcpy(&hdr,server.scan_buf+pos,sizeof(hdr));
+        if (hdr.count == SCAN_JOB_DONE) {
+            scanJobFinish(NULL);
+            return;
+        }
+        if (sdslen(server.scan_buf)-pos-sizeof(hdr) < hdr.len) break;
+        if (c) addReplyProto(c,server.scan_buf+pos+sizeof(hdr),hdr.len);
+        server.scan_matched += hdr.count;
+        pos += sizeof(hdr)+hdr.len;
+    }
+    if (pos) sdsrange(server.scan_buf,pos,-1);
+
+    if (nread <= 0) {
+        scanJobFinish("the background SCAN child terminated unexpectedly");
+    } else if (c == NULL) {
+        /* Nobody is interested in the keys anymore. */
+        killScanJob();
+    } else if (getClientOutputBufferMemoryUsage(c) > SCAN_JOB_MAX_PENDING) {
+        /* The client is slower than the child: stop reading, so that the
+         * child blocks on the pipe instead of us buffering the keyspace.
+         * scanJobCron() will resume the job. */
+        aeDeleteFileEvent(server.el,fd,AE_READABLE);
+        server.scan_paused = 1;
+    }
+}
+
+/* SCAN ... ASYNC implementation, see the top comment of this section. */
+void scanJobStart(client *c, sds pat, sds type, long batchsize) {
+    pid_t childpid;
+    long long start;
+    int fds[2];
+
+    if (c->resp < 3) {
+        addReplyError(c,"SCAN ASYNC requires the RESP3 protocol, see HELLO");
+        return;
+    }
+    if (server.scan_child_pid != -1 || server.scan_pipe_fd != -1) {
+        addReplyError(c,"A background SCAN is already in progress");
+        return;
+    }
+    /* Persistence comes first: don't fork while another child is active,
+     * nor delay a BGSAVE or BGREWRITEAOF that is waiting to start. */
+    if (hasActiveChildProcess() || server.rdb_bgsave_scheduled ||
+        server.aof_rewrite_scheduled)
+    {
+        addReplyError(c,"Background save or AOF rewrite in progress, "
+                        "retry later");
+        return;
+    }
+    if (pipe(fds) == -1) {
+        addReplyErrorFormat(c,"Can't create the background SCAN pipe: %s",
+            strerror(errno));
+        return;
+    }
+
+    start = ustime();
+    if ((childpid = fork()) == 0) {
+        int retval;
+
+        /* Child */
+        close(fds[0]);
+        closeListeningSockets(0);
+        redisSetProcTitle("redis-scan");
+        retval = scanJobRunChild(fds[1],c->db,pat,type,batchsize);
+        exitFromChild((retval == C_OK) ? 0 : 1);
+    }
+
+    /* Parent */
+    server.stat_fork_time = ustime()-start;
+    latencyAddSampleIfNeeded("fork",server.stat_fork_time/1000);
+    close(fds[1]);
+    if (childpid == -1) {
+        close(fds[0]);
+        addReplyErrorFormat(c,"Can't start the background SCAN: fork: %s",
+            strerror(errno));
+        return;
+    }
+    anetNonBlock(NULL,fds[0]);
+    if (aeCreateFileEvent(server.el,fds[0],AE_READABLE,
+                          scanJobReadHandler,NULL) == AE_ERR)
+    {
+        kill(childpid,SIGUSR1);
+        close(fds[0]);
+        addReplyError(c,"Can't start the background SCAN: "
+                        "too many open files");
+        server.scan_child_pid = childpid; /* Reaped by serverCron(). */
+        return;
+    }
+
+    serverLog(LL_VERBOSE,"Background SCAN started by pid %d",(int)childpid);
+    server.scan_child_pid = childpid;
+    server.scan_pipe_fd = fds[0];
+    server.scan_paused = 0;
+    server.scan_client_id = c->id;
+    server.scan_buf = sdsempty();
+    server.scan_matched = 0;
+    updateDictResizePolicy();
+    addReply(c,shared.ok);
+}
+
+/* Kill the background SCAN child, if any, and abort the job. */
+void killScanJob(void) {
+    if (server.scan_child_pid != -1) kill(server.scan_child_pid,SIGUSR1);
+    if (server.scan_pipe_fd != -1) scanJobFinish("background SCAN aborted");
+}
+
+/* Called by serverCron() when the SCAN child was reaped. The pipe is left
+ * alone: we may still have to read the last batches written by the child,
+ * the EOF will terminate the job. */
+void scanJobChildDone(int exitcode, int bysignal) {
+    if (bysignal || exitcode != 0) {
+        serverLog(LL_VERBOSE,"Background SCAN terminated with error "
+            "(exit code %d, signal %d)",exitcode,bysignal);
+    }
+    server.scan_child_pid = -1;
+    updateDictResizePolicy();
+}
+
+/* Called by serverCron(): reap the SCAN child when it exits, and resume the
+ * reading from the pipe once the client consumed its output buffer. */
+void scanJobCron(void) {
+    if (server.scan_child_pid != -1) {
+        int statloc;
+
+        if (waitpid(server.scan_child_pid,&statloc,WNOHANG) ==
+            server.scan_child_pid)
+        {
+            int bysignal = WIFSIGNALED(statloc) ? WTERMSIG(statloc) : 0;
+            scanJobChildDone(WEXITSTATUS(statloc),bysignal);
+        }
+    }
+
+    if (server.scan_pipe_fd != -1 && server.scan_paused) {
+        client *c = lookupClientByID(server.scan_client_id);
+        if (c == NULL) {
+            killScanJob();
+        } else if (getClientOutputBufferMemoryUsage(c) <=
+                   SCAN_JOB_MAX_PENDING/2)
+        {
+            if (aeCreateFileEvent(server.el,server.scan_pipe_fd,AE_READABLE,
+                                  scanJobReadHandler,NULL) != AE_ERR)
+            {
+                server.scan_paused = 0;
+            }
+        }
+    }
+}
+
 /* The SCAN command completely relies on scanGenericCommand. */
 // 执行 SCAN 类型命令
 void scanCommand(client *c) {
@@ -925,23 +1342,7 @@ void typeCommand(client *c) {
     char *type;
 
     o = lookupKeyReadWithFlags(c->db,c->argv[1],LOOKUP_NOTOUCH);
-    if (o == NULL) {
-        type = "none";
-    } else {
-        switch(o->type) {
-        case OBJ_STRING: type = "string"; break;
-        case OBJ_LIST: type = "list"; break;
-        case OBJ_SET: type = "set"; break;
-        case OBJ_ZSET: type = "zset"; break;
-        case OBJ_HASH: type = "hash"; break;
-        case OBJ_STREAM: type = "stream"; break;
-        case OBJ_MODULE: {
-            moduleValue *mv = o->ptr;
-            type = mv->type->name;
-        }; break;
-        default: type = "unknown"; break;
-        }
-    }
+    type = getObjectTypeName(o);
     addReplyStatus(c,type);
 }
 
@@ -1010,7 +1411,7 @@ void renameGenericCommand(client *c, int nx) {
         /* Overwrite: delete the old key before creating the new one
          * with the same name. */
         // 执行的时 RENAME 删除目标键之后进行改名
-        dbDelete(c->db,c->argv[2]);
+        dbDeleteReplaced(c->db,c->argv[2]);
     }
     // 增加目标键
     dbAdd(c->db,c->argv[2],o);
@@ -1145,15 +1546,17 @@ int dbSwapDatabases(int id1, int id2) {
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
     /* Swap hash tables. Note that we don't swap blocking_keys,
-     * ready_keys and watched_keys, since we want clients to
+     * ready_keys and the WATCH versions, since we want clients to
      * remain in the same DB they were. */
     // 直接交换两个数据库的各种字段
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->key_index = db2->key_index;
     db1->avg_ttl = db2->avg_ttl;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->key_index = aux.key_index;
     db2->avg_ttl = aux.avg_ttl;
 
     /* Now we need to handle clients blocked on lists: as an effect
@@ -1347,6 +1750,7 @@ int expireIfNeeded(redisDb *db, robj *key) {
     propagateExpire(db,key,server.lazyfree_lazy_expire);
     notifyKeyspaceEvent(NOTIFY_EXPIRED,
         "expired",key,db->id);
+    trackingInvalidateKey(key);
     // 删除策略
     return server.lazyfree_lazy_expire ? dbAsyncDelete(db,key) :
                                          dbSyncDelete(db,key);
@@ -1632,6 +2036,192 @@ int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys)
     return keys;
 }
 
+/*-----------------------------------------------------------------------------
+ * Ordered key index
+ *
+ * When 'key-index' is enabled every DB keeps, in addition to the main hash
+ * table, a radix tree with the names of all its keys. It is kept in sync by
+ * dbAdd() and the delete functions exactly like the slots_to_keys map of
+ * Redis Cluster, and is used to serve KEYS and SCAN patterns starting with
+ * a literal prefix, like "user:1000:*", by walking only the keys having
+ * such prefix, in lexicographical order, instead of the whole keyspace.
+ *----------------------------------------------------------------------------*/
+
+void keyIndexAdd(redisDb *db, robj *key) {
+    if (db->key_index == NULL) return;
+    raxInsert(db->key_index,(unsigned char*)key->ptr,sdslen(key->ptr),
+              NULL,NULL);
+}
+
+void keyIndexDel(redisDb *db, robj *key) {
+    if (db->key_index == NULL) return;
+    raxRemove(db->key_index,(unsigned char*)key->ptr,sdslen(key->ptr),NULL);
+}
+
+/* Empty the index of 'db', called when the DB itself is emptied. */
+void keyIndexFlush(redisDb *db, int async) {
+    if (db->key_index == NULL) return;
+    if (async) {
+        keyIndexFreeAsync(db->key_index);
+    } else {
+        raxFree(db->key_index);
+    }
+    db->key_index = raxNew();
+}
+
+/* Create or destroy the index of every DB, so that 'key-index' can be
+ * changed at runtime with CONFIG SET. Building the index is O(N) in the
+ * number of keys and blocks the server meanwhile, the old indexes are
+ * released in background. */
+void keyIndexSetEnabled(int enabled) {
+    for (int j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (enabled && db->key_index == NULL) {
+            dictIterator *di = dictGetIterator(db->dict);
+            dictEntry *de;
+
+            db->key_index = raxNew();
+            while((de = dictNext(di)) != NULL) {
+                sds key = dictGetKey(de);
+                raxInsert(db->key_index,(unsigned char*)key,sdslen(key),
+                          NULL,NULL);
+            }
+            dictReleaseIterator(di);
+        } else if (!enabled && db->key_index != NULL) {
+            keyIndexFreeAsync(db->key_index);
+            db->key_index = NULL;
+        }
+    }
+}
+
+/* Return the length of the literal prefix of the glob-style pattern 'pat',
+ * that is, the number of bytes before the first special character. Escaped
+ * characters stop the prefix as well, for simplicity. */
+size_t patternPrefixLen(const char *pat, size_t patlen) {
+    size_t j;
+
+    for (j = 0; j < patlen; j++) {
+        if (pat[j] == '*' || pat[j] == '?' || pat[j] == '[' || pat[j] == '\\')
+            break;
+    }
+    return j;
+}
+
+/* KEYS implementation for patterns with a literal prefix of 'prefixlen'
+ * bytes when the key index is available. */
+void keysCommandByPrefix(client *c, sds pattern, size_t prefixlen) {
+    size_t plen = sdslen(pattern);
+    unsigned long numkeys = 0;
+    void *replylen = addReplyDeferredLen(c);
+    /* "prefix*" matches every key with the prefix: no need to match. */
+    int prefixonly = (prefixlen == plen-1 && pattern[plen-1] == '*');
+    raxIterator ri;
+
+    raxStart(&ri,c->db->key_index);
+    raxSeek(&ri,">=",(unsigned char*)pattern,prefixlen);
+    while(raxNext(&ri)) {
+        robj *keyobj;
+
+        if (ri.key_len < prefixlen || memcmp(ri.key,pattern,prefixlen))
+            break;
+        if (!prefixonly &&
+            !stringmatchlen(pattern,plen,(char*)ri.key,ri.key_len,0))
+            continue;
+        keyobj = createStringObject((char*)ri.key,ri.key_len);
+        if (!keyIsExpired(c->db,keyobj)) {
+            addReplyBulk(c,keyobj);
+            numkeys++;
+        }
+        decrRefCount(keyobj);
+    }
+    raxStop(&ri);
+    setDeferredArrayLen(c,replylen,numkeys);
+}
+
+/* SCAN over the key index. The cursor of SCAN must be stateless (clients
+ * are free to abandon an iteration, and the cursor must be valid on any
+ * server with the same keys), but resuming an ordered walk requires the
+ * last key visited, which does not fit in a cursor. So the index is only
+ * used when all the matching keys can be returned by a single call: the
+ * reply then has cursor 0. Otherwise C_ERR is returned without replying,
+ * and the caller continues with the hash table based SCAN from cursor 0.
+ *
+ * This is the common case for selective prefixes, and the hash table walk
+ * wasted at most count*10 keys or SCAN_TIME_BUDGET_USEC otherwise. */
+int scanKeyIndex(client *c, sds pat, size_t prefixlen, sds type, long count) {
+    list *keys = listCreate();
+    listNode *node;
+    raxIterator ri;
+    sds key = sdsempty();
+    long long start = ustime();
+    long visited = 0, maxvisited = count*10;
+    int done = 1;
+    int prefixonly = (prefixlen == sdslen(pat)-1 && pat[prefixlen] == '*');
+
+    raxStart(&ri,c->db->key_index);
+    raxSeek(&ri,">=",(unsigned char*)pat,prefixlen);
+    while(raxNext(&ri)) {
+        if (ri.key_len < prefixlen || memcmp(ri.key,pat,prefixlen)) break;
+
+        /* There are more keys with this prefix than we can return. */
+        if (listLength(keys) >= (unsigned long)count ||
+            visited >= maxvisited ||
+            ((visited & SCAN_TIME_CHECK_MASK) == 0 && visited &&
+             ustime()-start > SCAN_TIME_BUDGET_USEC))
+        {
+            done = 0;
+            break;
+        }
+        visited++;
+
+        if (!prefixonly &&
+            !stringmatchlen(pat,sdslen(pat),(char*)ri.key,ri.key_len,0))
+            continue;
+        if (type) {
+            dictEntry *de;
+
+            key = sdscpylen(key,(char*)ri.key,ri.key_len);
+            de = dictFind(c->db->dict,key);
+            if (de == NULL || strcasecmp(type,getObjectTypeName(dictGetVal(de))))
+                continue;
+        }
+        listAddNodeTail(keys,createStringObject((char*)ri.key,ri.key_len));
+    }
+    raxStop(&ri);
+    if (!done) goto cleanup;
+
+    /* Expired keys are removed only now, deleting them while walking would
+     * invalidate the iterator. */
+    node = listFirst(keys);
+    while (node) {
+        listNode *next = listNextNode(node);
+        robj *kobj = listNodeValue(node);
+
+        if (expireIfNeeded(c->db,kobj)) {
+            decrRefCount(kobj);
+            listDelNode(keys,node);
+        }
+        node = next;
+    }
+
+    addReplyArrayLen(c, 2);
+    addReplyBulkCBuffer(c,"0",1);
+    addReplyArrayLen(c, listLength(keys));
+    while ((node = listFirst(keys)) != NULL) {
+        robj *kobj = listNodeValue(node);
+        addReplyBulk(c, kobj);
+        decrRefCount(kobj);
+        listDelNode(keys, node);
+    }
+
+cleanup:
+    sdsfree(key);
+    listSetFreeMethod(keys,decrRefCountVoid);
+    listRelease(keys);
+    return done ? C_OK : C_ERR;
+}
+
 /* Slot to Key API. This is used by Redis Cluster in order to obtain in
  * a fast way a key that belongs to a specified hash slot. This is useful
  * while rehashing the cluster and in other conditions when we need to
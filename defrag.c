@@ -828,8 +828,12 @@ long defragKey(redisDb *db, dictEntry *de) {
     } else if (ob->type == OBJ_STREAM) {
         defragged += defragStream(db, de);
     } else if (ob->type == OBJ_MODULE) {
-        /* Currently defragmenting modules private data types
-         * is not supported. */
+        /* Modules private data types are defragmented only if the type
+         * exports a defrag method, see RedisModule_DefragAlloc(). */
+        moduleValue *newmv, *mv = ob->ptr;
+        if ((newmv = activeDefragAlloc(mv)))
+            defragged++, ob->ptr = mv = newmv;
+        defragged += moduleTypeDefragValue(mv);
     } else {
         serverPanic("Unknown object type");
     }
@@ -1137,4 +1141,9 @@ void activeDefragCycle(void) {
     /* Not implemented yet. */
 }
 
+void *activeDefragAlloc(void *ptr) {
+    UNUSED(ptr);
+    return NULL;
+}
+
 #endif
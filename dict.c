@@ -561,6 +561,44 @@ void dictRelease(dict *d)
     zfree(d);
 }
 
+/* Free the entries stored in the buckets [start,end) of the dictionary,
+ * where the buckets of the two tables are numbered one after the other,
+ * from 0 to ht[0].size+ht[1].size. The 'used' counters are not updated:
+ * this is meant to release a dictionary nobody else references anymore
+ * from multiple threads, each one working on a different range, and the
+ * caller has to set them to zero before calling dictRelease(), which at
+ * that point will just free the tables.
+ *
+ * Returns the number of entries released. */
+unsigned long dictReleaseBuckets(dict *d, unsigned long start,
+                                 unsigned long end)
+{
+    unsigned long i, freed = 0;
+
+    for (i = start; i < end; i++) {
+        dictht *ht = &d->ht[0];
+        unsigned long idx = i;
+        dictEntry *he, *nextHe;
+
+        if (idx >= ht->size) {
+            idx -= ht->size;
+            ht = &d->ht[1];
+            if (idx >= ht->size) break;
+        }
+        he = ht->table[idx];
+        while(he) {
+            nextHe = he->next;
+            dictFreeKey(d, he);
+            dictFreeVal(d, he);
+            zfree(he);
+            freed++;
+            he = nextHe;
+        }
+        ht->table[idx] = NULL;
+    }
+    return freed;
+}
+
 
 // 查找一个key
 dictEntry *dictFind(dict *d, const void *key)
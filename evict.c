@@ -566,7 +566,7 @@ int freeMemoryIfNeeded(void) {
             delta = (long long) zmalloc_used_memory();
             latencyStartMonitor(eviction_latency);
             if (server.lazyfree_lazy_eviction)
-                dbAsyncDelete(db,keyobj);
+                dbAsyncEvict(db,keyobj);
             else
                 dbSyncDelete(db,keyobj);
             latencyEndMonitor(eviction_latency);
@@ -577,6 +577,7 @@ int freeMemoryIfNeeded(void) {
             server.stat_evictedkeys++;
             notifyKeyspaceEvent(NOTIFY_EVICTED, "evicted",
                 keyobj, db->id);
+            trackingInvalidateKey(keyobj);
             decrRefCount(keyobj);
             keys_freed++;
 
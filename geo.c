@@ -31,6 +31,7 @@
 #include "geo.h"
 #include "geohash_helper.h"
 #include "debugmacro.h"
+#include <math.h>
 
 /* Things exported from t_zset.c only for geo.c, since it is the only other
  * part of Redis that requires close zset introspection. */
@@ -43,6 +44,7 @@ int zslValueLteMax(double value, zrangespec *spec);
  *   - geoadd - add coordinates for value to geoset
  *   - georadius - search radius by coordinates in geoset
  *   - georadiusbymember - search radius based on geoset member position
+ *   - geosearch - search a radius or a box around coordinates or a member
  * ==================================================================== */
 
 /* ====================================================================
@@ -183,21 +185,27 @@ void addReplyDoubleDistance(client *c, double d) {
 }
 
 /* Helper function for geoGetPointsInRange(): given a sorted set score
- * representing a point, and another point (the center of our search) and
- * a radius, appends this entry as a geoPoint into the specified geoArray
- * only if the point is within the search area.
+ * representing a point, and the search area 'shape', appends this entry as
+ * a geoPoint into the specified geoArray only if the point is within the
+ * search area.
  *
  * returns C_OK if the point is included, or REIDS_ERR if it is outside. */
-int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius, double score, sds member) {
+int geoAppendIfWithinShape(geoArray *ga, geoShape *shape, double score, sds member) {
     double distance, xy[2];
 
     if (!decodeGeohash(score,xy)) return C_ERR; /* Can't decode. */
     /* Note that geohashGetDistanceIfInRadiusWGS84() takes arguments in
      * reverse order: longitude first, latitude later. */
-    if (!geohashGetDistanceIfInRadiusWGS84(lon,lat, xy[0], xy[1],
-                                           radius, &distance))
-    {
-        return C_ERR;
+    if (shape->type == GEO_SHAPE_CIRCLE) {
+        if (!geohashGetDistanceIfInRadiusWGS84(shape->xy[0],shape->xy[1],
+                                               xy[0], xy[1],
+                                               shape->radius, &distance))
+            return C_ERR;
+    } else {
+        if (!geohashGetDistanceIfInRectangle(shape->width,shape->height,
+                                             shape->xy[0],shape->xy[1],
+                                             xy[0], xy[1], &distance))
+            return C_ERR;
     }
 
     /* Append the new element. */
@@ -210,19 +218,24 @@ int geoAppendIfWithinRadius(geoArray *ga, double lon, double lat, double radius,
     return C_OK;
 }
 
+/* Drop the points of the array after the first 'len' ones. */
+void geoArrayTruncate(geoArray *ga, size_t len) {
+    for (size_t i = len; i < ga->used; i++) sdsfree(ga->array[i].member);
+    if (len < ga->used) ga->used = len;
+}
+
 /* Query a Redis sorted set to extract all the elements between 'min' and
  * 'max', appending them into the array of geoPoint structures 'gparray'.
  * The command returns the number of elements added to the array.
  *
- * Elements which are farest than 'radius' from the specified 'x' and 'y'
- * coordinates are not included.
+ * Elements which are outside the search area 'shape' are not included.
  *
  * The ability of this function to append to an existing set of points is
  * important for good performances because querying by radius is performed
  * using multiple queries to the sorted set, that we later need to sort
  * via qsort. Similarly we need to be able to reject points outside the search
  * radius area ASAP in order to allocate and process more points than needed. */
-int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double lat, double radius, geoArray *ga) {
+int geoGetPointsInRange(robj *zobj, double min, double max, geoShape *shape, geoArray *ga) {
     /* minex 0 = include min in range; maxex 1 = exclude max in range */
     /* That's: min <= val < max */
     zrangespec range = { .min = min, .max = max, .minex = 0, .maxex = 1 };
@@ -254,8 +267,8 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             ziplistGet(eptr, &vstr, &vlen, &vlong);
             member = (vstr == NULL) ? sdsfromlonglong(vlong) :
                                       sdsnewlen(vstr,vlen);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
-                == C_ERR) sdsfree(member);
+            if (geoAppendIfWithinShape(ga,shape,score,member) == C_ERR)
+                sdsfree(member);
             zzlNext(zl, &eptr, &sptr);
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -275,8 +288,8 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
                 break;
 
             ele = sdsdup(ele);
-            if (geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,ele)
-                == C_ERR) sdsfree(ele);
+            if (geoAppendIfWithinShape(ga,shape,ln->score,ele) == C_ERR)
+                sdsfree(ele);
             ln = ln->level[0].forward;
         }
     }
@@ -315,69 +328,11 @@ void scoresOfGeoHashBox(GeoHashBits hash, GeoHashFix52Bits *min, GeoHashFix52Bit
 /* Obtain all members between the min/max of this geohash bounding box.
  * Populate a geoArray of GeoPoints by calling geoGetPointsInRange().
  * Return the number of points added to the array. */
-int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, double lon, double lat, double radius) {
+int membersOfGeoHashBox(robj *zobj, GeoHashBits hash, geoArray *ga, geoShape *shape) {
     GeoHashFix52Bits min, max;
 
     scoresOfGeoHashBox(hash,&min,&max);
-    return geoGetPointsInRange(zobj, min, max, lon, lat, radius, ga);
-}
-
-/* Search all eight neighbors + self geohash box */
-int membersOfAllNeighbors(robj *zobj, GeoHashRadius n, double lon, double lat, double radius, geoArray *ga) {
-    GeoHashBits neighbors[9];
-    unsigned int i, count = 0, last_processed = 0;
-    int debugmsg = 0;
-
-    neighbors[0] = n.hash;
-    neighbors[1] = n.neighbors.north;
-    neighbors[2] = n.neighbors.south;
-    neighbors[3] = n.neighbors.east;
-    neighbors[4] = n.neighbors.west;
-    neighbors[5] = n.neighbors.north_east;
-    neighbors[6] = n.neighbors.north_west;
-    neighbors[7] = n.neighbors.south_east;
-    neighbors[8] = n.neighbors.south_west;
-
-    /* For each neighbor (*and* our own hashbox), get all the matching
-     * members and add them to the potential result list. */
-    for (i = 0; i < sizeof(neighbors) / sizeof(*neighbors); i++) {
-        if (HASHISZERO(neighbors[i])) {
-            if (debugmsg) D("neighbors[%d] is zero",i);
-            continue;
-        }
-
-        /* Debugging info. */
-        if (debugmsg) {
-            GeoHashRange long_range, lat_range;
-            geohashGetCoordRange(&long_range,&lat_range);
-            GeoHashArea myarea = {{0}};
-            geohashDecode(long_range, lat_range, neighbors[i], &myarea);
-
-            /* Dump center square. */
-            D("neighbors[%d]:\n",i);
-            D("area.longitude.min: %f\n", myarea.longitude.min);
-            D("area.longitude.max: %f\n", myarea.longitude.max);
-            D("area.latitude.min: %f\n", myarea.latitude.min);
-            D("area.latitude.max: %f\n", myarea.latitude.max);
-            D("\n");
-        }
-
-        /* When a huge Radius (in the 5000 km range or more) is used,
-         * adjacent neighbors can be the same, leading to duplicated
-         * elements. Skip every range which is the same as the one
-         * processed previously. */
-        if (last_processed &&
-            neighbors[i].bits == neighbors[last_processed].bits &&
-            neighbors[i].step == neighbors[last_processed].step)
-        {
-            if (debugmsg)
-                D("Skipping processing of %d, same as previous\n",i);
-            continue;
-        }
-        count += membersOfGeoHashBox(zobj, neighbors[i], ga, lon, lat, radius);
-        last_processed = i;
-    }
-    return count;
+    return geoGetPointsInRange(zobj, min, max, shape, ga);
 }
 
 /* Sort comparators for qsort() */
@@ -397,6 +352,134 @@ static int sort_gp_desc(const void *a, const void *b) {
     return -sort_gp_asc(a, b);
 }
 
+/* Every one of the 9 boxes returned by geohashGetAreasByRadius() is split
+ * into its children up to GEO_COVER_EXTRA_STEPS steps deeper, so that the
+ * cells of the search are much nearer to the actual search area: in
+ * dense areas this avoids decoding and discarding a lot of points that are
+ * inside the 9 boxes but far from the center. */
+#define GEO_COVER_EXTRA_STEPS 2
+#define GEO_COVER_MAX_CELLS (9*(1<<(2*GEO_COVER_EXTRA_STEPS)))
+
+typedef struct geoCell {
+    GeoHashBits hash;
+    double mindist;     /* Lower bound of the distance from the center. */
+} geoCell;
+
+static int sort_cell_asc(const void *a, const void *b) {
+    const geoCell *ca = a, *cb = b;
+    if (ca->mindist > cb->mindist)
+        return 1;
+    else if (ca->mindist == cb->mindist)
+        return 0;
+    else
+        return -1;
+}
+
+/* Add the cell 'hash' to the search cells, unless it can't contain points
+ * inside the search area. If 'depth' is greater than zero the cell is
+ * recursively replaced by its four children. */
+static void geoCoverCell(geoShape *shape, GeoHashBits hash, int depth,
+                         geoCell *cells, int *numcells)
+{
+    GeoHashRange long_range, lat_range;
+    GeoHashArea area;
+    double mindist;
+
+    geohashGetCoordRange(&long_range,&lat_range);
+    geohashDecode(long_range,lat_range,hash,&area);
+    mindist = geohashGetDistanceToArea(shape->xy[0],shape->xy[1],&area);
+    if (mindist > shape->radius) return;
+
+    /* Boxes are tested against the enclosing circle above, but the
+     * latitude and longitude bounds of the box are much tighter. */
+    if (shape->type == GEO_SHAPE_BOX &&
+        !geohashAreaIntersectsRectangle(shape->width,shape->height,
+                                        shape->xy[0],shape->xy[1],&area))
+        return;
+
+    if (depth == 0 || hash.step >= GEO_STEP_MAX) {
+        cells[*numcells].hash = hash;
+        cells[*numcells].mindist = mindist;
+        (*numcells)++;
+        return;
+    }
+    for (int j = 0; j < 4; j++) {
+        GeoHashBits child;
+        child.bits = (hash.bits << 2) | j;
+        child.step = hash.step + 1;
+        geoCoverCell(shape,child,depth-1,cells,numcells);
+    }
+}
+
+/* Search the points of the sorted set inside the area 'shape', appending
+ * them to 'ga'. The search starts from the center box and its eight
+ * neighbors, that are refined into smaller cells (see geoCoverCell()).
+ *
+ * If 'limit' is not zero, the caller only needs the 'limit' points nearest
+ * to the center. In this case the cells are visited nearest first, the
+ * array is kept trimmed to the best 'limit' points, and the search stops as
+ * soon as the farthest of such points is nearer than the next cell.
+ *
+ * Returns the number of points in the array. */
+int membersOfShape(robj *zobj, geoShape *shape, long limit, geoArray *ga) {
+    GeoHashRadius n;
+    GeoHashBits boxes[9];
+    geoCell cells[GEO_COVER_MAX_CELLS];
+    int i, j, numcells = 0, depth;
+
+    if (shape->type == GEO_SHAPE_BOX)
+        n = geohashGetAreasByBoxWGS84(shape->xy[0],shape->xy[1],
+                                      shape->width,shape->height);
+    else
+        n = geohashGetAreasByRadiusWGS84(shape->xy[0],shape->xy[1],
+                                         shape->radius);
+    boxes[0] = n.hash;
+    boxes[1] = n.neighbors.north;
+    boxes[2] = n.neighbors.south;
+    boxes[3] = n.neighbors.east;
+    boxes[4] = n.neighbors.west;
+    boxes[5] = n.neighbors.north_east;
+    boxes[6] = n.neighbors.north_west;
+    boxes[7] = n.neighbors.south_east;
+    boxes[8] = n.neighbors.south_west;
+
+    /* Ziplist range lookups are linear scans, so for small sets it is
+     * cheaper to scan the 9 boxes than many smaller cells. */
+    depth = (zobj->encoding == OBJ_ENCODING_SKIPLIST) ?
+            GEO_COVER_EXTRA_STEPS : 0;
+
+    for (i = 0; i < 9; i++) {
+        if (HASHISZERO(boxes[i])) continue;
+
+        /* When a huge Radius (in the 5000 km range or more) is used,
+         * adjacent neighbors can be the same, leading to duplicated
+         * elements. Skip every box which is the same as one already
+         * processed. */
+        for (j = 0; j < i; j++) {
+            if (boxes[i].bits == boxes[j].bits &&
+                boxes[i].step == boxes[j].step) break;
+        }
+        if (j != i) continue;
+        geoCoverCell(shape,boxes[i],depth,cells,&numcells);
+    }
+
+    if (limit) qsort(cells,numcells,sizeof(geoCell),sort_cell_asc);
+
+    for (i = 0; i < numcells; i++) {
+        int added = membersOfGeoHashBox(zobj, cells[i].hash, ga, shape);
+
+        if (!limit || ga->used < (size_t)limit) continue;
+        if (added) {
+            qsort(ga->array, ga->used, sizeof(geoPoint), sort_gp_asc);
+            geoArrayTruncate(ga,limit);
+        }
+        /* No point of the next cells can be nearer than their mindist. */
+        if (i+1 < numcells && ga->array[limit-1].dist <= cells[i+1].mindist)
+            break;
+    }
+    return ga->used;
+}
+
 /* ====================================================================
  * Commands
  * ==================================================================== */
@@ -455,10 +538,51 @@ void geoaddCommand(client *c) {
 #define RADIUS_COORDS (1<<0)    /* Search around coordinates. */
 #define RADIUS_MEMBER (1<<1)    /* Search around member. */
 #define RADIUS_NOSTORE (1<<2)   /* Do not acceot STORE/STOREDIST option. */
+#define GEOSEARCH (1<<3)        /* GEOSEARCH command variant. */
+
+/* Input Argument Helper.
+ * Extract the box size from the three arguments starting at 'argv', that
+ * should be in the form: <width> <height> <unit>, populating the box fields
+ * of 'shape'. On error C_ERR is returned and the client is replied. */
+int extractBoxOrReply(client *c, robj **argv, geoShape *shape) {
+    double width, height, to_meters;
+
+    if (getDoubleFromObjectOrReply(c, argv[0], &width,
+                                   "need numeric width") != C_OK ||
+        getDoubleFromObjectOrReply(c, argv[1], &height,
+                                   "need numeric height") != C_OK)
+    {
+        return C_ERR;
+    }
+
+    if (width < 0 || height < 0) {
+        addReplyError(c,"width or height cannot be negative");
+        return C_ERR;
+    }
+
+    if ((to_meters = extractUnitOrReply(c,argv[2])) < 0) return C_ERR;
+
+    shape->type = GEO_SHAPE_BOX;
+    shape->width = width * to_meters;
+    shape->height = height * to_meters;
+    /* The half diagonal is not enough: the box width is measured along
+     * the parallel of every point, so toward the poles the corners of the
+     * box are farther than in a flat plane. The sum of the two halves is
+     * an upper bound of the distance of any point of the box from the
+     * center: the point of the center meridian at the same latitude is at
+     * most height/2 away from the center, and the point is at most width/2
+     * away from it. */
+    shape->radius = shape->width/2 + shape->height/2;
+    shape->conversion = to_meters;
+    return C_OK;
+}
 
 /* GEORADIUS key x y radius unit [WITHDIST] [WITHHASH] [WITHCOORD] [ASC|DESC]
  *                               [COUNT count] [STORE key] [STOREDIST key]
- * GEORADIUSBYMEMBER key member radius unit ... options ... */
+ * GEORADIUSBYMEMBER key member radius unit ... options ...
+ * GEOSEARCH key [FROMMEMBER member] [FROMLONLAT long lat]
+ *               [BYRADIUS radius unit] [BYBOX width height unit]
+ *               [WITHCOORD] [WITHDIST] [WITHHASH] [ASC|DESC] [COUNT count] */
 void georadiusGeneric(client *c, int flags) {
     robj *key = c->argv[1];
     robj *storekey = NULL;
@@ -471,34 +595,40 @@ void georadiusGeneric(client *c, int flags) {
         return;
     }
 
-    /* Find long/lat to use for radius search based on inquiry type */
+    /* Find long/lat to use for radius search based on inquiry type.
+     * GEOSEARCH specifies both the center and the shape as options. */
     int base_args;
-    double xy[2] = { 0 };
+    geoShape shape = {0};
+    shape.type = GEO_SHAPE_CIRCLE;
+    shape.conversion = 1;
     if (flags & RADIUS_COORDS) {
         base_args = 6;
-        if (extractLongLatOrReply(c, c->argv + 2, xy) == C_ERR)
+        if (extractLongLatOrReply(c, c->argv + 2, shape.xy) == C_ERR)
             return;
     } else if (flags & RADIUS_MEMBER) {
         base_args = 5;
         robj *member = c->argv[2];
-        if (longLatFromMember(zobj, member, xy) == C_ERR) {
+        if (longLatFromMember(zobj, member, shape.xy) == C_ERR) {
             addReplyError(c, "could not decode requested zset member");
             return;
         }
+    } else if (flags & GEOSEARCH) {
+        base_args = 2;
     } else {
         addReplyError(c, "Unknown georadius search type");
         return;
     }
 
     /* Extract radius and units from arguments */
-    double radius_meters = 0, conversion = 1;
-    if ((radius_meters = extractDistanceOrReply(c, c->argv + base_args - 2,
-                                                &conversion)) < 0) {
+    if (!(flags & GEOSEARCH) &&
+        (shape.radius = extractDistanceOrReply(c, c->argv + base_args - 2,
+                                               &shape.conversion)) < 0) {
         return;
     }
 
     /* Discover and populate all optional parameters. */
     int withdist = 0, withhash = 0, withcoords = 0;
+    int frommember = 0, fromloc = 0, byradius = 0, bybox = 0;
     int sort = SORT_NONE;
     long long count = 0;
     if (c->argc > base_args) {
@@ -537,6 +667,44 @@ void georadiusGeneric(client *c, int flags) {
                 storekey = c->argv[base_args+i+1];
                 storedist = 1;
                 i++;
+            } else if ((flags & GEOSEARCH) &&
+                       !strcasecmp(arg, "frommember") &&
+                       (i+1) < remaining)
+            {
+                if (longLatFromMember(zobj, c->argv[base_args+i+1],
+                                      shape.xy) == C_ERR)
+                {
+                    addReplyError(c, "could not decode requested zset member");
+                    return;
+                }
+                frommember++;
+                i++;
+            } else if ((flags & GEOSEARCH) &&
+                       !strcasecmp(arg, "fromlonlat") &&
+                       (i+2) < remaining)
+            {
+                if (extractLongLatOrReply(c, c->argv+base_args+i+1,
+                                          shape.xy) == C_ERR) return;
+                fromloc++;
+                i += 2;
+            } else if ((flags & GEOSEARCH) &&
+                       !strcasecmp(arg, "byradius") &&
+                       (i+2) < remaining)
+            {
+                if ((shape.radius = extractDistanceOrReply(c,
+                        c->argv+base_args+i+1, &shape.conversion)) < 0)
+                    return;
+                shape.type = GEO_SHAPE_CIRCLE;
+                byradius++;
+                i += 2;
+            } else if ((flags & GEOSEARCH) &&
+                       !strcasecmp(arg, "bybox") &&
+                       (i+3) < remaining)
+            {
+                if (extractBoxOrReply(c, c->argv+base_args+i+1,
+                                      &shape) == C_ERR) return;
+                bybox++;
+                i += 3;
             } else {
                 addReply(c, shared.syntaxerr);
                 return;
@@ -544,6 +712,20 @@ void georadiusGeneric(client *c, int flags) {
         }
     }
 
+    /* GEOSEARCH needs exactly one center and exactly one shape. */
+    if ((flags & GEOSEARCH) && frommember + fromloc != 1) {
+        addReplyError(c,
+            "exactly one of FROMMEMBER or FROMLONLAT can be specified "
+            "for GEOSEARCH");
+        return;
+    }
+    if ((flags & GEOSEARCH) && byradius + bybox != 1) {
+        addReplyError(c,
+            "exactly one of BYRADIUS and BYBOX can be specified "
+            "for GEOSEARCH");
+        return;
+    }
+
     /* Trap options not compatible with STORE and STOREDIST. */
     if (storekey && (withdist || withhash || withcoords)) {
         addReplyError(c,
@@ -556,13 +738,10 @@ void georadiusGeneric(client *c, int flags) {
      * ordering if COUNT was specified but no sorting was requested. */
     if (count != 0 && sort == SORT_NONE) sort = SORT_ASC;
 
-    /* Get all neighbor geohash boxes for our radius search */
-    GeoHashRadius georadius =
-        geohashGetAreasByRadiusWGS84(xy[0], xy[1], radius_meters);
-
-    /* Search the zset for all matching points */
+    /* Search the zset for all matching points. When only the nearest
+     * COUNT points are needed the search can stop early. */
     geoArray *ga = geoArrayCreate();
-    membersOfAllNeighbors(zobj, georadius, xy[0], xy[1], radius_meters, ga);
+    membersOfShape(zobj, &shape, sort == SORT_ASC ? count : 0, ga);
 
     /* If no matching results, the user gets an empty reply. */
     if (ga->used == 0 && storekey == NULL) {
@@ -607,7 +786,7 @@ void georadiusGeneric(client *c, int flags) {
         int i;
         for (i = 0; i < returned_items; i++) {
             geoPoint *gp = ga->array+i;
-            gp->dist /= conversion; /* Fix according to unit. */
+            gp->dist /= shape.conversion; /* Fix according to unit. */
 
             /* If we have options in option_length, return each sub-result
              * as a nested multi-bulk.  Add 1 to account for result value
@@ -645,7 +824,7 @@ void georadiusGeneric(client *c, int flags) {
         for (i = 0; i < returned_items; i++) {
             zskiplistNode *znode;
             geoPoint *gp = ga->array+i;
-            gp->dist /= conversion; /* Fix according to unit. */
+            gp->dist /= shape.conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
             size_t elelen = sdslen(gp->member);
 
@@ -662,7 +841,7 @@ void georadiusGeneric(client *c, int flags) {
             notifyKeyspaceEvent(NOTIFY_LIST,"georadiusstore",storekey,
                                 c->db->id);
             server.dirty += returned_items;
-        } else if (dbDelete(c->db,storekey)) {
+        } else if (dbDeleteReplaced(c->db,storekey)) {
             signalModifiedKey(c->db,storekey);
             notifyKeyspaceEvent(NOTIFY_GENERIC,"del",storekey,c->db->id);
             server.dirty++;
@@ -692,6 +871,11 @@ void georadiusbymemberroCommand(client *c) {
     georadiusGeneric(c, RADIUS_MEMBER|RADIUS_NOSTORE);
 }
 
+/* GEOSEARCH wrapper function. */
+void geosearchCommand(client *c) {
+    georadiusGeneric(c, GEOSEARCH|RADIUS_NOSTORE);
+}
+
 /* GEOHASH key ele1 ele2 ... eleN
  *
  * Returns an array with an 11 characters geohash representation of the
@@ -816,3 +1000,110 @@ void geodistCommand(client *c) {
         addReplyDoubleDistance(c,
             geohashGetDistance(xyxy[0],xyxy[1],xyxy[2],xyxy[3]) / to_meter);
 }
+
+#ifdef REDIS_TEST
+#define geoTestAssert(_e) do { \
+    if (!(_e)) { \
+        printf("\n=== ASSERTION FAILED ===\n"); \
+        printf("==> %s:%d '%s' is not true\n",__FILE__,__LINE__,#_e); \
+        exit(1); \
+    } \
+} while(0)
+
+/* Add the point lon,lat as a member of the sorted set 'zobj'. */
+static void geoTestAdd(robj *zobj, double lon, double lat, long id) {
+    GeoHashBits hash;
+    sds member = sdsfromlonglong(id);
+    int flags = ZADD_NONE;
+
+    geohashEncodeWGS84(lon,lat,GEO_STEP_MAX,&hash);
+    geoTestAssert(zsetAdd(zobj,geohashAlign52Bits(hash),member,&flags,NULL));
+    sdsfree(member);
+}
+
+/* Return the number of members of 'zobj' inside 'shape', testing every
+ * member, that is the result membersOfShape() must return. */
+static size_t geoTestCountInShape(robj *zobj, geoShape *shape) {
+    zset *zs = zobj->ptr;
+    zskiplistNode *ln = zs->zsl->header->level[0].forward;
+    size_t count = 0;
+    double distance, xy[2];
+
+    for (; ln; ln = ln->level[0].forward) {
+        geoTestAssert(decodeGeohash(ln->score,xy));
+        count += geohashGetDistanceIfInRectangle(shape->width,shape->height,
+                                                 shape->xy[0],shape->xy[1],
+                                                 xy[0],xy[1],&distance);
+    }
+    return count;
+}
+
+/* Check that membersOfShape() finds all the members of 'zobj' inside the
+ * box 'shape'. */
+static void geoTestBox(robj *zobj, geoShape *shape) {
+    geoArray *ga = geoArrayCreate();
+    size_t expected = geoTestCountInShape(zobj,shape);
+
+    geoTestAssert(membersOfShape(zobj,shape,0,ga) == (int)expected);
+    geoTestAssert(ga->used == expected);
+    geoArrayFree(ga);
+}
+
+int geoTest(int argc, char **argv) {
+    geoShape shape = {0};
+
+    UNUSED(argc);
+    UNUSED(argv);
+    shape.type = GEO_SHAPE_BOX;
+    shape.conversion = 1;
+
+    printf("BYBOX finds the corner points at high latitudes: ");
+    {
+        robj *zobj = createZsetObject();
+
+        /* The corner of this box is 787891 meters away from the center,
+         * while the half diagonal is 756096 meters. */
+        shape.xy[0] = 75.069683;
+        shape.xy[1] = -62.696563;
+        shape.width = 1387989;
+        shape.height = 600174;
+        shape.radius = shape.width/2 + shape.height/2;
+        geoTestAdd(zobj,90.089119,-65.394279,0);
+        geoTestAssert(geoTestCountInShape(zobj,&shape) == 1);
+        geoTestBox(zobj,&shape);
+        decrRefCount(zobj);
+        printf("OK\n");
+    }
+
+    printf("BYBOX matches a full scan of random boxes: ");
+    {
+        for (int j = 0; j < 200; j++) {
+            robj *zobj = createZsetObject();
+            double lat = -85 + (rand() % 17000) / 100.0;
+
+            shape.xy[0] = -180 + (rand() % 36000) / 100.0;
+            shape.xy[1] = lat;
+            shape.width = 1000 + rand() % 3000000;
+            shape.height = 1000 + rand() % 3000000;
+            shape.radius = shape.width/2 + shape.height/2;
+            /* Crowd the points near the box so that many of them are
+             * close to the edges. */
+            for (long id = 0; id < 500; id++) {
+                double dlat = shape.height/2/111195; /* ~meters per degree */
+                double plat = lat + dlat * ((rand() % 2400) / 1000.0 - 1.2);
+                double plon = shape.xy[0] + (rand() % 9000) / 100.0 - 45;
+
+                if (plat > 85) plat = 85;
+                if (plat < -85) plat = -85;
+                if (plon >= GEO_LONG_MAX) plon -= 360;
+                if (plon < GEO_LONG_MIN) plon += 360;
+                geoTestAdd(zobj,plon,plat,id);
+            }
+            geoTestBox(zobj,&shape);
+            decrRefCount(zobj);
+        }
+        printf("OK\n");
+    }
+    return 0;
+}
+#endif
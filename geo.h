@@ -19,4 +19,19 @@ typedef struct geoArray {
     size_t used;
 } geoArray;
 
+/* The area searched by GEORADIUS and GEOSEARCH: either a circle or a box
+ * centered at the longitude, latitude pair 'xy'. For boxes 'radius' is the
+ * radius of a circle enclosing the box (see extractBoxOrReply()). */
+#define GEO_SHAPE_CIRCLE 0
+#define GEO_SHAPE_BOX 1
+
+typedef struct geoShape {
+    int type;           /* GEO_SHAPE_CIRCLE or GEO_SHAPE_BOX. */
+    double xy[2];       /* Center of the search. */
+    double radius;      /* In meters. */
+    double width;       /* Box width in meters. */
+    double height;      /* Box height in meters. */
+    double conversion;  /* Meters to the unit requested by the user. */
+} geoShape;
+
 #endif
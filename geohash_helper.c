@@ -111,19 +111,98 @@ int geohashBoundingBox(double longitude, double latitude, double radius_meters,
     return 1;
 }
 
+/* Return the longitude difference, in degrees, between the center and the
+ * edge of a box 'width_m' meters wide at the latitude 'lat', that is the
+ * dlon where hav(width_m/2/R) = cos(lat)^2 * hav(dlon) (see
+ * geohashGetDistanceIfInRectangle()). When the whole parallel is inside
+ * the box 180 is returned. */
+static double geohashBoxLongDelta(double width_m, double lat) {
+    double s, c;
+
+    if (width_m/2 >= M_PI*EARTH_RADIUS_IN_METERS) return 180;
+    s = sin(width_m/2/EARTH_RADIUS_IN_METERS/2);
+    c = cos(deg_rad(lat));
+    if (c <= s) return 180;
+    return rad_deg(2*asin(s/c));
+}
+
+/* Like geohashBoundingBox() but for the box of width_m x height_m meters
+ * centered at longitude,latitude. The box width is measured along the
+ * parallels, so the longitude bounds are the ones of the box edge nearest
+ * to a pole. */
+int geohashBoxBoundingBox(double longitude, double latitude, double width_m,
+                          double height_m, double *bounds) {
+    double dlat, polelat, dlon;
+
+    if (!bounds) return 0;
+
+    dlat = rad_deg(height_m/2/EARTH_RADIUS_IN_METERS);
+    polelat = fabs(latitude) + dlat;
+    dlon = geohashBoxLongDelta(width_m, polelat > 90 ? 90 : polelat);
+    bounds[0] = longitude - dlon;
+    bounds[2] = longitude + dlon;
+    bounds[1] = latitude - dlat;
+    bounds[3] = latitude + dlat;
+    return 1;
+}
+
+/* Return 1 if the center box 'area' and its 'neighbors' are too small to
+ * cover the search area of the specified radius and bounding box. */
+static int geohashNeighborsTooSmall(double longitude, double latitude,
+                                    double radius_meters, const double *bounds,
+                                    const GeoHashArea *area,
+                                    const GeoHashNeighbors *neighbors) {
+    GeoHashRange long_range, lat_range;
+    GeoHashArea north, south, east, west;
+    double top, bottom, east_max, west_min;
+
+    geohashGetCoordRange(&long_range,&lat_range);
+    geohashDecode(long_range, lat_range, neighbors->north, &north);
+    geohashDecode(long_range, lat_range, neighbors->south, &south);
+    geohashDecode(long_range, lat_range, neighbors->east, &east);
+    geohashDecode(long_range, lat_range, neighbors->west, &west);
+
+    if (geohashGetDistance(longitude,latitude,longitude,north.latitude.max)
+        < radius_meters) return 1;
+    if (geohashGetDistance(longitude,latitude,longitude,south.latitude.min)
+        < radius_meters) return 1;
+    if (geohashGetDistance(longitude,latitude,east.longitude.max,latitude)
+        < radius_meters) return 1;
+    if (geohashGetDistance(longitude,latitude,west.longitude.min,latitude)
+        < radius_meters) return 1;
+
+    /* Near the poles the bounding box can be much wider than the radius
+     * measured along the parallel of the center. The east and west
+     * neighbors of the boxes near the 180th meridian wrap around. */
+    if (bounds[2] - bounds[0] >= 360) return 1;
+    east_max = east.longitude.max;
+    if (east.longitude.min < area->longitude.min) east_max += 360;
+    west_min = west.longitude.min;
+    if (west.longitude.max > area->longitude.max) west_min -= 360;
+    if (east_max < bounds[2] || west_min > bounds[0]) return 1;
+
+    /* The north and south neighbors of the boxes at the edges of the
+     * map wrap around as well, but there is nothing to cover there. */
+    top = bounds[3] > GEO_LAT_MAX ? GEO_LAT_MAX : bounds[3];
+    bottom = bounds[1] < GEO_LAT_MIN ? GEO_LAT_MIN : bounds[1];
+    if (area->latitude.max < top && north.latitude.max < top) return 1;
+    if (area->latitude.min > bottom && south.latitude.min > bottom) return 1;
+    return 0;
+}
+
 /* Return a set of areas (center + 8) that are able to cover a range query
- * for the specified position and radius. */
-GeoHashRadius geohashGetAreasByRadius(double longitude, double latitude, double radius_meters) {
+ * for the specified position, radius and bounding box (see
+ * geohashBoundingBox()). */
+static GeoHashRadius geohashGetAreas(double longitude, double latitude,
+                                     double radius_meters, double *bounds) {
     GeoHashRange long_range, lat_range;
     GeoHashRadius radius;
     GeoHashBits hash;
     GeoHashNeighbors neighbors;
     GeoHashArea area;
     double min_lon, max_lon, min_lat, max_lat;
-    double bounds[4];
     int steps;
 
-    geohashBoundingBox(longitude, latitude, radius_meters, bounds);
     min_lon = bounds[0];
     min_lat = bounds[1];
     max_lon = bounds[2];
@@ -140,27 +219,13 @@ GeoHashRadius geohashGetAreasByRadius(double longitude, double latitude, double
      * Sometimes when the search area is near an edge of the
      * area, the estimated step is not small enough, since one of the
      * north / south / west / east square is too near to the search area
-     * to cover everything. */
-    int decrease_step = 0;
+     * to cover everything. Near the poles a single step may not be
+     * enough, so we continue until the neighbors cover the search area,
+     * or the 9 boxes cover the whole map. */
+    while (steps > 1 &&
+           geohashNeighborsTooSmall(longitude,latitude,radius_meters,bounds,
+                                    &area,&neighbors))
     {
-        GeoHashArea north, south, east, west;
-
-        geohashDecode(long_range, lat_range, neighbors.north, &north);
-        geohashDecode(long_range, lat_range, neighbors.south, &south);
-        geohashDecode(long_range, lat_range, neighbors.east, &east);
-        geohashDecode(long_range, lat_range, neighbors.west, &west);
-
-        if (geohashGetDistance(longitude,latitude,longitude,north.latitude.max)
-            < radius_meters) decrease_step = 1;
-        if (geohashGetDistance(longitude,latitude,longitude,south.latitude.min)
-            < radius_meters) decrease_step = 1;
-        if (geohashGetDistance(longitude,latitude,east.longitude.max,latitude)
-            < radius_meters) decrease_step = 1;
-        if (geohashGetDistance(longitude,latitude,west.longitude.min,latitude)
-            < radius_meters) decrease_step = 1;
-    }
-
-    if (steps > 1 && decrease_step) {
         steps--;
         geohashEncode(&long_range,&lat_range,longitude,latitude,steps,&hash);
         geohashNeighbors(&hash,&neighbors);
@@ -196,11 +261,30 @@ GeoHashRadius geohashGetAreasByRadius(double longitude, double latitude, double
     return radius;
 }
 
+/* Return a set of areas (center + 8) that are able to cover a range query
+ * for the specified position and radius. */
+GeoHashRadius geohashGetAreasByRadius(double longitude, double latitude, double radius_meters) {
+    double bounds[4];
+
+    geohashBoundingBox(longitude, latitude, radius_meters, bounds);
+    return geohashGetAreas(longitude, latitude, radius_meters, bounds);
+}
+
 GeoHashRadius geohashGetAreasByRadiusWGS84(double longitude, double latitude,
                                            double radius_meters) {
     return geohashGetAreasByRadius(longitude, latitude, radius_meters);
 }
 
+/* Return a set of areas (center + 8) that are able to cover a box query
+ * for the specified position and box size. */
+GeoHashRadius geohashGetAreasByBoxWGS84(double longitude, double latitude,
+                                        double width_m, double height_m) {
+    double bounds[4];
+
+    geohashBoxBoundingBox(longitude, latitude, width_m, height_m, bounds);
+    return geohashGetAreas(longitude, latitude, width_m/2 + height_m/2, bounds);
+}
+
 GeoHashFix52Bits geohashAlign52Bits(const GeoHashBits hash) {
     uint64_t bits = hash.bits;
     bits <<= (52 - hash.step * 2);
@@ -233,3 +317,90 @@ int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double *distance) {
     return geohashGetDistanceIfInRadius(x1, y1, x2, y2, radius, distance);
 }
+
+/* Return the distance in meters along a meridian between two latitudes. */
+double geohashGetLatDistance(double lat1d, double lat2d) {
+    return EARTH_RADIUS_IN_METERS * fabs(deg_rad(lat2d) - deg_rad(lat1d));
+}
+
+/* Return 1 if the point x2,y2 is inside the box of width_m x height_m
+ * meters centered at x1,y1, populating *distance with the distance from
+ * the center. Otherwise 0 is returned.
+ *
+ * The latitude check is the cheapest, so it is performed first. */
+int geohashGetDistanceIfInRectangle(double width_m, double height_m,
+                                    double x1, double y1,
+                                    double x2, double y2, double *distance) {
+    if (geohashGetLatDistance(y1, y2) > height_m/2) return 0;
+    if (geohashGetDistance(x1, y2, x2, y2) > width_m/2) return 0;
+    *distance = geohashGetDistance(x1, y1, x2, y2);
+    return 1;
+}
+
+/* Return a lower bound of the distance in meters between the point
+ * lon,lat and any point inside 'area'. It is used in order to drop the
+ * cells of a search that can't contain any matching point, and to visit
+ * the remaining cells nearest first.
+ *
+ * The bound follows from the haversine formula:
+ *
+ *   hav(d) = hav(dlat) + cos(lat1) * cos(lat2) * hav(dlon)
+ *
+ * where every term is minimized independently: dlat and dlon are the
+ * smallest deltas between the point and the area edges, and cos(lat2) is
+ * the smallest cosine among the area latitudes. */
+double geohashGetDistanceToArea(double lon, double lat, const GeoHashArea *area) {
+    double dlon = 0, dlat = 0, mincos, u, v, h;
+
+    if (lon < area->longitude.min || lon > area->longitude.max) {
+        double d1 = fabs(area->longitude.min - lon);
+        double d2 = fabs(area->longitude.max - lon);
+
+        /* Cells near the 180th meridian are near from the other side. */
+        if (d1 > 180) d1 = 360 - d1;
+        if (d2 > 180) d2 = 360 - d2;
+        dlon = d1 < d2 ? d1 : d2;
+    }
+    if (lat < area->latitude.min) dlat = area->latitude.min - lat;
+    else if (lat > area->latitude.max) dlat = lat - area->latitude.max;
+
+    mincos = cos(deg_rad(area->latitude.min));
+    if (cos(deg_rad(area->latitude.max)) < mincos)
+        mincos = cos(deg_rad(area->latitude.max));
+
+    u = sin(deg_rad(dlat) / 2);
+    v = sin(deg_rad(dlon) / 2);
+    h = u * u + cos(deg_rad(lat)) * mincos * v * v;
+    if (h > 1) h = 1;
+    return 2.0 * EARTH_RADIUS_IN_METERS * asin(sqrt(h));
+}
+
+/* Return 1 if 'area' may contain points inside the box of width_m x height_m
+ * meters centered at lon,lat, as defined by geohashGetDistanceIfInRectangle().
+ * Otherwise 0 is returned and the area can be skipped.
+ *
+ * The width of the box is measured along the parallels, so the longitude
+ * span of the box grows with the latitude: the span to check is the one of
+ * the latitude nearest to the poles among the ones the area and the box
+ * have in common. */
+int geohashAreaIntersectsRectangle(double width_m, double height_m,
+                                   double lon, double lat,
+                                   const GeoHashArea *area) {
+    double dlat = rad_deg(height_m/2/EARTH_RADIUS_IN_METERS);
+    double minlat = lat - dlat, maxlat = lat + dlat, polelat, dlon = 0;
+
+    if (area->latitude.max < minlat || area->latitude.min > maxlat) return 0;
+    if (area->latitude.min > minlat) minlat = area->latitude.min;
+    if (area->latitude.max < maxlat) maxlat = area->latitude.max;
+    polelat = fabs(minlat) > fabs(maxlat) ? fabs(minlat) : fabs(maxlat);
+
+    if (lon < area->longitude.min || lon > area->longitude.max) {
+        double d1 = fabs(area->longitude.min - lon);
+        double d2 = fabs(area->longitude.max - lon);
+
+        if (d1 > 180) d1 = 360 - d1;
+        if (d2 > 180) d2 = 360 - d2;
+        dlon = d1 < d2 ? d1 : d2;
+    }
+    return dlon <= geohashBoxLongDelta(width_m, polelat);
+}
@@ -51,10 +51,14 @@ int GeoHashBitsComparator(const GeoHashBits *a, const GeoHashBits *b);
 uint8_t geohashEstimateStepsByRadius(double range_meters, double lat);
 int geohashBoundingBox(double longitude, double latitude, double radius_meters,
                         double *bounds);
+int geohashBoxBoundingBox(double longitude, double latitude, double width_m,
+                          double height_m, double *bounds);
 GeoHashRadius geohashGetAreasByRadius(double longitude,
                                       double latitude, double radius_meters);
 GeoHashRadius geohashGetAreasByRadiusWGS84(double longitude, double latitude,
                                            double radius_meters);
+GeoHashRadius geohashGetAreasByBoxWGS84(double longitude, double latitude,
+                                        double width_m, double height_m);
 GeoHashRadius geohashGetAreasByRadiusMercator(double longitude, double latitude,
                                               double radius_meters);
 GeoHashFix52Bits geohashAlign52Bits(const GeoHashBits hash);
@@ -66,5 +70,13 @@ int geohashGetDistanceIfInRadius(double x1, double y1,
 int geohashGetDistanceIfInRadiusWGS84(double x1, double y1, double x2,
                                       double y2, double radius,
                                       double *distance);
+double geohashGetLatDistance(double lat1d, double lat2d);
+int geohashGetDistanceIfInRectangle(double width_m, double height_m,
+                                    double x1, double y1,
+                                    double x2, double y2, double *distance);
+double geohashGetDistanceToArea(double lon, double lat, const GeoHashArea *area);
+int geohashAreaIntersectsRectangle(double width_m, double height_m,
+                                   double lon, double lat,
+                                   const GeoHashArea *area);
 
 #endif /* GEOHASH_HELPER_HPP_ */
@@ -4,7 +4,33 @@
 #include "cluster.h"
 
 static size_t lazyfree_objects = 0;
+static size_t lazyfree_freed_objects = 0;
 pthread_mutex_t lazyfree_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lazyfree_freed_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Dictionaries with at least this number of elements are not released by
+ * a single thread: the table is split in ranges of buckets, and every
+ * range is a different job, so that all the lazyfree threads can work
+ * on it at the same time. This only happens with lazyfree-threads > 1. */
+#define LAZYFREE_PARALLEL_THRESHOLD (1024*64)
+#define LAZYFREE_CHUNKS_PER_THREAD 4
+
+/* A dictionary being released in parallel. The last thread finishing its
+ * chunk releases what remains: the tables, and the object owning the
+ * dictionary if any. */
+typedef struct lazyfreeDict {
+    pthread_mutex_t mutex;
+    unsigned long chunks;   /* Chunks still to release. */
+    dict *d;
+    robj *o;                /* Object owning 'd', or NULL. */
+    int per_entry;          /* If true every entry of 'd' was accounted in
+                               lazyfree_objects, otherwise just 'o'. */
+} lazyfreeDict;
+
+typedef struct lazyfreeDictChunk {
+    lazyfreeDict *ld;
+    unsigned long start, end; /* Range of buckets, see dictReleaseBuckets(). */
+} lazyfreeDictChunk;
 
 /* Return the number of currently pending objects to free. */
 size_t lazyfreeGetPendingObjectsCount(void) {
@@ -13,6 +39,13 @@ size_t lazyfreeGetPendingObjectsCount(void) {
     return aux;
 }
 
+/* Return the number of objects released by the lazyfree threads so far. */
+size_t lazyfreeGetFreedObjectsCount(void) {
+    size_t aux;
+    atomicGet(lazyfree_freed_objects,aux);
+    return aux;
+}
+
 /* Return the amount of work needed in order to free an object.
  * The return value is not always the actual number of allocations the
  * object is compoesd of, but a number proportional to it.
@@ -27,7 +60,10 @@ size_t lazyfreeGetPendingObjectsCount(void) {
  * elements.
  *
  * For lists the function returns the number of elements in the quicklist
- * representing the list. */
+ * representing the list.
+ *
+ * For module data types the effort is reported by the type free_effort
+ * method, if the module exports it. */
 size_t lazyfreeGetFreeEffort(robj *obj) {
     if (obj->type == OBJ_LIST) {
         quicklist *ql = obj->ptr;
@@ -41,18 +77,66 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
+    } else if (obj->type == OBJ_MODULE) {
+        return moduleTypeFreeEffort(obj->ptr);
     } else {
         return 1; /* Everything else is a single allocation. */
     }
 }
 
+/* Schedule the release of the dictionary 'd' by ranges of buckets, if it
+ * is big enough and there is more than one lazyfree thread, otherwise
+ * return 0 and do nothing. 'o' is the object owning the dictionary, if
+ * any, and is released after the dictionary. Use 'minsize' 0 to force the
+ * parallel release regardless of the size of the dictionary. */
+// 大字典按桶区间拆分为多个任务，由多个 lazyfree 线程并行释放
+static int lazyfreeDictInChunks(dict *d, robj *o, int per_entry,
+                                unsigned long minsize, int priority)
+{
+    unsigned long buckets, nchunks, j;
+    lazyfreeDict *ld;
+
+    if (server.lazyfree_threads <= 1 || dictSize(d) < minsize) return 0;
+    buckets = d->ht[0].size + d->ht[1].size;
+    nchunks = (unsigned long)server.lazyfree_threads*LAZYFREE_CHUNKS_PER_THREAD;
+    if (nchunks > buckets) nchunks = buckets;
+    if (nchunks == 0) nchunks = 1;
+
+    ld = zmalloc(sizeof(*ld));
+    pthread_mutex_init(&ld->mutex,NULL);
+    ld->chunks = nchunks;
+    ld->d = d;
+    ld->o = o;
+    ld->per_entry = per_entry;
+    for (j = 0; j < nchunks; j++) {
+        lazyfreeDictChunk *chunk = zmalloc(sizeof(*chunk));
+        chunk->ld = ld;
+        chunk->start = buckets / nchunks * j;
+        chunk->end = (j == nchunks-1) ? buckets : buckets / nchunks * (j+1);
+        bioCreateBackgroundJobWithPriority(BIO_LAZY_FREE,priority,
+                                           NULL,chunk,NULL);
+    }
+    return 1;
+}
+
+/* Queue an object for lazy freeing. Big hash tables backed objects are
+ * released in parallel by all the lazyfree threads. */
+static void lazyfreeObject(robj *o, int priority) {
+    atomicIncr(lazyfree_objects,1);
+    if (((o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) ||
+         (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT)) &&
+        lazyfreeDictInChunks(o->ptr,o,0,LAZYFREE_PARALLEL_THRESHOLD,priority))
+        return;
+    bioCreateBackgroundJobWithPriority(BIO_LAZY_FREE,priority,o,NULL,NULL);
+}
+
 /* Delete a key, value, and associated expiration entry if any, from the DB.
  * If there are enough allocations to free the value object may be put into
  * a lazy free list instead of being freed synchronously. The lazy free list
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 // 用来评估是否需要异步删除的阈值
-int dbAsyncDelete(redisDb *db, robj *key) {
+static int dbAsyncDeleteGeneric(redisDb *db, robj *key, int priority) {
     /* Deleting an entry from the expires dict will not free the sds of
      * the key, because it is shared with the main dictionary. */
     // 先从 expire 字典中删除这个 entry（释放 expire 字典的 entry 内存）
@@ -82,8 +166,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
          * equivalent to just calling decrRefCount(). */
         // 代价大于阈值，给后台线程删除
         if (free_effort > LAZYFREE_THRESHOLD && val->refcount == 1) {
-            atomicIncr(lazyfree_objects,1);
-            bioCreateBackgroundJob(BIO_LAZY_FREE,val,NULL,NULL);
+            lazyfreeObject(val,priority);
             dictSetVal(db->dict,de,NULL);
         }
     }
@@ -93,18 +176,29 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     if (de) {
         dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key);
+        keyIndexDel(db,key);
         return 1;
     } else {
         return 0;
     }
 }
 
+int dbAsyncDelete(redisDb *db, robj *key) {
+    return dbAsyncDeleteGeneric(db,key,BIO_PRIORITY_NORMAL);
+}
+
+/* Like dbAsyncDelete() but the value is queued before the other pending
+ * lazyfree jobs: this is used by eviction, that needs the memory back
+ * as soon as possible, and may even wait for it in freeMemoryIfNeeded(). */
+int dbAsyncEvict(redisDb *db, robj *key) {
+    return dbAsyncDeleteGeneric(db,key,BIO_PRIORITY_HIGH);
+}
+
 /* Free an object, if the object is huge enough, free it in async way. */
 void freeObjAsync(robj *o) {
     size_t free_effort = lazyfreeGetFreeEffort(o);
     if (free_effort > LAZYFREE_THRESHOLD && o->refcount == 1) {
-        atomicIncr(lazyfree_objects,1);
-        bioCreateBackgroundJob(BIO_LAZY_FREE,o,NULL,NULL);
+        lazyfreeObject(o,BIO_PRIORITY_NORMAL);
     } else {
         decrRefCount(o);
     }
@@ -118,6 +212,14 @@ void emptyDbAsync(redisDb *db) {
     db->dict = dictCreate(&dbDictType,NULL);
     db->expires = dictCreate(&keyptrDictType,NULL);
     atomicIncr(lazyfree_objects,dictSize(oldht1));
+    if (lazyfreeDictInChunks(oldht1,NULL,1,LAZYFREE_PARALLEL_THRESHOLD,
+                             BIO_PRIORITY_NORMAL))
+    {
+        /* The keys of the expires dict are shared with the main dict and
+         * are not freed with it, so the two can be released in parallel. */
+        lazyfreeDictInChunks(oldht2,NULL,0,0,BIO_PRIORITY_NORMAL);
+        return;
+    }
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
 }
 
@@ -133,11 +235,20 @@ void slotToKeyFlushAsync(void) {
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
 }
 
+/* Release the ordered key index of a DB in background. The index is a
+ * radix tree without values like the slots-keys map, so the same job is
+ * used to free it. */
+void keyIndexFreeAsync(rax *idx) {
+    atomicIncr(lazyfree_objects,idx->numele);
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,idx);
+}
+
 /* Release objects from the lazyfree thread. It's just decrRefCount()
  * updating the count of objects to release. */
 void lazyfreeFreeObjectFromBioThread(robj *o) {
     decrRefCount(o);
     atomicDecr(lazyfree_objects,1);
+    atomicIncr(lazyfree_freed_objects,1);
 }
 
 /* Release a database from the lazyfree thread. The 'db' pointer is the
@@ -150,6 +261,7 @@ void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
     dictRelease(ht1);
     dictRelease(ht2);
     atomicDecr(lazyfree_objects,numkeys);
+    atomicIncr(lazyfree_freed_objects,numkeys);
 }
 
 /* Release the skiplist mapping Redis Cluster keys to slots in the
@@ -158,4 +270,38 @@ void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
     size_t len = rt->numele;
     raxFree(rt);
     atomicDecr(lazyfree_objects,len);
+    atomicIncr(lazyfree_freed_objects,len);
+}
+
+/* Release a range of buckets of a dictionary scheduled by
+ * lazyfreeDictInChunks(). The thread releasing the last chunk also frees
+ * the now empty dictionary, and the object owning it if any. */
+void lazyfreeFreeDictChunkFromBioThread(void *ptr) {
+    lazyfreeDictChunk *chunk = ptr;
+    lazyfreeDict *ld = chunk->ld;
+    unsigned long freed, left;
+
+    freed = dictReleaseBuckets(ld->d,chunk->start,chunk->end);
+    zfree(chunk);
+    if (ld->per_entry) {
+        atomicDecr(lazyfree_objects,freed);
+        atomicIncr(lazyfree_freed_objects,freed);
+    }
+
+    pthread_mutex_lock(&ld->mutex);
+    left = --ld->chunks;
+    pthread_mutex_unlock(&ld->mutex);
+    if (left) return;
+
+    ld->d->ht[0].used = 0;
+    ld->d->ht[1].used = 0;
+    if (ld->o) {
+        decrRefCount(ld->o); /* Just frees the tables of the empty dict. */
+        atomicDecr(lazyfree_objects,1);
+        atomicIncr(lazyfree_freed_objects,1);
+    } else {
+        dictRelease(ld->d);
+    }
+    pthread_mutex_destroy(&ld->mutex);
+    zfree(ld);
 }
@@ -676,6 +676,7 @@ int RM_CreateCommand(RedisModuleCtx *ctx, const char *name, RedisModuleCmdFunc c
     cp->rediscmd->proc = RedisModuleCommandDispatcher;
     cp->rediscmd->arity = -1;
     cp->rediscmd->flags = flags | CMD_MODULE;
+    cp->rediscmd->id = ACLGetCommandID(cmdname); /* ID used for ACL. */
     cp->rediscmd->getkeys_proc = (redisGetKeysProc*)(unsigned long)cp;
     cp->rediscmd->firstkey = firstkey;
     cp->rediscmd->lastkey = lastkey;
@@ -2955,10 +2956,43 @@ void moduleTypeNameByID(char *name, uint64_t moduleid) {
  * * **rdb_save**: A callback function pointer that saves data to RDB files.
  * * **aof_rewrite**: A callback function pointer that rewrites data as commands.
  * * **digest**: A callback function pointer that is used for `DEBUG DIGEST`.
+ * * **mem_usage**: A callback function pointer that reports the number of
+ *   bytes used by a value, used by `MEMORY USAGE`.
  * * **free**: A callback function pointer that can free a type value.
  *
- * The **digest* and **mem_usage** methods should currently be omitted since
- * they are not yet implemented inside the Redis modules core.
+ * Types registered with `.version = 2` or greater can also set the
+ * following optional fields:
+ *
+ * * **rdb_save_chunk**: An incremental alternative to **rdb_save**, see
+ *   below.
+ * * **aof_rewrite_chunk**: An incremental alternative to **aof_rewrite**.
+ * * **free_effort**: A callback function pointer returning the amount of
+ *   work needed to free a value, usually the number of allocations or
+ *   elements it is composed of. When it is over the lazyfree threshold the
+ *   value is released in a background thread by UNLINK and the
+ *   lazyfree-lazy-* options, so the **free** method must be thread safe
+ *   when this method is exported.
+ * * **defrag**: A callback function pointer called by active defrag for
+ *   every value of the type. It should call RedisModule_DefragAlloc() for
+ *   the allocations owned by the value, updating its own pointers with
+ *   the returned ones, and can replace `*value` itself. The return value
+ *   is currently ignored and should be zero.
+ *
+ * The chunk methods have the following prototypes:
+ *
+ *      int rdb_save_chunk(RedisModuleIO *io, void *value, void **cursor);
+ *      int aof_rewrite_chunk(RedisModuleIO *io, RedisModuleString *key,
+ *                            void *value, void **cursor);
+ *
+ * They are called again and again with the same `cursor`, that is NULL
+ * the first time, and should serialize just a part of the value, storing
+ * in `*cursor` whatever is needed in order to continue. They must return
+ * non zero while there is more to save, and zero once the value was fully
+ * serialized, releasing the cursor state if any. Between two chunks Redis
+ * is able to perform other work, like draining the accumulated difference
+ * from the parent while rewriting the AOF, so huge values don't need to be
+ * emitted in a single step. When a chunk method is set, the corresponding
+ * non incremental method is not used.
  *
  * Note: the module name "AAAAAAAAA" is reserved and produces an error, it
  * happens to be pretty lame as well.
@@ -2994,6 +3028,11 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
         moduleTypeMemUsageFunc mem_usage;
         moduleTypeDigestFunc digest;
         moduleTypeFreeFunc free;
+        /* Fields below are only present if version >= 2. */
+        moduleTypeSaveChunkFunc rdb_save_chunk;
+        moduleTypeRewriteChunkFunc aof_rewrite_chunk;
+        moduleTypeFreeEffortFunc free_effort;
+        moduleTypeDefragFunc defrag;
     } *tms = (struct typemethods*) typemethods_ptr;
 
     moduleType *mt = zcalloc(sizeof(*mt));
@@ -3005,6 +3044,12 @@ moduleType *RM_CreateDataType(RedisModuleCtx *ctx, const char *name, int encver,
     mt->mem_usage = tms->mem_usage;
     mt->digest = tms->digest;
     mt->free = tms->free;
+    if (tms->version >= 2) {
+        mt->rdb_save_chunk = tms->rdb_save_chunk;
+        mt->aof_rewrite_chunk = tms->aof_rewrite_chunk;
+        mt->free_effort = tms->free_effort;
+        mt->defrag = tms->defrag;
+    }
     memcpy(mt->name,name,sizeof(mt->name));
     listAddNodeTail(ctx->module->types,mt);
     return mt;
@@ -3271,6 +3316,91 @@ loaderr:
     return 0; /* Never reached. */
 }
 
+/* --------------------------------------------------------------------------
+ * Incremental serialization, lazy free and defrag of modules data types
+ * -------------------------------------------------------------------------- */
+
+/* Called by the core between two chunks emitted by the rdb_save_chunk and
+ * aof_rewrite_chunk methods. When we are the child rewriting the AOF, read
+ * the accumulated diff from the parent from time to time, exactly like
+ * rewriteAppendOnlyFileRio() does between two keys. */
+static void moduleTypeChunkYield(rio *r, size_t *processed) {
+    if (r == NULL || server.aof_child_diff == NULL) return;
+    if (r->processed_bytes > *processed+AOF_READ_DIFF_INTERVAL_BYTES) {
+        *processed = r->processed_bytes;
+        aofReadDiffFromParent();
+    }
+}
+
+/* Serialize the module value 'mv' into the RDB stream of 'io', using the
+ * incremental rdb_save_chunk method when the type exports it. */
+void moduleTypeSaveValue(RedisModuleIO *io, moduleValue *mv) {
+    moduleType *mt = mv->type;
+
+    if (mt->rdb_save_chunk == NULL) {
+        mt->rdb_save(io,mv->value);
+        return;
+    }
+
+    void *cursor = NULL;
+    size_t processed = io->rio ? io->rio->processed_bytes : 0;
+    while(mt->rdb_save_chunk(io,mv->value,&cursor)) {
+        moduleTypeChunkYield(io->rio,&processed);
+    }
+}
+
+/* Like moduleTypeSaveValue() but for the AOF rewrite, using the
+ * aof_rewrite_chunk method when available. */
+void moduleTypeRewriteValue(RedisModuleIO *io, robj *key, moduleValue *mv) {
+    moduleType *mt = mv->type;
+
+    if (mt->aof_rewrite_chunk == NULL) {
+        mt->aof_rewrite(io,key,mv->value);
+        return;
+    }
+
+    void *cursor = NULL;
+    size_t processed = io->rio->processed_bytes;
+    while(mt->aof_rewrite_chunk(io,key,mv->value,&cursor)) {
+        moduleTypeChunkYield(io->rio,&processed);
+    }
+}
+
+/* Return the effort needed to free the module value, see
+ * lazyfreeGetFreeEffort(). Types not exporting a free_effort method are
+ * considered to be a single allocation, so they are always freed
+ * synchronously, since we can't know if their free method is thread safe. */
+size_t moduleTypeFreeEffort(moduleValue *mv) {
+    moduleType *mt = mv->type;
+    if (mt->free_effort == NULL) return 1;
+    return mt->free_effort(mv->value);
+}
+
+/* Call the defrag method of the module type, if any, and return the number
+ * of allocations that were moved. */
+long moduleTypeDefragValue(moduleValue *mv) {
+    moduleType *mt = mv->type;
+    RedisModuleDefragCtx ctx = {0};
+
+    if (mt->defrag == NULL) return 0;
+    mt->defrag(&ctx,&mv->value);
+    return ctx.defragged;
+}
+
+/* In the context of the defrag method of a module data type, try to move
+ * the allocation 'ptr' to a less fragmented memory area. If the allocation
+ * was moved the new pointer is returned and the old one is no longer valid,
+ * so the module must update its references. Otherwise NULL is returned and
+ * the old pointer can still be used.
+ *
+ * Only allocations performed with RedisModule_Alloc() and friends can be
+ * passed to this function. */
+void *RM_DefragAlloc(RedisModuleDefragCtx *ctx, void *ptr) {
+    void *newptr = activeDefragAlloc(ptr);
+    if (newptr) ctx->defragged++;
+    return newptr;
+}
+
 /* --------------------------------------------------------------------------
  * Key digest API (DEBUG DIGEST interface for modules types)
  * -------------------------------------------------------------------------- */
@@ -5011,6 +5141,7 @@ void moduleRegisterCoreAPI(void) {
     REGISTER_API(DigestAddStringBuffer);
     REGISTER_API(DigestAddLongLong);
     REGISTER_API(DigestEndSequence);
+    REGISTER_API(DefragAlloc);
     REGISTER_API(SubscribeToKeyspaceEvents);
     REGISTER_API(RegisterClusterMessageReceiver);
     REGISTER_API(SendClusterMessage);
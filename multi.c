@@ -38,6 +38,7 @@
 void initClientMultiState(client *c) {
     c->mstate.commands = NULL;
     c->mstate.count = 0;
+    c->mstate.alloc = 0;
     c->mstate.cmd_flags = 0;
 }
 
@@ -64,19 +65,28 @@ void freeClientMultiState(client *c) {
 // 向事务队列中添加一个命令
 void queueMultiCommand(client *c) {
     multiCmd *mc;
-    int j;
-    // 先分配空间
-    c->mstate.commands = zrealloc(c->mstate.commands,
-            sizeof(multiCmd)*(c->mstate.count+1));
+
+    /* Grow the queue geometrically, so that queueing N commands does not
+     * require N reallocations. */
+    // 空间不足时按倍数扩容
+    if (c->mstate.count == c->mstate.alloc) {
+        c->mstate.alloc = c->mstate.alloc ? c->mstate.alloc*2 : 4;
+        c->mstate.commands = zrealloc(c->mstate.commands,
+                sizeof(multiCmd)*c->mstate.alloc);
+    }
     // 定位到命令插入位置
     mc = c->mstate.commands+c->mstate.count;
     // 填充新命令的数据
     mc->cmd = c->cmd;
     mc->argc = c->argc;
-    mc->argv = zmalloc(sizeof(robj*)*c->argc);
-    memcpy(mc->argv,c->argv,sizeof(robj*)*c->argc);
-    for (j = 0; j < c->argc; j++)
-        incrRefCount(mc->argv[j]);
+
+    /* Move the argument vector into the queue instead of copying it: the
+     * client will allocate a new one for the next command anyway, so we
+     * save an allocation and the reference counting of every argument. */
+    // 直接接管客户端的参数数组，避免复制
+    mc->argv = c->argv;
+    c->argv = NULL;
+    c->argc = 0;
     c->mstate.count++;
     // 统计一下 flags ？
     c->mstate.cmd_flags |= c->cmd->flags;
@@ -138,6 +148,65 @@ void execCommandPropagateMulti(client *c) {
     decrRefCount(multistring);
 }
 
+/* Like execCommandPropagateMulti() but for the final EXEC. */
+void execCommandPropagateExec(client *c) {
+    robj *execstring = createStringObject("EXEC",4);
+
+    propagate(server.execCommand,c->db->id,&execstring,1,
+              PROPAGATE_AOF|PROPAGATE_REPL);
+    decrRefCount(execstring);
+}
+
+/* While a transaction is executed, instead of appending every command to
+ * the AOF buffer and to every slave output buffer as it gets propagated,
+ * we just encode the protocol into two buffers, that are fed as a single
+ * block when EXEC returns. This way big transactions don't pay the
+ * per-command cost of the AOF / replication feeding functions, and the
+ * slaves receive the MULTI/.../EXEC block in a single reply chunk.
+ *
+ * Note that the selected DB of the AOF and of the replication stream is
+ * tracked while encoding, so we emit SELECT commands exactly like we would
+ * do without batching. The batch is also flushed before administrative
+ * commands, see execCommand(). */
+// 事务执行期间将需要传播的命令累积在缓冲区中，EXEC 结束时一次性传播
+void execPropagateBatchBegin(void) {
+    serverAssert(server.propagate_batch == 0);
+    server.propagate_batch = 1;
+}
+
+/* Feed the AOF and the replication link with what was accumulated so far,
+ * without terminating the batch. */
+void execPropagateBatchFlush(void) {
+    size_t aoflen = sdslen(server.propagate_batch_aof);
+    size_t repllen = sdslen(server.propagate_batch_repl);
+
+    if (aoflen) feedAppendOnlyFileRaw(server.propagate_batch_aof,aoflen);
+    if (repllen) {
+        replicationFeedSlavesFromMasterStream(server.slaves,
+            server.propagate_batch_repl,repllen);
+    }
+
+    /* Reuse the buffers, unless they got huge. */
+    if (sdsalloc(server.propagate_batch_aof) > PROTO_MBULK_BIG_ARG) {
+        sdsfree(server.propagate_batch_aof);
+        server.propagate_batch_aof = sdsempty();
+    } else {
+        sdsclear(server.propagate_batch_aof);
+    }
+    if (sdsalloc(server.propagate_batch_repl) > PROTO_MBULK_BIG_ARG) {
+        sdsfree(server.propagate_batch_repl);
+        server.propagate_batch_repl = sdsempty();
+    } else {
+        sdsclear(server.propagate_batch_repl);
+    }
+}
+
+void execPropagateBatchEnd(void) {
+    serverAssert(server.propagate_batch == 1);
+    server.propagate_batch = 0;
+    execPropagateBatchFlush();
+}
+
 // 执行事务命令
 void execCommand(client *c) {
     int j;
@@ -163,6 +232,7 @@ void execCommand(client *c) {
     // 2）命令在入队时出错
     // 第一种情况返回多个批量回复的空对象
     // 第二种返回一个 EXECABOUT 对象
+    if (isWatchedKeyTouched(c)) c->flags |= CLIENT_DIRTY_CAS;
     if (c->flags & (CLIENT_DIRTY_CAS|CLIENT_DIRTY_EXEC)) {
         addReply(c, c->flags & CLIENT_DIRTY_EXEC ? shared.execaborterr :
                                                    shared.nullarray[c->resp]);
@@ -196,6 +266,7 @@ void execCommand(client *c) {
     orig_argc = c->argc;
     orig_cmd = c->cmd;
     addReplyArrayLen(c,c->mstate.count);
+    execPropagateBatchBegin();
     // 执行事务中的命令
     for (j = 0; j < c->mstate.count; j++) {
         // 因为 Redis 的命令必须在客户端的上下文中执行
@@ -217,6 +288,14 @@ void execCommand(client *c) {
             // 计数，仅第一次发送
             must_propagate = 1;
         }
+
+        /* Administrative commands may fork (BGREWRITEAOF, BGSAVE, CONFIG SET
+         * appendonly) or change the replication state (SLAVEOF): flush what
+         * was propagated so far, otherwise the batch would be appended to
+         * the AOF rewrite buffer after the child already saw its effects,
+         * or fed to the replication stream of the new role. */
+        if (c->cmd->flags & CMD_ADMIN) execPropagateBatchFlush();
+
         // 执行命令
         call(c,server.loading ? CMD_CALL_NONE : CMD_CALL_FULL);
 
@@ -236,11 +315,19 @@ void execCommand(client *c) {
     discardTransaction(c);
 
     /* Make sure the EXEC command will be propagated as well if MULTI
-     * was already propagated. */
-    // 将服务器设为脏，确保 EXEC 命令也会被传播
+     * was already propagated. We propagate it ourselves as part of the
+     * batch, so that the whole block is fed at once, and prevent call()
+     * from propagating it again. */
+    // 将 EXEC 加入批量传播的缓冲区，然后一次性传播整个事务
     if (must_propagate) {
-        int is_master = server.masterhost == NULL;
         server.dirty++;
+        execCommandPropagateExec(c);
+        preventCommandPropagation(c);
+    }
+    execPropagateBatchEnd();
+
+    if (must_propagate) {
+        int is_master = server.masterhost == NULL;
         /* If inside the MULTI/EXEC block this instance was suddenly
          * switched from master to slave (using the SLAVEOF command), the
          * initial MULTI was propagated into the replication backlog, but the
@@ -264,12 +351,29 @@ handle_monitor:
 
 /* ===================== WATCH (CAS alike for MULTI/EXEC) ===================
  *
- * The implementation uses a per-DB hash table mapping keys to list of clients
- * WATCHing those keys, so that given a key that is going to be modified
- * we can mark all the associated clients as dirty.
+ * The implementation uses version stamps: every DB where at least a key was
+ * ever WATCHed has an array of WATCH_VERSIONS_SLOTS counters, and every key
+ * is hashed into one of them. Every time a key is modified the counter of
+ * its slot is incremented, so the cost for the writes is just an hash and an
+ * increment, and nothing at all for DBs where nobody is WATCHing keys. The
+ * array is allocated the first time a key of the DB is WATCHed and is never
+ * released, so that WATCH / EXEC cycles don't allocate and clear it again
+ * every time.
+ *
+ * Every client contains a list of WATCHed keys with the version of their
+ * slot at WATCH time: EXEC fails if at least one of the versions changed.
+ * Since different keys can hash to the same slot, a modification of a key
+ * that is not WATCHed may make EXEC fail as well, but this is fine for an
+ * optimistic locking scheme: the client will just retry.
  *
- * Also every client contains a list of WATCHed keys so that's possible to
- * un-watch such keys when the client is freed or when UNWATCH is called. */
+ * FLUSHDB / FLUSHALL just increment the flush version of the DB: this
+ * touches only the keys that existed when the flush happened. A key that
+ * existed when it was WATCHed either still existed at flush time, or was
+ * deleted before, which already changed its version. A key that did not
+ * exist was either created before the flush, changing its version, or is
+ * not affected by the flush at all. */
+// 使用版本号实现 WATCH：每个被监视的数据库维护一个版本号数组，
+// 键修改时只需递增其哈希槽位的版本号，EXEC 时比较版本号即可
 
 /* In the client->watched_keys list we need to use watchedKey structures
  * as in order to identify a key in Redis we need both the key name and the
@@ -278,13 +382,32 @@ handle_monitor:
 typedef struct watchedKey {
     robj *key;
     redisDb *db; // 监视键所在数据库
+    unsigned int slot;      /* Slot of the key in db->watch_versions. */
+    uint32_t version;       /* Version of the slot at WATCH time. */
+    uint64_t flush_version; /* Flush version of the DB at WATCH time. */
+    int existed;            /* True if the key existed at WATCH time. */
 } watchedKey;
 
+/* Return the version slot of the specified key. */
+static unsigned int watchedKeySlot(robj *key) {
+    uint64_t hash;
+
+    if (sdsEncodedObject(key)) {
+        hash = dictGenHashFunction(key->ptr,sdslen(key->ptr));
+    } else {
+        char buf[LONG_STR_SIZE];
+        int len = ll2string(buf,sizeof(buf),(long)key->ptr);
+        hash = dictGenHashFunction(buf,len);
+    }
+    return hash & (WATCH_VERSIONS_SLOTS-1);
+}
+
 /* Watch for the specified key */
-// 监视一个 key，客户端和服务器数据库均保存一份，但是使用的数据结构不同
-// 服务器数据库中村树的结构是 dict，key = key_name,value = list[client]
+// 监视一个 key，记录其所在槽位当前的版本号
+// 重复监视同一个键是无害的，所以不再检查客户端是否已经监视了该键，
+// 避免 WATCH 大量键时的 O(N^2) 复杂度
 void watchForKey(client *c, robj *key) {
-    list *clients = NULL;
+    redisDb *db = c->db;
     listIter li;
     listNode *ln;
     watchedKey *wk;
@@ -294,25 +417,24 @@ void watchForKey(client *c, robj *key) {
     listRewind(c->watched_keys,&li);
     while((ln = listNext(&li))) {
         wk = listNodeValue(ln);
-        if (wk->db == c->db && equalStringObjects(key,wk->key))
+        if (wk->db == db && equalStringObjects(key,wk->key))
             return; /* Key already watched */
     }
-    /* This key is not already watched in this DB. Let's add it */
-    // 数据库中不存在，add
-    clients = dictFetchValue(c->db->watched_keys,key);
-    if (!clients) {
-        // 创建一个新的链表
-        clients = listCreate();
-        // 添加到对应的数据库中
-        dictAdd(c->db->watched_keys,key,clients);
-        incrRefCount(key);
-    }
-    // 添加在末尾
-    listAddNodeTail(clients,c);
+
+    /* Start versioning the keys of this DB if this is the first key
+     * ever WATCHed here. */
+    if (db->watch_versions == NULL)
+        db->watch_versions = zcalloc(sizeof(uint32_t)*WATCH_VERSIONS_SLOTS);
+    db->watched_keys_count++;
+
     /* Add the new key to the list of keys watched by this client */
     wk = zmalloc(sizeof(*wk));
     wk->key = key;
-    wk->db = c->db;
+    wk->db = db;
+    wk->slot = watchedKeySlot(key);
+    wk->version = db->watch_versions[wk->slot];
+    wk->flush_version = db->flush_version;
+    wk->existed = dictFind(db->dict,key->ptr) != NULL;
     incrRefCount(key);
     // 添加到客户端监视链表的末尾
     listAddNodeTail(c->watched_keys,wk);
@@ -329,19 +451,13 @@ void unwatchAllKeys(client *c) {
     // 遍历本地监视队列
     listRewind(c->watched_keys,&li);
     while((ln = listNext(&li))) {
-        list *clients;
-        watchedKey *wk;
+        watchedKey *wk = listNodeValue(ln);
+        redisDb *db = wk->db;
 
-        /* Lookup the watched key -> clients list and remove the client
-         * from the list */
-        wk = listNodeValue(ln);
-        // 监视对应键的 client 链表
-        clients = dictFetchValue(wk->db->watched_keys, wk->key);
-        serverAssertWithInfo(c,NULL,clients != NULL);
-        listDelNode(clients,listSearchKey(clients,c));
-        /* Kill the entry at all if this was the only client */
-        if (listLength(clients) == 0)
-            dictDelete(wk->db->watched_keys, wk->key);
+        /* Once nobody is WATCHing keys here anymore the versions are no
+         * longer updated, but we keep the array for the next WATCH. */
+        serverAssertWithInfo(c,NULL,db->watched_keys_count > 0);
+        db->watched_keys_count--;
         /* Remove this watched key from the client->watched list */
         listDelNode(c->watched_keys,ln);
         decrRefCount(wk->key);
@@ -349,28 +465,31 @@ void unwatchAllKeys(client *c) {
     }
 }
 
-/* "Touch" a key, so that if this key is being WATCHed by some client the
- * next EXEC will fail. */
-// 传入被监视的键 key，进行标记，执行 EXEC 会失败
-void touchWatchedKey(redisDb *db, robj *key) {
-    list *clients;
+/* Return true if at least one of the keys WATCHed by the client was
+ * touched since it was WATCHed, so that EXEC must fail. */
+// 比较版本号，判断被监视的键是否被修改过
+int isWatchedKeyTouched(client *c) {
     listIter li;
     listNode *ln;
-    // 没有监视，直接返回
-    if (dictSize(db->watched_keys) == 0) return;
-    // 返回监视的客户端列表
-    clients = dictFetchValue(db->watched_keys, key);
-    if (!clients) return;
 
-    /* Mark all the clients watching this key as CLIENT_DIRTY_CAS */
-    /* Check if we are already watching for this key */
-    listRewind(clients,&li);
+    listRewind(c->watched_keys,&li);
     while((ln = listNext(&li))) {
-        // 均设置 CLIENT_DIRTY_CAS flags 即可
-        client *c = listNodeValue(ln);
+        watchedKey *wk = listNodeValue(ln);
 
-        c->flags |= CLIENT_DIRTY_CAS;
+        if (wk->db->watch_versions[wk->slot] != wk->version) return 1;
+        if (wk->existed && wk->db->flush_version != wk->flush_version)
+            return 1;
     }
+    return 0;
+}
+
+/* "Touch" a key, so that if this key is being WATCHed by some client the
+ * next EXEC will fail. */
+// 传入被监视的键 key，递增其版本号，执行 EXEC 会失败
+void touchWatchedKey(redisDb *db, robj *key) {
+    // 没有监视，直接返回
+    if (db->watched_keys_count == 0) return;
+    db->watch_versions[watchedKeySlot(key)]++;
 }
 
 /* On FLUSHDB or FLUSHALL all the watched keys that are present before the
@@ -378,34 +497,15 @@ void touchWatchedKey(redisDb *db, robj *key) {
  * be touched. "dbid" is the DB that's getting the flush. -1 if it is
  * a FLUSHALL operation (all the DBs flushed). */
 // 当一个数据库被 FLUSHDB 或者 FLUSHALL 清空时
-// 它数据库内的所有 key 都应该被触碰
+// 递增数据库的 flush 版本号即可，EXEC 时仅对监视时存在的键生效
 // dbid 参数指定要被 FLUSH 的数据库
 // 如果 dbid 为 -1 ，那么表示执行的是 FLUSHALL
 // 所有数据库都将被 FLUSH
 void touchWatchedKeysOnFlush(int dbid) {
-    listIter li1, li2;
-    listNode *ln;
+    int j;
 
-    /* For every client, check all the waited keys */
-    // 大规模操作，遍历客户端即可
-    listRewind(server.clients,&li1);
-    while((ln = listNext(&li1))) {
-        // 当前客户端
-        client *c = listNodeValue(ln);
-        // 客户端监视键
-        listRewind(c->watched_keys,&li2);
-        while((ln = listNext(&li2))) {
-            watchedKey *wk = listNodeValue(ln);
-
-            /* For every watched key matching the specified DB, if the
-             * key exists, mark the client as dirty, as the key will be
-             * removed. */
-            if (dbid == -1 || wk->db->id == dbid) {
-                // 判断键是否存在
-                if (dictFind(wk->db->dict, wk->key->ptr) != NULL)
-                    c->flags |= CLIENT_DIRTY_CAS;
-            }
-        }
+    for (j = 0; j < server.dbnum; j++) {
+        if (dbid == -1 || j == dbid) server.db[j].flush_version++;
     }
 }
 
@@ -431,3 +531,105 @@ void unwatchCommand(client *c) {
     c->flags &= (~CLIENT_DIRTY_CAS);
     addReply(c,shared.ok);
 }
+
+#ifdef REDIS_TEST
+#define multiTestAssert(_e) ((_e)?(void)0:(_multiTestAssert(#_e,__FILE__,__LINE__),exit(1)))
+static void _multiTestAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+static void multiTestWatch(client *c, char *name) {
+    robj *key = createStringObject(name,strlen(name));
+    watchForKey(c,key);
+    decrRefCount(key);
+}
+
+static void multiTestTouch(redisDb *db, char *name) {
+    robj *key = createStringObject(name,strlen(name));
+    touchWatchedKey(db,key);
+    decrRefCount(key);
+}
+
+int multiTest(int argc, char **argv) {
+    redisDb db;
+    client c;
+    uint32_t *versions;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    memset(&db,0,sizeof(db));
+    memset(&c,0,sizeof(c));
+    db.dict = dictCreate(&dbDictType,NULL);
+    c.db = &db;
+    c.watched_keys = listCreate();
+
+    printf("Touched WATCHed keys are detected: ");
+    {
+        multiTestWatch(&c,"foo");
+        multiTestWatch(&c,"bar");
+        multiTestAssert(db.watched_keys_count == 2);
+        multiTestAssert(!isWatchedKeyTouched(&c));
+        multiTestTouch(&db,"bar");
+        multiTestAssert(isWatchedKeyTouched(&c));
+        unwatchAllKeys(&c);
+        multiTestAssert(db.watched_keys_count == 0);
+        printf("OK\n");
+    }
+
+    printf("The versions array is kept across WATCH cycles: ");
+    {
+        versions = db.watch_versions;
+        multiTestAssert(versions != NULL);
+        /* Modifications while nobody is WATCHing don't touch it. */
+        multiTestTouch(&db,"foo");
+        multiTestWatch(&c,"foo");
+        multiTestAssert(db.watch_versions == versions);
+        multiTestAssert(!isWatchedKeyTouched(&c));
+        multiTestTouch(&db,"foo");
+        multiTestAssert(isWatchedKeyTouched(&c));
+        unwatchAllKeys(&c);
+        multiTestAssert(db.watch_versions == versions);
+        printf("OK\n");
+    }
+
+    printf("FLUSHDB only touches keys that existed: ");
+    {
+        robj *key = createStringObject("foo",3);
+        server.dbnum = 1;
+        server.db = &db;
+        multiTestWatch(&c,"missing");
+        multiTestAssert(dictAdd(db.dict,sdsdup(key->ptr),key) == DICT_OK);
+        multiTestWatch(&c,"foo");
+        touchWatchedKeysOnFlush(0);
+        multiTestAssert(isWatchedKeyTouched(&c));
+        unwatchAllKeys(&c);
+        multiTestWatch(&c,"missing");
+        touchWatchedKeysOnFlush(-1);
+        multiTestAssert(!isWatchedKeyTouched(&c));
+        unwatchAllKeys(&c);
+        server.db = NULL;
+        server.dbnum = 0;
+        printf("OK\n");
+    }
+
+    printf("WATCHing the same key again is a no-op: ");
+    {
+        multiTestWatch(&c,"foo");
+        multiTestTouch(&db,"foo");
+        /* The second WATCH must not take a new snapshot of the key. */
+        multiTestWatch(&c,"foo");
+        multiTestAssert(listLength(c.watched_keys) == 1);
+        multiTestAssert(db.watched_keys_count == 1);
+        multiTestAssert(isWatchedKeyTouched(&c));
+        unwatchAllKeys(&c);
+        multiTestAssert(db.watched_keys_count == 0);
+        printf("OK\n");
+    }
+
+    listRelease(c.watched_keys);
+    dictRelease(db.dict);
+    zfree(db.watch_versions);
+    return 0;
+}
+#endif
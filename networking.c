@@ -60,21 +60,180 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     }
 }
 
+/* -----------------------------------------------------------------------------
+ * Reply blocks allocation.
+ *
+ * Blocks of the client reply list are allocated in size classes, from
+ * PROTO_REPLY_CHUNK_BYTES up to REPLY_BLOCK_MAX_CLASS_BYTES, doubling at
+ * every class (the size includes the clientReplyBlock header). Blocks that
+ * were written to the socket are not freed but put in a free list for
+ * their class, so that big replies don't allocate and free the same
+ * blocks over and over. The free lists are capped to
+ * REPLY_BLOCK_POOL_MAX_BYTES, and a single client can only put back
+ * REPLY_BLOCK_MAX_RETAIN_PER_WRITE blocks for every write, so that a
+ * single huge reply does not fill the pool with the biggest class.
+ * Replies larger than the biggest class use exact size allocations.
+ *
+ * The free lists are protected by a mutex: modules can write replies
+ * from their threads without holding the GIL, using the fake client of a
+ * thread safe context bound to a blocked client.
+ * -------------------------------------------------------------------------- */
+
+#define REPLY_BLOCK_CLASSES 7 /* 16k, 32k, 64k, ... 1MB */
+#define REPLY_BLOCK_MAX_CLASS_BYTES (PROTO_REPLY_CHUNK_BYTES<<(REPLY_BLOCK_CLASSES-1))
+#define REPLY_BLOCK_POOL_MAX_BYTES (1024*1024*4)
+#define REPLY_BLOCK_MAX_RETAIN_PER_WRITE 4
+
+/* Free blocks are linked using the first bytes of their buffer. */
+static clientReplyBlock *reply_block_pool[REPLY_BLOCK_CLASSES];
+static size_t reply_block_pool_bytes = 0;
+static pthread_mutex_t reply_block_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return the class of a block allocation of 'bytes' bytes (header
+ * included), or -1 if it is not exactly the size of a class. */
+static int replyBlockClass(size_t bytes) {
+    int j;
+
+    for (j = 0; j < REPLY_BLOCK_CLASSES; j++)
+        if (bytes == ((size_t)PROTO_REPLY_CHUNK_BYTES << j)) return j;
+    return -1;
+}
+
+/* Return a block able to hold at least 'len' bytes of payload. */
+static clientReplyBlock *replyBlockAlloc(size_t len) {
+    clientReplyBlock *b;
+    int j;
+
+    for (j = 0; j < REPLY_BLOCK_CLASSES; j++) {
+        size_t bytes = (size_t)PROTO_REPLY_CHUNK_BYTES << j;
+        if (len + sizeof(clientReplyBlock) > bytes) continue;
+
+        pthread_mutex_lock(&reply_block_pool_mutex);
+        if ((b = reply_block_pool[j]) != NULL) {
+            memcpy(&reply_block_pool[j],b->buf,sizeof(b));
+            reply_block_pool_bytes -= bytes;
+        }
+        pthread_mutex_unlock(&reply_block_pool_mutex);
+        if (b == NULL) b = zmalloc(bytes);
+        /* Don't take over the internal fragmentation here, so that the
+         * block size always identifies its class. */
+        b->size = bytes - sizeof(clientReplyBlock);
+        b->used = 0;
+        return b;
+    }
+
+    /* Bigger than the biggest class. */
+    b = zmalloc(len + sizeof(clientReplyBlock));
+    /* take over the allocation's internal fragmentation */
+    b->size = zmalloc_usable(b) - sizeof(clientReplyBlock);
+    b->used = 0;
+    return b;
+}
+
+/* Release a block, putting it in the free list of its class if possible
+ * and 'retain' is true. */
+static void replyBlockRelease(clientReplyBlock *b, int retain) {
+    size_t bytes;
+    int j;
+
+    if (b == NULL) return;
+    bytes = b->size + sizeof(clientReplyBlock);
+    j = replyBlockClass(bytes);
+    if (retain && j != -1) {
+        pthread_mutex_lock(&reply_block_pool_mutex);
+        if (reply_block_pool_bytes + bytes <= REPLY_BLOCK_POOL_MAX_BYTES) {
+            memcpy(b->buf,&reply_block_pool[j],sizeof(b));
+            reply_block_pool[j] = b;
+            reply_block_pool_bytes += bytes;
+            b = NULL;
+        }
+        pthread_mutex_unlock(&reply_block_pool_mutex);
+    }
+    zfree(b);
+}
+
+/* Return the memory held by the reply blocks free lists. */
+size_t replyBlockPoolMemory(void) {
+    size_t bytes;
+
+    pthread_mutex_lock(&reply_block_pool_mutex);
+    bytes = reply_block_pool_bytes;
+    pthread_mutex_unlock(&reply_block_pool_mutex);
+    return bytes;
+}
+
+#ifdef REDIS_TEST
+#define REPLY_BLOCK_TEST_THREADS 4
+#define REPLY_BLOCK_TEST_LOOPS 100000
+
+static void *replyBlockTestThread(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    clientReplyBlock *held[8] = {NULL};
+
+    for (int j = 0; j < REPLY_BLOCK_TEST_LOOPS; j++) {
+        int slot = rand_r(&seed) % 8;
+        if (held[slot]) {
+            replyBlockRelease(held[slot],1);
+            held[slot] = NULL;
+        } else {
+            size_t len = rand_r(&seed) % REPLY_BLOCK_MAX_CLASS_BYTES;
+            held[slot] = replyBlockAlloc(len);
+            serverAssert(held[slot]->size >= len);
+            memset(held[slot]->buf,slot,sizeof(void*)*2);
+        }
+    }
+    for (int j = 0; j < 8; j++) replyBlockRelease(held[j],1);
+    return NULL;
+}
+
+/* Allocate and release reply blocks from multiple threads, like module
+ * threads replying to blocked clients do, then check that the free lists
+ * are still consistent with the accounted size. */
+int replyBlockTest(int argc, char **argv) {
+    pthread_t tids[REPLY_BLOCK_TEST_THREADS];
+    size_t bytes = 0;
+    int j;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    printf("Reply blocks pool used by multiple threads: ");
+    for (j = 0; j < REPLY_BLOCK_TEST_THREADS; j++)
+        pthread_create(&tids[j],NULL,replyBlockTestThread,
+                       (void*)(uintptr_t)(j+1));
+    for (j = 0; j < REPLY_BLOCK_TEST_THREADS; j++)
+        pthread_join(tids[j],NULL);
+
+    for (j = 0; j < REPLY_BLOCK_CLASSES; j++) {
+        clientReplyBlock *b = reply_block_pool[j];
+        while (b) {
+            serverAssert(replyBlockClass(b->size+sizeof(*b)) == j);
+            bytes += b->size+sizeof(*b);
+            memcpy(&b,b->buf,sizeof(b));
+        }
+    }
+    serverAssert(bytes == replyBlockPoolMemory());
+    serverAssert(bytes <= REPLY_BLOCK_POOL_MAX_BYTES);
+    printf("OK\n");
+    return 0;
+}
+#endif
+
 /* Client.reply list dup and free methods. */
 // 复制方法
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
     // 分配空间
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
+    clientReplyBlock *buf = replyBlockAlloc(old->size);
     // 把 o 中的数据复制到 buf
-    memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    memcpy(buf->buf, old->buf, old->used);
+    buf->used = old->used;
     // 返回复制后的缓冲区
     return buf;
 }
 // 删除方法
 void freeClientReplyValue(void *o) {
-    // 直接释放即可，因为 o 中不存在指针，是一块完整的内存
-    zfree(o);
+    // o 中不存在指针，是一块完整的内存，可以放回空闲链表复用
+    replyBlockRelease(o,1);
 }
 
 // 比较两个 string 字符串，二进制安全的方式
@@ -151,7 +310,7 @@ client *createClient(int fd) {
     c->argc = 0;         // 命令参数数量
     c->argv = NULL;      // 命令参数
     c->cmd = c->lastcmd = NULL;  // 当前执行命令和下一条命令
-    c->user = ACLGetUserByName("default",7);
+    c->user = DefaultUser;
     c->multibulklen = 0; // 查询缓冲区中未读入的命令内容数量
     c->bulklen = -1;     // 读入参数长度
     c->sentlen = 0;   // 已发送字节
@@ -169,6 +328,8 @@ client *createClient(int fd) {
     c->slave_capa = SLAVE_CAPA_NONE;
     c->reply = listCreate();  // 回复链表
     c->reply_bytes = 0;    // 回复链表字节数
+    c->argv_len_sum = 0;
+    c->last_memory_usage = 0;
     c->obuf_soft_limit_reached_time = 0;
     // 回复链表的释放和复制函数，妙
     listSetFreeMethod(c->reply,freeClientReplyValue);
@@ -190,6 +351,8 @@ client *createClient(int fd) {
     c->pubsub_patterns = listCreate();
     c->peerid = NULL;   // 被缓存的peerid，peerid就是 ip:port
     c->client_list_node = NULL;
+    c->client_tracking_redirection = 0;
+    c->client_tracking_prefixes = NULL;
     // 订阅发布模式的释放和比较方法
     listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
@@ -328,12 +491,15 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         len -= copy;
     }
     if (len) {
-        /* Create a new node, make sure it is allocated to at
-         * least PROTO_REPLY_CHUNK_BYTES */
-        size_t size = len < PROTO_REPLY_CHUNK_BYTES? PROTO_REPLY_CHUNK_BYTES: len;
-        tail = zmalloc(size + sizeof(clientReplyBlock));
-        /* take over the allocation's internal fragmentation */
-        tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
+        /* Create a new node. When the reply list keeps growing the new
+         * node is twice as big as the last one, up to the biggest size
+         * class, so that huge replies use fewer, bigger blocks. */
+        size_t size = len;
+        if (tail && tail->size*2 > size) size = tail->size*2;
+        if (size > REPLY_BLOCK_MAX_CLASS_BYTES - sizeof(clientReplyBlock) &&
+            len <= REPLY_BLOCK_MAX_CLASS_BYTES - sizeof(clientReplyBlock))
+            size = REPLY_BLOCK_MAX_CLASS_BYTES - sizeof(clientReplyBlock);
+        tail = replyBlockAlloc(size);
         tail->used = len;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
@@ -963,6 +1129,7 @@ static void freeClientArgv(client *c) {
     for (j = 0; j < c->argc; j++)
         decrRefCount(c->argv[j]);
     c->argc = 0;
+    c->argv_len_sum = 0;
     c->cmd = NULL;
 }
 
@@ -1058,6 +1225,10 @@ void freeClient(client *c) {
             replicationGetSlaveName(c));
     }
 
+    /* Stop accounting its memory in the clients memory budget. */
+    server.stat_clients_memory -= c->last_memory_usage;
+    c->last_memory_usage = 0;
+
     /* Free the query buffer */
     sdsfree(c->querybuf);
     sdsfree(c->pending_querybuf);
@@ -1077,6 +1248,10 @@ void freeClient(client *c) {
     dictRelease(c->pubsub_channels);
     listRelease(c->pubsub_patterns);
 
+    /* Deallocate structures used to track client side caching. */
+    if (c->flags & CLIENT_TRACKING) disableTracking(c);
+    if (c->flags & CLIENT_KEYEVENTS) disableKeyEventsStream(c);
+
     /* Free data structures. */
     listRelease(c->reply);
     freeClientArgv(c);
@@ -1172,6 +1347,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
     ssize_t nwritten = 0, totwritten = 0;
     size_t objlen;
     clientReplyBlock *o;
+    int retained = 0;
      // 如果指定的client的回复缓冲区中还有数据，则返回真，表示可以写socket
     while(clientHasPendingReplies(c)) {
         if (c->bufpos > 0) {
@@ -1197,7 +1373,9 @@ int writeToClient(int fd, client *c, int handler_installed) {
             // 空对象跳过即可
             if (objlen == 0) {
                 c->reply_bytes -= o->size;
+                listNodeValue(listFirst(c->reply)) = NULL;
                 listDelNode(c->reply,listFirst(c->reply));
+                replyBlockRelease(o,retained++ < REPLY_BLOCK_MAX_RETAIN_PER_WRITE);
                 continue;
             }
             // 写入 fd
@@ -1210,7 +1388,9 @@ int writeToClient(int fd, client *c, int handler_installed) {
             // 发送完成，则删除该节点，重置发送的数据长度，更新回复链表的总字节数
             if (c->sentlen == objlen) {
                 c->reply_bytes -= o->size;
+                listNodeValue(listFirst(c->reply)) = NULL;
                 listDelNode(c->reply,listFirst(c->reply));
+                replyBlockRelease(o,retained++ < REPLY_BLOCK_MAX_RETAIN_PER_WRITE);
                 c->sentlen = 0;
                 /* If there are no longer objects in the list, we expect
                  * the count of reply bytes to be exactly zero. */
@@ -1274,6 +1454,7 @@ int writeToClient(int fd, client *c, int handler_installed) {
             return C_ERR;
         }
     }
+    updateClientMemUsage(c);
     return C_OK;
 }
 
@@ -1456,6 +1637,7 @@ int processInlineBuffer(client *c) {
         if (sdslen(argv[j])) {
             c->argv[c->argc] = createObject(OBJ_STRING,argv[j]);
             c->argc++;
+            c->argv_len_sum += sdslen(argv[j]);
         } else {
             sdsfree(argv[j]);
         }
@@ -1637,6 +1819,7 @@ int processMultibulkBuffer(client *c) {
                     createStringObject(c->querybuf+c->qb_pos,c->bulklen);
                 c->qb_pos += c->bulklen+2;
             }
+            c->argv_len_sum += c->bulklen;
             c->bulklen = -1;
             c->multibulklen--;
         }
@@ -1725,6 +1908,9 @@ void processInputBuffer(client *c) {
                 if (!(c->flags & CLIENT_BLOCKED) || c->btype != BLOCKED_MODULE)
                     resetClient(c);
             }
+            /* Invalidation messages for keys this client modified are
+             * sent after the reply of the command. */
+            trackingHandlePendingKeyInvalidations();
             /* freeMemoryIfNeeded may flush slave output buffers. This may
              * result into a slave, that may be the active client, to be
              * freed. */
@@ -1839,6 +2025,13 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         return;
     }
 
+    /* The query buffer grew: update the clients memory budget, and evict
+     * clients if we are over it, before processing more commands. This
+     * may schedule this very client for closing, in which case
+     * processInputBuffer() will not process anything. */
+    updateClientMemUsage(c);
+    evictClients();
+
     /* Time to process the buffer. If the client is a master we need to
      * compute the difference between the applied offset before and after
      * processing the buffer, to understand how much of the replication stream
@@ -1930,6 +2123,10 @@ sds catClientInfoString(sds s, client *client) {
     if (client->flags & CLIENT_CLOSE_ASAP) *p++ = 'A';
     if (client->flags & CLIENT_UNIX_SOCKET) *p++ = 'U';
     if (client->flags & CLIENT_READONLY) *p++ = 'r';
+    if (client->flags & CLIENT_TRACKING) *p++ = 't';
+    if (client->flags & CLIENT_TRACKING_BROKEN_REDIR) *p++ = 'R';
+    if (client->flags & CLIENT_TRACKING_BCAST) *p++ = 'B';
+    if (client->flags & CLIENT_KEYEVENTS) *p++ = 'k';
     if (p == flags) *p++ = 'N';
     *p++ = '\0';
 
@@ -1999,6 +2196,9 @@ void clientCommand(client *c) {
 "pause <timeout>        -- Suspend all Redis clients for <timout> milliseconds.",
 "reply (on|off|skip)    -- Control the replies sent to the current connection.",
 "setname <name>         -- Assign the name <name> to the current connection.",
+"tracking (on|off) [REDIRECT <id>] [BCAST] [PREFIX <prefix> ...] -- Enable client keys tracking for client side caching.",
+"getredir               -- Return the client ID we are redirecting to when tracking is enabled.",
+"keyevents (on|off)     -- Receive the keyspace events in batches via RESP3 push.",
 "unblock <clientid> [TIMEOUT|ERROR] -- Unblock the specified blocked client.",
 NULL
         };
@@ -2174,6 +2374,115 @@ NULL
         } else {
             addReply(c,shared.czero);
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"tracking") && c->argc >= 3) {
+        /* CLIENT TRACKING (on|off) [REDIRECT <id>] [BCAST] [PREFIX first]
+         *                          [PREFIX second] ... */
+        long long redir = 0;
+        int bcast = 0, j;
+        robj **prefix = NULL;
+        size_t numprefix = 0;
+
+        /* Parse the options. */
+        for (j = 3; j < c->argc; j++) {
+            int moreargs = (c->argc-1) - j;
+
+            if (!strcasecmp(c->argv[j]->ptr,"redirect") && moreargs) {
+                j++;
+                if (redir != 0) {
+                    addReplyError(c,"A client can only redirect to a single "
+                                    "other client");
+                    zfree(prefix);
+                    return;
+                }
+                if (getLongLongFromObjectOrReply(c,c->argv[j],&redir,NULL) !=
+                    C_OK)
+                {
+                    zfree(prefix);
+                    return;
+                }
+                /* We will require the client with the specified ID to exist
+                 * right now, even if it is possible that it gets disconnected
+                 * later. Still a valid sanity check. */
+                if (lookupClientByID(redir) == NULL) {
+                    addReplyError(c,"The client ID you want redirect to "
+                                    "does not exist");
+                    zfree(prefix);
+                    return;
+                }
+            } else if (!strcasecmp(c->argv[j]->ptr,"bcast")) {
+                bcast = 1;
+            } else if (!strcasecmp(c->argv[j]->ptr,"prefix") && moreargs) {
+                j++;
+                prefix = zrealloc(prefix,sizeof(robj*)*(numprefix+1));
+                prefix[numprefix++] = c->argv[j];
+            } else {
+                zfree(prefix);
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+
+        /* Options are ok: enable or disable the tracking for this client. */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            /* Before enabling tracking, make sure options are compatible
+             * among each other and with the current state of the client. */
+            if (!bcast && numprefix) {
+                addReplyError(c,
+                    "PREFIX option requires BCAST mode to be enabled");
+                zfree(prefix);
+                return;
+            }
+
+            if (c->flags & CLIENT_TRACKING) {
+                int oldbcast = !!(c->flags & CLIENT_TRACKING_BCAST);
+                if (oldbcast != bcast) {
+                    addReplyError(c,
+                    "You can't switch BCAST mode on/off before disabling "
+                    "tracking for this client, and then re-enabling it with "
+                    "a different mode.");
+                    zfree(prefix);
+                    return;
+                }
+            }
+
+            if (bcast && !checkPrefixCollisionsOrReply(c,prefix,numprefix)) {
+                zfree(prefix);
+                return;
+            }
+
+            enableTracking(c,redir,bcast,prefix,numprefix);
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            disableTracking(c);
+        } else {
+            zfree(prefix);
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        zfree(prefix);
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"keyevents") && c->argc == 3) {
+        /* CLIENT KEYEVENTS (on|off) */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            if (c->resp < 3) {
+                addReplyError(c,"CLIENT KEYEVENTS requires the RESP3 "
+                                "protocol, see HELLO");
+                return;
+            }
+            enableKeyEventsStream(c);
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            disableKeyEventsStream(c);
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"getredir") && c->argc == 2) {
+        /* CLIENT GETREDIR */
+        if (c->flags & CLIENT_TRACKING) {
+            addReplyLongLong(c,c->client_tracking_redirection);
+        } else {
+            addReplyLongLong(c,-1);
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"setname") && c->argc == 3) {
         // 给客户端设置名字
         int j, len = sdslen(c->argv[2]->ptr);
@@ -2243,8 +2552,24 @@ void helloCommand(client *c) {
         return;
     }
 
+    /* Switching the user and the protocol at the same time is possible
+     * using the AUTH option. */
+    if (c->argc == 5 && !strcasecmp(c->argv[2]->ptr,"auth")) {
+        if (ACLCheckUserCredentials(c->argv[3],c->argv[4]) == C_OK) {
+            c->authenticated = 1;
+            c->user = ACLGetUserByName(c->argv[3]->ptr,
+                                       sdslen(c->argv[3]->ptr));
+        } else {
+            addReplyError(c,"-WRONGPASS invalid username-password pair");
+            return;
+        }
+    } else if (c->argc != 2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
     /* At this point we need to be authenticated to continue. */
-    if (!c->authenticated) {
+    if (!c->authenticated && ACLDefaultUserRequiresAuth()) {
         addReplyError(c,"-NOAUTH HELLO must be called with the client already "
                         "authenticated, otherwise the HELLO AUTH <user> <pass> "
                         "option can be used to authenticate the client and "
@@ -2395,6 +2720,90 @@ unsigned long getClientOutputBufferMemoryUsage(client *c) {
     return c->reply_bytes + (list_item_size*listLength(c->reply));
 }
 
+/* Return the memory used by a client: query buffer, output buffers, the
+ * arguments of the command being read, the client structure itself, and
+ * an estimate of the entries used by its Pub/Sub subscriptions and its
+ * WATCHed keys. Like getClientOutputBufferMemoryUsage() this is O(1). */
+size_t getClientMemoryUsage(client *c) {
+    size_t mem = sizeof(client);
+
+    mem += getClientOutputBufferMemoryUsage(c);
+    if (c->querybuf) mem += sdsZmallocSize(c->querybuf);
+    if (c->pending_querybuf) mem += sdsZmallocSize(c->pending_querybuf);
+    mem += c->argv_len_sum + c->argc*(sizeof(robj*)+sizeof(robj));
+    mem += dictSize(c->pubsub_channels)*sizeof(dictEntry);
+    mem += listLength(c->pubsub_patterns)*sizeof(listNode);
+    /* Every WATCHed key has a list node here and one in the db, plus a
+     * small structure referencing the key object. */
+    mem += listLength(c->watched_keys)*(sizeof(listNode)*3);
+    return mem;
+}
+
+/* Update the memory accounted for the client 'c' in the clients memory
+ * budget (see maxmemory-clients). Called when the client buffers change
+ * size: after reading from the socket, after writing to it, and from
+ * clientsCron() for everything else. Masters and replicas, that can't be
+ * evicted, are not accounted, neither are clients that are already
+ * going to be closed. */
+void updateClientMemUsage(client *c) {
+    size_t mem = 0;
+    int type = getClientType(c);
+
+    if (c->fd != -1 && type != CLIENT_TYPE_MASTER &&
+        type != CLIENT_TYPE_SLAVE && !(c->flags & CLIENT_CLOSE_ASAP))
+    {
+        mem = getClientMemoryUsage(c);
+    }
+    server.stat_clients_memory -= c->last_memory_usage;
+    server.stat_clients_memory += mem;
+    c->last_memory_usage = mem;
+}
+
+static int clientMemUsageCompare(const void *a, const void *b) {
+    const client *ca = *(client**)a, *cb = *(client**)b;
+
+    if (ca->last_memory_usage == cb->last_memory_usage) return 0;
+    return ca->last_memory_usage > cb->last_memory_usage ? -1 : 1;
+}
+
+/* If the memory used by clients is over maxmemory-clients, close the
+ * biggest consumers until we are back under the budget, so that clients
+ * buffers don't push the instance over maxmemory, evicting keys. This is
+ * O(N log N) in the number of clients, but only when over the budget:
+ * the evicted clients stop being accounted immediately, so a single call
+ * brings the total back under the limit. */
+void evictClients(void) {
+    client **candidates;
+    listIter li;
+    listNode *ln;
+    unsigned long j, count = 0;
+
+    if (!server.maxmemory_clients ||
+        server.stat_clients_memory <= server.maxmemory_clients) return;
+
+    candidates = zmalloc(sizeof(client*)*listLength(server.clients));
+    listRewind(server.clients,&li);
+    while((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        if (c->last_memory_usage) candidates[count++] = c;
+    }
+    qsort(candidates,count,sizeof(client*),clientMemUsageCompare);
+
+    for (j = 0; j < count; j++) {
+        client *c = candidates[j];
+        sds ci;
+
+        if (server.stat_clients_memory <= server.maxmemory_clients) break;
+        ci = catClientInfoString(sdsempty(),c);
+        serverLog(LL_WARNING,"Evicting client using %zu bytes to enforce maxmemory-clients: %s", c->last_memory_usage, ci);
+        sdsfree(ci);
+        freeClientAsync(c);
+        updateClientMemUsage(c);
+        server.stat_evictedclients++;
+    }
+    zfree(candidates);
+}
+
 /* Get the class of a client, used in order to enforce limits to different
  * classes of clients.
  *
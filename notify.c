@@ -91,6 +91,158 @@ sds keyspaceEventsFlagsToString(int flags) {
     return res;
 }
 
+/* Return the notification channels a Pub/Sub channel or pattern may
+ * receive messages from, as NOTIFY_KEYSPACE / NOTIFY_KEYEVENT flags. For
+ * patterns only the literal prefix is checked, so the result may be a false
+ * positive, which just means we'll format events nobody receives. */
+static int notifyChannelClasses(robj *o, int ispattern) {
+    int classes = 0;
+    size_t len, cmplen;
+    char *p;
+
+    if (!sdsEncodedObject(o)) return 0; /* Integers can't match. */
+    p = o->ptr;
+    len = sdslen(p);
+    cmplen = ispattern ? patternPrefixLen(p,len) : len;
+    if (cmplen > 11) cmplen = 11;
+    if ((ispattern || len >= 11) && !memcmp(p,"__keyspace@",cmplen))
+        classes |= NOTIFY_KEYSPACE;
+    if ((ispattern || len >= 11) && !memcmp(p,"__keyevent@",cmplen))
+        classes |= NOTIFY_KEYEVENT;
+    return classes;
+}
+
+/* Called by the Pub/Sub layer every time a channel or pattern subscription
+ * is added (delta = 1) or removed (delta = -1): we keep the number of
+ * subscriptions that may receive keyspace events, so that when there are
+ * none notifyKeyspaceEvent() can return before formatting anything. */
+void notifyUpdateSubscribers(robj *o, int ispattern, int delta) {
+    int classes = notifyChannelClasses(o,ispattern);
+
+    if (classes & NOTIFY_KEYSPACE) server.notify_keyspace_subscribers += delta;
+    if (classes & NOTIFY_KEYEVENT) server.notify_keyevent_subscribers += delta;
+}
+
+/* Set the 'notify-keyspace-prefixes' option: a space separated list of key
+ * prefixes, only the keys starting with one of them generate events. An
+ * empty string disables the filter. Returns C_ERR if the string can't be
+ * parsed. */
+int setNotifyKeyspacePrefixes(char *prefixes) {
+    int count;
+    sds *argv = sdssplitargs(prefixes,&count);
+
+    if (argv == NULL) return C_ERR;
+    sdsfreesplitres(server.notify_prefixes,server.notify_prefixes_count);
+    zfree(server.notify_keyspace_prefixes);
+    server.notify_prefixes = count ? argv : NULL;
+    server.notify_prefixes_count = count;
+    server.notify_keyspace_prefixes = count ? zstrdup(prefixes) : NULL;
+    if (count == 0) sdsfreesplitres(argv,count);
+    return C_OK;
+}
+
+/* Return 1 if 'key' passes the 'notify-keyspace-prefixes' filter. */
+int notifyKeyMatchesPrefixes(robj *key) {
+    if (server.notify_prefixes_count == 0) return 1;
+    for (int j = 0; j < server.notify_prefixes_count; j++) {
+        sds prefix = server.notify_prefixes[j];
+        size_t plen = sdslen(prefix);
+
+        if (sdslen(key->ptr) >= plen && !memcmp(key->ptr,prefix,plen))
+            return 1;
+    }
+    return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * Batched events stream
+ *
+ * RESP3 clients can call CLIENT KEYEVENTS ON to receive the events enabled
+ * by 'notify-keyspace-events' without subscribing to any channel: instead
+ * of a Pub/Sub message per event per channel, the events generated while
+ * serving an event loop iteration are accumulated and delivered with a
+ * single push message per client:
+ *
+ *     >2 "keyevents" [[dbid, event, key], [dbid, event, key], ...]
+ *
+ * The protocol of the batch is generated once and copied to every client.
+ * A batch is also sent as soon as it reaches NOTIFY_BATCH_MAX_EVENTS events,
+ * so that a single command touching many keys can't make it grow too much,
+ * unless the client executing the command is itself a client of the stream:
+ * the push would end in the middle of its reply (for instance of an EXEC),
+ * so in that case we wait for beforeSleep().
+ *----------------------------------------------------------------------------*/
+
+static sds KeyEventsBatch = NULL;
+static unsigned long KeyEventsBatchLen = 0;
+
+void notifyAddToBatch(char *event, robj *key, int dbid) {
+    size_t eventlen = strlen(event);
+
+    if (KeyEventsBatch == NULL) KeyEventsBatch = sdsempty();
+    KeyEventsBatch = sdscatfmt(KeyEventsBatch,"*3\r\n:%i\r\n$%u\r\n",
+        dbid,(unsigned int)eventlen);
+    KeyEventsBatch = sdscatlen(KeyEventsBatch,event,eventlen);
+    KeyEventsBatch = sdscatfmt(KeyEventsBatch,"\r\n$%u\r\n",
+        (unsigned int)sdslen(key->ptr));
+    KeyEventsBatch = sdscatsds(KeyEventsBatch,key->ptr);
+    KeyEventsBatch = sdscatlen(KeyEventsBatch,"\r\n",2);
+    if (++KeyEventsBatchLen >= NOTIFY_BATCH_MAX_EVENTS &&
+        !(server.current_client &&
+          server.current_client->flags & CLIENT_KEYEVENTS))
+    {
+        flushKeyEventsBatch();
+    }
+}
+
+/* Send the accumulated events to the clients of the stream. Called in
+ * beforeSleep(). */
+void flushKeyEventsBatch(void) {
+    listNode *ln;
+    listIter li;
+    char hdr[64];
+    int hdrlen;
+
+    if (KeyEventsBatchLen == 0) return;
+    hdrlen = snprintf(hdr,sizeof(hdr),">2\r\n$9\r\nkeyevents\r\n*%lu\r\n",
+        KeyEventsBatchLen);
+    listRewind(server.keyevents_clients,&li);
+    while((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+        addReplyProto(c,hdr,hdrlen);
+        addReplyProto(c,KeyEventsBatch,sdslen(KeyEventsBatch));
+    }
+    KeyEventsBatchLen = 0;
+    if (sdsalloc(KeyEventsBatch) > PROTO_IOBUF_LEN*4) {
+        sdsfree(KeyEventsBatch);
+        KeyEventsBatch = NULL;
+    } else {
+        sdsclear(KeyEventsBatch);
+    }
+}
+
+/* CLIENT KEYEVENTS ON / OFF implementation. */
+void enableKeyEventsStream(client *c) {
+    if (c->flags & CLIENT_KEYEVENTS) return;
+    c->flags |= CLIENT_KEYEVENTS;
+    listAddNodeTail(server.keyevents_clients,c);
+}
+
+void disableKeyEventsStream(client *c) {
+    listNode *ln;
+
+    if (!(c->flags & CLIENT_KEYEVENTS)) return;
+    c->flags &= ~CLIENT_KEYEVENTS;
+    ln = listSearchKey(server.keyevents_clients,c);
+    serverAssert(ln != NULL);
+    listDelNode(server.keyevents_clients,ln);
+    /* Drop the pending events if nobody is left to receive them. */
+    if (listLength(server.keyevents_clients) == 0) {
+        KeyEventsBatchLen = 0;
+        if (KeyEventsBatch) sdsclear(KeyEventsBatch);
+    }
+}
+
 /* The API provided to the rest of the Redis core is a simple function:
  *
  * notifyKeyspaceEvent(char *event, robj *key, int dbid);
@@ -117,12 +269,28 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
     /* If notifications for this class of events are off, return ASAP. */
     // 如果服务器为不发送 type 类型的通知，直接返回
     if (!(server.notify_keyspace_events & type)) return;
+
+    /* Nobody could receive this event? Don't even format it. */
+    if (!server.notify_keyspace_subscribers &&
+        !server.notify_keyevent_subscribers &&
+        !listLength(server.keyevents_clients)) return;
+
+    /* Only keys having one of the configured prefixes are notified. */
+    if (!notifyKeyMatchesPrefixes(key)) return;
+
+    /* Clients consuming the batched stream get the event with the next
+     * "keyevents" push, see flushKeyEventsBatch(). */
+    if (listLength(server.keyevents_clients))
+        notifyAddToBatch(event,key,dbid);
+
     // 事件的名字
     eventobj = createStringObject(event,strlen(event));
 
     /* __keyspace@<db>__:<key> <event> notifications. */
     // 发送键空间通知
-    if (server.notify_keyspace_events & NOTIFY_KEYSPACE) {
+    if (server.notify_keyspace_events & NOTIFY_KEYSPACE &&
+        server.notify_keyspace_subscribers)
+    {
         // 构建频道对象
         chan = sdsnewlen("__keyspace@",11);
         len = ll2string(buf,sizeof(buf),dbid);
@@ -138,7 +306,9 @@ void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid) {
 
     /* __keyevent@<db>__:<event> <key> notifications. */
     // 发送键事件通知
-    if (server.notify_keyspace_events & NOTIFY_KEYEVENT) {
+    if (server.notify_keyspace_events & NOTIFY_KEYEVENT &&
+        server.notify_keyevent_subscribers)
+    {
         // 构建频道对象
         chan = sdsnewlen("__keyevent@",11);
         if (len == -1) len = ll2string(buf,sizeof(buf),dbid);
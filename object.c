@@ -1040,11 +1040,10 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     } else if (o->type == OBJ_MODULE) {
         moduleValue *mv = o->ptr;
         moduleType *mt = mv->type;
-        if (mt->mem_usage != NULL) {
-            asize = mt->mem_usage(mv->value);
-        } else {
-            asize = 0;
-        }
+        /* Account for the object and the moduleValue wrapper as well, so
+         * that MEMORY USAGE is comparable with the native types. */
+        asize = sizeof(*o)+sizeof(*mv);
+        if (mt->mem_usage != NULL) asize += mt->mem_usage(mv->value);
     } else {
         serverPanic("Unknown object type");
     }
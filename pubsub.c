@@ -194,6 +194,7 @@ int pubsubSubscribeChannel(client *c, robj *channel) {
         }
         // 在这里添加到服务器端的对应频道订阅链表
         listAddNodeTail(clients,c);
+        notifyUpdateSubscribers(channel,0,1);
     }
     /* Notify the client */
     // 通知客户端
@@ -234,6 +235,7 @@ int pubsubUnsubscribeChannel(client *c, robj *channel, int notify) {
             // 频道没有客户端订阅，同样删除
             dictDelete(server.pubsub_channels,channel);
         }
+        notifyUpdateSubscribers(channel,0,-1);
     }
     /* Notify the client */
     // 通知客户端
@@ -257,6 +259,7 @@ int pubsubSubscribePattern(client *c, robj *pattern) {
         pat->client = c;
         // 仅仅把订阅节点保存在链表里，并不像频道一样根据 channel 不同进行区分
         listAddNodeTail(server.pubsub_patterns,pat);
+        notifyUpdateSubscribers(pat->pattern,1,1);
     }
     /* Notify the client */
     addReplyPubsubPatSubscribed(c,pattern);
@@ -281,6 +284,7 @@ int pubsubUnsubscribePattern(client *c, robj *pattern, int notify) {
         pat.pattern = pattern;
         ln = listSearchKey(server.pubsub_patterns,&pat);
         listDelNode(server.pubsub_patterns,ln);
+        notifyUpdateSubscribers(pattern,1,-1);
     }
     /* Notify the client */
     if (notify) addReplyPubsubPatUnsubscribed(c,pattern);
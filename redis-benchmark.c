@@ -33,56 +33,142 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <math.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <sds.h> /* Use hiredis sds. */
 #include "ae.h"
 #include "hiredis.h"
 #include "adlist.h"
 #include "zmalloc.h"
+#include "anet.h"
+#include "atomicvar.h"
 
 #define UNUSED(V) ((void) V)
+uint16_t crc16(const char *buf, int len);
 #define RANDPTR_INITIAL_SIZE 8
+#define MAX_THREADS 256
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_MAX_NODES 1024
+#define CLUSTER_MAX_REDIRECTS 16 /* Per request, before giving up. */
+#define CLUSTER_ROUTE_ATTEMPTS 64 /* See clusterRouteRequest(). */
+
+/* Latency histogram with a fixed relative error, in the spirit of the HDR
+ * histograms: latencies below LATENCY_HIST_SUB_BUCKETS microseconds are
+ * recorded exactly, while bigger values are grouped by their power of two
+ * magnitude, and every magnitude is split into LATENCY_HIST_SUB_BUCKETS/2
+ * linear sub buckets. So every value keeps three significant digits, the
+ * memory used does not depend on the number of requests, and the
+ * histograms of different threads are merged just summing the counters. */
+#define LATENCY_HIST_SUB_BITS 11
+#define LATENCY_HIST_SUB_BUCKETS (1<<LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_MAX_SHIFT 26 /* Values up to 2^37 us, about 38 hours. */
+#define LATENCY_HIST_BUCKETS (LATENCY_HIST_SUB_BUCKETS + \
+    LATENCY_HIST_MAX_SHIFT*(LATENCY_HIST_SUB_BUCKETS/2))
+
+typedef struct latencyHistogram {
+    long long total;        /* Number of recorded values. */
+    long long max;          /* Biggest recorded value. */
+    long long counts[LATENCY_HIST_BUCKETS];
+} latencyHistogram;
+
+/* A command of the --mix workload. */
+typedef struct benchmarkCommand {
+    int weight;             /* Relative frequency of the command. */
+    sds cmd;                /* The command in the Redis protocol. */
+} benchmarkCommand;
+
+/* A master node of the cluster, in --cluster mode. */
+typedef struct clusterNode {
+    char *ip;
+    int port;
+    long long redirects;    /* MOVED/ASK replies received from the node. */
+} clusterNode;
+
+/* Every thread runs its own event loop serving a subset of the clients.
+ * When --threads is not used, a single thread structure is used by the
+ * main thread. */
+typedef struct benchmarkThread {
+    int index;
+    pthread_t thread;
+    aeEventLoop *el;
+    list *clients;
+    int liveclients;
+    int numclients;         /* Number of clients this thread should serve. */
+    uint64_t rand_state;    /* State of benchmarkRandom(). */
+    latencyHistogram *latency;
+    list *idle;             /* --rps mode: clients waiting for a request. */
+    long long rate_seq;     /* --rps mode: next request to send. */
+    long long queued;       /* --rps mode: requests that found no idle client. */
+    latencyHistogram **node_latency; /* --cluster mode: latency by node. */
+} benchmarkThread;
 
 static struct config {
-    aeEventLoop *el;
     const char *hostip;
     int hostport;
     const char *hostsocket;
     int numclients;
     int liveclients;
-    int requests;
-    int requests_issued;
-    int requests_finished;
+    long long requests;
+    long long requests_issued;
+    long long requests_finished;
     int keysize;
     int datasize;
     int randomkeys;
     int randomkeys_keyspacelen;
+    double zipf_theta;      /* Zipfian keys if non zero, see zipfNext(). */
     int keepalive;
     int pipeline;
     int showerrors;
     long long start;
+    long long start_us;     /* Same as 'start', in microseconds. */
     long long totlatency;
-    long long *latency;
     const char *title;
-    list *clients;
     int quiet;
     int csv;
+    int csv_latency;        /* Add the latency percentiles to --csv rows. */
+    int json;
     int loop;
     int idlemode;
     int dbnum;
     sds dbnumstr;
     char *tests;
     char *auth;
+    int num_threads;        /* Number of --threads, 0 for no threads. */
+    benchmarkThread **threads;
+    int duration;           /* Run for this number of seconds if non zero. */
+    int report_interval;    /* Periodic report every N seconds if non zero. */
+    long long last_report;  /* Time of the last periodic report. */
+    latencyHistogram *report_snapshot; /* Histogram at the last report. */
+    benchmarkCommand *mix;  /* Commands of the --mix workload. */
+    int mixlen;
+    int mixweight;          /* Sum of the weights of the mix commands. */
+    int rps;                /* Open loop mode at this rate if non zero. */
+    int cluster;            /* Cluster mode. */
+    clusterNode **cluster_nodes;
+    int cluster_numnodes;
+    int *cluster_slots;     /* Index of the node serving every slot, or -1.
+                               Read and updated without locking, see
+                               clusterGetSlotNode(). */
+    pthread_mutex_t cluster_mutex; /* Protects adding nodes. */
 } config;
 
 typedef struct _client {
     redisContext *context;
+    redisContext **contexts; /* --cluster mode: connection to every node. */
+    int numcontexts;
+    int node;               /* --cluster mode: node 'context' points to. */
+    int redirects;          /* --cluster mode: redirections of the request. */
+    int resend;             /* Send the current request again. */
+    benchmarkThread *thread; /* The thread serving this client. */
     sds obuf;
     char **randptr;         /* Pointers to :rand: strings inside the command buf */
     size_t randlen;         /* Number of pointers in client->randptr */
@@ -95,11 +181,16 @@ typedef struct _client {
                                such as auth and select are prefixed to the pipeline of
                                benchmark commands and discarded after the first send. */
     int prefixlen;          /* Size in bytes of the pending prefix commands */
+    int idle;               /* --rps mode: in the idle list of the thread. */
+    long long idle_since;   /* --rps mode: time the client became idle. */
 } *client;
 
 /* Prototypes */
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
-static void createMissingClients(client c);
+static void createMissingClients(benchmarkThread *t, client from);
+static void dispatchScheduledRequests(benchmarkThread *t);
+static void randomizePlaceholder(client c, char *p);
+int showThroughput(struct aeEventLoop *eventLoop, long long id, void *clientData);
 
 /* Implementation */
 static long long ustime(void) {
@@ -122,22 +213,180 @@ static long long mstime(void) {
     return mst;
 }
 
+/* ---------------------------- Latency histogram -------------------------- */
+
+static int histIndex(long long value) {
+    int shift = 0;
+
+    if (value < 0) value = 0;
+    if (value < LATENCY_HIST_SUB_BUCKETS) return value;
+    while ((value >> shift) >= LATENCY_HIST_SUB_BUCKETS) shift++;
+    if (shift > LATENCY_HIST_MAX_SHIFT) return LATENCY_HIST_BUCKETS-1;
+    return LATENCY_HIST_SUB_BUCKETS + (shift-1)*(LATENCY_HIST_SUB_BUCKETS/2) +
+           (int)((value >> shift) - LATENCY_HIST_SUB_BUCKETS/2);
+}
+
+/* Return the highest value that is recorded in the bucket 'idx'. */
+static long long histValue(int idx) {
+    long long sub;
+    int shift;
+
+    if (idx < LATENCY_HIST_SUB_BUCKETS) return idx;
+    idx -= LATENCY_HIST_SUB_BUCKETS;
+    shift = idx/(LATENCY_HIST_SUB_BUCKETS/2) + 1;
+    sub = idx%(LATENCY_HIST_SUB_BUCKETS/2) + LATENCY_HIST_SUB_BUCKETS/2;
+    return ((sub+1) << shift) - 1;
+}
+
+static void histRecord(latencyHistogram *h, long long value) {
+    h->counts[histIndex(value)]++;
+    h->total++;
+    if (value > h->max) h->max = value;
+}
+
+/* Populate 'dst' with the sum of the histograms of all the threads, or
+ * of the histograms of the cluster node 'node' if it is not -1. Note that
+ * the histograms of running threads are read without any lock: this is
+ * only used for the reports, so a few values more or less are fine. */
+static void histSnapshot(latencyHistogram *dst, int node) {
+    int nthreads = config.num_threads ? config.num_threads : 1;
+
+    memset(dst,0,sizeof(*dst));
+    for (int i = 0; i < nthreads; i++) {
+        latencyHistogram *src = (node == -1) ? config.threads[i]->latency :
+                                config.threads[i]->node_latency[node];
+        if (src == NULL) continue;
+        for (int j = 0; j < LATENCY_HIST_BUCKETS; j++)
+            dst->counts[j] += src->counts[j];
+        dst->total += src->total;
+        if (src->max > dst->max) dst->max = src->max;
+    }
+}
+
+/* Turn 'h' into the histogram of the values recorded after 'prev' was
+ * taken. The max is only known up to the histogram precision. */
+static void histSubtract(latencyHistogram *h, latencyHistogram *prev) {
+    long long max = 0;
+
+    for (int j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        h->counts[j] -= prev->counts[j];
+        if (h->counts[j]) max = histValue(j);
+    }
+    h->total -= prev->total;
+    if (max < h->max) h->max = max;
+}
+
+/* Return the value at the percentile 'perc' (0-100) of the histogram. */
+static long long histPercentile(latencyHistogram *h, double perc) {
+    long long target, seen = 0;
+
+    if (h->total == 0) return 0;
+    target = (long long)ceil(perc/100*h->total);
+    if (target < 1) target = 1;
+    for (int j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += h->counts[j];
+        if (seen >= target) {
+            long long value = histValue(j);
+            return value > h->max ? h->max : value;
+        }
+    }
+    return h->max;
+}
+
+/* ------------------------------ Random keys ------------------------------ */
+
+/* xorshift64* generator: every thread has its own state so that threads
+ * don't contend on the lock of random(). */
+static uint64_t benchmarkRandom(benchmarkThread *t) {
+    uint64_t x = t->rand_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t->rand_state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* Zipfian distribution of the random keys with the method described in
+ * "Quickly Generating Billion-Record Synthetic Databases" by Gray et al.,
+ * also used by YCSB. The key 0 is the most popular one. */
+static struct {
+    long long n;
+    double theta, alpha, zetan, eta;
+} zipf;
+
+static double zipfZeta(long long n, double theta) {
+    long long exact = n < 1000000 ? n : 1000000;
+    double sum = 0;
+
+    /* Sum the first terms, and approximate the remaining ones with the
+     * integral of x^-theta, otherwise huge keyspaces would take ages. */
+    for (long long i = 1; i <= exact; i++) sum += 1/pow((double)i,theta);
+    if (n > exact)
+        sum += (pow(n+0.5,1-theta) - pow(exact+0.5,1-theta)) / (1-theta);
+    return sum;
+}
+
+static void zipfInit(long long n, double theta) {
+    zipf.n = n;
+    zipf.theta = theta;
+    zipf.alpha = 1/(1-theta);
+    zipf.zetan = zipfZeta(n,theta);
+    zipf.eta = (1-pow(2.0/n,1-theta)) / (1-zipfZeta(2,theta)/zipf.zetan);
+}
+
+/* Return the next key given an uniform random number 'u' in [0,1). */
+static long long zipfNext(double u) {
+    double uz = u*zipf.zetan;
+    long long key;
+
+    if (uz < 1) return 0;
+    if (uz < 1+pow(0.5,zipf.theta)) return 1;
+    key = (long long)(zipf.n * pow(zipf.eta*u - zipf.eta + 1, zipf.alpha));
+    return key >= zipf.n ? zipf.n-1 : key;
+}
+
+static size_t randomKey(benchmarkThread *t) {
+    if (config.zipf_theta != 0) {
+        double u = (benchmarkRandom(t) >> 11) * (1.0/9007199254740992.0);
+        return zipfNext(u);
+    }
+    return benchmarkRandom(t) % config.randomkeys_keyspacelen;
+}
+
+/* -------------------------------- Clients -------------------------------- */
+
 static void freeClient(client c) {
+    benchmarkThread *t = c->thread;
     listNode *ln;
-    aeDeleteFileEvent(config.el,c->context->fd,AE_WRITABLE);
-    aeDeleteFileEvent(config.el,c->context->fd,AE_READABLE);
-    redisFree(c->context);
+    aeDeleteFileEvent(t->el,c->context->fd,AE_WRITABLE);
+    aeDeleteFileEvent(t->el,c->context->fd,AE_READABLE);
+    if (c->contexts) {
+        for (int j = 0; j < c->numcontexts; j++)
+            if (c->contexts[j]) redisFree(c->contexts[j]);
+        zfree(c->contexts);
+    } else {
+        redisFree(c->context);
+    }
     sdsfree(c->obuf);
     zfree(c->randptr);
-    zfree(c);
-    config.liveclients--;
-    ln = listSearchKey(config.clients,c);
+    atomicDecr(config.liveclients,1);
+    ln = listSearchKey(t->clients,c);
     assert(ln != NULL);
-    listDelNode(config.clients,ln);
+    listDelNode(t->clients,ln);
+    if (c->idle) {
+        ln = listSearchKey(t->idle,c);
+        assert(ln != NULL);
+        listDelNode(t->idle,ln);
+    }
+    zfree(c);
+
+    /* No more clients to serve: this thread is done. */
+    if (--t->liveclients == 0) aeStop(t->el);
 }
 
-static void freeAllClients(void) {
-    listNode *ln = config.clients->head, *next;
+static void freeAllClients(benchmarkThread *t) {
+    listNode *ln = t->clients->head, *next;
 
     while(ln) {
         next = ln->next;
@@ -147,43 +396,456 @@ static void freeAllClients(void) {
 }
 
 static void resetClient(client c) {
-    aeDeleteFileEvent(config.el,c->context->fd,AE_WRITABLE);
-    aeDeleteFileEvent(config.el,c->context->fd,AE_READABLE);
-    aeCreateFileEvent(config.el,c->context->fd,AE_WRITABLE,writeHandler,c);
+    aeEventLoop *el = c->thread->el;
+    aeDeleteFileEvent(el,c->context->fd,AE_WRITABLE);
+    aeDeleteFileEvent(el,c->context->fd,AE_READABLE);
+    aeCreateFileEvent(el,c->context->fd,AE_WRITABLE,writeHandler,c);
     c->written = 0;
     c->pending = config.pipeline;
 }
 
+/* Replace the 12 digits placeholder at 'p' with a random key number. */
+static void randomizePlaceholder(client c, char *p) {
+    size_t r = randomKey(c->thread);
+    size_t j;
+
+    p += 11;
+    for (j = 0; j < 12; j++) {
+        *p = '0'+r%10;
+        r/=10;
+        p--;
+    }
+}
+
 static void randomizeClientKey(client c) {
     size_t i;
 
-    for (i = 0; i < c->randlen; i++) {
-        char *p = c->randptr[i]+11;
-        size_t r = random() % config.randomkeys_keyspacelen;
-        size_t j;
+    for (i = 0; i < c->randlen; i++)
+        randomizePlaceholder(c,c->randptr[i]);
+}
+
+/* Find the __rand_int__ substrings in the output buffer of the client, that
+ * need to be randomized at every request. */
+static void findClientRandPlaceholders(client c) {
+    char *p = c->obuf;
 
-        for (j = 0; j < 12; j++) {
-            *p = '0'+r%10;
-            r/=10;
-            p--;
+    c->randfree += c->randlen;
+    c->randlen = 0;
+    if (c->randptr == NULL) {
+        c->randfree = RANDPTR_INITIAL_SIZE;
+        c->randptr = zmalloc(sizeof(char*)*c->randfree);
+    }
+    while ((p = strstr(p,"__rand_int__")) != NULL) {
+        if (c->randfree == 0) {
+            c->randptr = zrealloc(c->randptr,sizeof(char*)*c->randlen*2);
+            c->randfree += c->randlen;
         }
+        c->randptr[c->randlen++] = p;
+        c->randfree--;
+        p += 12; /* 12 is strlen("__rand_int__). */
+    }
+}
+
+/* In --mix mode the request is built again every time, picking for every
+ * command of the pipeline one of the mix commands, with a probability
+ * proportional to its weight. */
+static void buildMixRequest(client c) {
+    if (c->prefixlen) sdsrange(c->obuf,0,c->prefixlen-1);
+    else sdsclear(c->obuf);
+
+    for (int j = 0; j < config.pipeline; j++) {
+        int r = benchmarkRandom(c->thread) % config.mixweight, k = 0;
+
+        while (r >= config.mix[k].weight) r -= config.mix[k++].weight;
+        c->obuf = sdscatsds(c->obuf,config.mix[k].cmd);
     }
+    if (config.randomkeys) findClientRandPlaceholders(c);
+}
+
+/* Reserve the next request to send. Returns 0 when the benchmark already
+ * issued all its requests, or its time is over when --duration is used. */
+static int reserveRequest(void) {
+    long long issued;
+
+    if (config.duration &&
+        mstime()-config.start >= (long long)config.duration*1000) return 0;
+    atomicGetIncr(config.requests_issued,issued,1);
+    return issued < config.requests;
+}
+
+/* ------------------------------ Cluster mode ------------------------------
+ * With --cluster the slots configuration is fetched with CLUSTER SLOTS, and
+ * every client has a connection to every master. Every request is sent to
+ * the master serving the key of its first command, that is assumed to be
+ * the first argument, as it happens for the commands of the default tests.
+ * MOVED and ASK redirections update the slots configuration and, without
+ * pipelining, are followed sending the request again.
+ * ------------------------------------------------------------------------- */
+
+/* Return the hash slot of the key, honoring {hash tags}. */
+static unsigned int keyHashSlot(char *key, int keylen) {
+    int s, e; /* start-end indexes of { and } */
+
+    for (s = 0; s < keylen; s++)
+        if (key[s] == '{') break;
+
+    /* No '{' ? Hash the whole key. This is the base case. */
+    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+
+    /* '{' found? Check if we have the corresponding '}'. */
+    for (e = s+1; e < keylen; e++)
+        if (key[e] == '}') break;
+
+    /* No '}' or nothing between {} ? Hash the whole key. */
+    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
+
+    /* If we are here there is both a { and a } on its right. Hash
+     * what is in the middle between { and }. */
+    return crc16(key+s+1,e-s-1) & 0x3FFF;
+}
+
+/* Return the index of the node ip:port, adding it to the known nodes if
+ * needed. Returns -1 if there are already too many nodes. */
+static int clusterGetNode(const char *ip, int port) {
+    int j;
+
+    pthread_mutex_lock(&config.cluster_mutex);
+    for (j = 0; j < config.cluster_numnodes; j++) {
+        clusterNode *n = config.cluster_nodes[j];
+        if (n->port == port && !strcmp(n->ip,ip)) break;
+    }
+    if (j == config.cluster_numnodes) {
+        if (j == CLUSTER_MAX_NODES) {
+            j = -1;
+        } else {
+            clusterNode *n = zcalloc(sizeof(*n));
+            n->ip = zstrdup(ip);
+            n->port = port;
+            config.cluster_nodes[j] = n;
+            config.cluster_numnodes++;
+        }
+    }
+    pthread_mutex_unlock(&config.cluster_mutex);
+    return j;
+}
+
+/* Return the index of the node serving 'slot', or -1 if unknown.
+ *
+ * This is called for every key sent, so the slots map is read without
+ * locking: every entry is an int loaded and stored atomically, and a MOVED
+ * redirection just stores the new node of its slot (clusterSetSlotNode()).
+ * The acquire / release pair makes sure that a node added by another
+ * thread is visible once its index is read from the map. */
+static int clusterGetSlotNode(int slot) {
+    return __atomic_load_n(&config.cluster_slots[slot],__ATOMIC_ACQUIRE);
+}
+
+static void clusterSetSlotNode(int slot, int node) {
+    __atomic_store_n(&config.cluster_slots[slot],node,__ATOMIC_RELEASE);
+}
+
+/* Connect to the node, authenticating if needed. The connection is
+ * created in blocking mode, and turned into a non blocking one later. */
+static redisContext *clusterConnectNode(int node) {
+    clusterNode *n = config.cluster_nodes[node];
+    redisContext *ctx = redisConnect(n->ip,n->port);
+
+    if (ctx->err) {
+        fprintf(stderr,"Could not connect to Redis at %s:%d: %s\n",
+            n->ip,n->port,ctx->errstr);
+        exit(1);
+    }
+    if (config.auth) {
+        redisReply *r = redisCommand(ctx,"AUTH %s",config.auth);
+        if (r == NULL || r->type == REDIS_REPLY_ERROR) {
+            fprintf(stderr,"AUTH failed at %s:%d\n",n->ip,n->port);
+            exit(1);
+        }
+        freeReplyObject(r);
+    }
+    anetNonBlock(NULL,ctx->fd);
+    ctx->flags &= ~REDIS_BLOCK;
+    /* Suppress hiredis cleanup of unused buffers for max speed. */
+    ctx->reader->maxbuf = 0;
+    return ctx;
+}
+
+/* Fetch the slots configuration of the cluster we are connected to. */
+static void fetchClusterSlots(void) {
+    redisContext *ctx = redisConnect(config.hostip,config.hostport);
+    redisReply *r;
+    int j;
+
+    if (ctx->err) {
+        fprintf(stderr,"Could not connect to Redis at %s:%d: %s\n",
+            config.hostip,config.hostport,ctx->errstr);
+        exit(1);
+    }
+    if (config.auth) {
+        r = redisCommand(ctx,"AUTH %s",config.auth);
+        if (r) freeReplyObject(r);
+    }
+    r = redisCommand(ctx,"CLUSTER SLOTS");
+    if (r == NULL || r->type != REDIS_REPLY_ARRAY) {
+        fprintf(stderr,"Error fetching the cluster configuration: %s\n",
+            (r && r->type == REDIS_REPLY_ERROR) ? r->str : ctx->errstr);
+        exit(1);
+    }
+
+    config.cluster_slots = zmalloc(sizeof(int)*CLUSTER_SLOTS);
+    for (j = 0; j < CLUSTER_SLOTS; j++) config.cluster_slots[j] = -1;
+
+    /* Every entry is: start slot, end slot, master, replicas... where
+     * every node is in the form: ip, port, id. */
+    for (size_t i = 0; i < r->elements; i++) {
+        redisReply *range = r->element[i], *master;
+        int node;
+
+        if (range->elements < 3) continue;
+        master = range->element[2];
+        if (master->elements < 2) continue;
+        node = clusterGetNode(master->element[0]->str,
+                              (int)master->element[1]->integer);
+        if (node == -1) continue;
+        for (j = range->element[0]->integer;
+             j <= range->element[1]->integer && j < CLUSTER_SLOTS; j++)
+            config.cluster_slots[j] = node;
+    }
+    freeReplyObject(r);
+    redisFree(ctx);
+
+    if (config.cluster_numnodes == 0) {
+        fprintf(stderr,"The cluster has no slots assigned.\n");
+        exit(1);
+    }
+}
+
+/* Return the connection of the client to the node, connecting if needed. */
+static redisContext *clientNodeContext(client c, int node) {
+    if (node >= c->numcontexts) {
+        int numnodes = config.cluster_numnodes;
+        c->contexts = zrealloc(c->contexts,sizeof(redisContext*)*numnodes);
+        memset(c->contexts+c->numcontexts,0,
+            sizeof(redisContext*)*(numnodes-c->numcontexts));
+        c->numcontexts = numnodes;
+    }
+    if (c->contexts[node] == NULL) c->contexts[node] = clusterConnectNode(node);
+    return c->contexts[node];
+}
+
+/* Make the client talk with another node. Any event of the old connection
+ * is removed: the caller should register the needed ones. */
+static void clientSwitchNode(client c, int node) {
+    aeDeleteFileEvent(c->thread->el,c->context->fd,AE_WRITABLE);
+    aeDeleteFileEvent(c->thread->el,c->context->fd,AE_READABLE);
+    c->context = clientNodeContext(c,node);
+    c->node = node;
+}
+
+/* Parse the command in the Redis protocol at 'p', setting *key to its first
+ * argument, and *next to the start of the next command. Returns 0 if the
+ * command has no arguments or is not in the multi bulk format. */
+static int parseCommandKey(char *p, char *end, char **key, size_t *keylen,
+                           char **next)
+{
+    long argc, len = 0;
+    int j;
+
+    if (p >= end || *p != '*') return 0;
+    argc = strtol(p+1,NULL,10);
+    p = strchr(p,'\n')+1;
+    for (j = 0; j < argc; j++) {
+        len = strtol(p+1,NULL,10);
+        p = strchr(p,'\n')+1;
+        if (j == 1) {
+            *key = p;
+            *keylen = len;
+        }
+        p += len+2;
+    }
+    *next = p;
+    return argc > 1;
+}
+
+/* Pick the node to send the current request to. With pipelining every
+ * command is sent to the node serving the key of the first one, so the
+ * random keys of the following commands are picked again until they
+ * belong to such node, up to CLUSTER_ROUTE_ATTEMPTS times. */
+static int clusterRouteRequest(client c) {
+    char *p = c->obuf+c->prefixlen, *end = c->obuf+sdslen(c->obuf);
+    int node = -1;
+
+    while (p < end) {
+        char *key = NULL, *next;
+        size_t keylen = 0;
+
+        if (!parseCommandKey(p,end,&key,&keylen,&next)) break;
+        for (int attempt = 0; ; attempt++) {
+            int keynode = clusterGetSlotNode(keyHashSlot(key,keylen));
+            size_t rerolled = 0;
+
+            if (node == -1) node = keynode;
+            if (keynode == node || attempt == CLUSTER_ROUTE_ATTEMPTS) break;
+            for (size_t j = 0; j < c->randlen; j++) {
+                if (c->randptr[j] >= key && c->randptr[j] < key+keylen) {
+                    randomizePlaceholder(c,c->randptr[j]);
+                    rerolled++;
+                }
+            }
+            if (!rerolled) break; /* Not a random key: nothing to do. */
+        }
+        p = next;
+    }
+    return node == -1 ? c->node : node;
+}
+
+/* Handle a MOVED or ASK error. The slots configuration is updated, and if
+ * the request can be sent again to the right node, 1 is returned. */
+static int clusterHandleRedirect(client c, redisReply *r) {
+    char *p, *colon;
+    int ask, slot, node;
+
+    if (r->type != REDIS_REPLY_ERROR) return 0;
+    if (!strncmp(r->str,"MOVED ",6)) ask = 0;
+    else if (!strncmp(r->str,"ASK ",4)) ask = 1;
+    else return 0;
+
+    /* The format is: MOVED|ASK <slot> <ip>:<port> */
+    p = strchr(r->str,' ')+1;
+    slot = atoi(p);
+    if ((p = strchr(p,' ')) == NULL) return 0;
+    p++;
+    if ((colon = strrchr(p,':')) == NULL) return 0;
+    *colon = '\0';
+    if ((node = clusterGetNode(p,atoi(colon+1))) == -1) return 0;
+
+    atomicIncr(config.cluster_nodes[c->node]->redirects,1);
+    if (!ask && slot >= 0 && slot < CLUSTER_SLOTS)
+        clusterSetSlotNode(slot,node);
+
+    /* With pipelining the other commands of the request were already
+     * executed: the redirected ones are just accounted as errors. */
+    if (config.pipeline != 1 || c->redirects == CLUSTER_MAX_REDIRECTS)
+        return 0;
+    c->redirects++;
+    clientSwitchNode(c,node);
+
+    /* ASK redirections need the ASKING command, that is prefixed to the
+     * request and discarded with its reply, like AUTH and SELECT. */
+    if (ask) {
+        sds buf = sdsnew("*1\r\n$6\r\nASKING\r\n");
+        size_t prefixlen = sdslen(buf);
+
+        buf = sdscatsds(buf,c->obuf);
+        for (size_t j = 0; j < c->randlen; j++)
+            c->randptr[j] = buf + prefixlen + (c->randptr[j] - c->obuf);
+        sdsfree(c->obuf);
+        c->obuf = buf;
+        c->prefixlen = prefixlen;
+        c->prefix_pending = 1;
+    }
+    c->written = 0;
+    c->pending = config.pipeline + c->prefix_pending;
+    c->latency = -1;
+    c->resend = 1;
+    aeCreateFileEvent(c->thread->el,c->context->fd,AE_WRITABLE,writeHandler,c);
+    return 1;
+}
+
+/* ---------------------------- Open loop mode -----------------------------
+ * With --rps the benchmark does not send a new request as soon as a client
+ * receives a reply. Requests are instead scheduled at a constant rate, and
+ * every one is sent by any idle client as soon as it is due. The latency of
+ * a request is measured from its intended send time when no client was
+ * idle at that time, so that the time spent waiting for a connection is
+ * accounted as it would be by a real application, instead of being hidden
+ * by the benchmark slowing down (the "coordinated omission" problem).
+ * ------------------------------------------------------------------------- */
+
+static void setClientIdle(client c) {
+    c->idle = 1;
+    c->idle_since = ustime();
+    listAddNodeTail(c->thread->idle,c);
+}
+
+/* Intended send time of the request number 'seq' of the thread 't'. Every
+ * thread sends its share of the requests, proportional to its clients. */
+static long long scheduledTime(benchmarkThread *t, long long seq) {
+    double rate = (double)config.rps * t->numclients / config.numclients;
+    return config.start_us + (long long)(seq * (1000000.0 / rate));
+}
+
+/* Send all the requests that are due, as long as there are idle clients
+ * to send them. */
+static void dispatchScheduledRequests(benchmarkThread *t) {
+    long long now = ustime();
+
+    while (listLength(t->idle)) {
+        long long due = scheduledTime(t,t->rate_seq);
+        listNode *ln;
+        client c;
+
+        if (due > now) break;
+        if (!reserveRequest()) {
+            /* We are done: release the clients still waiting. */
+            while (listLength(t->idle))
+                freeClient(listNodeValue(listFirst(t->idle)));
+            return;
+        }
+        t->rate_seq++;
+
+        ln = listFirst(t->idle);
+        c = listNodeValue(ln);
+        listDelNode(t->idle,ln);
+        c->idle = 0;
+
+        /* If the client was already idle at the intended time, the delay
+         * is only due to our timer resolution, and the server did not see
+         * the request later than it could. Otherwise the request waited
+         * for a connection, and such time is part of its latency. */
+        if (c->idle_since <= due) {
+            c->start = now;
+        } else {
+            c->start = due;
+            t->queued++;
+        }
+        aeCreateFileEvent(t->el,c->context->fd,AE_WRITABLE,writeHandler,c);
+    }
+}
+
+static int dispatchTimer(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    UNUSED(eventLoop);
+    UNUSED(id);
+    dispatchScheduledRequests(clientData);
+    return 1; /* every millisecond */
 }
 
 static void clientDone(client c) {
-    if (config.requests_finished == config.requests) {
+    benchmarkThread *t = c->thread;
+    long long finished;
+
+    atomicGet(config.requests_finished,finished);
+    if (finished >= config.requests) {
         freeClient(c);
-        aeStop(config.el);
+        aeStop(t->el);
         return;
     }
     if (config.keepalive) {
-        resetClient(c);
+        if (config.rps) {
+            aeDeleteFileEvent(t->el,c->context->fd,AE_READABLE);
+            c->written = 0;
+            c->pending = config.pipeline;
+            setClientIdle(c);
+        } else {
+            resetClient(c);
+        }
     } else {
-        config.liveclients--;
-        createMissingClients(c);
-        config.liveclients++;
+        t->liveclients--;
+        createMissingClients(t,c);
+        t->liveclients++;
         freeClient(c);
     }
+    if (config.rps) dispatchScheduledRequests(t);
 }
 
 static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -208,11 +870,18 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                 exit(1);
             }
             if (reply != NULL) {
+                long long finished;
+
                 if (reply == (void*)REDIS_REPLY_ERROR) {
                     fprintf(stderr,"Unexpected error reply, exiting...\n");
                     exit(1);
                 }
 
+                if (config.cluster && clusterHandleRedirect(c,reply)) {
+                    freeReplyObject(reply);
+                    return; /* The request is sent again. */
+                }
+
                 if (config.showerrors) {
                     static time_t lasterr_time = 0;
                     time_t now = time(NULL);
@@ -241,8 +910,16 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                     continue;
                 }
 
-                if (config.requests_finished < config.requests)
-                    config.latency[config.requests_finished++] = c->latency;
+                atomicGetIncr(config.requests_finished,finished,1);
+                if (finished < config.requests) {
+                    histRecord(c->thread->latency,c->latency);
+                    if (config.cluster) {
+                        latencyHistogram **h =
+                            &c->thread->node_latency[c->node];
+                        if (*h == NULL) *h = zcalloc(sizeof(latencyHistogram));
+                        histRecord(*h,c->latency);
+                    }
+                }
                 c->pending--;
                 if (c->pending == 0) {
                     clientDone(c);
@@ -261,19 +938,32 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     UNUSED(fd);
     UNUSED(mask);
 
-    /* Initialize request when nothing was written. */
-    if (c->written == 0) {
+    /* Initialize request when nothing was written. In --rps mode the
+     * request was already reserved, and its start time set, by
+     * dispatchScheduledRequests(). */
+    if (c->written == 0 && !c->resend) {
         /* Enforce upper bound to number of requests. */
-        if (config.requests_issued++ >= config.requests) {
+        if (!config.rps && !reserveRequest()) {
             freeClient(c);
             return;
         }
 
         /* Really initialize: randomize keys and set start time. */
+        if (config.mixlen) buildMixRequest(c);
         if (config.randomkeys) randomizeClientKey(c);
-        c->start = ustime();
+        if (config.cluster) {
+            int node = clusterRouteRequest(c);
+            if (node != c->node) {
+                clientSwitchNode(c,node);
+                aeCreateFileEvent(c->thread->el,c->context->fd,AE_WRITABLE,
+                    writeHandler,c);
+            }
+            c->redirects = 0;
+        }
+        if (!config.rps) c->start = ustime();
         c->latency = -1;
     }
+    c->resend = 0;
 
     if (sdslen(c->obuf) > c->written) {
         void *ptr = c->obuf+c->written;
@@ -286,14 +976,14 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         }
         c->written += nwritten;
         if (sdslen(c->obuf) == c->written) {
-            aeDeleteFileEvent(config.el,c->context->fd,AE_WRITABLE);
-            aeCreateFileEvent(config.el,c->context->fd,AE_READABLE,readHandler,c);
+            aeDeleteFileEvent(c->thread->el,c->context->fd,AE_WRITABLE);
+            aeCreateFileEvent(c->thread->el,c->context->fd,AE_READABLE,readHandler,c);
         }
     }
 }
 
-/* Create a benchmark client, configured to send the command passed as 'cmd' of
- * 'len' bytes.
+/* Create a benchmark client served by the thread 't', configured to send
+ * the command passed as 'cmd' of 'len' bytes.
  *
  * The command is copied N times in the client output buffer (that is reused
  * again and again to send the request to the server) accordingly to the configured
@@ -313,11 +1003,22 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
  *    for arguments randomization.
  *
  * Even when cloning another client, prefix commands are applied if needed.*/
-static client createClient(char *cmd, size_t len, client from) {
+static client createClient(char *cmd, size_t len, client from, benchmarkThread *t) {
     int j;
     client c = zmalloc(sizeof(struct _client));
 
-    if (config.hostsocket == NULL) {
+    c->contexts = NULL;
+    c->numcontexts = 0;
+    c->node = 0;
+    c->redirects = 0;
+    c->resend = 0;
+    c->thread = t;
+    if (config.cluster) {
+        /* Spread the clients across the nodes: the connections to the
+         * other nodes are created as soon as they are needed. */
+        c->node = benchmarkRandom(t) % config.cluster_numnodes;
+        c->context = clientNodeContext(c,c->node);
+    } else if (config.hostsocket == NULL) {
         c->context = redisConnectNonBlock(config.hostip,config.hostport);
     } else {
         c->context = redisConnectUnixNonBlock(config.hostsocket);
@@ -341,7 +1042,7 @@ static client createClient(char *cmd, size_t len, client from) {
      * These commands are discarded after the first response, so if the client is
      * reused the commands will not be used again. */
     c->prefix_pending = 0;
-    if (config.auth) {
+    if (config.auth && !config.cluster) {
         char *buf = NULL;
         int len = redisFormatCommand(&buf, "AUTH %s", config.auth);
         c->obuf = sdscatlen(c->obuf, buf, len);
@@ -359,8 +1060,11 @@ static client createClient(char *cmd, size_t len, client from) {
         c->prefix_pending++;
     }
     c->prefixlen = sdslen(c->obuf);
-    /* Append the request itself. */
-    if (from) {
+    /* Append the request itself. In --mix mode the request is built by
+     * buildMixRequest() before every send. */
+    if (config.mixlen) {
+        /* Nothing to do. */
+    } else if (from) {
         c->obuf = sdscatlen(c->obuf,
             from->obuf+from->prefixlen,
             sdslen(from->obuf)-from->prefixlen);
@@ -373,9 +1077,10 @@ static client createClient(char *cmd, size_t len, client from) {
     c->pending = config.pipeline+c->prefix_pending;
     c->randptr = NULL;
     c->randlen = 0;
+    c->randfree = 0;
 
     /* Find substrings in the output buffer that need to be randomized. */
-    if (config.randomkeys) {
+    if (config.randomkeys && !config.mixlen) {
         if (from) {
             c->randlen = from->randlen;
             c->randfree = 0;
@@ -387,34 +1092,25 @@ static client createClient(char *cmd, size_t len, client from) {
                 c->randptr[j] += c->prefixlen - from->prefixlen;
             }
         } else {
-            char *p = c->obuf;
-
-            c->randlen = 0;
-            c->randfree = RANDPTR_INITIAL_SIZE;
-            c->randptr = zmalloc(sizeof(char*)*c->randfree);
-            while ((p = strstr(p,"__rand_int__")) != NULL) {
-                if (c->randfree == 0) {
-                    c->randptr = zrealloc(c->randptr,sizeof(char*)*c->randlen*2);
-                    c->randfree += c->randlen;
-                }
-                c->randptr[c->randlen++] = p;
-                c->randfree--;
-                p += 12; /* 12 is strlen("__rand_int__). */
-            }
+            findClientRandPlaceholders(c);
         }
     }
-    if (config.idlemode == 0)
-        aeCreateFileEvent(config.el,c->context->fd,AE_WRITABLE,writeHandler,c);
-    listAddNodeTail(config.clients,c);
-    config.liveclients++;
+    c->idle = 0;
+    if (config.rps)
+        setClientIdle(c);
+    else if (config.idlemode == 0)
+        aeCreateFileEvent(t->el,c->context->fd,AE_WRITABLE,writeHandler,c);
+    listAddNodeTail(t->clients,c);
+    t->liveclients++;
+    atomicIncr(config.liveclients,1);
     return c;
 }
 
-static void createMissingClients(client c) {
+static void createMissingClients(benchmarkThread *t, client from) {
     int n = 0;
 
-    while(config.liveclients < config.numclients) {
-        createClient(NULL,0,c);
+    while(t->liveclients < t->numclients) {
+        createClient(NULL,0,from,t);
 
         /* Listen backlog is quite limited on most systems */
         if (++n > 64) {
@@ -424,56 +1120,294 @@ static void createMissingClients(client c) {
     }
 }
 
-static int compareLatency(const void *a, const void *b) {
-    return (*(long long*)a)-(*(long long*)b);
+/* -------------------------------- Threads -------------------------------- */
+
+static benchmarkThread *createBenchmarkThread(int index) {
+    benchmarkThread *t = zmalloc(sizeof(*t));
+    int nthreads = config.num_threads ? config.num_threads : 1;
+
+    t->index = index;
+    t->el = aeCreateEventLoop(1024*10);
+    t->clients = listCreate();
+    t->liveclients = 0;
+    t->numclients = config.numclients/nthreads +
+                    (index < config.numclients%nthreads);
+    t->rand_state = ((uint64_t)random() << 32) ^ random() ^ (index+1);
+    t->latency = zcalloc(sizeof(latencyHistogram));
+    t->idle = listCreate();
+    t->rate_seq = 0;
+    t->queued = 0;
+    t->node_latency = config.cluster ?
+        zcalloc(sizeof(latencyHistogram*)*CLUSTER_MAX_NODES) : NULL;
+    return t;
+}
+
+static void freeBenchmarkThread(benchmarkThread *t) {
+    freeAllClients(t);
+    aeDeleteEventLoop(t->el);
+    listRelease(t->clients);
+    listRelease(t->idle);
+    zfree(t->latency);
+    if (t->node_latency) {
+        for (int j = 0; j < CLUSTER_MAX_NODES; j++) zfree(t->node_latency[j]);
+        zfree(t->node_latency);
+    }
+    zfree(t);
+}
+
+static void *benchmarkThreadMain(void *arg) {
+    benchmarkThread *t = arg;
+    aeMain(t->el);
+    return NULL;
+}
+
+/* -------------------------------- Reports -------------------------------- */
+
+/* Print 's' as a JSON string, quotes included. Test titles contain the
+ * command line of --mix and custom tests, so they can contain quotes,
+ * backslashes and control characters. */
+static void printJSONString(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        unsigned char ch = *s;
+
+        switch(ch) {
+        case '"': printf("\\\""); break;
+        case '\\': printf("\\\\"); break;
+        case '\n': printf("\\n"); break;
+        case '\r': printf("\\r"); break;
+        case '\t': printf("\\t"); break;
+        default:
+            if (ch < 0x20) printf("\\u%04x",ch);
+            else putchar(ch);
+            break;
+        }
+    }
+    putchar('"');
+}
+
+/* Show the share of the requests, the latency and the redirections of
+ * every node, as a JSON array with --json. 'total' is the number of
+ * recorded latencies, and 'finished' the number of requests. */
+static void showClusterNodesReport(long long total, long long finished) {
+    latencyHistogram *h = zmalloc(sizeof(*h));
+    float seconds = (float)config.totlatency/1000;
+
+    if (config.json) printf(",\"nodes\":[");
+    else printf("per node:\n");
+    for (int j = 0; j < config.cluster_numnodes; j++) {
+        clusterNode *n = config.cluster_nodes[j];
+        /* Requests per node, estimated from the recorded latencies. */
+        long long requests;
+
+        histSnapshot(h,j);
+        requests = total ? h->total*finished/total : 0;
+        if (config.json) {
+            printf("%s{\"node\":\"%s:%d\",\"requests\":%lld,"
+                   "\"rps\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+                   "\"max_ms\":%.3f,\"redirects\":%lld}",
+                   j ? "," : "", n->ip, n->port, requests,
+                   requests/seconds,
+                   (double)histPercentile(h,50)/1000,
+                   (double)histPercentile(h,99)/1000,
+                   (double)h->max/1000, n->redirects);
+        } else {
+            printf("  %s:%d: %.2f requests per second, p50=%.3f p99=%.3f "
+                   "max=%.3f msec, %lld redirections\n",
+                   n->ip, n->port, requests/seconds,
+                   (double)histPercentile(h,50)/1000,
+                   (double)histPercentile(h,99)/1000,
+                   (double)h->max/1000, n->redirects);
+        }
+    }
+    if (config.json) printf("]");
+    zfree(h);
 }
 
 static void showLatencyReport(void) {
     int i, curlat = 0;
     float perc, reqpersec;
-
-    reqpersec = (float)config.requests_finished/((float)config.totlatency/1000);
-    if (!config.quiet && !config.csv) {
+    long long finished = config.requests_finished;
+    latencyHistogram *h = zmalloc(sizeof(*h));
+    double p50, p99, p999, max;
+
+    if (finished > config.requests) finished = config.requests;
+    histSnapshot(h,-1);
+    p50 = (double)histPercentile(h,50)/1000;
+    p99 = (double)histPercentile(h,99)/1000;
+    p999 = (double)histPercentile(h,99.9)/1000;
+    max = (double)h->max/1000;
+
+    reqpersec = (float)finished/((float)config.totlatency/1000);
+    if (config.json) {
+        printf("{\"test\":");
+        printJSONString(config.title);
+        printf(",\"requests\":%lld,\"seconds\":%.3f,"
+               "\"rps\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,"
+               "\"p999_ms\":%.3f,\"max_ms\":%.3f",
+               finished, (float)config.totlatency/1000,
+               reqpersec, p50, p99, p999, max);
+        if (config.cluster) showClusterNodesReport(h->total,finished);
+        printf("}\n");
+    } else if (!config.quiet && !config.csv) {
         printf("====== %s ======\n", config.title);
-        printf("  %d requests completed in %.2f seconds\n", config.requests_finished,
+        printf("  %lld requests completed in %.2f seconds\n", finished,
             (float)config.totlatency/1000);
         printf("  %d parallel clients\n", config.numclients);
+        if (config.num_threads)
+            printf("  %d threads\n", config.num_threads);
+        if (config.rps) {
+            long long queued = 0;
+            int nthreads = config.num_threads ? config.num_threads : 1;
+
+            for (i = 0; i < nthreads; i++) queued += config.threads[i]->queued;
+            printf("  open loop at %d requests per second\n", config.rps);
+            if (queued)
+                printf("  %lld requests waited for a free client, "
+                       "consider using more clients (-c)\n", queued);
+        }
         printf("  %d bytes payload\n", config.datasize);
         printf("  keep alive: %d\n", config.keepalive);
         printf("\n");
 
-        qsort(config.latency,config.requests,sizeof(long long),compareLatency);
-        for (i = 0; i < config.requests; i++) {
-            if (config.latency[i]/1000 != curlat || i == (config.requests-1)) {
-                curlat = config.latency[i]/1000;
-                perc = ((float)(i+1)*100)/config.requests;
+        long long seen = 0;
+        for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+            if (h->counts[i] == 0) continue;
+            seen += h->counts[i];
+            if (histValue(i)/1000 != curlat || seen == h->total) {
+                curlat = histValue(i)/1000;
+                perc = ((float)seen*100)/h->total;
                 printf("%.2f%% <= %d milliseconds\n", perc, curlat);
             }
         }
+        printf("latency percentiles (msec): p50=%.3f p99=%.3f p99.9=%.3f "
+               "max=%.3f\n", p50, p99, p999, max);
+        if (config.cluster) showClusterNodesReport(h->total,finished);
         printf("%.2f requests per second\n\n", reqpersec);
     } else if (config.csv) {
-        printf("\"%s\",\"%.2f\"\n", config.title, reqpersec);
+        printf("\"%s\",\"%.2f\"", config.title, reqpersec);
+        if (config.csv_latency) {
+            printf(",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\"",
+                p50, p99, p999, max);
+        }
+        printf("\n");
+    } else {
+        printf("%s: %.2f requests per second, p50=%.3f p99=%.3f msec\n",
+            config.title, reqpersec, p50, p99);
+    }
+    zfree(h);
+}
+
+/* Emit the throughput and latency of the last --report-interval seconds,
+ * as CSV with --csv, as JSON with --json, or in human readable form. */
+static void showPeriodicReport(long long now) {
+    latencyHistogram *h = zmalloc(sizeof(*h));
+    double elapsed = (double)(now-config.start)/1000;
+    double interval = (double)(now-config.last_report)/1000;
+    double rps, p50, p99, p999, max;
+
+    histSnapshot(h,-1);
+    histSubtract(h,config.report_snapshot);
+    histSnapshot(config.report_snapshot,-1);
+    config.last_report = now;
+
+    rps = interval > 0 ? h->total/interval : 0;
+    p50 = (double)histPercentile(h,50)/1000;
+    p99 = (double)histPercentile(h,99)/1000;
+    p999 = (double)histPercentile(h,99.9)/1000;
+    max = (double)h->max/1000;
+    if (config.json) {
+        printf("{\"test\":");
+        printJSONString(config.title);
+        printf(",\"elapsed\":%.3f,\"rps\":%.2f,"
+               "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,"
+               "\"max_ms\":%.3f}\n",
+               elapsed, rps, p50, p99, p999, max);
+    } else if (config.csv) {
+        printf("\"%s\",\"%.3f\",\"%.2f\",\"%.3f\",\"%.3f\",\"%.3f\",\"%.3f\"\n",
+               config.title, elapsed, rps, p50, p99, p999, max);
     } else {
-        printf("%s: %.2f requests per second\n", config.title, reqpersec);
+        printf("%s: %.1fs %.2f requests per second, p50=%.3f p99=%.3f "
+               "p99.9=%.3f max=%.3f msec\n",
+               config.title, elapsed, rps, p50, p99, p999, max);
     }
+    fflush(stdout);
+    zfree(h);
 }
 
 static void benchmark(char *title, char *cmd, int len) {
-    client c;
+    int j, nthreads = config.num_threads ? config.num_threads : 1;
+    client c = NULL;
 
     config.title = title;
     config.requests_issued = 0;
     config.requests_finished = 0;
 
-    c = createClient(cmd,len,NULL);
-    createMissingClients(c);
-
-    config.start = mstime();
-    aeMain(config.el);
+    /* Create the clients of every thread before starting the threads,
+     * so that the connection time is not part of the benchmark. */
+    config.threads = zmalloc(sizeof(benchmarkThread*)*nthreads);
+    for (j = 0; j < nthreads; j++) {
+        config.threads[j] = createBenchmarkThread(j);
+        if (c == NULL) c = createClient(cmd,len,NULL,config.threads[j]);
+        createMissingClients(config.threads[j],c);
+    }
+    aeCreateTimeEvent(config.threads[0]->el,1,showThroughput,NULL,NULL);
+    config.report_snapshot = zcalloc(sizeof(latencyHistogram));
+
+    config.start_us = ustime();
+    config.start = config.start_us/1000;
+    if (config.rps) {
+        for (j = 0; j < nthreads; j++) {
+            benchmarkThread *t = config.threads[j];
+            aeCreateTimeEvent(t->el,1,dispatchTimer,t,NULL);
+        }
+    }
+    config.last_report = config.start;
+    if (config.num_threads) {
+        for (j = 0; j < nthreads; j++) {
+            if (pthread_create(&config.threads[j]->thread,NULL,
+                benchmarkThreadMain,config.threads[j]) != 0)
+            {
+                fprintf(stderr,"Error creating benchmark thread: %s\n",
+                    strerror(errno));
+                exit(1);
+            }
+        }
+        for (j = 0; j < nthreads; j++)
+            pthread_join(config.threads[j]->thread,NULL);
+    } else {
+        aeMain(config.threads[0]->el);
+    }
     config.totlatency = mstime()-config.start;
 
     showLatencyReport();
-    freeAllClients();
+    for (j = 0; j < nthreads; j++) freeBenchmarkThread(config.threads[j]);
+    zfree(config.threads);
+    config.threads = NULL;
+    zfree(config.report_snapshot);
+}
+
+/* Add a command to the --mix workload. 'spec' is in the form
+ * "<weight> <command> <arg> ... <arg>". Returns -1 on error. */
+static int addMixCommand(const char *spec) {
+    int argc, weight;
+    sds *argv = sdssplitargs(spec,&argc);
+    char *cmd;
+    int len;
+
+    if (argv == NULL || argc < 2 || (weight = atoi(argv[0])) <= 0) {
+        if (argv) sdsfreesplitres(argv,argc);
+        return -1;
+    }
+    len = redisFormatCommandArgv(&cmd,argc-1,(const char**)argv+1,NULL);
+    config.mix = zrealloc(config.mix,sizeof(benchmarkCommand)*(config.mixlen+1));
+    config.mix[config.mixlen].weight = weight;
+    config.mix[config.mixlen].cmd = sdsnewlen(cmd,len);
+    config.mixlen++;
+    config.mixweight += weight;
+    free(cmd);
+    sdsfreesplitres(argv,argc);
+    return 0;
 }
 
 /* Returns number of consumed options. */
@@ -490,7 +1424,7 @@ int parseOptions(int argc, const char **argv) {
             config.numclients = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"-n")) {
             if (lastarg) goto invalid;
-            config.requests = atoi(argv[++i]);
+            config.requests = atoll(argv[++i]);
         } else if (!strcmp(argv[i],"-k")) {
             if (lastarg) goto invalid;
             config.keepalive = atoi(argv[++i]);
@@ -525,6 +1459,42 @@ int parseOptions(int argc, const char **argv) {
             config.quiet = 1;
         } else if (!strcmp(argv[i],"--csv")) {
             config.csv = 1;
+        } else if (!strcmp(argv[i],"--csv-latency")) {
+            config.csv = 1;
+            config.csv_latency = 1;
+        } else if (!strcmp(argv[i],"--json")) {
+            config.json = 1;
+        } else if (!strcmp(argv[i],"--threads")) {
+            if (lastarg) goto invalid;
+            config.num_threads = atoi(argv[++i]);
+            if (config.num_threads < 0) config.num_threads = 0;
+            if (config.num_threads > MAX_THREADS)
+                config.num_threads = MAX_THREADS;
+        } else if (!strcmp(argv[i],"--zipf")) {
+            if (lastarg) goto invalid;
+            config.zipf_theta = strtod(argv[++i],NULL);
+            if (config.zipf_theta <= 0 || config.zipf_theta >= 1) {
+                fprintf(stderr,"--zipf theta must be between 0 and 1 "
+                               "(both excluded)\n");
+                exit(1);
+            }
+        } else if (!strcmp(argv[i],"--duration")) {
+            if (lastarg) goto invalid;
+            config.duration = atoi(argv[++i]);
+            if (config.duration < 0) config.duration = 0;
+        } else if (!strcmp(argv[i],"--report-interval")) {
+            if (lastarg) goto invalid;
+            config.report_interval = atoi(argv[++i]);
+            if (config.report_interval < 0) config.report_interval = 0;
+        } else if (!strcmp(argv[i],"--cluster")) {
+            config.cluster = 1;
+        } else if (!strcmp(argv[i],"--rps")) {
+            if (lastarg) goto invalid;
+            config.rps = atoi(argv[++i]);
+            if (config.rps < 0) config.rps = 0;
+        } else if (!strcmp(argv[i],"--mix")) {
+            if (lastarg) goto invalid;
+            if (addMixCommand(argv[++i]) == -1) goto invalid;
         } else if (!strcmp(argv[i],"-l")) {
             config.loop = 1;
         } else if (!strcmp(argv[i],"-I")) {
@@ -586,10 +1556,41 @@ usage:
 "                    (no more than 1 error per second is displayed)\n"
 " -q                 Quiet. Just show query/sec values\n"
 " --csv              Output in CSV format\n"
+" --csv-latency      Like --csv, adding the p50, p99, p99.9 and max latency\n"
+"                    columns (msec) at the end of every row.\n"
+" --json             Output in JSON format, one object per line\n"
+" --threads <num>    Run the clients in <num> threads, each with its own\n"
+"                    event loop (default 0, a single event loop).\n"
+" --zipf <theta>     Pick the __rand_int__ keys with a Zipfian distribution\n"
+"                    of exponent 0 < theta < 1 (YCSB uses 0.99), instead of\n"
+"                    an uniform one. Key 0 is the most popular.\n"
+" --duration <sec>   Run every test for <sec> seconds instead of -n requests.\n"
+" --report-interval <sec>\n"
+"                    Every <sec> seconds report throughput and latency\n"
+"                    percentiles of the last interval (CSV with --csv, JSON\n"
+"                    with --json).\n"
+" --mix \"<weight> <command> [args ...]\"\n"
+"                    Add a command to a mixed workload: every request picks\n"
+"                    one of the --mix commands with a probability proportional\n"
+"                    to its weight. Can be repeated.\n"
+" --cluster          Cluster mode: fetch the slots with CLUSTER SLOTS from the\n"
+"                    -h -p node, and send every request to the master serving\n"
+"                    the key of its first command (the first argument).\n"
+"                    Multi key commands need keys sharing a {hash tag}.\n"
+"                    Throughput and latency are also reported by node.\n"
+" --rps <rate>       Open loop mode: send <rate> requests per second (of\n"
+"                    <numreq> commands with -P) no matter how fast the\n"
+"                    replies arrive, using the -c clients as a connection\n"
+"                    pool. Latency is measured from the time every request\n"
+"                    was scheduled, so it includes the time spent waiting\n"
+"                    for a free connection.\n"
 " -l                 Loop. Run the tests forever\n"
 " -t <tests>         Only run the comma separated list of tests. The test\n"
 "                    names are the same as the ones produced as output.\n"
+"                    The \"geo\" test only runs if selected with -t.\n"
 " -I                 Idle mode. Just open N idle connections and wait.\n\n"
+    );
+    printf(
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
 "   $ redis-benchmark\n\n"
@@ -604,28 +1605,43 @@ usage:
 " Fill a list with 10000 random elements:\n"
 "   $ redis-benchmark -r 10000 -n 10000 lpush mylist __rand_int__\n\n"
 " On user specified command lines __rand_int__ is replaced with a random integer\n"
-" with a range of values selected by the -r option.\n"
+" with a range of values selected by the -r option.\n\n"
+" Run 80%% GET and 20%% SET on Zipfian keys for 60 seconds with 4 threads,\n"
+" reporting every second in JSON:\n"
+"   $ redis-benchmark --threads 4 -c 200 -r 1000000 --zipf 0.99 --duration 60 \\\n"
+"       --report-interval 1 --json --mix \"80 GET key:__rand_int__\" \\\n"
+"       --mix \"20 SET key:__rand_int__ xxx\"\n"
     );
     exit(exit_status);
 }
 
 int showThroughput(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    int liveclients;
+    long long finished, now = mstime();
     UNUSED(eventLoop);
     UNUSED(id);
     UNUSED(clientData);
 
-    if (config.liveclients == 0 && config.requests_finished != config.requests) {
+    atomicGet(config.liveclients,liveclients);
+    atomicGet(config.requests_finished,finished);
+    if (liveclients == 0 && finished < config.requests && !config.duration) {
         fprintf(stderr,"All clients disconnected... aborting.\n");
         exit(1);
     }
-    if (config.csv) return 250;
+    if (config.report_interval &&
+        now-config.last_report >= (long long)config.report_interval*1000)
+    {
+        showPeriodicReport(now);
+        return 250;
+    }
+    if (config.csv || config.json || config.report_interval) return 250;
     if (config.idlemode == 1) {
-        printf("clients: %d\r", config.liveclients);
+        printf("clients: %d\r", liveclients);
         fflush(stdout);
 	return 250;
     }
-    float dt = (float)(mstime()-config.start)/1000.0;
-    float rps = (float)config.requests_finished/dt;
+    float dt = (float)(now-config.start)/1000.0;
+    float rps = (float)finished/dt;
     printf("%s: %.2f\r", config.title, rps);
     fflush(stdout);
     return 250; /* every 250ms */
@@ -650,8 +1666,6 @@ int main(int argc, const char **argv) {
     char *data, *cmd;
     int len;
 
-    client c;
-
     srandom(time(NULL));
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
@@ -659,8 +1673,6 @@ int main(int argc, const char **argv) {
     config.numclients = 50;
     config.requests = 100000;
     config.liveclients = 0;
-    config.el = aeCreateEventLoop(1024*10);
-    aeCreateTimeEvent(config.el,1,showThroughput,NULL,NULL);
     config.keepalive = 1;
     config.datasize = 3;
     config.pipeline = 1;
@@ -669,10 +1681,23 @@ int main(int argc, const char **argv) {
     config.randomkeys_keyspacelen = 0;
     config.quiet = 0;
     config.csv = 0;
+    config.csv_latency = 0;
+    config.json = 0;
     config.loop = 0;
     config.idlemode = 0;
-    config.latency = NULL;
-    config.clients = listCreate();
+    config.zipf_theta = 0;
+    config.num_threads = 0;
+    config.threads = NULL;
+    config.duration = 0;
+    config.report_interval = 0;
+    config.mix = NULL;
+    config.mixlen = 0;
+    config.mixweight = 0;
+    config.rps = 0;
+    config.cluster = 0;
+    config.cluster_nodes = NULL;
+    config.cluster_numnodes = 0;
+    config.cluster_slots = NULL;
     config.hostip = "127.0.0.1";
     config.hostport = 6379;
     config.hostsocket = NULL;
@@ -684,7 +1709,27 @@ int main(int argc, const char **argv) {
     argc -= i;
     argv += i;
 
-    config.latency = zmalloc(sizeof(long long)*config.requests);
+    /* Threads without clients would just spin. */
+    if (config.num_threads > config.numclients)
+        config.num_threads = config.numclients;
+    if (config.duration) config.requests = LLONG_MAX;
+    if (config.cluster) {
+        if (config.dbnum != 0) {
+            fprintf(stderr,"--dbnum can't be used in cluster mode\n");
+            exit(1);
+        }
+        pthread_mutex_init(&config.cluster_mutex,NULL);
+        config.cluster_nodes =
+            zcalloc(sizeof(clusterNode*)*CLUSTER_MAX_NODES);
+        fetchClusterSlots();
+    }
+    if (config.zipf_theta != 0) {
+        if (!config.randomkeys || config.randomkeys_keyspacelen == 0) {
+            fprintf(stderr,"--zipf requires a keyspace length set with -r\n");
+            exit(1);
+        }
+        zipfInit(config.randomkeys_keyspacelen,config.zipf_theta);
+    }
 
     if (config.keepalive == 0) {
         printf("WARNING: keepalive disabled, you probably need 'echo 1 > /proc/sys/net/ipv4/tcp_tw_reuse' for Linux and 'sudo sysctl -w net.inet.tcp.msl=1000' for Mac OS X in order to use a lot of clients/requests\n");
@@ -692,12 +1737,19 @@ int main(int argc, const char **argv) {
 
     if (config.idlemode) {
         printf("Creating %d idle connections and waiting forever (Ctrl+C when done)\n", config.numclients);
-        c = createClient("",0,NULL); /* will never receive a reply */
-        createMissingClients(c);
-        aeMain(config.el);
+        benchmark("IDLE","",0); /* will never receive a reply */
         /* and will wait for every */
     }
 
+    /* Run the --mix workload. */
+    if (config.mixlen) {
+        do {
+            benchmark("MIX",NULL,0);
+        } while(config.loop);
+
+        return 0;
+    }
+
     /* Run benchmark with command in the remainder of the arguments. */
     if (argc) {
         sds title = sdsnew(argv[0]);
@@ -839,6 +1891,47 @@ int main(int argc, const char **argv) {
             free(cmd);
         }
 
+        /* Not part of the default tests: it loads a 1000 members key. */
+        if (config.tests && test_is_selected("geo")) {
+            /* A dense urban-like dataset: 1000 points in a grid of about
+             * 1 km x 1 km, so that most of the points of the searched
+             * geohash boxes are outside the search radius. */
+            const char *argv[1+1+3*1000];
+            char *args = zmalloc(3*1000*32), *p = args;
+            int j = 2;
+
+            argv[0] = "GEOADD";
+            argv[1] = "mygeo";
+            for (i = 0; i < 1000; i++) {
+                argv[j++] = p;
+                p += sprintf(p,"%.6f",13.361389+(i%32)*0.0004)+1;
+                argv[j++] = p;
+                p += sprintf(p,"%.6f",38.115556+(i/32)*0.0003)+1;
+                argv[j++] = p;
+                p += sprintf(p,"member:%d",i)+1;
+            }
+            len = redisFormatCommandArgv(&cmd,j,argv,NULL);
+            benchmark("GEOADD (needed to benchmark GEORADIUS, 1000 points)",
+                cmd,len);
+            free(cmd);
+            zfree(args);
+
+            len = redisFormatCommand(&cmd,
+                "GEORADIUS mygeo 13.367 38.12 200 m");
+            benchmark("GEORADIUS (200 m)",cmd,len);
+            free(cmd);
+
+            len = redisFormatCommand(&cmd,
+                "GEORADIUS mygeo 13.367 38.12 500 m COUNT 10 ASC");
+            benchmark("GEORADIUS (500 m, nearest 10)",cmd,len);
+            free(cmd);
+
+            len = redisFormatCommand(&cmd,
+                "GEOSEARCH mygeo FROMLONLAT 13.367 38.12 BYBOX 400 300 m");
+            benchmark("GEOSEARCH (400 m x 300 m box)",cmd,len);
+            free(cmd);
+        }
+
         if (!config.csv) printf("\n");
     } while(config.loop);
 
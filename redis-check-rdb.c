@@ -29,6 +29,7 @@
 
 #include "server.h"
 #include "rdb.h"
+#include "cluster.h"
 
 #include <stdarg.h>
 
@@ -172,12 +173,783 @@ void rdbCheckSetupSignals(void) {
     sigaction(SIGILL, &act, NULL);
 }
 
+/* ----------------------------------------------------------------------------
+ * Offline memory analysis
+ *
+ * When redis-check-rdb is called with --analyze, every key/value pair loaded
+ * from the RDB file is handed to a pool of worker threads instead of being
+ * freed immediately. Each worker computes the in-memory size of the values it
+ * receives (the same way MEMORY USAGE does) and accumulates private stats,
+ * that are merged once the whole file was consumed. This way it is possible
+ * to produce the kind of reports redis-cli --bigkeys / --memkeys provide, plus
+ * per-prefix and expire distributions, without touching the live server.
+ *
+ * The loading thread and the workers communicate via a bounded queue of
+ * batches, so the memory used is proportional to the number of in-flight
+ * batches and not to the size of the RDB file.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_ANALYZE_BATCH_SIZE 256      /* Keys per batch. */
+#define RDB_ANALYZE_QUEUED_PER_THREAD 4 /* Max pending batches per thread. */
+#define RDB_ANALYZE_MAX_THREADS 64
+#define RDB_ANALYZE_MAX_PREFIX_LEN 128
+#define RDB_ANALYZE_MAX_PREFIXES 100000 /* Per worker and once merged,
+                                            then use (other). */
+#define RDB_ANALYZE_NOPREFIX "(no prefix)"
+#define RDB_ANALYZE_OTHERPREFIX "(other)"
+
+/* Expire histogram buckets. */
+#define RDB_ANALYZE_EXP_NONE 0
+#define RDB_ANALYZE_EXP_EXPIRED 1
+#define RDB_ANALYZE_EXP_HOUR 2
+#define RDB_ANALYZE_EXP_DAY 3
+#define RDB_ANALYZE_EXP_WEEK 4
+#define RDB_ANALYZE_EXP_MONTH 5
+#define RDB_ANALYZE_EXP_LONGER 6
+#define RDB_ANALYZE_EXP_BUCKETS 7
+
+char *rdb_analyze_expire_string[] = {
+    "no expire",
+    "already expired",
+    "< 1 hour",
+    "< 1 day",
+    "< 7 days",
+    "< 30 days",
+    ">= 30 days"
+};
+
+typedef struct rdbAnalyzeItem {
+    robj *key;
+    robj *val;
+    long long expire;       /* Unix time in milliseconds or -1. */
+} rdbAnalyzeItem;
+
+typedef struct rdbAnalyzeBatch {
+    rdbAnalyzeItem items[RDB_ANALYZE_BATCH_SIZE];
+    int count;
+    struct rdbAnalyzeBatch *next;
+} rdbAnalyzeBatch;
+
+/* A key candidate for the top-N biggest keys report. */
+typedef struct rdbAnalyzeKey {
+    sds name;
+    size_t bytes;
+    unsigned long elements;
+    int type;
+    int encoding;
+} rdbAnalyzeKey;
+
+/* Keys and bytes accounted to a given key prefix. */
+typedef struct rdbAnalyzePrefix {
+    unsigned long long keys;
+    unsigned long long bytes;
+} rdbAnalyzePrefix;
+
+/* Stats accumulated by a single worker. Workers never share stats, so
+ * no locking is needed while analyzing keys. */
+typedef struct rdbAnalyzeStats {
+    unsigned long long keys, bytes;
+    unsigned long long type_keys[OBJ_STREAM+1];
+    unsigned long long type_bytes[OBJ_STREAM+1];
+    unsigned long long type_elements[OBJ_STREAM+1];
+    unsigned long long enc_keys[OBJ_STREAM+1][OBJ_ENCODING_STREAM+1];
+    unsigned long long expire_keys[RDB_ANALYZE_EXP_BUCKETS];
+    unsigned long long expire_bytes[RDB_ANALYZE_EXP_BUCKETS];
+    rax *prefixes;          /* Prefix -> rdbAnalyzePrefix. */
+    unsigned long prefixes_count;
+    rdbAnalyzeKey *top;     /* Min-heap of the biggest keys. */
+    int top_count;
+} rdbAnalyzeStats;
+
+struct {
+    int enabled;
+    int threads;
+    int top;                /* Number of biggest keys to report. */
+    size_t samples;         /* Samples for aggregated values size. */
+    char *separators;       /* Chars terminating the key prefix. */
+    long long snapshot_time;/* Reference time for the expire histogram. */
+    pthread_t tids[RDB_ANALYZE_MAX_THREADS];
+    rdbAnalyzeStats *stats; /* One entry per worker. */
+    /* Work queue. */
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    rdbAnalyzeBatch *head, *tail;
+    int queued;
+    int done;               /* Set when no more batches will be queued. */
+    rdbAnalyzeBatch *current; /* Batch being filled by the loading thread. */
+} rdbAnalyze;
+
+/* Return the number of elements of an aggregated value, or the length of
+ * the string for string values. */
+unsigned long rdbAnalyzeValueElements(robj *o) {
+    switch(o->type) {
+    case OBJ_STRING: return stringObjectLen(o);
+    case OBJ_LIST: return listTypeLength(o);
+    case OBJ_SET: return setTypeSize(o);
+    case OBJ_ZSET: return zsetLength(o);
+    case OBJ_HASH: return hashTypeLength(o);
+    case OBJ_STREAM: return ((stream*)o->ptr)->length;
+    default: return 0;
+    }
+}
+
+int rdbAnalyzeExpireBucket(long long expire) {
+    long long ttl;
+
+    if (expire == -1) return RDB_ANALYZE_EXP_NONE;
+    ttl = expire - rdbAnalyze.snapshot_time;
+    if (ttl <= 0) return RDB_ANALYZE_EXP_EXPIRED;
+    if (ttl < 3600*1000LL) return RDB_ANALYZE_EXP_HOUR;
+    if (ttl < 86400*1000LL) return RDB_ANALYZE_EXP_DAY;
+    if (ttl < 86400*7*1000LL) return RDB_ANALYZE_EXP_WEEK;
+    if (ttl < 86400*30*1000LL) return RDB_ANALYZE_EXP_MONTH;
+    return RDB_ANALYZE_EXP_LONGER;
+}
+
+/* Account 'keys' and 'bytes' to the specified prefix in the stats
+ * prefixes radix tree, creating the entry if needed. When 'limit' is
+ * true and the worker already tracks too many prefixes, the new prefix is
+ * accounted to the (other) bucket instead, so that keys without a real
+ * namespace (for instance "session123:...") can't use unbounded memory. */
+void rdbAnalyzeAddPrefix(rdbAnalyzeStats *st, unsigned char *p, size_t len,
+                         unsigned long long keys, unsigned long long bytes,
+                         int limit)
+{
+    rdbAnalyzePrefix *ps = raxFind(st->prefixes,p,len);
+    if (ps == raxNotFound) {
+        if (limit && st->prefixes_count >= RDB_ANALYZE_MAX_PREFIXES) {
+            p = (unsigned char*)RDB_ANALYZE_OTHERPREFIX;
+            len = strlen(RDB_ANALYZE_OTHERPREFIX);
+            ps = raxFind(st->prefixes,p,len);
+        }
+        if (ps == raxNotFound) {
+            ps = zcalloc(sizeof(*ps));
+            raxInsert(st->prefixes,p,len,ps,NULL);
+            st->prefixes_count++;
+        }
+    }
+    ps->keys += keys;
+    ps->bytes += bytes;
+}
+
+/* Min-heap helpers for the top-N keys: the root is the smallest key
+ * among the biggest N seen so far. */
+void rdbAnalyzeHeapDown(rdbAnalyzeKey *h, int count, int j) {
+    while(1) {
+        int min = j, l = j*2+1, r = j*2+2;
+        if (l < count && h[l].bytes < h[min].bytes) min = l;
+        if (r < count && h[r].bytes < h[min].bytes) min = r;
+        if (min == j) break;
+        rdbAnalyzeKey tmp = h[j];
+        h[j] = h[min];
+        h[min] = tmp;
+        j = min;
+    }
+}
+
+void rdbAnalyzeHeapUp(rdbAnalyzeKey *h, int j) {
+    while(j > 0) {
+        int parent = (j-1)/2;
+        if (h[parent].bytes <= h[j].bytes) break;
+        rdbAnalyzeKey tmp = h[j];
+        h[j] = h[parent];
+        h[parent] = tmp;
+        j = parent;
+    }
+}
+
+/* Offer a key to the top-N heap. The key name is only copied if the key
+ * actually enters the heap. */
+void rdbAnalyzeAddTop(rdbAnalyzeStats *st, char *name, size_t namelen,
+                      size_t bytes, unsigned long elements, int type,
+                      int encoding)
+{
+    rdbAnalyzeKey *k;
+
+    if (rdbAnalyze.top == 0) return;
+    if (st->top_count == rdbAnalyze.top) {
+        if (bytes <= st->top[0].bytes) return;
+        k = st->top;
+        sdsfree(k->name);
+    } else {
+        k = st->top+st->top_count;
+    }
+    k->name = sdsnewlen(name,namelen);
+    k->bytes = bytes;
+    k->elements = elements;
+    k->type = type;
+    k->encoding = encoding;
+    if (k == st->top && st->top_count == rdbAnalyze.top) {
+        rdbAnalyzeHeapDown(st->top,st->top_count,0);
+    } else {
+        st->top_count++;
+        rdbAnalyzeHeapUp(st->top,st->top_count-1);
+    }
+}
+
+/* Analyze a single key, updating the worker stats. The size reported is
+ * the same estimate MEMORY USAGE would return for this key once loaded:
+ * value size, plus key string and the main dictionary entry, plus one more
+ * entry in the expires dictionary if the key has a TTL. */
+void rdbAnalyzeKeyValue(rdbAnalyzeStats *st, rdbAnalyzeItem *item) {
+    robj *o = item->val;
+    sds name = item->key->ptr;
+    size_t namelen = sdslen(name);
+    size_t bytes = objectComputeSize(o,rdbAnalyze.samples);
+    unsigned long elements = rdbAnalyzeValueElements(o);
+    int bucket = rdbAnalyzeExpireBucket(item->expire);
+    int type = (o->type <= OBJ_STREAM) ? o->type : OBJ_MODULE;
+    int encoding = (o->encoding <= OBJ_ENCODING_STREAM) ? o->encoding : 0;
+
+    bytes += sdsAllocSize(name) + sizeof(dictEntry);
+    if (item->expire != -1) bytes += sizeof(dictEntry);
+
+    st->keys++;
+    st->bytes += bytes;
+    st->type_keys[type]++;
+    st->type_bytes[type] += bytes;
+    st->type_elements[type] += elements;
+    st->enc_keys[type][encoding]++;
+    st->expire_keys[bucket]++;
+    st->expire_bytes[bucket] += bytes;
+
+    /* The prefix is the part of the key before the first separator. Key
+     * names are binary safe, so don't stop at NUL bytes. */
+    size_t plen, seplen = strlen(rdbAnalyze.separators);
+    for (plen = 0; plen < namelen; plen++)
+        if (memchr(rdbAnalyze.separators,name[plen],seplen)) break;
+    if (plen >= namelen || plen == 0) {
+        rdbAnalyzeAddPrefix(st,(unsigned char*)RDB_ANALYZE_NOPREFIX,
+            strlen(RDB_ANALYZE_NOPREFIX),1,bytes,0);
+    } else {
+        if (plen > RDB_ANALYZE_MAX_PREFIX_LEN)
+            plen = RDB_ANALYZE_MAX_PREFIX_LEN;
+        rdbAnalyzeAddPrefix(st,(unsigned char*)name,plen,1,bytes,1);
+    }
+
+    rdbAnalyzeAddTop(st,name,namelen,bytes,elements,o->type,o->encoding);
+}
+
+void *rdbAnalyzeWorkerMain(void *arg) {
+    rdbAnalyzeStats *st = arg;
+
+    while(1) {
+        rdbAnalyzeBatch *b;
+
+        pthread_mutex_lock(&rdbAnalyze.lock);
+        while(rdbAnalyze.head == NULL && !rdbAnalyze.done)
+            pthread_cond_wait(&rdbAnalyze.not_empty,&rdbAnalyze.lock);
+        b = rdbAnalyze.head;
+        if (b) {
+            rdbAnalyze.head = b->next;
+            if (rdbAnalyze.head == NULL) rdbAnalyze.tail = NULL;
+            rdbAnalyze.queued--;
+            pthread_cond_signal(&rdbAnalyze.not_full);
+        }
+        pthread_mutex_unlock(&rdbAnalyze.lock);
+        if (b == NULL) break; /* Done and nothing left in the queue. */
+
+        for (int j = 0; j < b->count; j++) {
+            rdbAnalyzeKeyValue(st,b->items+j);
+            decrRefCount(b->items[j].key);
+            decrRefCount(b->items[j].val);
+        }
+        zfree(b);
+    }
+    return NULL;
+}
+
+/* Put the batch being filled into the queue, blocking if the workers are
+ * behind, so that the loading thread never gets too much ahead. */
+void rdbAnalyzeQueueCurrentBatch(void) {
+    rdbAnalyzeBatch *b = rdbAnalyze.current;
+
+    if (b == NULL) return;
+    rdbAnalyze.current = NULL;
+    b->next = NULL;
+    pthread_mutex_lock(&rdbAnalyze.lock);
+    while(rdbAnalyze.queued >=
+          rdbAnalyze.threads*RDB_ANALYZE_QUEUED_PER_THREAD)
+        pthread_cond_wait(&rdbAnalyze.not_full,&rdbAnalyze.lock);
+    if (rdbAnalyze.tail)
+        rdbAnalyze.tail->next = b;
+    else
+        rdbAnalyze.head = b;
+    rdbAnalyze.tail = b;
+    rdbAnalyze.queued++;
+    pthread_cond_signal(&rdbAnalyze.not_empty);
+    pthread_mutex_unlock(&rdbAnalyze.lock);
+}
+
+/* Called by the loading loop for every key: ownership of 'key' and 'val'
+ * is transferred to the analyzer. */
+void rdbAnalyzeFeed(robj *key, robj *val, long long expire) {
+    rdbAnalyzeBatch *b = rdbAnalyze.current;
+
+    if (b == NULL) {
+        b = rdbAnalyze.current = zmalloc(sizeof(*b));
+        b->count = 0;
+    }
+    b->items[b->count].key = key;
+    b->items[b->count].val = val;
+    b->items[b->count].expire = expire;
+    if (++b->count == RDB_ANALYZE_BATCH_SIZE) rdbAnalyzeQueueCurrentBatch();
+}
+
+void rdbAnalyzeStart(void) {
+    if (rdbAnalyze.snapshot_time == 0) rdbAnalyze.snapshot_time = mstime();
+    pthread_mutex_init(&rdbAnalyze.lock,NULL);
+    pthread_cond_init(&rdbAnalyze.not_empty,NULL);
+    pthread_cond_init(&rdbAnalyze.not_full,NULL);
+    rdbAnalyze.stats = zcalloc(sizeof(rdbAnalyzeStats)*rdbAnalyze.threads);
+    for (int j = 0; j < rdbAnalyze.threads; j++) {
+        rdbAnalyzeStats *st = rdbAnalyze.stats+j;
+        st->prefixes = raxNew();
+        st->top = zmalloc(sizeof(rdbAnalyzeKey)*(rdbAnalyze.top+1));
+        if (pthread_create(&rdbAnalyze.tids[j],NULL,
+                           rdbAnalyzeWorkerMain,st) != 0)
+        {
+            fprintf(stderr,"Can't create analyzer thread: %s\n",
+                strerror(errno));
+            exit(1);
+        }
+    }
+}
+
+/* Flush the last batch and wait for the workers to process everything
+ * that is still queued. */
+void rdbAnalyzeStop(void) {
+    rdbAnalyzeQueueCurrentBatch();
+    pthread_mutex_lock(&rdbAnalyze.lock);
+    rdbAnalyze.done = 1;
+    pthread_cond_broadcast(&rdbAnalyze.not_empty);
+    pthread_mutex_unlock(&rdbAnalyze.lock);
+    for (int j = 0; j < rdbAnalyze.threads; j++)
+        pthread_join(rdbAnalyze.tids[j],NULL);
+}
+
+/* Merge the stats of all the workers into the first one. */
+void rdbAnalyzeMergeStats(void) {
+    rdbAnalyzeStats *dst = rdbAnalyze.stats;
+
+    for (int j = 1; j < rdbAnalyze.threads; j++) {
+        rdbAnalyzeStats *src = rdbAnalyze.stats+j;
+        raxIterator ri;
+        int t, e;
+
+        dst->keys += src->keys;
+        dst->bytes += src->bytes;
+        for (t = 0; t <= OBJ_STREAM; t++) {
+            dst->type_keys[t] += src->type_keys[t];
+            dst->type_bytes[t] += src->type_bytes[t];
+            dst->type_elements[t] += src->type_elements[t];
+            for (e = 0; e <= OBJ_ENCODING_STREAM; e++)
+                dst->enc_keys[t][e] += src->enc_keys[t][e];
+        }
+        for (t = 0; t < RDB_ANALYZE_EXP_BUCKETS; t++) {
+            dst->expire_keys[t] += src->expire_keys[t];
+            dst->expire_bytes[t] += src->expire_bytes[t];
+        }
+
+        raxStart(&ri,src->prefixes);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri)) {
+            rdbAnalyzePrefix *ps = ri.data;
+            int noprefix = ri.key_len == strlen(RDB_ANALYZE_NOPREFIX) &&
+                !memcmp(ri.key,RDB_ANALYZE_NOPREFIX,ri.key_len);
+            /* Cap the merged prefixes too, otherwise we could report
+             * up to RDB_ANALYZE_MAX_PREFIXES prefixes per worker. */
+            rdbAnalyzeAddPrefix(dst,ri.key,ri.key_len,ps->keys,ps->bytes,
+                                !noprefix);
+        }
+        raxStop(&ri);
+        raxFreeWithCallback(src->prefixes,zfree);
+
+        for (t = 0; t < src->top_count; t++) {
+            rdbAnalyzeKey *k = src->top+t;
+            rdbAnalyzeAddTop(dst,k->name,sdslen(k->name),k->bytes,
+                k->elements,k->type,k->encoding);
+            sdsfree(k->name);
+        }
+        zfree(src->top);
+    }
+}
+
+int rdbAnalyzeCompareKeys(const void *a, const void *b) {
+    const rdbAnalyzeKey *ka = a, *kb = b;
+    if (ka->bytes == kb->bytes) return 0;
+    return (ka->bytes < kb->bytes) ? 1 : -1;
+}
+
+typedef struct rdbAnalyzePrefixEntry {
+    sds prefix;
+    rdbAnalyzePrefix *ps;
+} rdbAnalyzePrefixEntry;
+
+int rdbAnalyzeComparePrefixes(const void *a, const void *b) {
+    const rdbAnalyzePrefixEntry *pa = a, *pb = b;
+    if (pa->ps->bytes == pb->ps->bytes) return 0;
+    return (pa->ps->bytes < pb->ps->bytes) ? 1 : -1;
+}
+
+/* Name of the type as reported by TYPE. Module values can't be loaded
+ * without the module, so we never need to look at the module type name. */
+char *rdbAnalyzeTypeName(int type) {
+    robj fake;
+
+    if (type == OBJ_MODULE) return "module";
+    fake.type = type;
+    return getObjectTypeName(&fake);
+}
+
+/* Return the percentage of 'part' over 'total' avoiding divisions by zero. */
+double rdbAnalyzePerc(unsigned long long part, unsigned long long total) {
+    return total ? (double)part*100/total : 0;
+}
+
+void rdbAnalyzeReport(void) {
+    rdbAnalyzeStats *st = rdbAnalyze.stats;
+    char hbytes[64];
+    int t, e;
+
+    rdbAnalyzeMergeStats();
+    bytesToHuman(hbytes,st->bytes);
+    printf("\n-------- memory summary --------\n\n");
+    printf("Keys analyzed: %llu\n", st->keys);
+    printf("Estimated memory (keys and values): %s (%llu bytes)\n",
+        hbytes, st->bytes);
+    printf("Value size samples: ");
+    if (rdbAnalyze.samples == SIZE_MAX) printf("all\n");
+    else printf("%zu\n", rdbAnalyze.samples);
+
+    printf("\n-------- by type --------\n\n");
+    for (t = 0; t <= OBJ_STREAM; t++) {
+        if (st->type_keys[t] == 0) continue;
+        bytesToHuman(hbytes,st->type_bytes[t]);
+        printf("%-8s %12llu keys %10s (%5.2f%%) %14llu %s, avg %llu bytes/key\n",
+            rdbAnalyzeTypeName(t), st->type_keys[t], hbytes,
+            rdbAnalyzePerc(st->type_bytes[t],st->bytes),
+            st->type_elements[t],
+            t == OBJ_STRING ? "bytes of data" : "elements",
+            st->type_bytes[t]/st->type_keys[t]);
+    }
+
+    printf("\n-------- by encoding --------\n\n");
+    for (t = 0; t <= OBJ_STREAM; t++) {
+        for (e = 0; e <= OBJ_ENCODING_STREAM; e++) {
+            if (st->enc_keys[t][e] == 0) continue;
+            printf("%-8s %-12s %12llu keys (%5.2f%%)\n",
+                rdbAnalyzeTypeName(t), strEncoding(e), st->enc_keys[t][e],
+                rdbAnalyzePerc(st->enc_keys[t][e],st->type_keys[t]));
+        }
+    }
+
+    printf("\n-------- by expire --------\n\n");
+    for (t = 0; t < RDB_ANALYZE_EXP_BUCKETS; t++) {
+        bytesToHuman(hbytes,st->expire_bytes[t]);
+        printf("%-16s %12llu keys %10s (%5.2f%%)\n",
+            rdb_analyze_expire_string[t], st->expire_keys[t], hbytes,
+            rdbAnalyzePerc(st->expire_bytes[t],st->bytes));
+    }
+
+    /* Prefixes, sorted by memory usage. */
+    rdbAnalyzePrefixEntry *pe =
+        zmalloc(sizeof(*pe)*(st->prefixes_count ? st->prefixes_count : 1));
+    unsigned long count = 0;
+    raxIterator ri;
+    raxStart(&ri,st->prefixes);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        pe[count].prefix = sdsnewlen(ri.key,ri.key_len);
+        pe[count].ps = ri.data;
+        count++;
+    }
+    raxStop(&ri);
+    qsort(pe,count,sizeof(*pe),rdbAnalyzeComparePrefixes);
+    printf("\n-------- by prefix (up to '%s', %lu prefixes) --------\n\n",
+        rdbAnalyze.separators, count);
+    for (unsigned long j = 0; j < count; j++) {
+        if (rdbAnalyze.top && j == (unsigned long)rdbAnalyze.top) {
+            printf("... %lu more prefixes\n", count-j);
+            break;
+        }
+        bytesToHuman(hbytes,pe[j].ps->bytes);
+        printf("%-32s %12llu keys %10s (%5.2f%%)\n",
+            pe[j].prefix, pe[j].ps->keys, hbytes,
+            rdbAnalyzePerc(pe[j].ps->bytes,st->bytes));
+    }
+    for (unsigned long j = 0; j < count; j++) sdsfree(pe[j].prefix);
+    zfree(pe);
+    raxFreeWithCallback(st->prefixes,zfree);
+
+    /* Biggest keys. */
+    qsort(st->top,st->top_count,sizeof(rdbAnalyzeKey),rdbAnalyzeCompareKeys);
+    printf("\n-------- top %d keys by memory --------\n\n", st->top_count);
+    for (t = 0; t < st->top_count; t++) {
+        rdbAnalyzeKey *k = st->top+t;
+        sds repr = sdscatrepr(sdsempty(),k->name,sdslen(k->name));
+
+        bytesToHuman(hbytes,k->bytes);
+        printf("%10s  %-8s %-12s %12lu %s  %s\n",
+            hbytes, rdbAnalyzeTypeName(k->type), strEncoding(k->encoding),
+            k->elements, k->type == OBJ_STRING ? "bytes" : "elements",
+            repr);
+        sdsfree(repr);
+        sdsfree(k->name);
+    }
+    zfree(st->top);
+    zfree(rdbAnalyze.stats);
+    rdbAnalyze.stats = NULL;
+}
+
+/* ----------------------------------------------------------------------------
+ * Offline transformation and resharding
+ *
+ * When redis-check-rdb is called with --output, the keys loaded from the
+ * input files are written again into one or more new RDB files. Keys can be
+ * filtered by pattern and type, already expired keys can be dropped, and
+ * with --partitions the hash slots space is split in N equal ranges, each
+ * written to a different file, so that the nodes of a new cluster can be
+ * seeded directly from disk.
+ *
+ * Since values are loaded with rdbLoadObject() and saved again with
+ * rdbSaveKeyValuePair(), old encodings (zipmaps, linked lists, zset v1, ...)
+ * and small aggregates are converted to the current compact encodings in
+ * the process.
+ *
+ * When reading multiple inputs the names of the keys written are remembered,
+ * and a key found in more than one input is an error: the server would
+ * refuse to load an RDB file with duplicated keys. With --partitions only
+ * DB 0 is written, since cluster nodes refuse to start with keys in other
+ * DBs.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_TRANSFORM_MAX_PARTITIONS 1024
+
+struct {
+    int enabled;
+    char *output;           /* Output file, or prefix with --partitions. */
+    int partitions;
+    char *pattern;          /* Only keys matching this glob style pattern. */
+    char *type;             /* Only keys of this type. */
+    int drop_expired;
+    long long now;          /* Reference time to drop expired keys. */
+    FILE **fps;
+    rio *rios;
+    sds *filenames, *tmpfilenames;
+    long long *curdb;       /* Last DB selected in every output, or -1. */
+    unsigned long long *written; /* Keys written in every output. */
+    unsigned long long filtered, expired, otherdbs;
+    rax *seen;              /* DB ID + name of the keys written, only with
+                               multiple inputs, NULL otherwise. */
+    sds seenkey;            /* Scratch buffer for the 'seen' lookups. */
+} rdbTransform;
+
+/* Return the output partition for 'key': the slots space is split in
+ * 'partitions' contiguous ranges of the same size. */
+int rdbTransformPartition(robj *key) {
+    unsigned int slot;
+
+    if (rdbTransform.partitions == 1) return 0;
+    slot = keyHashSlot(key->ptr,sdslen(key->ptr));
+    return (long long)slot*rdbTransform.partitions/CLUSTER_SLOTS;
+}
+
+/* Create the temp output files and write the RDB header. On error the
+ * function logs the problem and returns C_ERR. */
+int rdbTransformStart(void) {
+    int n = rdbTransform.partitions;
+    char magic[10];
+
+    rdbTransform.now = mstime();
+    rdbTransform.fps = zcalloc(sizeof(FILE*)*n);
+    rdbTransform.rios = zcalloc(sizeof(rio)*n);
+    rdbTransform.filenames = zcalloc(sizeof(sds)*n);
+    rdbTransform.tmpfilenames = zcalloc(sizeof(sds)*n);
+    rdbTransform.curdb = zmalloc(sizeof(long long)*n);
+    rdbTransform.written = zcalloc(sizeof(unsigned long long)*n);
+    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+
+    for (int j = 0; j < n; j++) {
+        rio *r = rdbTransform.rios+j;
+
+        if (n == 1)
+            rdbTransform.filenames[j] = sdsnew(rdbTransform.output);
+        else
+            rdbTransform.filenames[j] = sdscatprintf(sdsempty(),"%s-%d.rdb",
+                rdbTransform.output, j);
+        rdbTransform.tmpfilenames[j] = sdscatprintf(sdsempty(),
+            "%s.tmp-%d", rdbTransform.filenames[j], (int) getpid());
+        rdbTransform.fps[j] = fopen(rdbTransform.tmpfilenames[j],"w");
+        if (rdbTransform.fps[j] == NULL) {
+            rdbCheckError("Can't create output file %s: %s",
+                rdbTransform.tmpfilenames[j], strerror(errno));
+            return C_ERR;
+        }
+        rioInitWithFile(r,rdbTransform.fps[j]);
+        rioSetAutoSync(r,REDIS_AUTOSYNC_BYTES);
+        if (server.rdb_checksum) r->update_cksum = rioGenericUpdateChecksum;
+        rdbTransform.curdb[j] = -1;
+        if (rioWrite(r,magic,9) == 0 ||
+            rdbSaveInfoAuxFields(r,RDB_SAVE_NONE,NULL) == -1)
+        {
+            rdbCheckError("Error writing %s: %s",
+                rdbTransform.tmpfilenames[j], strerror(errno));
+            return C_ERR;
+        }
+    }
+    return C_OK;
+}
+
+/* Write the key to the right output, unless it is filtered out. Returns
+ * C_ERR on write errors. The caller retains the ownership of the key and
+ * the value. */
+int rdbTransformKey(robj *key, robj *val, long long expire, uint64_t dbid) {
+    int j;
+    rio *r;
+
+    if (rdbTransform.pattern &&
+        !stringmatchlen(rdbTransform.pattern,strlen(rdbTransform.pattern),
+                        key->ptr,sdslen(key->ptr),0))
+    {
+        rdbTransform.filtered++;
+        return C_OK;
+    }
+    if (rdbTransform.type &&
+        strcasecmp(rdbTransform.type,getObjectTypeName(val)))
+    {
+        rdbTransform.filtered++;
+        return C_OK;
+    }
+    if (rdbTransform.drop_expired && expire != -1 &&
+        expire < rdbTransform.now)
+    {
+        rdbTransform.expired++;
+        return C_OK;
+    }
+    if (rdbTransform.partitions != 1 && dbid != 0) {
+        rdbTransform.otherdbs++;
+        return C_OK;
+    }
+    if (rdbTransform.seen) {
+        rdbTransform.seenkey = sdscpylen(rdbTransform.seenkey,
+            (char*)&dbid,sizeof(dbid));
+        rdbTransform.seenkey = sdscatsds(rdbTransform.seenkey,key->ptr);
+        if (!raxTryInsert(rdbTransform.seen,
+                          (unsigned char*)rdbTransform.seenkey,
+                          sdslen(rdbTransform.seenkey),NULL,NULL))
+        {
+            rdbCheckError("Key '%s' of DB %llu was already read from "
+                "another input file", (char*)key->ptr,
+                (unsigned long long)dbid);
+            return C_ERR;
+        }
+    }
+
+    j = rdbTransformPartition(key);
+    r = rdbTransform.rios+j;
+    if (rdbTransform.curdb[j] != (long long)dbid) {
+        if (rdbSaveType(r,RDB_OPCODE_SELECTDB) == -1 ||
+            rdbSaveLen(r,dbid) == -1) goto werr;
+        rdbTransform.curdb[j] = dbid;
+    }
+    if (rdbSaveKeyValuePair(r,key,val,expire) == -1) goto werr;
+    rdbTransform.written[j]++;
+    return C_OK;
+
+werr:
+    rdbCheckError("Error writing %s: %s",
+        rdbTransform.tmpfilenames[j], strerror(errno));
+    return C_ERR;
+}
+
+/* Terminate the output files and rename them to their final names if
+ * 'success' is true, otherwise remove them. Files are renamed only after
+ * all of them were completed and synced, so that a failure never leaves
+ * only a part of the partitions in place. Returns C_ERR if some output
+ * could not be completed. */
+int rdbTransformStop(int success) {
+    int j, created = 0;
+
+    for (j = 0; j < rdbTransform.partitions; j++) {
+        rio *r = rdbTransform.rios+j;
+        FILE *fp = rdbTransform.fps[j];
+        uint64_t cksum;
+
+        if (fp == NULL) break; /* Failed creating the files. */
+        created++;
+        rdbTransform.fps[j] = NULL;
+        if (!success) {
+            fclose(fp);
+            continue;
+        }
+        cksum = r->cksum;
+        memrev64ifbe(&cksum);
+        if (rdbSaveType(r,RDB_OPCODE_EOF) == -1 ||
+            rioWrite(r,&cksum,8) == 0 ||
+            fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+        {
+            rdbCheckError("Error writing %s: %s",
+                rdbTransform.tmpfilenames[j], strerror(errno));
+            success = 0; /* Remove the other outputs as well. */
+        }
+        fclose(fp);
+    }
+    if (rdbTransform.partitions != created) success = 0;
+
+    for (j = 0; j < created; j++) {
+        if (success &&
+            rename(rdbTransform.tmpfilenames[j],rdbTransform.filenames[j])
+            == -1)
+        {
+            rdbCheckError("Can't rename %s to %s: %s",
+                rdbTransform.tmpfilenames[j], rdbTransform.filenames[j],
+                strerror(errno));
+            success = 0;
+        }
+        if (!success) unlink(rdbTransform.tmpfilenames[j]);
+    }
+    if (rdbTransform.seen) {
+        raxFree(rdbTransform.seen);
+        rdbTransform.seen = NULL;
+    }
+    return success ? C_OK : C_ERR;
+}
+
+void rdbTransformReport(void) {
+    int first = 0, j;
+
+    printf("[info] %llu keys filtered out\n", rdbTransform.filtered);
+    printf("[info] %llu expired keys dropped\n", rdbTransform.expired);
+    if (rdbTransform.partitions != 1) {
+        printf("[info] %llu keys of DBs other than 0 dropped\n",
+            rdbTransform.otherdbs);
+    }
+    for (j = 0; j < rdbTransform.partitions; j++) {
+        /* Compute the slots range of the partition. */
+        int last = first;
+        while(last+1 < CLUSTER_SLOTS &&
+              (long long)(last+1)*rdbTransform.partitions/CLUSTER_SLOTS == j)
+            last++;
+        if (rdbTransform.partitions == 1) {
+            printf("[info] %llu keys written to %s\n",
+                rdbTransform.written[j], rdbTransform.filenames[j]);
+        } else {
+            printf("[info] slots %d-%d: %llu keys written to %s\n",
+                first, last, rdbTransform.written[j],
+                rdbTransform.filenames[j]);
+        }
+        first = last+1;
+    }
+}
+
 /* Check the specified RDB file. Return 0 if the RDB looks sane, otherwise
  * 1 is returned.
  * The file is specified as a filename in 'rdbfilename' if 'fp' is not NULL,
  * otherwise the already open file 'fp' is checked. */
 int redis_check_rdb(char *rdbfilename, FILE *fp) {
-    uint64_t dbid;
+    uint64_t dbid = 0;
     int type, rdbver;
     char buf[1024];
     long long expiretime, now = mstime();
@@ -267,6 +1039,11 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
 
             rdbCheckInfo("AUX FIELD %s = '%s'",
                 (char*)auxkey->ptr, (char*)auxval->ptr);
+            /* The expire histogram is relative to the time the snapshot
+             * was created, not to the time we analyze it. */
+            if (!strcasecmp(auxkey->ptr,"ctime"))
+                rdbAnalyze.snapshot_time =
+                    strtoll(auxval->ptr,NULL,10)*1000;
             decrRefCount(auxkey);
             decrRefCount(auxval);
             continue; /* Read type again. */
@@ -291,8 +1068,19 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             rdbstate.already_expired++;
         if (expiretime != -1) rdbstate.expires++;
         rdbstate.key = NULL;
-        decrRefCount(key);
-        decrRefCount(val);
+        if (rdbTransform.enabled &&
+            rdbTransformKey(key,val,expiretime,dbid) == C_ERR)
+        {
+            decrRefCount(key);
+            decrRefCount(val);
+            goto err;
+        }
+        if (rdbAnalyze.enabled) {
+            rdbAnalyzeFeed(key,val,expiretime);
+        } else {
+            decrRefCount(key);
+            decrRefCount(val);
+        }
         rdbstate.key_type = -1;
         expiretime = -1;
     }
@@ -327,6 +1115,72 @@ err:
     return 1;
 }
 
+/* Parse the options following the RDB file name, and populate the list
+ * of the input files. Returns C_ERR on syntax errors so that the caller can
+ * show the usage. */
+int rdbCheckParseOptions(int argc, char **argv, char ***inputs,
+                         int *numinputs)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    *inputs = zmalloc(sizeof(char*)*argc);
+    (*inputs)[0] = argv[1];
+    *numinputs = 1;
+    rdbTransform.partitions = 1;
+
+    rdbAnalyze.top = 20;
+    rdbAnalyze.samples = SIZE_MAX;
+    rdbAnalyze.separators = ":";
+    rdbAnalyze.threads = (ncpu > 0) ? ncpu : 1;
+    if (rdbAnalyze.threads > 16) rdbAnalyze.threads = 16;
+
+    for (int j = 2; j < argc; j++) {
+        int lastarg = (j == argc-1);
+
+        if (!strcasecmp(argv[j],"--analyze")) {
+            rdbAnalyze.enabled = 1;
+        } else if (!strcasecmp(argv[j],"--top") && !lastarg) {
+            rdbAnalyze.top = atoi(argv[++j]);
+            if (rdbAnalyze.top < 0) return C_ERR;
+        } else if (!strcasecmp(argv[j],"--threads") && !lastarg) {
+            rdbAnalyze.threads = atoi(argv[++j]);
+            if (rdbAnalyze.threads < 1 ||
+                rdbAnalyze.threads > RDB_ANALYZE_MAX_THREADS) return C_ERR;
+        } else if (!strcasecmp(argv[j],"--separators") && !lastarg) {
+            rdbAnalyze.separators = argv[++j];
+            if (rdbAnalyze.separators[0] == '\0') return C_ERR;
+        } else if (!strcasecmp(argv[j],"--samples") && !lastarg) {
+            long long samples = strtoll(argv[++j],NULL,10);
+            if (samples < 0) return C_ERR;
+            rdbAnalyze.samples = samples ? (size_t)samples : SIZE_MAX;
+        } else if (!strcasecmp(argv[j],"--input") && !lastarg) {
+            (*inputs)[(*numinputs)++] = argv[++j];
+        } else if (!strcasecmp(argv[j],"--output") && !lastarg) {
+            rdbTransform.enabled = 1;
+            rdbTransform.output = argv[++j];
+        } else if (!strcasecmp(argv[j],"--partitions") && !lastarg) {
+            rdbTransform.partitions = atoi(argv[++j]);
+            if (rdbTransform.partitions < 1 ||
+                rdbTransform.partitions > RDB_TRANSFORM_MAX_PARTITIONS)
+                return C_ERR;
+        } else if (!strcasecmp(argv[j],"--match") && !lastarg) {
+            rdbTransform.pattern = argv[++j];
+        } else if (!strcasecmp(argv[j],"--type") && !lastarg) {
+            rdbTransform.type = argv[++j];
+        } else if (!strcasecmp(argv[j],"--drop-expired")) {
+            rdbTransform.drop_expired = 1;
+        } else {
+            return C_ERR;
+        }
+    }
+    /* The filters only make sense when writing a new RDB. */
+    if (!rdbTransform.enabled &&
+        (rdbTransform.pattern || rdbTransform.type ||
+         rdbTransform.drop_expired || rdbTransform.partitions != 1))
+        return C_ERR;
+    return C_OK;
+}
+
 /* RDB check main: called form redis.c when Redis is executed with the
  * redis-check-rdb alias, on during RDB loading errors.
  *
@@ -340,10 +1194,37 @@ err:
  * Otherwise if called with a non NULL fp, the function returns C_OK or
  * C_ERR depending on the success or failure. */
 int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
-    if (argc != 2 && fp == NULL) {
-        fprintf(stderr, "Usage: %s <rdb-file-name>\n", argv[0]);
+    char *single[1];
+    char **inputs = single;
+    int numinputs = 1;
+
+    if (fp == NULL && (argc < 2 ||
+        rdbCheckParseOptions(argc,argv,&inputs,&numinputs) == C_ERR))
+    {
+        fprintf(stderr,
+"Usage: %s <rdb-file-name> [--input <rdb-file-name> ...] [options]\n"
+"  --input <file>       Additional RDB file to read (can be repeated). The\n"
+"                       same key can't be written from multiple inputs.\n"
+"  --analyze            Report memory usage by type, encoding, expire and\n"
+"                       key prefix, and the biggest keys, without loading\n"
+"                       the dataset into a running server.\n"
+"  --top <count>        Number of keys and prefixes to report (default 20).\n"
+"  --threads <count>    Worker threads computing sizes (default: CPUs).\n"
+"  --separators <chars> Characters ending a key prefix (default ':').\n"
+"  --samples <count>    Elements sampled to estimate aggregated values\n"
+"                       size, 0 to inspect all of them (default 0).\n"
+"  --output <file>      Write the keys read into a new RDB file, converting\n"
+"                       values to the current encodings.\n"
+"  --partitions <n>     Split the hash slots in <n> ranges, writing every\n"
+"                       range to <file>-<index>.rdb (default 1). Only the\n"
+"                       keys of DB 0 are written.\n"
+"  --match <pattern>    Only write keys matching the pattern.\n"
+"  --type <type>        Only write keys of the specified type.\n"
+"  --drop-expired       Don't write keys that are already expired.\n",
+            argv[0]);
         exit(1);
     }
+    if (fp) single[0] = argv[1];
     /* In order to call the loading functions we need to create the shared
      * integer objects, however since this function may be called from
      * an already initialized Redis instance, check if we really need to. */
@@ -351,13 +1232,120 @@ int redis_check_rdb_main(int argc, char **argv, FILE *fp) {
         createSharedObjects();
     server.loading_process_events_interval_bytes = 0;
     rdbCheckMode = 1;
-    rdbCheckInfo("Checking RDB file %s", argv[1]);
     rdbCheckSetupSignals();
-    int retval = redis_check_rdb(argv[1],fp);
+    if (rdbAnalyze.enabled) rdbAnalyzeStart();
+    int retval = 0;
+    if (rdbTransform.enabled && numinputs > 1) {
+        rdbTransform.seen = raxNew();
+        rdbTransform.seenkey = sdsempty();
+    }
+    if (rdbTransform.enabled && rdbTransformStart() == C_ERR) retval = 1;
+    for (int j = 0; j < numinputs && retval == 0; j++) {
+        rdbCheckInfo("Checking RDB file %s", inputs[j]);
+        retval = redis_check_rdb(inputs[j],fp);
+    }
+    if (rdbTransform.enabled && rdbTransformStop(retval == 0) == C_ERR)
+        retval = 1;
+    if (rdbAnalyze.enabled) rdbAnalyzeStop();
     if (retval == 0) {
         rdbCheckInfo("\\o/ RDB looks OK! \\o/");
         rdbShowGenericInfo();
+        if (rdbTransform.enabled) rdbTransformReport();
+        if (rdbAnalyze.enabled) rdbAnalyzeReport();
     }
     if (fp) return (retval == 0) ? C_OK : C_ERR;
     exit(retval);
 }
+
+#ifdef REDIS_TEST
+#define rdbTransformTestAssert(_e) ((_e)?(void)0:(_rdbTransformTestAssert(#_e,__FILE__,__LINE__),exit(1)))
+static void _rdbTransformTestAssert(char *estr, char *file, int line) {
+    printf("\n\n=== ASSERTION FAILED ===\n");
+    printf("==> %s:%d '%s' is not true\n",file,line,estr);
+}
+
+/* Return true if every partition of the output exists. */
+static int rdbTransformTestOutputsExist(void) {
+    for (int j = 0; j < rdbTransform.partitions; j++)
+        if (access(rdbTransform.filenames[j],F_OK) == -1) return 0;
+    return 1;
+}
+
+/* Return true if no partition of the output exists, temp files included. */
+static int rdbTransformTestOutputsMissing(void) {
+    for (int j = 0; j < rdbTransform.partitions; j++) {
+        if (access(rdbTransform.filenames[j],F_OK) == 0 ||
+            access(rdbTransform.tmpfilenames[j],F_OK) == 0) return 0;
+    }
+    return 1;
+}
+
+static int rdbTransformTestKey(char *name, uint64_t dbid) {
+    robj *key = createStringObject(name,strlen(name));
+    robj *val = createStringObject("value",5);
+    int retval = rdbTransformKey(key,val,-1,dbid);
+    decrRefCount(key);
+    decrRefCount(val);
+    return retval;
+}
+
+int rdbTransformTest(int argc, char **argv) {
+    sds output = sdscatprintf(sdsempty(),"/tmp/redis-rdbtransform-%d",
+        (int) getpid());
+
+    UNUSED(argc);
+    UNUSED(argv);
+    if (shared.integers[0] == NULL) createSharedObjects();
+    rdbCheckMode = 1;
+    rdbTransform.enabled = 1;
+    rdbTransform.output = output;
+    rdbTransform.partitions = 2;
+
+    printf("Keys of other DBs are dropped with partitions: ");
+    {
+        rdbTransformTestAssert(rdbTransformStart() == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("foo",0) == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("bar",0) == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("foo",1) == C_OK);
+        rdbTransformTestAssert(rdbTransform.otherdbs == 1);
+        rdbTransformTestAssert(rdbTransform.written[0]+
+                               rdbTransform.written[1] == 2);
+        rdbTransformTestAssert(rdbTransformStop(1) == C_OK);
+        rdbTransformTestAssert(rdbTransformTestOutputsExist());
+        for (int j = 0; j < rdbTransform.partitions; j++)
+            unlink(rdbTransform.filenames[j]);
+        printf("OK\n");
+    }
+
+    printf("Duplicated keys across inputs are an error: ");
+    {
+        rdbTransform.seen = raxNew();
+        rdbTransform.seenkey = sdsempty();
+        rdbTransformTestAssert(rdbTransformStart() == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("foo",0) == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("bar",0) == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("foo",0) == C_ERR);
+        rdbTransformTestAssert(rdbTransformStop(0) == C_ERR);
+        rdbTransformTestAssert(rdbTransform.seen == NULL);
+        printf("OK\n");
+    }
+
+    printf("No output is left behind on failure: ");
+    {
+        rdbTransformTestAssert(rdbTransformTestOutputsMissing());
+        rdbTransformTestAssert(rdbTransformStart() == C_OK);
+        rdbTransformTestAssert(rdbTransformTestKey("foo",0) == C_OK);
+        /* Simulate an error writing the second partition. */
+        fclose(rdbTransform.fps[1]);
+        rdbTransform.fps[1] = fopen("/dev/full","w");
+        rdbTransformTestAssert(rdbTransform.fps[1] != NULL);
+        rdbTransform.rios[1].io.file.fp = rdbTransform.fps[1];
+        rdbTransformTestAssert(rdbTransformStop(1) == C_ERR);
+        rdbTransformTestAssert(rdbTransformTestOutputsMissing());
+        printf("OK\n");
+    }
+
+    sdsfree(output);
+    return 0;
+}
+#endif
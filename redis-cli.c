@@ -45,6 +45,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <poll.h>
 
 #include <hiredis.h>
 #include <sds.h> /* use sds.h from hiredis, so that only one set of sds functions will be present in the binary */
@@ -63,6 +64,7 @@
 #define OUTPUT_CSV 2
 #define REDIS_CLI_KEEPALIVE_INTERVAL 15 /* seconds */
 #define REDIS_CLI_DEFAULT_PIPE_TIMEOUT 30 /* seconds */
+#define REDIS_CLI_DEFAULT_PIPE_DEPTH 1000 /* pending commands per conn */
 #define REDIS_CLI_HISTFILE_ENV "REDISCLI_HISTFILE"
 #define REDIS_CLI_HISTFILE_DEFAULT ".rediscli_history"
 #define REDIS_CLI_RCFILE_ENV "REDISCLI_RCFILE"
@@ -202,11 +204,15 @@ static struct config {
     int slave_mode;
     int pipe_mode;
     int pipe_timeout;
+    int pipe_conns;     /* Connections per node in routed pipe mode. */
+    int pipe_depth;     /* Max pending commands per connection. */
     int getrdb_mode;
     int stat_mode;
     int scan_mode;
     int intrinsic_latency_mode;
     int intrinsic_latency_duration;
+    int failover_probe_mode;
+    char *failover_probe_key;
     char *pattern;
     char *rdb_filename;
     int bigkeys;
@@ -1317,6 +1323,9 @@ static int parseOptions(int argc, char **argv) {
             config.scan_mode = 1;
         } else if (!strcmp(argv[i],"--pattern") && !lastarg) {
             config.pattern = argv[++i];
+        } else if (!strcmp(argv[i],"--failover-probe") && !lastarg) {
+            config.failover_probe_mode = 1;
+            config.failover_probe_key = argv[++i];
         } else if (!strcmp(argv[i],"--intrinsic-latency") && !lastarg) {
             config.intrinsic_latency_mode = 1;
             config.intrinsic_latency_duration = atoi(argv[++i]);
@@ -1327,6 +1336,12 @@ static int parseOptions(int argc, char **argv) {
             config.pipe_mode = 1;
         } else if (!strcmp(argv[i],"--pipe-timeout") && !lastarg) {
             config.pipe_timeout = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--pipe-conns") && !lastarg) {
+            config.pipe_conns = atoi(argv[++i]);
+            if (config.pipe_conns < 1) config.pipe_conns = 1;
+        } else if (!strcmp(argv[i],"--pipe-depth") && !lastarg) {
+            config.pipe_depth = atoi(argv[++i]);
+            if (config.pipe_depth < 1) config.pipe_depth = 1;
         } else if (!strcmp(argv[i],"--bigkeys")) {
             config.bigkeys = 1;
         } else if (!strcmp(argv[i],"--hotkeys")) {
@@ -1526,12 +1541,22 @@ static void usage(void) {
 "  --pipe             Transfer raw Redis protocol from stdin to server.\n"
 "  --pipe-timeout <n> In --pipe mode, abort with error if after sending all data.\n"
 "                     no reply is received within <n> seconds.\n"
-"                     Default timeout: %d. Use 0 to wait forever.\n"
+"                     Default timeout: %d. Use 0 to wait forever.\n",
+    version, REDIS_CLI_DEFAULT_PIPE_TIMEOUT);
+    /* Using another fprintf call to avoid -Woverlength-strings compile warning */
+    fprintf(stderr,
+"  --pipe-conns <n>   In --pipe mode, parse the input and route every command\n"
+"                     to the node serving its key (with -c) using <n>\n"
+"                     connections per node. Default: 1.\n"
+"  --pipe-depth <n>   Max pending commands per --pipe-conns connection.\n"
+"                     Default: %d.\n"
 "  --bigkeys          Sample Redis keys looking for big keys.\n"
 "  --hotkeys          Sample Redis keys looking for hot keys.\n"
 "                     only works when maxmemory-policy is *lfu.\n"
 "  --scan             List all keys using the SCAN command.\n"
 "  --pattern <pat>    Useful with --scan to specify a SCAN pattern.\n"
+"  --failover-probe <key> SET <key> in a loop and report how long writes failed\n"
+"                     every time they are accepted again (use -c in cluster).\n"
 "  --intrinsic-latency <sec> Run a test to measure intrinsic system latency.\n"
 "                     The test will run for the specified amount of seconds.\n"
 "  --eval <file>      Send an EVAL command using the Lua script at <file>.\n"
@@ -1547,7 +1572,7 @@ static void usage(void) {
 "  --help             Output this help and exit.\n"
 "  --version          Output version and exit.\n"
 "\n",
-    version, REDIS_CLI_DEFAULT_PIPE_TIMEOUT);
+    REDIS_CLI_DEFAULT_PIPE_DEPTH);
     /* Using another fprintf call to avoid -Woverlength-strings compile warning */
     fprintf(stderr,
 "Cluster Manager Commands:\n"
@@ -5914,6 +5939,204 @@ static int clusterManagerCommandHelp(int argc, char **argv) {
     return 0;
 }
 
+/*------------------------------------------------------------------------------
+ * Failover probe mode
+ *--------------------------------------------------------------------------- */
+
+#define FAILOVER_PROBE_DEFAULT_INTERVAL 10 /* milliseconds. */
+#define FAILOVER_PROBE_TIMEOUT 200 /* milliseconds. */
+#define FAILOVER_PROBE_MAX_REDIRECTS 5 /* Followed without waiting. */
+
+/* Connect to ip:port with short connect and I/O timeouts: when probing a
+ * failover we don't want to hang on a node that is going away. Returns
+ * NULL if the connection or the authentication fails. */
+static redisContext *failoverProbeConnect(char *ip, int port) {
+    struct timeval tv = {0, FAILOVER_PROBE_TIMEOUT*1000};
+    redisContext *c = redisConnectWithTimeout(ip,port,tv);
+    redisReply *reply;
+
+    if (c == NULL) return NULL;
+    if (c->err) {
+        redisFree(c);
+        return NULL;
+    }
+    redisSetTimeout(c,tv);
+    if (config.auth) {
+        reply = redisCommand(c,"AUTH %s",config.auth);
+        if (reply == NULL) {
+            redisFree(c);
+            return NULL;
+        }
+        freeReplyObject(reply);
+    }
+    return c;
+}
+
+/* Add to the 'nodes' array all the nodes reported by CLUSTER SLOTS that are
+ * not already there, so that the probe can move to another node when the
+ * one it is talking with goes down. Nothing is done if the server is not
+ * a cluster node. */
+static void failoverProbeRefreshNodes(redisContext *c, sds **nodes,
+                                      int *numnodes)
+{
+    redisReply *reply = redisCommand(c,"CLUSTER SLOTS");
+    size_t i, j;
+    int k;
+
+    if (reply == NULL) return;
+    if (reply->type != REDIS_REPLY_ARRAY) {
+        freeReplyObject(reply);
+        return;
+    }
+    for (i = 0; i < reply->elements; i++) {
+        redisReply *range = reply->element[i];
+        if (range->type != REDIS_REPLY_ARRAY) continue;
+        for (j = 2; j < range->elements; j++) {
+            redisReply *node = range->element[j];
+            if (node->type != REDIS_REPLY_ARRAY || node->elements < 2 ||
+                node->element[0]->type != REDIS_REPLY_STRING ||
+                node->element[1]->type != REDIS_REPLY_INTEGER) continue;
+            sds addr = sdscatprintf(sdsempty(),"%s:%lld",
+                node->element[0]->str, node->element[1]->integer);
+            for (k = 0; k < *numnodes; k++)
+                if (!strcmp((*nodes)[k],addr)) break;
+            if (k == *numnodes) {
+                *nodes = zrealloc(*nodes,sizeof(sds)*(*numnodes+1));
+                (*nodes)[(*numnodes)++] = addr;
+            } else {
+                sdsfree(addr);
+            }
+        }
+    }
+    freeReplyObject(reply);
+}
+
+/* Write the probe key in a loop, following -MOVED and -ASK redirections and
+ * moving to other known nodes when the current one is unreachable. Every time
+ * writes are accepted again after one or more failures, the duration of
+ * the write outage is reported: killing the master serving the key while
+ * this runs measures the time from the crash to the first write accepted
+ * by the promoted replica. */
+static void failoverProbeMode(void) {
+    redisContext *c;
+    redisReply *reply;
+    sds ip = sdsnew(config.hostip), *nodes = NULL;
+    int port = config.hostport, numnodes = 0, next = 0;
+    long long interval = config.interval ? config.interval/1000 :
+                                           FAILOVER_PROBE_DEFAULT_INTERVAL;
+    long long outage_start = 0, failures = 0, counter = 0;
+    int redirects = 0; /* Consecutive redirections. */
+    int asking = 0;    /* Send ASKING first, we were redirected by -ASK. */
+
+    c = failoverProbeConnect(ip,port);
+    if (c == NULL) {
+        fprintf(stderr,"Could not connect to Redis at %s:%d\n",ip,port);
+        exit(1);
+    }
+    failoverProbeRefreshNodes(c,&nodes,&numnodes);
+    if (config.output == OUTPUT_STANDARD) {
+        printf("Writing '%s' every %lld ms, %d cluster nodes known.\n",
+            config.failover_probe_key, interval, numnodes);
+    }
+
+    while(1) {
+        reply = NULL;
+        if (c && asking) {
+            /* The ASKING reply is just +OK: what matters is the SET one. */
+            redisAppendCommand(c,"ASKING");
+            redisAppendCommand(c,"SET %s %lld",
+                config.failover_probe_key, ++counter);
+            if (redisGetReply(c,(void**)&reply) == REDIS_OK) {
+                freeReplyObject(reply);
+                if (redisGetReply(c,(void**)&reply) != REDIS_OK) reply = NULL;
+            } else {
+                reply = NULL;
+            }
+        } else if (c) {
+            reply = redisCommand(c,"SET %s %lld",
+                config.failover_probe_key, ++counter);
+        }
+        asking = 0;
+
+        if (reply && reply->type != REDIS_REPLY_ERROR) {
+            redirects = 0;
+            if (outage_start) {
+                long long outage = mstime()-outage_start;
+                if (config.output == OUTPUT_STANDARD) {
+                    printf("Writes accepted again by %s:%d after %lld ms "
+                           "(%lld failed attempts)\n",
+                           ip, port, outage, failures);
+                } else {
+                    printf("%lld,%lld,%s,%d\n", outage, failures, ip, port);
+                }
+                fflush(stdout);
+                outage_start = 0;
+                failures = 0;
+                failoverProbeRefreshNodes(c,&nodes,&numnodes);
+            }
+        } else if (reply && config.cluster_mode &&
+                   (!strncmp(reply->str,"MOVED ",6) ||
+                    !strncmp(reply->str,"ASK ",4)))
+        {
+            /* -MOVED 3999 127.0.0.1:6381: the redirection alone is not a
+             * failure, but the new node may be unreachable. After -ASK the
+             * slot is being migrated: the new node accepts the key only
+             * after ASKING, and will send us back with -MOVED until the
+             * migration is done. */
+            char *addr = strchr(reply->str,' ');
+            char *colon;
+            if (addr) addr = strchr(addr+1,' ');
+            if (addr && (colon = strrchr(addr+1,':')) != NULL) {
+                sdsfree(ip);
+                ip = sdsnewlen(addr+1,colon-(addr+1));
+                port = atoi(colon+1);
+                redisFree(c);
+                c = failoverProbeConnect(ip,port);
+                if (c == NULL) {
+                    if (!outage_start) outage_start = mstime();
+                    failures++;
+                } else {
+                    asking = !strncmp(reply->str,"ASK ",4);
+                }
+            }
+            /* Follow the redirection ASAP, unless the nodes are bouncing
+             * us back and forth while the slots configuration settles:
+             * in that case account a failure and wait like for errors. */
+            if (++redirects < FAILOVER_PROBE_MAX_REDIRECTS) {
+                freeReplyObject(reply);
+                continue;
+            }
+            redirects = 0;
+            if (c) {
+                if (!outage_start) outage_start = mstime();
+                failures++;
+            }
+        } else {
+            redirects = 0;
+            /* I/O error, timeout, or an error like -CLUSTERDOWN or
+             * -READONLY: writes are not accepted right now. */
+            if (!outage_start) outage_start = mstime();
+            failures++;
+            if (reply == NULL) {
+                if (c) redisFree(c);
+                c = failoverProbeConnect(ip,port);
+                if (c == NULL && numnodes) {
+                    /* Try the next known node: it will redirect us to the
+                     * current owner of the key once the failover is done. */
+                    char *addr = nodes[next++ % numnodes];
+                    char *colon = strrchr(addr,':');
+                    sdsfree(ip);
+                    ip = sdsnewlen(addr,colon-addr);
+                    port = atoi(colon+1);
+                    c = failoverProbeConnect(ip,port);
+                }
+            }
+        }
+        if (reply) freeReplyObject(reply);
+        usleep(interval*1000);
+    }
+}
+
 /*------------------------------------------------------------------------------
  * Latency and latency history modes
  *--------------------------------------------------------------------------- */
@@ -6411,6 +6634,605 @@ static void pipeMode(void) {
         exit(0);
 }
 
+/*------------------------------------------------------------------------------
+ * Routed bulk import mode
+ *
+ * Like --pipe, but the protocol read from stdin is parsed, so that every
+ * command can be sent to the cluster node serving its key, using multiple
+ * pipelined connections per node. All the commands hashing to the same slot
+ * use the same connection, so the order of the operations on a given key is
+ * preserved (unless the command is redirected by the cluster).
+ *--------------------------------------------------------------------------- */
+
+#define PIPEMODE_ROUTED_MAX_REDIRECTS 16
+#define PIPEMODE_ROUTED_READ_LEN (1024*64)
+
+typedef struct pipeCommand {
+    sds proto;          /* The command in RESP format. */
+    int slot;
+    int asking;         /* Preceded by ASKING: skip its reply first. */
+    int redirects;      /* Number of -MOVED / -ASK received so far. */
+} pipeCommand;
+
+typedef struct pipeConn {
+    redisContext *context;  /* NULL if not connected yet. */
+    redisReader *reader;
+    sds obuf;
+    size_t obuf_pos;
+    list *pending;          /* Commands queued or sent, waiting a reply. */
+} pipeConn;
+
+typedef struct pipeNode {
+    sds ip;             /* NULL when connecting to config.hostsocket. */
+    int port;
+    pipeConn *conns;    /* config.pipe_conns connections. */
+} pipeNode;
+
+static struct {
+    pipeNode **nodes;
+    int numnodes;
+    pipeNode *slots[CLUSTER_MANAGER_SLOTS];
+    dict *firstkey;     /* Command name -> position of the first key. */
+    sds name;           /* Scratch buffer for command names lookups. */
+    int cluster;        /* True if the server is a cluster node. */
+    long long sent, replies, errors, redirects;
+    time_t last_reply_time;
+} pipeState;
+
+static dictType pipeCommandsDictType = {
+    dictSdsHash,               /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictSdsKeyCompare,         /* key compare */
+    dictSdsDestructor,         /* key destructor */
+    NULL                       /* val destructor */
+};
+
+static pipeNode *pipeGetNode(char *ip, int port) {
+    pipeNode *n;
+    int j;
+
+    for (j = 0; j < pipeState.numnodes; j++) {
+        n = pipeState.nodes[j];
+        if (n->port == port &&
+            ((ip == NULL && n->ip == NULL) ||
+             (ip && n->ip && !strcmp(ip,n->ip)))) return n;
+    }
+    n = zmalloc(sizeof(*n));
+    n->ip = ip ? sdsnew(ip) : NULL;
+    n->port = port;
+    n->conns = zcalloc(sizeof(pipeConn)*config.pipe_conns);
+    pipeState.nodes = zrealloc(pipeState.nodes,
+        sizeof(pipeNode*)*(pipeState.numnodes+1));
+    pipeState.nodes[pipeState.numnodes++] = n;
+    return n;
+}
+
+/* Return the connection of node 'n' used for 'slot', connecting it if
+ * needed. Connections are blocking while authenticating, then they are
+ * switched to non blocking mode. */
+static pipeConn *pipeGetConn(pipeNode *n, int slot) {
+    pipeConn *pc = n->conns+(slot % config.pipe_conns);
+    char aneterr[ANET_ERR_LEN];
+    redisReply *reply;
+
+    if (pc->context) return pc;
+    if (n->ip)
+        pc->context = redisConnect(n->ip,n->port);
+    else
+        pc->context = redisConnectUnix(config.hostsocket);
+    if (pc->context == NULL || pc->context->err) {
+        fprintf(stderr,"Could not connect to Redis at %s:%d: %s\n",
+            n->ip ? n->ip : config.hostsocket, n->port,
+            pc->context ? pc->context->errstr : "out of memory");
+        exit(1);
+    }
+    if (config.auth) {
+        reply = redisCommand(pc->context,"AUTH %s",config.auth);
+        if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+            fprintf(stderr,"AUTH failed: %s\n",
+                reply ? reply->str : pc->context->errstr);
+            exit(1);
+        }
+        freeReplyObject(reply);
+    }
+    if (!pipeState.cluster && config.dbnum != 0) {
+        reply = redisCommand(pc->context,"SELECT %d",config.dbnum);
+        if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+            fprintf(stderr,"SELECT failed: %s\n",
+                reply ? reply->str : pc->context->errstr);
+            exit(1);
+        }
+        freeReplyObject(reply);
+    }
+    if (anetNonBlock(aneterr,pc->context->fd) == ANET_ERR) {
+        fprintf(stderr, "Can't set the socket in non blocking mode: %s\n",
+            aneterr);
+        exit(1);
+    }
+    pc->reader = redisReaderCreate();
+    pc->obuf = sdsempty();
+    pc->obuf_pos = 0;
+    pc->pending = listCreate();
+    return pc;
+}
+
+/* Queue the command in the output buffer of the connection serving its
+ * slot. If 'n' is not NULL the command is sent to that node, regardless
+ * of the slots map (this is used for -ASK redirections). */
+static void pipeDispatch(pipeCommand *cmd, pipeNode *n) {
+    pipeConn *pc;
+
+    if (n == NULL) n = pipeState.slots[cmd->slot];
+    if (n == NULL) n = pipeState.nodes[0]; /* Unassigned slot. */
+    pc = pipeGetConn(n,cmd->slot);
+    if (cmd->asking)
+        pc->obuf = sdscatlen(pc->obuf,"*1\r\n$6\r\nASKING\r\n",16);
+    pc->obuf = sdscatsds(pc->obuf,cmd->proto);
+    listAddNodeTail(pc->pending,cmd);
+}
+
+/* Return true if the connection serving the command already has too
+ * many commands in flight: in this case we stop reading the input. */
+static int pipeCommandMustWait(pipeCommand *cmd) {
+    pipeNode *n = pipeState.slots[cmd->slot];
+    pipeConn *pc;
+
+    if (n == NULL) n = pipeState.nodes[0];
+    pc = n->conns+(cmd->slot % config.pipe_conns);
+    return pc->pending && listLength(pc->pending) >= (unsigned)config.pipe_depth;
+}
+
+/* Return the slot of a command given the position of its first key and
+ * the argument at that position, if any. The slot is computed even when
+ * the server is not a cluster node, since it is also used in order to
+ * spread the keys across the connections. */
+static int pipeCommandSlot(int keypos, char *key, size_t keylen) {
+    if (keypos <= 0 || key == NULL) return 0;
+    return clusterManagerKeyHashSlot(key,keylen);
+}
+
+/* Return the position of the first key of the command 'name', or 0 if
+ * the command has no keys or its keys can't be found without parsing the
+ * whole command (like for EVAL): these commands are sent to the node
+ * serving slot 0, and will be redirected if needed. */
+static int pipeCommandFirstKey(char *name, size_t len) {
+    dictEntry *de;
+
+    if (pipeState.firstkey == NULL) return 1;
+    pipeState.name = sdscpylen(pipeState.name,name,len);
+    sdstolower(pipeState.name);
+    de = dictFind(pipeState.firstkey,pipeState.name);
+    return de ? dictGetSignedIntegerVal(de) : 1;
+}
+
+/* Commands changing the state of the connection can't work in this mode,
+ * since the following commands may be sent over other connections: use
+ * -n to select the DB instead. Exit with an error if 'name' is one of
+ * them. */
+static void pipeRefuseConnectionCommand(char *name, size_t len) {
+    static char *refused[] = {"select","multi","exec","discard","watch",
+                              "unwatch",NULL};
+    int j;
+
+    for (j = 0; refused[j]; j++) {
+        if (strlen(refused[j]) == len && !strncasecmp(name,refused[j],len)) {
+            fprintf(stderr,"%s is not supported when importing with "
+                "multiple connections (-c or --pipe-conns)\n",refused[j]);
+            exit(1);
+        }
+    }
+}
+
+/* Try to parse a command from 'buf' starting at '*pos'. On success a new
+ * command is returned and '*pos' is updated. NULL is returned if more data
+ * is needed. On protocol errors the program exits, since it is not
+ * possible to resynchronize with the input. */
+static pipeCommand *pipeParseCommand(sds buf, size_t *pos) {
+    char *start = buf+*pos, *p = start, *end = buf+sdslen(buf), *nl, *eptr;
+    char *key = NULL;
+    size_t keylen = 0;
+    long long argc, j, len;
+    int keypos = -1;
+    pipeCommand *cmd;
+    sds proto;
+
+    /* Skip empty lines: plain --pipe allows a CRLF between commands. */
+    while (p < end && (*p == '\r' || *p == '\n')) p++;
+    *pos = p-buf;
+    start = p;
+    if (p == end) return NULL;
+
+    if (*p != '*') {
+        /* Inline command: translate it into the multi bulk format. */
+        int argcount, k;
+        sds line, *argv;
+        size_t *argvlen;
+        char *formatted;
+
+        nl = memchr(p,'\n',end-p);
+        if (nl == NULL) return NULL;
+        line = sdsnewlen(p,nl-p);
+        argv = sdssplitargs(line,&argcount);
+        sdsfree(line);
+        *pos = (nl+1)-buf;
+        if (argv == NULL) {
+            fprintf(stderr,"Invalid inline command in the input\n");
+            exit(1);
+        }
+        if (argcount == 0) {
+            sdsfreesplitres(argv,argcount);
+            return pipeParseCommand(buf,pos);
+        }
+        argvlen = zmalloc(sizeof(size_t)*argcount);
+        for (k = 0; k < argcount; k++) argvlen[k] = sdslen(argv[k]);
+        len = redisFormatCommandArgv(&formatted,argcount,
+            (const char**)argv,argvlen);
+        proto = sdsnewlen(formatted,len);
+        free(formatted);
+        keypos = pipeCommandFirstKey(argv[0],argvlen[0]);
+        cmd = zmalloc(sizeof(*cmd));
+        cmd->slot = pipeCommandSlot(keypos,
+            keypos > 0 && keypos < argcount ? argv[keypos] : NULL,
+            keypos > 0 && keypos < argcount ? argvlen[keypos] : 0);
+        pipeRefuseConnectionCommand(argv[0],argvlen[0]);
+        zfree(argvlen);
+        sdsfreesplitres(argv,argcount);
+        goto created;
+    }
+
+    nl = memchr(p,'\r',end-p);
+    if (nl == NULL || nl+1 >= end) return NULL;
+    argc = strtoll(p+1,&eptr,10);
+    if (eptr != nl || argc <= 0) goto protoerr;
+    p = nl+2;
+    for (j = 0; j < argc; j++) {
+        if (p >= end) return NULL;
+        if (*p != '$') goto protoerr;
+        nl = memchr(p,'\r',end-p);
+        if (nl == NULL || nl+1 >= end) return NULL;
+        len = strtoll(p+1,&eptr,10);
+        if (eptr != nl || len < 0) goto protoerr;
+        p = nl+2;
+        if (end-p < len+2) return NULL;
+        if (j == 0) {
+            pipeRefuseConnectionCommand(p,len);
+            keypos = pipeCommandFirstKey(p,len);
+        } else if (j == keypos) {
+            key = p;
+            keylen = len;
+        }
+        p += len+2;
+    }
+    proto = sdsnewlen(start,p-start);
+    *pos = p-buf;
+    cmd = zmalloc(sizeof(*cmd));
+    cmd->slot = pipeCommandSlot(keypos,key,keylen);
+
+created:
+    cmd->proto = proto;
+    cmd->asking = 0;
+    cmd->redirects = 0;
+    return cmd;
+
+protoerr:
+    fprintf(stderr,"Protocol error in the input at offset %zu of the "
+                   "current buffer\n", (size_t)(start-buf));
+    exit(1);
+}
+
+static void pipeFreeCommand(pipeCommand *cmd) {
+    sdsfree(cmd->proto);
+    zfree(cmd);
+}
+
+/* Handle a reply for the first pending command of the connection,
+ * following -MOVED and -ASK redirections. */
+static void pipeHandleReply(pipeConn *pc, redisReply *reply) {
+    listNode *ln = listFirst(pc->pending);
+    pipeCommand *cmd = ln->value;
+
+    if (cmd->asking) {
+        /* Reply to the ASKING command preceding the real one. */
+        cmd->asking = 0;
+        return;
+    }
+    listDelNode(pc->pending,ln);
+
+    if (reply->type == REDIS_REPLY_ERROR &&
+        (!strncmp(reply->str,"MOVED ",6) || !strncmp(reply->str,"ASK ",4)) &&
+        cmd->redirects < PIPEMODE_ROUTED_MAX_REDIRECTS)
+    {
+        /* -MOVED 3999 127.0.0.1:6381 */
+        char *slotp = strchr(reply->str,' '), *addr, *colon;
+        int ask = reply->str[0] == 'A';
+
+        addr = slotp ? strchr(slotp+1,' ') : NULL;
+        colon = addr ? strrchr(addr+1,':') : NULL;
+        if (colon) {
+            sds ip = sdsnewlen(addr+1,colon-(addr+1));
+            pipeNode *n = pipeGetNode(ip,atoi(colon+1));
+            int slot = atoi(slotp+1);
+
+            sdsfree(ip);
+            if (!ask && slot >= 0 && slot < CLUSTER_MANAGER_SLOTS)
+                pipeState.slots[slot] = n;
+            cmd->redirects++;
+            cmd->asking = ask;
+            pipeState.redirects++;
+            pipeDispatch(cmd,ask ? n : NULL);
+            return;
+        }
+    }
+
+    if (reply->type == REDIS_REPLY_ERROR) {
+        fprintf(stderr,"%s\n", reply->str);
+        pipeState.errors++;
+    }
+    pipeState.replies++;
+    pipeFreeCommand(cmd);
+}
+
+/* Read replies from the connection. */
+static void pipeReadConn(pipeConn *pc) {
+    char ibuf[1024*16];
+    redisReply *reply;
+    ssize_t nread;
+
+    do {
+        nread = read(pc->context->fd,ibuf,sizeof(ibuf));
+        if (nread == 0 ||
+            (nread == -1 && errno != EAGAIN && errno != EINTR))
+        {
+            fprintf(stderr, "Error reading from the server: %s\n",
+                nread == 0 ? "connection closed" : strerror(errno));
+            exit(1);
+        }
+        if (nread > 0) {
+            redisReaderFeed(pc->reader,ibuf,nread);
+            pipeState.last_reply_time = time(NULL);
+        }
+    } while(nread > 0);
+
+    do {
+        if (redisReaderGetReply(pc->reader,(void**)&reply) == REDIS_ERR) {
+            fprintf(stderr, "Error reading replies from server\n");
+            exit(1);
+        }
+        if (reply) {
+            if (listLength(pc->pending) == 0) {
+                fprintf(stderr, "Unexpected reply from server\n");
+                exit(1);
+            }
+            pipeHandleReply(pc,reply);
+            freeReplyObject(reply);
+        }
+    } while(reply);
+}
+
+static void pipeWriteConn(pipeConn *pc) {
+    ssize_t nwritten;
+    size_t len = sdslen(pc->obuf)-pc->obuf_pos;
+
+    if (len == 0) return;
+    nwritten = write(pc->context->fd,pc->obuf+pc->obuf_pos,len);
+    if (nwritten == -1) {
+        if (errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "Error writing to the server: %s\n",
+                strerror(errno));
+            exit(1);
+        }
+        return;
+    }
+    pc->obuf_pos += nwritten;
+    if (pc->obuf_pos == sdslen(pc->obuf)) {
+        sdsclear(pc->obuf);
+        pc->obuf_pos = 0;
+    } else if (pc->obuf_pos > PIPEMODE_WRITE_LOOP_MAX_BYTES) {
+        sdsrange(pc->obuf,pc->obuf_pos,-1);
+        pc->obuf_pos = 0;
+    }
+}
+
+/* Fetch the slots map via CLUSTER SLOTS and the keys positions via COMMAND
+ * using the already connected 'context'. If the server is not a cluster
+ * node all the slots are served by the node we are connected to. */
+static void pipeLoadTopology(void) {
+    redisReply *reply;
+    size_t i;
+    int j;
+
+    pipeState.name = sdsempty();
+    reply = redisCommand(context,"COMMAND");
+    if (reply && reply->type == REDIS_REPLY_ARRAY) {
+        pipeState.firstkey = dictCreate(&pipeCommandsDictType,NULL);
+        for (i = 0; i < reply->elements; i++) {
+            redisReply *c = reply->element[i];
+            dictEntry *de;
+
+            if (c->type != REDIS_REPLY_ARRAY || c->elements < 4 ||
+                c->element[0]->type != REDIS_REPLY_STRING ||
+                c->element[3]->type != REDIS_REPLY_INTEGER) continue;
+            de = dictAddRaw(pipeState.firstkey,
+                sdsnew(c->element[0]->str),NULL);
+            if (de) dictSetSignedIntegerVal(de,c->element[3]->integer);
+        }
+    }
+    if (reply) freeReplyObject(reply);
+
+    if (config.cluster_mode) {
+        reply = redisCommand(context,"CLUSTER SLOTS");
+        if (reply && reply->type == REDIS_REPLY_ARRAY) {
+            pipeState.cluster = 1;
+            for (i = 0; i < reply->elements; i++) {
+                redisReply *r = reply->element[i], *m;
+                pipeNode *n;
+                long long s;
+
+                if (r->type != REDIS_REPLY_ARRAY || r->elements < 3) continue;
+                m = r->element[2];
+                if (m->type != REDIS_REPLY_ARRAY || m->elements < 2) continue;
+                n = pipeGetNode(m->element[0]->str,m->element[1]->integer);
+                for (s = r->element[0]->integer;
+                     s <= r->element[1]->integer &&
+                     s < CLUSTER_MANAGER_SLOTS; s++)
+                {
+                    pipeState.slots[s] = n;
+                }
+            }
+        }
+        if (reply) freeReplyObject(reply);
+    }
+
+    if (pipeState.numnodes == 0) {
+        pipeNode *n = pipeGetNode(config.hostsocket ? NULL : config.hostip,
+                                  config.hostport);
+        for (j = 0; j < CLUSTER_MANAGER_SLOTS; j++) pipeState.slots[j] = n;
+    }
+}
+
+static void pipeRoutedPrintStats(long long start, long long *last_sent,
+                                 long long *last_time)
+{
+    long long now = mstime();
+    long long elapsed = now-*last_time;
+
+    if (elapsed <= 0) return;
+    printf("%lld sent, %lld replies, %lld errors, %lld redirections, "
+           "%lld ops/sec (%lld ops/sec avg)\n",
+           pipeState.sent, pipeState.replies, pipeState.errors,
+           pipeState.redirects,
+           (pipeState.sent-*last_sent)*1000/elapsed,
+           now > start ? pipeState.replies*1000/(now-start) : 0);
+    fflush(stdout);
+    *last_sent = pipeState.sent;
+    *last_time = now;
+}
+
+static void pipeRoutedMode(void) {
+    sds ibuf = sdsempty();
+    size_t ipos = 0;
+    int eof = 0;
+    pipeCommand *stalled = NULL; /* Parsed command waiting for room. */
+    struct pollfd *pfd = NULL;
+    pipeConn **pconns = NULL;
+    long long start = mstime(), last_time = start, last_sent = 0;
+
+    pipeLoadTopology();
+    pipeState.last_reply_time = time(NULL);
+    if (config.output == OUTPUT_STANDARD) {
+        printf("Importing to %d node(s), %d connection(s) per node, "
+               "up to %d pending commands per connection.\n",
+               pipeState.numnodes, config.pipe_conns, config.pipe_depth);
+    }
+
+    while(1) {
+        int numfds = 0, inflight = 0, j, k;
+
+        /* Route as many input commands as possible. */
+        while(1) {
+            if (stalled == NULL) stalled = pipeParseCommand(ibuf,&ipos);
+            if (stalled == NULL || pipeCommandMustWait(stalled)) break;
+            pipeDispatch(stalled,NULL);
+            pipeState.sent++;
+            stalled = NULL;
+        }
+
+        /* Check if we are done. */
+        for (j = 0; j < pipeState.numnodes; j++) {
+            pipeNode *n = pipeState.nodes[j];
+            for (k = 0; k < config.pipe_conns; k++)
+                if (n->conns[k].pending)
+                    inflight += listLength(n->conns[k].pending);
+        }
+        if (eof && stalled == NULL && inflight == 0) {
+            if (ipos != sdslen(ibuf)) {
+                fprintf(stderr,"Incomplete command at the end of the input\n");
+                pipeState.errors++;
+            }
+            break;
+        }
+
+        /* Poll stdin, if the parser needs more input (regardless of how
+         * much is already buffered, a single command can be bigger than
+         * PIPEMODE_ROUTED_READ_LEN), and all the connected nodes. */
+        pfd = zrealloc(pfd,sizeof(*pfd)*
+            (pipeState.numnodes*config.pipe_conns+1));
+        pconns = zrealloc(pconns,sizeof(pipeConn*)*
+            (pipeState.numnodes*config.pipe_conns+1));
+        if (!eof && stalled == NULL) {
+            pfd[numfds].fd = STDIN_FILENO;
+            pfd[numfds].events = POLLIN;
+            pconns[numfds] = NULL;
+            numfds++;
+        }
+        for (j = 0; j < pipeState.numnodes; j++) {
+            pipeNode *n = pipeState.nodes[j];
+            for (k = 0; k < config.pipe_conns; k++) {
+                pipeConn *pc = n->conns+k;
+                if (pc->context == NULL) continue;
+                pfd[numfds].fd = pc->context->fd;
+                pfd[numfds].events = POLLIN;
+                if (sdslen(pc->obuf) != pc->obuf_pos)
+                    pfd[numfds].events |= POLLOUT;
+                pconns[numfds] = pc;
+                numfds++;
+            }
+        }
+
+        if (poll(pfd,numfds,100) == -1 && errno != EINTR) {
+            fprintf(stderr,"poll() error: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for (j = 0; j < numfds; j++) {
+            if (pfd[j].revents == 0) continue;
+            if (pconns[j] == NULL) {
+                char buf[PIPEMODE_ROUTED_READ_LEN];
+                ssize_t nread = read(STDIN_FILENO,buf,sizeof(buf));
+
+                if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+                    fprintf(stderr, "Error reading from stdin: %s\n",
+                        strerror(errno));
+                    exit(1);
+                } else if (nread == 0) {
+                    eof = 1;
+                } else if (nread > 0) {
+                    sdsrange(ibuf,ipos,-1);
+                    ipos = 0;
+                    ibuf = sdscatlen(ibuf,buf,nread);
+                }
+                continue;
+            }
+            if (pfd[j].revents & (POLLIN|POLLERR|POLLHUP))
+                pipeReadConn(pconns[j]);
+            if (pfd[j].revents & POLLOUT)
+                pipeWriteConn(pconns[j]);
+        }
+
+        if (config.output == OUTPUT_STANDARD && mstime()-last_time >= 1000)
+            pipeRoutedPrintStats(start,&last_sent,&last_time);
+
+        /* Handle timeout, like in pipeMode(). */
+        if (eof && config.pipe_timeout > 0 &&
+            time(NULL)-pipeState.last_reply_time > config.pipe_timeout)
+        {
+            fprintf(stderr,"No replies for %d seconds: exiting.\n",
+                config.pipe_timeout);
+            pipeState.errors++;
+            break;
+        }
+    }
+
+    long long elapsed = mstime()-start;
+    printf("errors: %lld, replies: %lld, redirections: %lld, "
+           "%.2f seconds, %lld ops/sec\n",
+           pipeState.errors, pipeState.replies, pipeState.redirects,
+           (double)elapsed/1000,
+           elapsed ? pipeState.replies*1000/elapsed : pipeState.replies);
+    exit(pipeState.errors ? 1 : 0);
+}
+
 /*------------------------------------------------------------------------------
  * Find big keys
  *--------------------------------------------------------------------------- */
@@ -7193,10 +8015,14 @@ int main(int argc, char **argv) {
     config.stat_mode = 0;
     config.scan_mode = 0;
     config.intrinsic_latency_mode = 0;
+    config.failover_probe_mode = 0;
+    config.failover_probe_key = NULL;
     config.pattern = NULL;
     config.rdb_filename = NULL;
     config.pipe_mode = 0;
     config.pipe_timeout = REDIS_CLI_DEFAULT_PIPE_TIMEOUT;
+    config.pipe_conns = 1;
+    config.pipe_depth = REDIS_CLI_DEFAULT_PIPE_DEPTH;
     config.bigkeys = 0;
     config.hotkeys = 0;
     config.stdinarg = 0;
@@ -7257,6 +8083,9 @@ int main(int argc, char **argv) {
         latencyMode();
     }
 
+    /* Failover probe mode */
+    if (config.failover_probe_mode) failoverProbeMode();
+
     /* Latency distribution mode */
     if (config.latency_dist_mode) {
         if (cliConnect(0) == REDIS_ERR) exit(1);
@@ -7278,7 +8107,10 @@ int main(int argc, char **argv) {
     /* Pipe mode */
     if (config.pipe_mode) {
         if (cliConnect(0) == REDIS_ERR) exit(1);
-        pipeMode();
+        if (config.cluster_mode || config.pipe_conns > 1)
+            pipeRoutedMode();
+        else
+            pipeMode();
     }
 
     /* Find big keys */
@@ -30,6 +30,7 @@
 
 
 #include "server.h"
+#include "bio.h"
 
 #include <sys/time.h>
 #include <unistd.h>
@@ -178,7 +179,7 @@ void feedReplicationBacklogWithObject(robj *o) {
 void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     listNode *ln;
     listIter li;
-    int j, len;
+    int j, len, dictid_len;
     char llstr[LONG_STR_SIZE];
 
     /* If the instance is not a top level master, return ASAP: we'll just proxy
@@ -195,6 +196,28 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
     /* We can't have slaves attached and no backlog. */
     serverAssert(!(listLength(slaves) != 0 && server.repl_backlog == NULL));
 
+    /* While EXEC is running the command is just encoded into the batch,
+     * that is fed to the backlog and the slaves as a single block by
+     * execPropagateBatchEnd(). */
+    if (server.propagate_batch && slaves == server.slaves) {
+        if (server.slaveseldb != dictid) {
+            if (dictid >= 0 && dictid < PROTO_SHARED_SELECT_CMDS) {
+                server.propagate_batch_repl = sdscatsds(
+                    server.propagate_batch_repl,shared.select[dictid]->ptr);
+            } else {
+                dictid_len = ll2string(llstr,sizeof(llstr),dictid);
+                server.propagate_batch_repl = sdscatprintf(
+                    server.propagate_batch_repl,
+                    "*2\r\n$6\r\nSELECT\r\n$%d\r\n%s\r\n",
+                    dictid_len, llstr);
+            }
+            server.slaveseldb = dictid;
+        }
+        server.propagate_batch_repl = catAppendOnlyGenericCommand(
+            server.propagate_batch_repl,argc,argv);
+        return;
+    }
+
     /* Send SELECT command to every slave if needed. */
     if (server.slaveseldb != dictid) {
         robj *selectcmd;
@@ -203,8 +226,6 @@ void replicationFeedSlaves(list *slaves, int dictid, robj **argv, int argc) {
         if (dictid >= 0 && dictid < PROTO_SHARED_SELECT_CMDS) {
             selectcmd = shared.select[dictid];
         } else {
-            int dictid_len;
-
             dictid_len = ll2string(llstr,sizeof(llstr),dictid);
             selectcmd = createObject(OBJ_STRING,
                 sdscatprintf(sdsempty(),
@@ -806,12 +827,13 @@ void syncCommand(client *c) {
              * let's start one. */
             // 如果没有正在执行BGSAVE，且没有进行写AOF文件
             // 则开始为复制执行BGSAVE，并且是将RDB文件写到磁盘上
-            if (server.aof_child_pid == -1) {
+            if (!hasActiveChildProcess()) {
                 startBgsaveForReplication(c->slave_capa);
             } else {
                 serverLog(LL_NOTICE,
-                    "No BGSAVE in progress, but an AOF rewrite is active. "
-                    "BGSAVE for replication delayed");
+                    "No BGSAVE in progress, but an AOF rewrite or a "
+                    "background SCAN is active. BGSAVE for replication "
+                    "delayed");
             }
         }
     }
@@ -1148,6 +1170,7 @@ void replicationCreateMasterClient(int fd, int dbid) {
     server.master = createClient(fd);
     server.master->flags |= CLIENT_MASTER;
     server.master->authenticated = 1;
+    server.master->user = NULL; /* This client can do everything. */
     server.master->reploff = server.master_initial_offset;
     server.master->read_reploff = server.master->reploff;
     memcpy(server.master->replid, server.master_replid,
@@ -1316,6 +1339,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
 
     if (eof_reached) {
         int aof_is_enabled = server.aof_state != AOF_OFF;
+        int old_rdb_fd;
 
         /* Ensure background save doesn't overwrite synced data */
         if (server.rdb_child_pid != -1) {
@@ -1326,14 +1350,20 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
                 "any race",
                     (long) server.rdb_child_pid);
             kill(server.rdb_child_pid,SIGUSR1);
-            rdbRemoveTempFile(server.rdb_child_pid);
+            rdbRemoveTempFile(server.rdb_child_pid,0);
         }
 
+        /* Reference the old RDB file, if any, so that rename() does not
+         * unlink it synchronously: it is released in the background when
+         * the descriptor is closed. */
+        old_rdb_fd = open(server.rdb_filename,O_RDONLY|O_NONBLOCK);
         if (rename(server.repl_transfer_tmpfile,server.rdb_filename) == -1) {
             serverLog(LL_WARNING,"Failed trying to rename the temp DB into dump.rdb in MASTER <-> REPLICA synchronization: %s", strerror(errno));
             cancelReplicationHandshake();
+            if (old_rdb_fd != -1) close(old_rdb_fd);
             return;
         }
+        if (old_rdb_fd != -1) bioCloseFile(old_rdb_fd,0);
         serverLog(LL_NOTICE, "MASTER <-> REPLICA sync: Flushing old data");
         /* We need to stop any AOFRW fork before flusing and parsing
          * RDB, otherwise we'll create a copy-on-write disaster. */
@@ -2083,7 +2113,7 @@ void replicationAbortSyncTransfer(void) {
     // 关闭传输 RDB 文件的临时描述符
     close(server.repl_transfer_fd);
     // 删除临时 RDB 文件
-    unlink(server.repl_transfer_tmpfile);
+    bioUnlinkFile(server.repl_transfer_tmpfile,1);
     zfree(server.repl_transfer_tmpfile);
 }
 
@@ -2417,6 +2447,7 @@ void replicationResurrectCachedMaster(int newfd) {
     server.master->fd = newfd;
     server.master->flags &= ~(CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP);
     server.master->authenticated = 1;
+    server.master->user = NULL; /* This client can do everything. */
     server.master->lastinteraction = server.unixtime;
     server.repl_state = REPL_STATE_CONNECTED;
     server.repl_down_since = 0;
@@ -2879,7 +2910,7 @@ void replicationCron(void) {
      * In case of diskless replication, we make sure to wait the specified
      * number of seconds (according to configuration) so that other slaves
      * have the time to arrive before we start streaming. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1) {
+    if (!hasActiveChildProcess()) {
         time_t idle, max_idle = 0;
         int slaves_waiting = 0;
         int mincapa = -1;
@@ -73,9 +73,13 @@ typedef struct sentinelAddr {
 #define SRI_RECONF_DONE (1<<10)     /* Slave synchronized with new master. */
 #define SRI_FORCE_FAILOVER (1<<11)  /* Force failover with master up. */
 #define SRI_SCRIPT_KILL_SENT (1<<12) /* SCRIPT KILL already sent on -BUSY */
+#define SRI_NO_ROLE (1<<13)         /* Instance refused ROLE: always use INFO. */
 
 /* Note: times are in milliseconds. */
 #define SENTINEL_INFO_PERIOD 10000
+#define SENTINEL_INFO_FULL_PERIOD 60000
+#define SENTINEL_INFO_JITTER 1000
+#define SENTINEL_PROMOTION_INFO_PERIOD 100
 #define SENTINEL_PING_PERIOD 1000
 #define SENTINEL_ASK_PERIOD 1000
 #define SENTINEL_PUBLISH_PERIOD 2000
@@ -201,7 +205,13 @@ typedef struct sentinelRedisInstance {
     // 由SENTINEL down-after-millisenconds 配置设定
     mstime_t down_after_period; /* Consider it down after that period. */
     // 从实例获取 INFO 命令回复的时间
-    mstime_t info_refresh;  /* Time at which we received INFO output from it. */
+    mstime_t info_refresh;  /* Time at which we received INFO output from it,
+                               or a ROLE reply confirming the INFO state. */
+    mstime_t info_full_refresh; /* Time at which we received the last full
+                                   INFO output. */
+    mstime_t info_jitter;   /* Random amount subtracted from the polling
+                               period, so that the polling of many instances
+                               is spread over time. */
     // 该实例中重命名进行发送的命令，使用映射在 renamed_commands 中的命令来进行发送，例如 SLAVEOF CONFING INFO 等
     // 就是使用另一条命令来代替某一条命令
     dict *renamed_commands;     /* Commands renamed in this instance:
@@ -1342,6 +1352,8 @@ sentinelRedisInstance *createSentinelRedisInstance(char *name, int flags, char *
     ri->master = master;
     ri->slaves = dictCreate(&instancesDictType,NULL);
     ri->info_refresh = 0;
+    ri->info_full_refresh = 0;
+    ri->info_jitter = rand() % SENTINEL_INFO_JITTER;
     ri->renamed_commands = dictCreate(&renamedCommandsDictType,NULL);
 
     /* Failover state. */
@@ -2138,6 +2150,12 @@ void sentinelReconnectInstance(sentinelRedisInstance *ri) {
             sentinelSendAuthIfNeeded(ri,link->cc);
             sentinelSetClientName(ri,link->cc,"cmd");
 
+            /* The instance may have been restarted or upgraded while we
+             * were disconnected: get a full INFO ASAP, and give ROLE
+             * another chance. */
+            ri->info_full_refresh = 0;
+            ri->flags &= ~SRI_NO_ROLE;
+
             /* Send a PING ASAP when reconnecting. */
             sentinelSendPing(ri);
         }
@@ -2319,6 +2337,7 @@ void sentinelRefreshInstanceInfo(sentinelRedisInstance *ri, const char *info) {
         }
     }
     ri->info_refresh = mstime();
+    ri->info_full_refresh = ri->info_refresh;
     sdsfreesplitres(lines,numlines);
 
     /* ---------------------------- Acting half -----------------------------
@@ -2461,6 +2480,138 @@ void sentinelInfoReplyCallback(redisAsyncContext *c, void *reply, void *privdata
         sentinelRefreshInstanceInfo(ri,r->str);
 }
 
+/* Send INFO to the instance. Returns C_OK if the command was queued. */
+int sentinelSendInfo(sentinelRedisInstance *ri) {
+    int retval = redisAsyncCommand(ri->link->cc,
+        sentinelInfoReplyCallback, ri, "%s",
+        sentinelInstanceMapCommand(ri,"INFO"));
+    if (retval == C_OK) ri->link->pending_commands++;
+    return retval;
+}
+
+/* Return true if the next state poll of the instance must use INFO. ROLE
+ * is only used as a cheap way to confirm that nothing changed while the
+ * instance is in a steady state: every time something is in progress, or
+ * may need the fields that only INFO reports (run_id, slave_priority,
+ * master_link_down_since_seconds, replicas not yet online), we want the
+ * full output. */
+int sentinelInstanceNeedsFullInfo(sentinelRedisInstance *ri, mstime_t now) {
+    if (ri->flags & SRI_NO_ROLE) return 1;
+    if (ri->info_full_refresh == 0 ||
+        now - ri->info_full_refresh > SENTINEL_INFO_FULL_PERIOD) return 1;
+    if (ri->flags & (SRI_S_DOWN|SRI_O_DOWN|SRI_FAILOVER_IN_PROGRESS|
+                     SRI_PROMOTED|SRI_RECONF_SENT|SRI_RECONF_INPROG|
+                     SRI_RECONF_DONE)) return 1;
+    if (ri->role_reported != (ri->flags & (SRI_MASTER|SRI_SLAVE))) return 1;
+    if (ri->flags & SRI_SLAVE) {
+        if (ri->master->flags & (SRI_O_DOWN|SRI_FAILOVER_IN_PROGRESS))
+            return 1;
+        if (ri->master_link_down_time != 0 ||
+            ri->slave_master_link_status != SENTINEL_MASTER_LINK_STATUS_UP)
+            return 1;
+    }
+    return 0;
+}
+
+/* Return true if the ROLE reply 'r' shows the instance exactly in the
+ * state we already know from the last INFO. */
+int sentinelRoleReplyMatchesState(sentinelRedisInstance *ri, redisReply *r) {
+    redisReply *role;
+    size_t j;
+
+    if (r->type != REDIS_REPLY_ARRAY || r->elements < 1) return 0;
+    role = r->element[0];
+    if (role->type != REDIS_REPLY_STRING) return 0;
+
+    if (ri->flags & SRI_MASTER) {
+        redisReply *slaves;
+
+        if (strcmp(role->str,"master") || r->elements != 3) return 0;
+        slaves = r->element[2];
+        if (slaves->type != REDIS_REPLY_ARRAY) return 0;
+
+        /* Every online replica must be already known. */
+        for (j = 0; j < slaves->elements; j++) {
+            redisReply *slave = slaves->element[j], *ip, *port;
+
+            if (slave->type != REDIS_REPLY_ARRAY || slave->elements < 2)
+                return 0;
+            ip = slave->element[0];
+            port = slave->element[1];
+            if (ip->type != REDIS_REPLY_STRING) return 0;
+            if (port->type != REDIS_REPLY_STRING &&
+                port->type != REDIS_REPLY_INTEGER) return 0;
+            if (sentinelRedisInstanceLookupSlave(ri,ip->str,
+                port->type == REDIS_REPLY_STRING ?
+                atoi(port->str) : (int)port->integer) == NULL) return 0;
+        }
+        return 1;
+    } else {
+        redisReply *host, *port, *state, *offset;
+
+        if (strcmp(role->str,"slave") || r->elements < 5) return 0;
+        host = r->element[1];
+        port = r->element[2];
+        state = r->element[3];
+        offset = r->element[4];
+        if (host->type != REDIS_REPLY_STRING ||
+            port->type != REDIS_REPLY_INTEGER ||
+            state->type != REDIS_REPLY_STRING ||
+            offset->type != REDIS_REPLY_INTEGER) return 0;
+
+        /* Same master we know from INFO, which is also the one we expect,
+         * and the replication link is up. */
+        if (ri->slave_master_host == NULL ||
+            strcasecmp(host->str,ri->slave_master_host) ||
+            port->integer != ri->slave_master_port ||
+            strcasecmp(host->str,ri->master->addr->ip) ||
+            port->integer != ri->master->addr->port ||
+            strcmp(state->str,"connected")) return 0;
+        ri->slave_repl_offset = offset->integer;
+        return 1;
+    }
+}
+
+/* Reply to the ROLE command sent instead of INFO. If the reply confirms
+ * what we already know, the INFO state is considered refreshed, otherwise
+ * we ask for the full INFO output immediately so that the usual code path
+ * handles the change. */
+void sentinelRoleReplyCallback(redisAsyncContext *c, void *reply, void *privdata) {
+    sentinelRedisInstance *ri = privdata;
+    instanceLink *link = c->data;
+    redisReply *r;
+
+    if (!reply || !link) return;
+    link->pending_commands--;
+    r = reply;
+
+    if (r->type == REDIS_REPLY_ERROR) {
+        /* Old instances or renamed/denied ROLE: stop using it. Transient
+         * errors are handled by the PING logic. */
+        if (strncmp(r->str,"LOADING",7) &&
+            strncmp(r->str,"BUSY",4) &&
+            strncmp(r->str,"MASTERDOWN",10))
+        {
+            ri->flags |= SRI_NO_ROLE;
+            sentinelSendInfo(ri);
+        }
+        return;
+    }
+
+    if (sentinelRoleReplyMatchesState(ri,r)) {
+        mstime_t now = mstime();
+        ri->info_refresh = now;
+
+        /* A valid reply is as good as a PONG: this allows to skip the next
+         * PING for this instance. */
+        link->last_avail_time = now;
+        link->act_ping_time = 0;
+        link->last_pong_time = now;
+    } else {
+        sentinelSendInfo(ri);
+    }
+}
+
 /* Just discard the reply. We use this when we are not monitoring the return
  * value of the command but its effects directly. */
 void sentinelDiscardReplyCallback(redisAsyncContext *c, void *reply, void *privdata) {
@@ -2772,6 +2923,31 @@ int sentinelSendPing(sentinelRedisInstance *ri) {
     }
 }
 
+/* PUBLISH is propagated to replicas, so the Hello messages we send to a
+ * master are also delivered to the subscribers of its replicas. When a
+ * replica is healthy and connected to the master we expect, publishing to
+ * it as well just doubles the Hello traffic every Sentinel has to process.
+ * We still publish directly as soon as something looks wrong, including
+ * not seeing any Pub/Sub traffic on the replica link for a while. */
+int sentinelHelloReachesSlaveViaMaster(sentinelRedisInstance *ri, mstime_t now) {
+    sentinelRedisInstance *master = ri->master;
+
+    if (!(ri->flags & SRI_SLAVE)) return 0;
+    if (ri->flags & (SRI_S_DOWN|SRI_PROMOTED|SRI_RECONF_SENT|
+                     SRI_RECONF_INPROG|SRI_RECONF_DONE)) return 0;
+    if (master->flags & (SRI_S_DOWN|SRI_O_DOWN|SRI_FAILOVER_IN_PROGRESS))
+        return 0;
+    if (master->link->disconnected) return 0;
+    if (ri->role_reported != SRI_SLAVE ||
+        ri->slave_master_link_status != SENTINEL_MASTER_LINK_STATUS_UP ||
+        ri->slave_master_host == NULL ||
+        strcasecmp(ri->slave_master_host,master->addr->ip) ||
+        ri->slave_master_port != master->addr->port) return 0;
+    if (now - ri->link->pc_last_activity > SENTINEL_PUBLISH_PERIOD*2)
+        return 0;
+    return 1;
+}
+
 /* Send periodic PING, INFO, and PUBLISH to the Hello channel to
  * the specified master or slave instance. */
 void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
@@ -2800,13 +2976,20 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
      * Similarly we monitor the INFO output more often if the slave reports
      * to be disconnected from the master, so that we can have a fresh
      * disconnection time figure. */
-    if ((ri->flags & SRI_SLAVE) &&
+    if ((ri->flags & SRI_PROMOTED) &&
+        ri->master->failover_state == SENTINEL_FAILOVER_STATE_WAIT_PROMOTION)
+    {
+        /* The failover can't progress until we see the promoted slave
+         * reporting the master role: every millisecond spent here is
+         * write unavailability, so poll it at every timer tick. */
+        info_period = SENTINEL_PROMOTION_INFO_PERIOD;
+    } else if ((ri->flags & SRI_SLAVE) &&
         ((ri->master->flags & (SRI_O_DOWN|SRI_FAILOVER_IN_PROGRESS)) ||
          (ri->master_link_down_time != 0)))
     {
         info_period = 1000;
     } else {
-        info_period = SENTINEL_INFO_PERIOD;
+        info_period = SENTINEL_INFO_PERIOD - ri->info_jitter;
     }
 
     /* We ping instances every time the last received pong is older than
@@ -2815,15 +2998,22 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
     ping_period = ri->down_after_period;
     if (ping_period > SENTINEL_PING_PERIOD) ping_period = SENTINEL_PING_PERIOD;
 
-    /* Send INFO to masters and slaves, not sentinels. */
+    /* Send INFO to masters and slaves, not sentinels. When the instance
+     * is in a steady state we just send ROLE, that is much cheaper to
+     * produce and to parse, and only fetch INFO again if ROLE reports
+     * something different, or every SENTINEL_INFO_FULL_PERIOD. */
     if ((ri->flags & SRI_SENTINEL) == 0 &&
         (ri->info_refresh == 0 ||
         (now - ri->info_refresh) > info_period))
     {
-        retval = redisAsyncCommand(ri->link->cc,
-            sentinelInfoReplyCallback, ri, "%s",
-            sentinelInstanceMapCommand(ri,"INFO"));
-        if (retval == C_OK) ri->link->pending_commands++;
+        if (sentinelInstanceNeedsFullInfo(ri,now)) {
+            sentinelSendInfo(ri);
+        } else {
+            retval = redisAsyncCommand(ri->link->cc,
+                sentinelRoleReplyCallback, ri, "%s",
+                sentinelInstanceMapCommand(ri,"ROLE"));
+            if (retval == C_OK) ri->link->pending_commands++;
+        }
     }
 
     /* Send PING to all the three kinds of instances. */
@@ -2833,7 +3023,9 @@ void sentinelSendPeriodicCommands(sentinelRedisInstance *ri) {
     }
 
     /* PUBLISH hello messages to all the three kinds of instances. */
-    if ((now - ri->last_pub_time) > SENTINEL_PUBLISH_PERIOD) {
+    if ((now - ri->last_pub_time) > SENTINEL_PUBLISH_PERIOD &&
+        !sentinelHelloReachesSlaveViaMaster(ri,now))
+    {
         sentinelSendHello(ri);
     }
 }
@@ -238,7 +238,7 @@ struct redisCommand redisCommandTable[] = {
     {"keys",keysCommand,2,"rS",0,NULL,0,0,0,0,0,0},
     {"scan",scanCommand,-2,"rR",0,NULL,0,0,0,0,0,0},
     {"dbsize",dbsizeCommand,1,"rF",0,NULL,0,0,0,0,0,0},
-    {"auth",authCommand,2,"sltF",0,NULL,0,0,0,0,0,0},
+    {"auth",authCommand,-2,"sltF",0,NULL,0,0,0,0,0,0},
     {"ping",pingCommand,-1,"tF",0,NULL,0,0,0,0,0,0},
     {"echo",echoCommand,2,"F",0,NULL,0,0,0,0,0,0},
     {"save",saveCommand,1,"as",0,NULL,0,0,0,0,0,0},
@@ -287,6 +287,7 @@ struct redisCommand redisCommandTable[] = {
     {"memory",memoryCommand,-2,"rR",0,NULL,0,0,0,0,0,0},
     {"client",clientCommand,-2,"as",0,NULL,0,0,0,0,0,0},
     {"hello",helloCommand,-2,"sF",0,NULL,0,0,0,0,0,0},
+    {"acl",aclCommand,-2,"ast",0,NULL,0,0,0,0,0,0},
     {"eval",evalCommand,-3,"s",0,evalGetKeys,0,0,0,0,0,0},
     {"evalsha",evalShaCommand,-3,"s",0,evalGetKeys,0,0,0,0,0,0},
     {"slowlog",slowlogCommand,-2,"aR",0,NULL,0,0,0,0,0,0},
@@ -302,6 +303,7 @@ struct redisCommand redisCommandTable[] = {
     {"georadius_ro",georadiusroCommand,-6,"r",0,georadiusGetKeys,1,1,1,0,0,0},
     {"georadiusbymember",georadiusbymemberCommand,-5,"w",0,georadiusGetKeys,1,1,1,0,0,0},
     {"georadiusbymember_ro",georadiusbymemberroCommand,-5,"r",0,georadiusGetKeys,1,1,1,0,0,0},
+    {"geosearch",geosearchCommand,-7,"r",0,NULL,1,1,1,0,0,0},
     {"geohash",geohashCommand,-2,"r",0,NULL,1,1,1,0,0,0},
     {"geopos",geoposCommand,-2,"r",0,NULL,1,1,1,0,0,0},
     {"geodist",geodistCommand,-4,"r",0,NULL,1,1,1,0,0,0},
@@ -778,12 +780,20 @@ int incrementallyRehash(int dbid) {
  * for dict.c to resize the hash tables accordingly to the fact we have o not
  * running childs. */
 void updateDictResizePolicy(void) {
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1)
+    if (!hasActiveChildProcess())
         dictEnableResize();
     else
         dictDisableResize();
 }
 
+/* Return true if there is a child saving the RDB, rewriting the AOF or
+ * serving a SCAN ASYNC. Only one of them can run at a time: the ones that
+ * find another child active are refused or scheduled for later. */
+int hasActiveChildProcess(void) {
+    return server.rdb_child_pid != -1 || server.aof_child_pid != -1 ||
+           server.scan_child_pid != -1;
+}
+
 /* ======================= Cron: called every 100 ms ======================== */
 
 /* Add a sample to the operations per second array of samples. */
@@ -1011,6 +1021,7 @@ void clientsCron(void) {
         // 释放多余输入缓冲区
         if (clientsCronResizeQueryBuffer(c)) continue;
         if (clientsCronTrackExpansiveClients(c)) continue;
+        updateClientMemUsage(c);
     }
 }
 
@@ -1247,12 +1258,14 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * a BGSAVE was in progress. */
     // 如果 BGSAVE 和 BGREWRITEAOF 都没有在执行
     // 并且有一个 BGREWRITEAOF 在等待，那么执行 BGREWRITEAOF
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
-        server.aof_rewrite_scheduled)
-    {
+    if (!hasActiveChildProcess() && server.aof_rewrite_scheduled) {
         rewriteAppendOnlyFileBackground();
     }
 
+    /* Reap the background SCAN child and resume its job if it was paused
+     * waiting for a slow client. */
+    scanJobCron();
+
     /* Check if a background saving or AOF rewrite in progress terminated. */
     // 检查后台 RDB 和 AOF 是否已经终止
     if (server.rdb_child_pid != -1 || server.aof_child_pid != -1 ||
@@ -1280,6 +1293,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             } else if (pid == server.aof_child_pid) {
                 backgroundRewriteDoneHandler(exitcode,bysignal);
                 if (!bysignal && exitcode == 0) receiveChildInfo();
+            } else if (pid == server.scan_child_pid) {
+                scanJobChildDone(exitcode,bysignal);
             } else {
                 if (!ldbRemoveChild(pid)) {
                     serverLog(LL_WARNING,
@@ -1290,9 +1305,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             updateDictResizePolicy();
             closeChildInfoPipe();
         }
-    } else {
-        /* If there is not a background saving/rewrite in progress check if
-         * we have to save/rewrite now. */
+    } else if (server.scan_child_pid == -1) {
+        /* If there is not a background saving/rewrite/SCAN in progress
+         * check if we have to save/rewrite now. */
         for (j = 0; j < server.saveparamslen; j++) {
             struct saveparam *sp = server.saveparams+j;
 
@@ -1379,8 +1394,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * Note: this code must be after the replicationCron() call above so
      * make sure when refactoring this file to keep this order. This is useful
      * because we want to give priority to RDB savings for replication. */
-    if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
-        server.rdb_bgsave_scheduled &&
+    if (!hasActiveChildProcess() && server.rdb_bgsave_scheduled &&
         (server.unixtime-server.lastbgsave_try > CONFIG_BGSAVE_RETRY_DELAY ||
          server.lastbgsave_status == C_OK))
     {
@@ -1439,12 +1453,25 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
 
+    /* Send the invalidation messages to clients participating to the
+     * client side caching protocol in broadcasting (BCAST) mode, and make
+     * sure the tracking table stays within 'tracking-table-max-keys'. */
+    trackingBroadcastInvalidationMessages();
+    trackingLimitUsedSlots();
+
+    /* Deliver the keyspace events accumulated for the batched stream. */
+    flushKeyEventsBatch();
+
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWrites();
 
+    /* Close the biggest clients if they are using more memory than
+     * maxmemory-clients. */
+    evictClients();
+
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
      * time. */
@@ -1642,11 +1669,19 @@ void initServerConfig(void) {
     server.activerehashing = CONFIG_DEFAULT_ACTIVE_REHASHING;
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
+    server.notify_keyspace_prefixes = NULL;
+    server.notify_prefixes = NULL;
+    server.notify_prefixes_count = 0;
+    server.notify_keyspace_subscribers = 0;
+    server.notify_keyevent_subscribers = 0;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
     server.blocked_clients = 0;
     memset(server.blocked_clients_by_type,0,
            sizeof(server.blocked_clients_by_type));
     server.maxmemory = CONFIG_DEFAULT_MAXMEMORY;
+    server.maxmemory_clients = CONFIG_DEFAULT_MAXMEMORY_CLIENTS;
+    server.tracking_clients = 0;
+    server.tracking_table_max_keys = CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS;
     server.maxmemory_policy = CONFIG_DEFAULT_MAXMEMORY_POLICY;
     server.maxmemory_samples = CONFIG_DEFAULT_MAXMEMORY_SAMPLES;
     server.lfu_log_factor = CONFIG_DEFAULT_LFU_LOG_FACTOR;
@@ -1668,6 +1703,7 @@ void initServerConfig(void) {
     server.cluster_slave_validity_factor = CLUSTER_DEFAULT_SLAVE_VALIDITY;
     server.cluster_require_full_coverage = CLUSTER_DEFAULT_REQUIRE_FULL_COVERAGE;
     server.cluster_slave_no_failover = CLUSTER_DEFAULT_SLAVE_NO_FAILOVER;
+    server.cluster_fast_failover = CLUSTER_DEFAULT_FAST_FAILOVER;
     server.cluster_configfile = zstrdup(CONFIG_DEFAULT_CLUSTER_CONFIG_FILE);
     server.cluster_announce_ip = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_IP;
     server.cluster_announce_port = CONFIG_DEFAULT_CLUSTER_ANNOUNCE_PORT;
@@ -1679,6 +1715,9 @@ void initServerConfig(void) {
     server.lazyfree_lazy_eviction = CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION;
     server.lazyfree_lazy_expire = CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE;
     server.lazyfree_lazy_server_del = CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL;
+    server.lazyfree_lazy_overwrite = CONFIG_DEFAULT_LAZYFREE_LAZY_OVERWRITE;
+    server.key_index = CONFIG_DEFAULT_KEY_INDEX;
+    server.lazyfree_threads = CONFIG_DEFAULT_LAZYFREE_THREADS;
     server.always_show_logo = CONFIG_DEFAULT_ALWAYS_SHOW_LOGO;
     server.lua_time_limit = LUA_SCRIPT_TIME_LIMIT;
 
@@ -2036,6 +2075,7 @@ void resetServerStats(void) {
     server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
     server.stat_evictedkeys = 0;
+    server.stat_evictedclients = 0;
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_active_defrag_hits = 0;
@@ -2083,6 +2123,9 @@ void initServer(void) {
     server.monitors = listCreate();
     server.clients_pending_write = listCreate();
     server.slaveseldb = -1; /* Force to emit the first SELECT command. */
+    server.propagate_batch = 0;
+    server.propagate_batch_aof = sdsempty();
+    server.propagate_batch_repl = sdsempty();
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
@@ -2131,19 +2174,29 @@ void initServer(void) {
         server.db[j].expires = dictCreate(&keyptrDictType,NULL);
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
-        server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].watch_versions = NULL;
+        server.db[j].watched_keys_count = 0;
+        server.db[j].flush_version = 0;
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].defrag_later = listCreate();
+        server.db[j].key_index = server.key_index ? raxNew() : NULL;
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     listSetFreeMethod(server.pubsub_patterns,freePubsubPattern);
     listSetMatchMethod(server.pubsub_patterns,listMatchPubsubPattern);
+    server.keyevents_clients = listCreate();
     server.cronloops = 0;
     server.rdb_child_pid = -1;
     server.aof_child_pid = -1;
+    server.scan_child_pid = -1;
+    server.scan_pipe_fd = -1;
+    server.scan_paused = 0;
+    server.scan_client_id = 0;
+    server.scan_buf = NULL;
+    server.scan_matched = 0;
     server.rdb_child_type = RDB_CHILD_TYPE_NONE;
     server.rdb_bgsave_scheduled = 0;
     server.child_info_pipe[0] = -1;
@@ -2160,6 +2213,7 @@ void initServer(void) {
     /* A few stats we don't want to reset: server startup time, and peak mem. */
     server.stat_starttime = time(NULL);
     server.stat_peak_memory = 0;
+    server.stat_clients_memory = 0;
     server.stat_rdb_cow_bytes = 0;
     server.stat_aof_cow_bytes = 0;
     server.cron_malloc_stats.zmalloc_used = 0;
@@ -2228,7 +2282,6 @@ void initServer(void) {
     if (server.cluster_enabled) clusterInit();
     replicationScriptCacheInit();
     scriptingInit(1);
-    ACLInit();
     slowlogInit();
     latencyMonitorInit();
     bioInit();
@@ -2473,7 +2526,7 @@ void preventCommandReplication(client *c) {
 // 真正的执行一条指令
 void call(client *c, int flags) {
     long long dirty, start, duration;
-    int client_old_flags = c->flags;   //备份client的flags
+    uint64_t client_old_flags = c->flags;   //备份client的flags
     struct redisCommand *real_cmd = c->cmd;
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
@@ -2501,6 +2554,19 @@ void call(client *c, int flags) {
     dirty = server.dirty-dirty;  // 修改键个数
     if (dirty < 0) dirty = 0;    // 防止出错
 
+    /* If the client has keys tracking enabled for client side caching,
+     * make sure to remember the keys it fetched via this command. Keys
+     * read by a script are attributed to the client calling EVAL. */
+    if (c->cmd->flags & CMD_READONLY) {
+        client *caller = (c->flags & CLIENT_LUA && server.lua_caller) ?
+                            server.lua_caller : c;
+        if (caller->flags & CLIENT_TRACKING &&
+            !(caller->flags & CLIENT_TRACKING_BCAST))
+        {
+            trackingRememberKeys(caller);
+        }
+    }
+
     /* When EVAL is called loading the AOF we don't want commands called
      * from Lua to go into the slowlog or to populate statistics. */
     if (server.loading && c->flags & CLIENT_LUA)
@@ -2646,15 +2712,32 @@ int processCommand(client *c) {
 
     /* Check if the user is authenticated */
     // 判断客户端是否认证成功，（authCommand，helloCommand 确保不是认证命令）
-    if (server.requirepass &&
-        !c->authenticated &&
-        (c->cmd->proc != authCommand || c->cmd->proc == helloCommand))
+    int auth_required = ACLDefaultUserRequiresAuth() && !c->authenticated;
+    if (auth_required &&
+        c->cmd->proc != authCommand &&
+        c->cmd->proc != helloCommand)
     {
         flagTransaction(c);
         addReply(c,shared.noautherr);
         return C_OK;
     }
 
+    /* Check if the user can run this command according to the current
+     * ACLs. */
+    int acl_retval = ACLCheckCommandPerm(c);
+    if (acl_retval != ACL_OK) {
+        flagTransaction(c);
+        if (acl_retval == ACL_DENIED_CMD)
+            addReplyErrorFormat(c,
+                "-NOPERM this user has no permissions to run "
+                "the '%s' command", c->cmd->name);
+        else
+            addReplyErrorFormat(c,
+                "-NOPERM this user has no permissions to access "
+                "one of the keys used as arguments");
+        return C_OK;
+    }
+
     /* If cluster is enabled perform the cluster redirection here.
      * However we don't perform the redirection if:
      * 1) The sender of this command is our master.
@@ -2853,13 +2936,16 @@ int prepareForShutdown(int flags) {
     /* Kill all the Lua debugger forked sessions. */
     ldbKillForkedSessions();
 
+    /* Kill the background SCAN child, nobody is going to read its output. */
+    killScanJob();
+
     /* Kill the saving child if there is a background saving in progress.
        We want to avoid race conditions, for instance our saving child may
        overwrite the synchronous saving did by SHUTDOWN. */
     if (server.rdb_child_pid != -1) {
         serverLog(LL_WARNING,"There is a child saving an .rdb. Killing it!");
         kill(server.rdb_child_pid,SIGUSR1);
-        rdbRemoveTempFile(server.rdb_child_pid);
+        rdbRemoveTempFile(server.rdb_child_pid,0);
     }
 
     if (server.aof_state != AOF_OFF) {
@@ -2876,8 +2962,11 @@ int prepareForShutdown(int flags) {
                 "There is a child rewriting the AOF. Killing it!");
             kill(server.aof_child_pid,SIGUSR1);
         }
-        /* Append only file: flush buffers and fsync() the AOF at exit */
+        /* Append only file: flush buffers and fsync() the AOF at exit.
+         * If we are executing a transaction (SHUTDOWN inside MULTI/EXEC)
+         * the commands executed so far are still in the EXEC batch. */
         serverLog(LL_NOTICE,"Calling fsync() on the AOF file.");
+        if (server.propagate_batch) execPropagateBatchFlush();
         flushAppendOnlyFile(1);
         redis_fsync(server.aof_fd);
     }
@@ -2944,16 +3033,45 @@ int writeCommandsDeniedByDiskError(void) {
     }
 }
 
+/* AUTH <password>
+ * AUTH <username> <password>
+ *
+ * The first form authenticates against the "default" user, whose password
+ * is set by the "requirepass" option. */
 void authCommand(client *c) {
-    if (!server.requirepass) {
-        addReplyError(c,"Client sent AUTH, but no password is set");
-    } else if (ACLCheckUserCredentials(NULL,c->argv[1]) == C_OK) {
-      c->authenticated = 1;
-      addReply(c,shared.ok);
+    robj *username, *password;
+
+    if (c->argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    if (c->argc == 2) {
+        if (!ACLDefaultUserRequiresAuth()) {
+            addReplyError(c,"Client sent AUTH, but no password is set");
+            return;
+        }
+        username = createStringObject("default",7);
+        password = c->argv[1];
+    } else {
+        username = c->argv[1];
+        password = c->argv[2];
+    }
+
+    if (ACLCheckUserCredentials(username,password) == C_OK) {
+        c->authenticated = 1;
+        c->user = ACLGetUserByName(username->ptr,sdslen(username->ptr));
+        addReply(c,shared.ok);
     } else {
-      c->authenticated = 0;
-      addReplyError(c,"invalid password");
+        c->authenticated = 0;
+        c->user = DefaultUser;
+        if (c->argc == 2)
+            addReplyError(c,"invalid password");
+        else
+            addReplyError(c,"-WRONGPASS invalid username-password pair");
     }
+
+    if (c->argc == 2) decrRefCount(username);
 }
 
 /* The PING command. It works in a different way if the client is in
@@ -3229,10 +3347,12 @@ sds genRedisInfoString(char *section) {
             "connected_clients:%lu\r\n"
             "client_recent_max_input_buffer:%zu\r\n"
             "client_recent_max_output_buffer:%zu\r\n"
-            "blocked_clients:%d\r\n",
+            "blocked_clients:%d\r\n"
+            "tracking_clients:%d\r\n",
             listLength(server.clients)-listLength(server.slaves),
             maxin, maxout,
-            server.blocked_clients);
+            server.blocked_clients,
+            server.tracking_clients);
     }
 
     /* Memory */
@@ -3249,6 +3369,9 @@ sds genRedisInfoString(char *section) {
         const char *evict_policy = evictPolicyToString();
         long long memory_lua = (long long)lua_gc(server.lua,LUA_GCCOUNT,0)*1024;
         struct redisMemOverhead *mh = getMemoryOverheadData();
+        bioStats lazyfree_stats;
+
+        bioGetStatsOfType(BIO_LAZY_FREE,&lazyfree_stats);
 
         /* Peak memory is updated from time to time by serverCron() so it
          * may happen that the instantaneous value is slightly bigger than
@@ -3292,6 +3415,8 @@ sds genRedisInfoString(char *section) {
             "maxmemory:%lld\r\n"
             "maxmemory_human:%s\r\n"
             "maxmemory_policy:%s\r\n"
+            "maxmemory_clients:%llu\r\n"
+            "mem_clients_total:%zu\r\n"
             "allocator_frag_ratio:%.2f\r\n"
             "allocator_frag_bytes:%zu\r\n"
             "allocator_rss_ratio:%.2f\r\n"
@@ -3304,10 +3429,17 @@ sds genRedisInfoString(char *section) {
             "mem_replication_backlog:%zu\r\n"
             "mem_clients_slaves:%zu\r\n"
             "mem_clients_normal:%zu\r\n"
+            "mem_reply_blocks_cached:%zu\r\n"
             "mem_aof_buffer:%zu\r\n"
             "mem_allocator:%s\r\n"
             "active_defrag_running:%d\r\n"
-            "lazyfree_pending_objects:%zu\r\n",
+            "lazyfree_pending_objects:%zu\r\n"
+            "lazyfree_freed_objects:%zu\r\n"
+            "lazyfree_threads:%d\r\n"
+            "lazyfree_pending_jobs:%llu\r\n"
+            "lazyfree_processed_jobs:%llu\r\n"
+            "lazyfree_avg_queue_latency_usec:%llu\r\n"
+            "lazyfree_max_queue_latency_usec:%llu\r\n",
             zmalloc_used,
             hmem,
             server.cron_malloc_stats.process_rss,
@@ -3332,6 +3464,8 @@ sds genRedisInfoString(char *section) {
             server.maxmemory,
             maxmemory_hmem,
             evict_policy,
+            server.maxmemory_clients,
+            server.stat_clients_memory,
             mh->allocator_frag,
             mh->allocator_frag_bytes,
             mh->allocator_rss,
@@ -3344,10 +3478,17 @@ sds genRedisInfoString(char *section) {
             mh->repl_backlog,
             mh->clients_slaves,
             mh->clients_normal,
+            replyBlockPoolMemory(),
             mh->aof_buffer,
             ZMALLOC_LIB,
             server.active_defrag_running,
-            lazyfreeGetPendingObjectsCount()
+            lazyfreeGetPendingObjectsCount(),
+            lazyfreeGetFreedObjectsCount(),
+            lazyfree_stats.threads,
+            lazyfree_stats.pending,
+            lazyfree_stats.processed,
+            lazyfree_stats.avg_wait_usec,
+            lazyfree_stats.max_wait_usec
         );
         freeMemoryOverheadData(mh);
     }
@@ -3462,6 +3603,7 @@ sds genRedisInfoString(char *section) {
             "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "evicted_keys:%lld\r\n"
+            "evicted_clients:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
             "pubsub_channels:%ld\r\n"
@@ -3472,7 +3614,10 @@ sds genRedisInfoString(char *section) {
             "active_defrag_hits:%lld\r\n"
             "active_defrag_misses:%lld\r\n"
             "active_defrag_key_hits:%lld\r\n"
-            "active_defrag_key_misses:%lld\r\n",
+            "active_defrag_key_misses:%lld\r\n"
+            "tracking_total_keys:%llu\r\n"
+            "tracking_total_items:%llu\r\n"
+            "tracking_total_prefixes:%llu\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -3488,6 +3633,7 @@ sds genRedisInfoString(char *section) {
             server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_evictedkeys,
+            server.stat_evictedclients,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
             dictSize(server.pubsub_channels),
@@ -3498,7 +3644,10 @@ sds genRedisInfoString(char *section) {
             server.stat_active_defrag_hits,
             server.stat_active_defrag_misses,
             server.stat_active_defrag_key_hits,
-            server.stat_active_defrag_key_misses);
+            server.stat_active_defrag_key_misses,
+            (unsigned long long) trackingGetTotalKeys(),
+            (unsigned long long) trackingGetTotalItems(),
+            (unsigned long long) trackingGetTotalPrefixes());
     }
 
     /* Replication */
@@ -3852,7 +4001,7 @@ static void sigShutdownHandler(int sig) {
      * on disk. */
     if (server.shutdown_asap && sig == SIGINT) {
         serverLogFromHandler(LL_WARNING, "You insist... exiting now.");
-        rdbRemoveTempFile(getpid());
+        rdbRemoveTempFile(getpid(),1);
         exit(1); /* Exit with an error since this was not a clean shutdown. */
     } else if (server.loading) {
         exit(0);
@@ -4080,6 +4229,18 @@ int main(int argc, char **argv) {
             return crc64Test(argc, argv);
         } else if (!strcasecmp(argv[2], "zmalloc")) {
             return zmalloc_test(argc, argv);
+        } else if (!strcasecmp(argv[2], "ae")) {
+            return aeTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "acl")) {
+            return aclTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "replyblocks")) {
+            return replyBlockTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "rdbtransform")) {
+            return rdbTransformTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "multi")) {
+            return multiTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "geo")) {
+            return geoTest(argc, argv);
         }
 
         return -1; /* test not found */
@@ -4108,6 +4269,8 @@ int main(int argc, char **argv) {
     server.sentinel_mode = checkForSentinelMode(argc,argv);
     // 初始化服务器配置，server 是一个全局变量
     initServerConfig();
+    ACLInit(); /* The ACL subsystem must be initialized ASAP because the
+                  basic networking code and client creation depends on it. */
     moduleInitModulesSystem();
 
     /* Store the executable path and arguments in a safe place in order
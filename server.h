@@ -98,6 +98,7 @@ typedef long long mstime_t; /* millisecond time type. */
 #define AOF_REWRITE_MIN_SIZE (64*1024*1024)
 #define AOF_REWRITE_ITEMS_PER_CMD 64
 #define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
+#define WATCH_VERSIONS_SLOTS (1<<18) /* Version slots of DBs with WATCHed keys. */
 #define CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN 10000
 #define CONFIG_DEFAULT_SLOWLOG_MAX_LEN 128
 #define CONFIG_DEFAULT_MAX_CLIENTS 10000
@@ -136,6 +137,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_SLAVE_ANNOUNCE_PORT 0
 #define CONFIG_DEFAULT_REPL_DISABLE_TCP_NODELAY 0
 #define CONFIG_DEFAULT_MAXMEMORY 0
+#define CONFIG_DEFAULT_MAXMEMORY_CLIENTS 0
+#define CONFIG_DEFAULT_TRACKING_TABLE_MAX_KEYS 1000000 /* Keys tracked for
+                                                          client caching. */
 #define CONFIG_DEFAULT_MAXMEMORY_SAMPLES 5
 #define CONFIG_DEFAULT_LFU_LOG_FACTOR 10
 #define CONFIG_DEFAULT_LFU_DECAY_TIME 1
@@ -157,6 +161,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EVICTION 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_EXPIRE 0
 #define CONFIG_DEFAULT_LAZYFREE_LAZY_SERVER_DEL 0
+#define CONFIG_DEFAULT_LAZYFREE_LAZY_OVERWRITE 1
+#define CONFIG_DEFAULT_LAZYFREE_THREADS 1
+#define CONFIG_DEFAULT_KEY_INDEX 0
 #define CONFIG_DEFAULT_ALWAYS_SHOW_LOGO 0
 #define CONFIG_DEFAULT_ACTIVE_DEFRAG 0
 #define CONFIG_DEFAULT_DEFRAG_THRESHOLD_LOWER 10 /* don't defrag when fragmentation is below 10% */
@@ -173,6 +180,11 @@ typedef long long mstime_t; /* millisecond time type. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW 0
 #define ACTIVE_EXPIRE_CYCLE_FAST 1
 
+/* SCAN */
+#define SCAN_TIME_BUDGET_USEC 1000 /* Max time of a single SCAN call. */
+#define SCAN_TIME_CHECK_MASK 63    /* Check the clock every 64 buckets. */
+#define SCAN_JOB_DEFAULT_BATCH 1000 /* Keys per push message in SCAN ASYNC */
+
 /* Instantaneous metrics tracking. */
 #define STATS_METRIC_SAMPLES 16     /* Number of samples per metric. */
 #define STATS_METRIC_COMMAND 0      /* Number of commands executed. */
@@ -261,6 +273,12 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CLIENT_LUA_DEBUG_SYNC (1<<26)  /* EVAL debugging without fork() */
 #define CLIENT_MODULE (1<<27) /* Non connected client used by some module. */
 #define CLIENT_PROTECTED (1<<28) /* Client should not be freed for now. */
+#define CLIENT_TRACKING (1<<29)    /* Client enabled keys tracking in order to
+                                      perform client side caching. */
+#define CLIENT_TRACKING_BROKEN_REDIR (1<<30) /* Target client is invalid. */
+#define CLIENT_TRACKING_BCAST (1ULL<<31) /* Tracking in broadcasting mode. */
+#define CLIENT_KEYEVENTS (1ULL<<32) /* Receives the batched keyspace events
+                                       stream, see CLIENT KEYEVENTS. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -496,6 +514,7 @@ typedef long long mstime_t; /* millisecond time type. */
 struct RedisModule;
 struct RedisModuleIO;
 struct RedisModuleDigest;
+struct RedisModuleDefragCtx;
 struct RedisModuleCtx;
 struct redisObject;
 
@@ -509,6 +528,10 @@ typedef void (*moduleTypeRewriteFunc)(struct RedisModuleIO *io, struct redisObje
 typedef void (*moduleTypeDigestFunc)(struct RedisModuleDigest *digest, void *value);
 typedef size_t (*moduleTypeMemUsageFunc)(const void *value);
 typedef void (*moduleTypeFreeFunc)(void *value);
+typedef int (*moduleTypeSaveChunkFunc)(struct RedisModuleIO *io, void *value, void **cursor);
+typedef int (*moduleTypeRewriteChunkFunc)(struct RedisModuleIO *io, struct redisObject *key, void *value, void **cursor);
+typedef size_t (*moduleTypeFreeEffortFunc)(const void *value);
+typedef int (*moduleTypeDefragFunc)(struct RedisModuleDefragCtx *ctx, void **value);
 
 /* The module type, which is referenced in each value of a given type, defines
  * the methods and links to the module exporting the type. */
@@ -521,6 +544,11 @@ typedef struct RedisModuleType {
     moduleTypeMemUsageFunc mem_usage;
     moduleTypeDigestFunc digest;
     moduleTypeFreeFunc free;
+    moduleTypeSaveChunkFunc rdb_save_chunk;     /* Optional incremental save. */
+    moduleTypeRewriteChunkFunc aof_rewrite_chunk; /* Optional incremental
+                                                     AOF rewrite. */
+    moduleTypeFreeEffortFunc free_effort;
+    moduleTypeDefragFunc defrag;
     char name[10]; /* 9 bytes name + null term. Charset: A-Z a-z 0-9 _- */
 } moduleType;
 
@@ -584,6 +612,14 @@ typedef struct RedisModuleDigest {
     memset(mdvar.x,0,sizeof(mdvar.x)); \
 } while(0);
 
+/* Context passed to the defrag method of module data types. The module
+ * calls RedisModule_DefragAlloc() for every allocation it owns, and we just
+ * count how many of them were actually moved, in order to update the
+ * active defrag stats like we do for the native types. */
+typedef struct RedisModuleDefragCtx {
+    long defragged;         /* Number of reallocated pointers. */
+} RedisModuleDefragCtx;
+
 /* Objects encoding. Some kind of objects like Strings and Hashes can be
  * internally represented in multiple ways. The 'encoding' field of the object
  * is set to one of this fields for this object. */
@@ -651,14 +687,19 @@ typedef struct redisDb {
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     // 可以解除阻塞的键
     dict *ready_keys;           /* Blocked keys that received a PUSH */
-    // 正在被 watch 监视的键
-    dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    // 被 watch 监视的键的版本号，首次有键被监视时分配，之后一直保留
+    uint32_t *watch_versions;   /* Version of the WATCHed keys slots, NULL
+                                   if no key was ever WATCHed in this DB. */
+    unsigned long watched_keys_count; /* Number of WATCHed keys in this DB. */
+    uint64_t flush_version;     /* Incremented on FLUSHDB / FLUSHALL. */
     // 数据库号码
     int id;                     /* Database ID */
     // 数据库的键的平均 TTL，统计信息
     long long avg_ttl;          /* Average TTL, just for stats */
     // 逐渐尝试逐个碎片整理的键名列表
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
+    rax *key_index;             /* Ordered index of the key names, NULL
+                                   unless 'key-index' is enabled. */
 } redisDb;
 
 /* Client MULTI/EXEC state */
@@ -678,6 +719,7 @@ typedef struct multiState {
     multiCmd *commands;     /* Array of MULTI commands */
     // 已入队命令计数
     int count;              /* Total number of MULTI commands */
+    int alloc;              /* Number of slots allocated in 'commands'. */
     int cmd_flags;          /* The accumulated command flags OR-ed together.
                                So if at least a command has a given flag, it
                                will be set in this field. */
@@ -737,7 +779,11 @@ typedef struct readyList {
 #define USER_MAX_COMMAND_BIT 1024
 #define USER_FLAG_ENABLED (1<<0)        /* The user is active. */
 #define USER_FLAG_ALLKEYS (1<<1)        /* The user can mention any key. */
+#define USER_FLAG_ALLCOMMANDS (1<<2)    /* The user can run all commands. */
+#define USER_FLAG_NOPASS (1<<3)         /* The user requires no password, any
+                                           provided password will work. */
 typedef struct user {
+    sds name;       /* The username as an SDS string. */
     uint64_t flags; /* See USER_FLAG_* */
 
     /* The bit in allowed_commands is set if this user has the right to
@@ -759,8 +805,25 @@ typedef struct user {
     list *patterns;  /* A list of allowed key patterns. If this field is NULL
                         the user cannot mention any key in a command, unless
                         the flag ALLKEYS is set in the user. */
+
+    /* The patterns above are compiled into a matcher that avoids calling
+     * stringmatchlen() for every pattern and every key. Patterns without
+     * glob characters ("user:1000") and patterns that are a literal prefix
+     * followed by a single trailing star ("user:*") are stored in the
+     * key_prefixes radix tree, the value being a bitmask of ACL_KEY_EXACT
+     * and ACL_KEY_PREFIX. Since a key can only match a prefix of one of the
+     * lengths in key_prefix_lens (sorted ascending), checking a key costs
+     * one radix tree lookup per distinct prefix length. Everything else ends
+     * in the key_globs list and is matched the slow way. */
+    rax *key_prefixes;
+    size_t *key_prefix_lens;
+    size_t key_prefix_lens_count;
+    list *key_globs;
 } user;
 
+#define ACL_KEY_EXACT (1<<0)
+#define ACL_KEY_PREFIX (1<<1)
+
 /* With multiplexing we need to take per-client state.
  * Clients are taken in a linked list. */
 // 客户端使用一个链表进行连接
@@ -787,12 +850,14 @@ typedef struct client {
     // 要发送到客户端的回复对象列表
     list *reply;            /* List of reply objects to send to the client. */
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */
+    size_t argv_len_sum;    /* Sum of the lengths of the objects in argv. */
+    size_t last_memory_usage; /* Memory accounted in the clients budget. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
     time_t lastinteraction; /* Time of the last interaction, used for timeout */
     time_t obuf_soft_limit_reached_time;
-    int flags;              /* Client flags: CLIENT_* macros. */
+    uint64_t flags;         /* Client flags: CLIENT_* macros. */
     int authenticated;      /* When requirepass is non-NULL. */
     int replstate;          /* Replication state if this is a slave. */
     int repl_put_online_on_ack; /* Install slave write handler on ACK. */
@@ -823,6 +888,13 @@ typedef struct client {
     sds peerid;             /* Cached peer ID. */
     listNode *client_list_node; /* list node in client list */
 
+    /* Client side caching: when the client has CLIENT_TRACKING set, this is
+     * the ID of the client receiving its invalidation messages, or zero to
+     * send them to the client itself. */
+    uint64_t client_tracking_redirection;
+    rax *client_tracking_prefixes; /* A dictionary of prefixes we are already
+                                      subscribed to in BCAST mode. */
+
     /* Response buffer */
     // 回复缓冲区
     int bufpos;
@@ -1080,6 +1152,9 @@ struct redisServer {
     double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
+    long long stat_evictedclients;  /* Clients closed by maxmemory-clients */
+    size_t stat_clients_memory;     /* Memory accounted to clients, see
+                                       updateClientMemUsage(). */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
     long long stat_active_defrag_hits;      /* number of allocations moved */
@@ -1192,8 +1267,20 @@ struct redisServer {
         size_t cow_size;            /* Copy on write size. */
         unsigned long long magic;   /* Magic value to make sure data is valid. */
     } child_info_data;
+    /* Background SCAN (SCAN ... ASYNC) */
+    pid_t scan_child_pid;           /* PID of the SCAN child or -1. */
+    int scan_pipe_fd;               /* Pipe the child writes keys into. */
+    int scan_paused;                /* Not reading the pipe: client is slow. */
+    uint64_t scan_client_id;        /* Client receiving the keys. */
+    sds scan_buf;                   /* Partial batch read from the pipe. */
+    long long scan_matched;         /* Keys sent to the client so far. */
     /* Propagation of commands in AOF / replication */
     redisOpArray also_propagate;    /* Additional command to propagate. */
+    int propagate_batch;            /* If true propagate() accumulates the
+                                       protocol in the two buffers below,
+                                       see execPropagateBatchBegin(). */
+    sds propagate_batch_aof;        /* Pending AOF protocol of the batch. */
+    sds propagate_batch_repl;       /* Pending replication protocol. */
     /* Logging */
     char *logfile;                  /* Path of log file */
     int syslog_enabled;             /* Is syslog enabled? */
@@ -1266,6 +1353,7 @@ struct redisServer {
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */
     unsigned long long maxmemory;   /* Max number of memory bytes to use */
+    unsigned long long maxmemory_clients; /* Memory budget of all clients. */
     int maxmemory_policy;           /* 最大使用内存 Policy for key eviction */
     int maxmemory_samples;          /* Pricision of random sampling */
     int lfu_log_factor;             /* LFU logarithmic counter factor. */
@@ -1304,6 +1392,18 @@ struct redisServer {
     list *pubsub_patterns;  /* A list of pubsub_patterns */
     int notify_keyspace_events; /* Events to propagate via Pub/Sub. This is an
                                    xor of NOTIFY_... flags. */
+    char *notify_keyspace_prefixes; /* Only keys with these prefixes are
+                                       notified, NULL for all the keys. */
+    sds *notify_prefixes;       /* The prefixes above, already split. */
+    int notify_prefixes_count;  /* Number of elements of notify_prefixes. */
+    long notify_keyspace_subscribers; /* Subscriptions that may match
+                                         __keyspace@... channels. */
+    long notify_keyevent_subscribers; /* Same for __keyevent@... */
+    list *keyevents_clients;    /* Clients of the batched events stream. */
+    /* Client side caching. */
+    unsigned int tracking_clients;  /* # of clients with tracking enabled.*/
+    long long tracking_table_max_keys; /* Max number of keys in the
+                                          tracking table, 0 = no limit. */
     /* Cluster */
     int cluster_enabled;      /* Is cluster enabled? */
     mstime_t cluster_node_timeout; /* Cluster node timeout. */
@@ -1315,6 +1415,8 @@ struct redisServer {
                                           there is at least an uncovered slot.*/
     int cluster_slave_no_failover;  /* Prevent slave from starting a failover
                                        if the master is in failure state. */
+    int cluster_fast_failover;      /* Detect refused nodes early and shorten
+                                       the slave election delays. */
     char *cluster_announce_ip;  /* IP address to announce on cluster bus. */
     int cluster_announce_port;     /* base port to announce on cluster bus. */
     int cluster_announce_bus_port; /* bus port to announce on cluster bus. */
@@ -1345,6 +1447,10 @@ struct redisServer {
     int lazyfree_lazy_eviction;
     int lazyfree_lazy_expire;
     int lazyfree_lazy_server_del;
+    int lazyfree_lazy_overwrite;
+    /* Ordered key index */
+    int key_index;                  /* Index key names for prefix lookups. */
+    int lazyfree_threads;       /* Number of threads releasing objects. */
     /* Latency monitor */
     long long latency_monitor_threshold;
     dict *latency_events;
@@ -1507,6 +1613,10 @@ size_t moduleCount(void);
 void moduleAcquireGIL(void);
 void moduleReleaseGIL(void);
 void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
+void moduleTypeSaveValue(RedisModuleIO *io, moduleValue *mv);
+void moduleTypeRewriteValue(RedisModuleIO *io, robj *key, moduleValue *mv);
+size_t moduleTypeFreeEffort(moduleValue *mv);
+long moduleTypeDefragValue(moduleValue *mv);
 
 
 /* Utils */
@@ -1521,6 +1631,7 @@ void redisSetProcTitle(char *title);
 
 /* networking.c -- Networking and Client related operations */
 client *createClient(int fd);
+client *lookupClientByID(uint64_t id);
 void closeTimedoutClients(void);
 void freeClient(client *c);
 void freeClientAsync(client *c);
@@ -1567,6 +1678,10 @@ void copyClientOutputBuffer(client *dst, client *src);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
+size_t replyBlockPoolMemory(void);
+#ifdef REDIS_TEST
+int replyBlockTest(int argc, char **argv);
+#endif
 void *dupClientReplyValue(void *o);
 void getClientsMaxBuffers(unsigned long *longest_output_list,
                           unsigned long *biggest_input_buffer);
@@ -1577,6 +1692,9 @@ void rewriteClientCommandVector(client *c, int argc, ...);
 void rewriteClientCommandArgument(client *c, int i, robj *newval);
 void replaceClientCommandVector(client *c, int argc, robj **argv);
 unsigned long getClientOutputBufferMemoryUsage(client *c);
+size_t getClientMemoryUsage(client *c);
+void updateClientMemUsage(client *c);
+void evictClients(void);
 void freeClientsInAsyncFreeQueue(void);
 void asyncCloseClientOnOutputBufferLimitReached(client *c);
 int getClientType(client *c);
@@ -1630,9 +1748,16 @@ void freeClientMultiState(client *c);
 void queueMultiCommand(client *c);
 void touchWatchedKey(redisDb *db, robj *key);
 void touchWatchedKeysOnFlush(int dbid);
+int isWatchedKeyTouched(client *c);
 void discardTransaction(client *c);
 void flagTransaction(client *c);
 void execCommandPropagateMulti(client *c);
+void execPropagateBatchBegin(void);
+void execPropagateBatchFlush(void);
+void execPropagateBatchEnd(void);
+#ifdef REDIS_TEST
+int multiTest(int argc, char **argv);
+#endif
 
 /* Redis object implementation */
 void decrRefCount(robj *o);
@@ -1676,6 +1801,7 @@ int getLongLongFromObject(robj *o, long long *target);
 int getLongDoubleFromObject(robj *o, long double *target);
 int getLongDoubleFromObjectOrReply(client *c, robj *o, long double *target, const char *msg);
 char *strEncoding(int encoding);
+size_t objectComputeSize(robj *o, size_t sample_size);
 int compareStringObjects(robj *a, robj *b);
 int collateStringObjects(robj *a, robj *b);
 int equalStringObjects(robj *a, robj *b);
@@ -1734,6 +1860,8 @@ int rdbSaveRio(rio *rdb, int *error, int flags, rdbSaveInfo *rsi);
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
+void feedAppendOnlyFileRaw(const char *buf, size_t len);
+sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
 int loadAppendOnlyFile(char *filename);
@@ -1751,10 +1879,24 @@ void sendChildInfo(int process_type);
 void receiveChildInfo(void);
 
 /* acl.c -- Authentication related prototypes. */
+#define ACL_OK 0
+#define ACL_DENIED_CMD 1
+#define ACL_DENIED_KEY 2
+extern user *DefaultUser;
 void ACLInit(void);
 int ACLCheckUserCredentials(robj *username, robj *password);
 unsigned long ACLGetCommandID(const char *cmdname);
 user *ACLGetUserByName(const char *name, size_t namelen);
+user *ACLCreateUser(const char *name, size_t namelen);
+int ACLSetUser(user *u, const char *op, ssize_t oplen);
+char *ACLSetUserStringError(void);
+int ACLCheckCommandPerm(client *c);
+void ACLUpdateDefaultUserPassword(char *password);
+int ACLDefaultUserRequiresAuth(void);
+sds ACLHashPassword(unsigned char *cleartext, size_t len);
+#ifdef REDIS_TEST
+int aclTest(int argc, char **argv);
+#endif
 
 /* Sorted sets data type */
 
@@ -1852,6 +1994,7 @@ void serverLogRaw(int level, const char *msg);
 void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
+int hasActiveChildProcess(void);
 int htNeedsResize(dict *dict);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
@@ -1860,6 +2003,7 @@ void closeListeningSockets(int unlink_unix_socket);
 void updateCachedTime(void);
 void resetServerStats(void);
 void activeDefragCycle(void);
+void *activeDefragAlloc(void *ptr);
 unsigned int getLRUClock(void);
 unsigned int LRU_CLOCK(void);
 const char *evictPolicyToString(void);
@@ -1917,8 +2061,30 @@ void freePubsubPattern(void *p);
 int listMatchPubsubPattern(void *a, void *b);
 int pubsubPublishMessage(robj *channel, robj *message);
 
+/* Client side caching (tracking mode) */
+void enableTracking(client *c, uint64_t redirect_to, int bcast, robj **prefix, size_t numprefix);
+void disableTracking(client *c);
+int checkPrefixCollisionsOrReply(client *c, robj **prefix, size_t numprefix);
+void trackingRememberKeys(client *c);
+void trackingInvalidateKey(robj *keyobj);
+void trackingInvalidateKeysOnFlush(int dbid);
+void trackingLimitUsedSlots(void);
+void trackingBroadcastInvalidationMessages(void);
+void trackingHandlePendingKeyInvalidations(void);
+uint64_t trackingGetTotalItems(void);
+uint64_t trackingGetTotalKeys(void);
+uint64_t trackingGetTotalPrefixes(void);
+
 /* Keyspace events notification */
+#define NOTIFY_BATCH_MAX_EVENTS 1024 /* Max events per "keyevents" push. */
 void notifyKeyspaceEvent(int type, char *event, robj *key, int dbid);
+void notifyUpdateSubscribers(robj *o, int ispattern, int delta);
+int setNotifyKeyspacePrefixes(char *prefixes);
+int notifyKeyMatchesPrefixes(robj *key);
+void notifyAddToBatch(char *event, robj *key, int dbid);
+void flushKeyEventsBatch(void);
+void enableKeyEventsStream(client *c);
+void disableKeyEventsStream(client *c);
 int keyspaceEventsStringToFlags(char *classes);
 sds keyspaceEventsFlagsToString(int flags);
 
@@ -1955,6 +2121,7 @@ int dbExists(redisDb *db, robj *key);
 robj *dbRandomKey(redisDb *db);
 int dbSyncDelete(redisDb *db, robj *key);
 int dbDelete(redisDb *db, robj *key);
+int dbDeleteReplaced(redisDb *db, robj *key);
 robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 
 #define EMPTYDB_NO_FLAGS 0      /* No flags. */
@@ -1970,13 +2137,28 @@ unsigned int delKeysInSlot(unsigned int hashslot);
 int verifyClusterConfigWithData(void);
 void scanGenericCommand(client *c, robj *o, unsigned long cursor);
 int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
+char *getObjectTypeName(robj *o);
+void scanJobStart(client *c, sds pat, sds type, long batchsize);
+void scanJobChildDone(int exitcode, int bysignal);
+void scanJobCron(void);
+void killScanJob(void);
+void keyIndexAdd(redisDb *db, robj *key);
+void keyIndexDel(redisDb *db, robj *key);
+void keyIndexFlush(redisDb *db, int async);
+void keyIndexSetEnabled(int enabled);
+void keyIndexFreeAsync(rax *idx);
+size_t patternPrefixLen(const char *pat, size_t patlen);
+void keysCommandByPrefix(client *c, sds pattern, size_t prefixlen);
+int scanKeyIndex(client *c, sds pat, size_t prefixlen, sds type, long count);
 void slotToKeyAdd(robj *key);
 void slotToKeyDel(robj *key);
 void slotToKeyFlush(void);
 int dbAsyncDelete(redisDb *db, robj *key);
+int dbAsyncEvict(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
 void slotToKeyFlushAsync(void);
 size_t lazyfreeGetPendingObjectsCount(void);
+size_t lazyfreeGetFreedObjectsCount(void);
 void freeObjAsync(robj *o);
 
 /* API to get key arguments from commands */
@@ -1989,6 +2171,11 @@ int *migrateGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkey
 int *georadiusGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 int *xreadGetKeys(struct redisCommand *cmd, robj **argv, int argc, int *numkeys);
 
+/* Geo */
+#ifdef REDIS_TEST
+int geoTest(int argc, char **argv);
+#endif
+
 /* Cluster */
 void clusterInit(void);
 unsigned short crc16(const char *buf, int len);
@@ -2009,6 +2196,9 @@ void sentinelIsRunning(void);
 /* redis-check-rdb & aof */
 int redis_check_rdb(char *rdbfilename, FILE *fp);
 int redis_check_rdb_main(int argc, char **argv, FILE *fp);
+#ifdef REDIS_TEST
+int rdbTransformTest(int argc, char **argv);
+#endif
 int redis_check_aof_main(int argc, char **argv);
 
 /* Scripting */
@@ -2056,6 +2246,7 @@ uint64_t redisBuildId(void);
 
 /* Commands prototypes */
 void authCommand(client *c);
+void aclCommand(client *c);
 void pingCommand(client *c);
 void echoCommand(client *c);
 void commandCommand(client *c);
@@ -2222,6 +2413,7 @@ void geoencodeCommand(client *c);
 void geodecodeCommand(client *c);
 void georadiusbymemberCommand(client *c);
 void georadiusbymemberroCommand(client *c);
+void geosearchCommand(client *c);
 void georadiusCommand(client *c);
 void georadiusroCommand(client *c);
 void geoaddCommand(client *c);
@@ -2266,6 +2458,7 @@ void bugReportStart(void);
 void serverLogObjectDebugInfo(const robj *o);
 void sigsegvHandler(int sig, siginfo_t *info, void *secret);
 sds genRedisInfoString(char *section);
+void bytesToHuman(char *s, unsigned long long n);
 void enableWatchdog(int period);
 void disableWatchdog(void);
 void watchdogScheduleSignal(int period);
@@ -36,6 +36,20 @@
 // SORT 命令实现
 
 zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+int sortCompare(const void *s1, const void *s2);
+
+#if __GNUC__ >= 3
+#define sortPrefetch(addr) __builtin_prefetch(addr)
+#else
+#define sortPrefetch(addr) ((void)(addr))
+#endif
+
+/* BY / GET lookups are performed in batches of this many elements, so that
+ * the memory of the main dictionary can be prefetched. */
+#define SORT_LOOKUP_BATCH 16
+
+/* Numeric sorts of at least this many elements use the radix sort. */
+#define SORT_RADIX_MIN_LEN 256
 
 // 创建一次 sort 操作
 redisSortOperation *createSortOperation(int type, robj *pattern) {
@@ -45,94 +59,231 @@ redisSortOperation *createSortOperation(int type, robj *pattern) {
     return so;
 }
 
-/* Return the value associated to the key with a name obtained using
- * the following rules:
+/* A BY / GET pattern, parsed once so that lookupKeysByPattern() does not
+ * need to search for '*' and '->' again for every element. */
+typedef struct sortPattern {
+    sds spat;           /* The pattern itself. */
+    int self;           /* True if the pattern is "#". */
+    int valid;          /* False if the pattern does not contain '*'. */
+    size_t prefixlen;   /* Length of the part before '*'. */
+    size_t postfixlen;  /* Length of the part after '*', without field. */
+    sds field;          /* Hash field name after "->", or NULL. */
+} sortPattern;
+
+void sortPatternInit(sortPattern *sp, robj *pattern) {
+    char *p, *f;
+    size_t fieldlen = 0;
+
+    sp->spat = pattern->ptr;
+    sp->self = (sp->spat[0] == '#' && sp->spat[1] == '\0');
+    sp->field = NULL;
+    sp->prefixlen = sp->postfixlen = 0;
+    p = strchr(sp->spat,'*');
+    sp->valid = p != NULL;
+    if (!sp->valid) return;
+
+    if ((f = strstr(p+1, "->")) != NULL && *(f+2) != '\0') {
+        fieldlen = sdslen(sp->spat)-(f-sp->spat)-2;
+        sp->field = sdsnewlen(f+2,fieldlen);
+    }
+    sp->prefixlen = p-sp->spat;
+    sp->postfixlen = sdslen(sp->spat)-(sp->prefixlen+1)-
+                     (fieldlen ? fieldlen+2 : 0);
+}
+
+void sortPatternFree(sortPattern *sp) {
+    sdsfree(sp->field);
+}
+
+/* Return the values associated to the keys with a name obtained using
+ * the following rules, for 'count' elements of the vector at once:
  *
- * 1) The first occurrence of '*' in 'pattern' is substituted with 'subst'.
+ * 1) The first occurrence of '*' in 'pattern' is substituted with the
+ *    element.
  *
- * 2) If 'pattern' matches the "->" string, everything on the left of
+ * 2) If 'pattern' matches the "->" string, everything on the right of
  *    the arrow is treated as the name of a hash field, and the part on the
  *    left as the key name containing a hash. The value of the specified
  *    field is returned.
  *
- * 3) If 'pattern' equals "#", the function simply returns 'subst' itself so
- *    that the SORT command can be used like: SORT key GET # to retrieve
- *    the Set/List elements directly.
+ * 3) If 'pattern' equals "#", the function simply returns the element
+ *    itself so that the SORT command can be used like: SORT key GET # to
+ *    retrieve the Set/List elements directly.
+ *
+ * The values are stored in 'results', with their refcount increased by 1
+ * when they are non-NULL.
  *
- * The returned object will always have its refcount increased by 1
- * when it is non-NULL. */
-robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
-    char *p, *f, *k;
-    sds spat, ssub;
-    robj *keyobj, *fieldobj = NULL, *o;
-    int prefixlen, sublen, postfixlen, fieldlen;
-
-    /* If the pattern is "#" return the substitution object itself in order
-     * to implement the "SORT ... GET #" feature. */
-    spat = pattern->ptr;
-    if (spat[0] == '#' && spat[1] == '\0') {
-        incrRefCount(subst);
-        return subst;
+ * The key names are built into 'keys', an array of SORT_LOOKUP_BATCH
+ * objects owned by the caller and reused across calls, then the buckets
+ * of the main dictionary and the entries are prefetched, and only at the
+ * end the actual lookups are performed. This way the cache misses of
+ * the different keys overlap instead of being paid one after the other,
+ * which is the dominant cost when sorting big collections BY a pattern. */
+void lookupKeysByPattern(redisDb *db, sortPattern *sp, redisSortObject *vector,
+                         int count, robj **keys, robj **results)
+{
+    dict *d = db->dict;
+    int i, prefetch = dictSize(d) && !dictIsRehashing(d);
+    unsigned long idx[SORT_LOOKUP_BATCH];
+
+    serverAssert(count <= SORT_LOOKUP_BATCH);
+    if (sp->self) {
+        for (i = 0; i < count; i++) {
+            incrRefCount(vector[i].obj);
+            results[i] = vector[i].obj;
+        }
+        return;
+    }
+    if (!sp->valid) {
+        for (i = 0; i < count; i++) results[i] = NULL;
+        return;
     }
 
-    /* The substitution object may be specially encoded. If so we create
-     * a decoded object on the fly. Otherwise getDecodedObject will just
-     * increment the ref count, that we'll decrement later. */
-    subst = getDecodedObject(subst);
-    ssub = subst->ptr;
-
-    /* If we can't find '*' in the pattern we return NULL as to GET a
-     * fixed key does not make sense. */
-    p = strchr(spat,'*');
-    if (!p) {
-        decrRefCount(subst);
-        return NULL;
+    /* Perform the '*' substitution. The key objects are reused unless
+     * someone else took a reference while looking them up. */
+    for (i = 0; i < count; i++) {
+        robj *subst = vector[i].obj;
+        char buf[LONG_STR_SIZE];
+        char *ssub;
+        size_t sublen;
+
+        if (sdsEncodedObject(subst)) {
+            ssub = subst->ptr;
+            sublen = sdslen(subst->ptr);
+        } else {
+            ssub = buf;
+            sublen = ll2string(buf,sizeof(buf),(long)subst->ptr);
+        }
+        if (keys[i] == NULL || keys[i]->refcount != 1) {
+            if (keys[i]) decrRefCount(keys[i]);
+            keys[i] = createObject(OBJ_STRING,sdsempty());
+        }
+        sds k = keys[i]->ptr;
+        sdsclear(k);
+        k = sdscatlen(k,sp->spat,sp->prefixlen);
+        k = sdscatlen(k,ssub,sublen);
+        k = sdscatlen(k,sp->spat+sp->prefixlen+1,sp->postfixlen);
+        keys[i]->ptr = k;
+        if (prefetch) {
+            idx[i] = dictHashKey(d,k) & d->ht[0].sizemask;
+            sortPrefetch(&d->ht[0].table[idx[i]]);
+        }
     }
 
-    /* Find out if we're dealing with a hash dereference. */
-    if ((f = strstr(p+1, "->")) != NULL && *(f+2) != '\0') {
-        fieldlen = sdslen(spat)-(f-spat)-2;
-        fieldobj = createStringObject(f+2,fieldlen);
-    } else {
-        fieldlen = 0;
+    /* Prefetch the first entry of every bucket. */
+    if (prefetch) {
+        for (i = 0; i < count; i++) {
+            dictEntry *he = d->ht[0].table[idx[i]];
+            if (he) sortPrefetch(he);
+        }
     }
 
-    /* Perform the '*' substitution. */
-    prefixlen = p-spat;
-    sublen = sdslen(ssub);
-    postfixlen = sdslen(spat)-(prefixlen+1)-(fieldlen ? fieldlen+2 : 0);
-    keyobj = createStringObject(NULL,prefixlen+sublen+postfixlen);
-    k = keyobj->ptr;
-    memcpy(k,spat,prefixlen);
-    memcpy(k+prefixlen,ssub,sublen);
-    memcpy(k+prefixlen+sublen,p+1,postfixlen);
-    decrRefCount(subst); /* Incremented by decodeObject() */
-
-    /* Lookup substituted key */
-    o = lookupKeyRead(db,keyobj);
-    if (o == NULL) goto noobj;
-
-    if (fieldobj) {
-        if (o->type != OBJ_HASH) goto noobj;
-
-        /* Retrieve value from hash by the field name. The returend object
-         * is a new object with refcount already incremented. */
-        o = hashTypeGetValueObject(o, fieldobj->ptr);
-    } else {
-        if (o->type != OBJ_STRING) goto noobj;
+    /* Finally perform the lookups. */
+    for (i = 0; i < count; i++) {
+        robj *o = lookupKeyRead(db,keys[i]);
+
+        if (o == NULL) {
+            results[i] = NULL;
+        } else if (sp->field) {
+            results[i] = (o->type == OBJ_HASH) ?
+                         hashTypeGetValueObject(o,sp->field) : NULL;
+        } else if (o->type == OBJ_STRING) {
+            incrRefCount(o);
+            results[i] = o;
+        } else {
+            results[i] = NULL;
+        }
+    }
+}
+
+/* Perform the GET lookups for the next batch of elements to output, that
+ * are the first 'left' elements of 'vector' (at max SORT_LOOKUP_BATCH are
+ * processed). The value of the GET pattern 'k' for the i-th element is
+ * stored at vals[k*SORT_LOOKUP_BATCH+i]. */
+void sortLookupGetBatch(redisDb *db, sortPattern *patterns, int numpatterns,
+                        redisSortObject *vector, long left, robj **keys,
+                        robj **vals)
+{
+    int count = left > SORT_LOOKUP_BATCH ? SORT_LOOKUP_BATCH : left, k;
+
+    for (k = 0; k < numpatterns; k++)
+        lookupKeysByPattern(db,patterns+k,vector,count,keys,
+                            vals+k*SORT_LOOKUP_BATCH);
+}
+
+/* Convert a score into an unsigned integer with the same ordering, so that
+ * it can be sorted with a radix sort. Negative numbers have all the bits
+ * flipped, positive ones just the sign bit. For DESC sorting the order is
+ * reversed flipping all the bits again. */
+static uint64_t sortScoreToRadixKey(double score, int desc) {
+    uint64_t bits;
+
+    if (score == 0) score = 0; /* -0.0 and 0.0 must compare equal. */
+    memcpy(&bits,&score,sizeof(bits));
+    bits = (bits & (1ULL<<63)) ? ~bits : bits | (1ULL<<63);
+    return desc ? ~bits : bits;
+}
+
+typedef struct sortRadixItem {
+    uint64_t key;
+    long idx;
+} sortRadixItem;
+
+/* Sort the vector by score using a LSD radix sort with 8 bits digits,
+ * skipping the digits that are the same for all the elements (for
+ * instance the low mantissa bytes when sorting integers). Elements with
+ * the same score are finally sorted with sortCompare(), that compares them
+ * lexicographically, so that the result is the same as the one of
+ * qsort(). The globals used by sortCompare() must be already set. */
+void sortVectorByScore(redisSortObject *vector, long len, int desc) {
+    sortRadixItem *items = zmalloc(sizeof(*items)*len);
+    sortRadixItem *aux = zmalloc(sizeof(*items)*len);
+    size_t (*count)[256] = zcalloc(sizeof(size_t)*8*256);
+    long j, i;
+    int digit;
+
+    for (j = 0; j < len; j++) {
+        uint64_t key = sortScoreToRadixKey(vector[j].u.score,desc);
+        items[j].key = key;
+        items[j].idx = j;
+        for (digit = 0; digit < 8; digit++)
+            count[digit][(key >> (digit*8)) & 0xff]++;
+    }
+
+    for (digit = 0; digit < 8; digit++) {
+        size_t pos = 0, *c = count[digit];
+        int shift = digit*8;
 
-        /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+        /* All the elements have the same value for this digit? */
+        if (c[(items[0].key >> shift) & 0xff] == (size_t)len) continue;
+        for (i = 0; i < 256; i++) {
+            size_t n = c[i];
+            c[i] = pos;
+            pos += n;
+        }
+        for (j = 0; j < len; j++)
+            aux[c[(items[j].key >> shift) & 0xff]++] = items[j];
+        sortRadixItem *tmp = items;
+        items = aux;
+        aux = tmp;
+    }
+
+    /* Reorder the vector accordingly. */
+    redisSortObject *sorted = zmalloc(sizeof(*sorted)*len);
+    for (j = 0; j < len; j++) sorted[j] = vector[items[j].idx];
+    memcpy(vector,sorted,sizeof(*sorted)*len);
+    zfree(sorted);
+
+    /* Sort the runs of elements with the same score. */
+    for (j = 0; j < len; j = i) {
+        for (i = j+1; i < len && items[i].key == items[j].key; i++);
+        if (i-j > 1)
+            qsort(vector+j,i-j,sizeof(redisSortObject),sortCompare);
     }
-    decrRefCount(keyobj);
-    if (fieldobj) decrRefCount(fieldobj);
-    return o;
-
-noobj:
-    decrRefCount(keyobj);
-    if (fieldlen) decrRefCount(fieldobj);
-    return NULL;
+
+    zfree(items);
+    zfree(aux);
+    zfree(count);
 }
 
 /* sortCompare() is used by qsort in sortCommand(). Given that qsort_r with
@@ -200,6 +351,9 @@ void sortCommand(client *c) {
     int syntax_error = 0;
     robj *sortval, *sortby = NULL, *storekey = NULL;
     redisSortObject *vector; /* Resulting vector to sort */
+    robj *lookupkeys[SORT_LOOKUP_BATCH] = {NULL}; /* See lookupKeysByPattern */
+    robj **lookupvals = NULL; /* Results of the batched lookups. */
+    sortPattern bypattern, *getpatterns = NULL;
 
     /* Lookup the key to sort. It must be of the right types */
     sortval = lookupKeyRead(c->db,c->argv[1]);
@@ -449,13 +603,37 @@ void sortCommand(client *c) {
     }
     serverAssertWithInfo(c,sortval,j == vectorlen);
 
+    /* Parse the BY and GET patterns just once. */
+    if (sortby) sortPatternInit(&bypattern,sortby);
+    if (getop) {
+        listNode *ln;
+        listIter li;
+        int k = 0;
+
+        getpatterns = zmalloc(sizeof(sortPattern)*getop);
+        listRewind(operations,&li);
+        while((ln = listNext(&li))) {
+            redisSortOperation *sop = ln->value;
+            sortPatternInit(getpatterns+k,sop->pattern);
+            k++;
+        }
+    }
+    lookupvals = zmalloc(sizeof(robj*)*SORT_LOOKUP_BATCH*(getop ? getop : 1));
+
     /* Now it's time to load the right scores in the sorting vector */
     if (!dontsort) {
         for (j = 0; j < vectorlen; j++) {
             robj *byval;
             if (sortby) {
-                /* lookup value to sort by */
-                byval = lookupKeyByPattern(c->db,sortby,vector[j].obj);
+                /* lookup value to sort by, in batches. */
+                int batchpos = j % SORT_LOOKUP_BATCH;
+                if (batchpos == 0) {
+                    int count = vectorlen-j;
+                    if (count > SORT_LOOKUP_BATCH) count = SORT_LOOKUP_BATCH;
+                    lookupKeysByPattern(c->db,&bypattern,vector+j,count,
+                                        lookupkeys,lookupvals);
+                }
+                byval = lookupvals[batchpos];
                 if (!byval) continue;
             } else {
                 /* use object itself to sort by */
@@ -484,7 +662,7 @@ void sortCommand(client *c) {
                 }
             }
 
-            /* when the object was retrieved using lookupKeyByPattern,
+            /* when the object was retrieved using lookupKeysByPattern,
              * its refcount needs to be decreased. */
             if (sortby) {
                 decrRefCount(byval);
@@ -497,6 +675,8 @@ void sortCommand(client *c) {
         server.sort_store = storekey ? 1 : 0;
         if (sortby && (start != 0 || end != vectorlen-1))
             pqsort(vector,vectorlen,sizeof(redisSortObject),sortCompare, start,end);
+        else if (!alpha && vectorlen >= SORT_RADIX_MIN_LEN)
+            sortVectorByScore(vector,vectorlen,desc);
         else
             qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
     }
@@ -510,26 +690,19 @@ void sortCommand(client *c) {
         /* STORE option not specified, sent the sorting result to client */
         addReplyArrayLen(c,outputlen);
         for (j = start; j <= end; j++) {
-            listNode *ln;
-            listIter li;
+            int batchpos = (j-start) % SORT_LOOKUP_BATCH, k;
 
             if (!getop) addReplyBulk(c,vector[j].obj);
-            listRewind(operations,&li);
-            while((ln = listNext(&li))) {
-                redisSortOperation *sop = ln->value;
-                robj *val = lookupKeyByPattern(c->db,sop->pattern,
-                    vector[j].obj);
-
-                if (sop->type == SORT_OP_GET) {
-                    if (!val) {
-                        addReplyNull(c);
-                    } else {
-                        addReplyBulk(c,val);
-                        decrRefCount(val);
-                    }
+            if (getop && batchpos == 0) sortLookupGetBatch(c->db,getpatterns,
+                getop,vector+j,end-j+1,lookupkeys,lookupvals);
+            for (k = 0; k < getop; k++) {
+                robj *val = lookupvals[k*SORT_LOOKUP_BATCH+batchpos];
+
+                if (!val) {
+                    addReplyNull(c);
                 } else {
-                    /* Always fails */
-                    serverAssertWithInfo(c,sortval,sop->type == SORT_OP_GET);
+                    addReplyBulk(c,val);
+                    decrRefCount(val);
                 }
             }
         }
@@ -538,30 +711,23 @@ void sortCommand(client *c) {
 
         /* STORE option specified, set the sorting result as a List object */
         for (j = start; j <= end; j++) {
-            listNode *ln;
-            listIter li;
+            int batchpos = (j-start) % SORT_LOOKUP_BATCH, k;
 
             if (!getop) {
                 listTypePush(sobj,vector[j].obj,LIST_TAIL);
             } else {
-                listRewind(operations,&li);
-                while((ln = listNext(&li))) {
-                    redisSortOperation *sop = ln->value;
-                    robj *val = lookupKeyByPattern(c->db,sop->pattern,
-                        vector[j].obj);
-
-                    if (sop->type == SORT_OP_GET) {
-                        if (!val) val = createStringObject("",0);
-
-                        /* listTypePush does an incrRefCount, so we should take care
-                         * care of the incremented refcount caused by either
-                         * lookupKeyByPattern or createStringObject("",0) */
-                        listTypePush(sobj,val,LIST_TAIL);
-                        decrRefCount(val);
-                    } else {
-                        /* Always fails */
-                        serverAssertWithInfo(c,sortval,sop->type == SORT_OP_GET);
-                    }
+                if (batchpos == 0) sortLookupGetBatch(c->db,getpatterns,
+                    getop,vector+j,end-j+1,lookupkeys,lookupvals);
+                for (k = 0; k < getop; k++) {
+                    robj *val = lookupvals[k*SORT_LOOKUP_BATCH+batchpos];
+
+                    if (!val) val = createStringObject("",0);
+
+                    /* listTypePush does an incrRefCount, so we should take care
+                     * care of the incremented refcount caused by either
+                     * lookupKeysByPattern or createStringObject("",0) */
+                    listTypePush(sobj,val,LIST_TAIL);
+                    decrRefCount(val);
                 }
             }
         }
@@ -570,7 +736,7 @@ void sortCommand(client *c) {
             notifyKeyspaceEvent(NOTIFY_LIST,"sortstore",storekey,
                                 c->db->id);
             server.dirty += outputlen;
-        } else if (dbDelete(c->db,storekey)) {
+        } else if (dbDeleteReplaced(c->db,storekey)) {
             signalModifiedKey(c->db,storekey);
             notifyKeyspaceEvent(NOTIFY_GENERIC,"del",storekey,c->db->id);
             server.dirty++;
@@ -590,4 +756,10 @@ void sortCommand(client *c) {
             decrRefCount(vector[j].u.cmpobj);
     }
     zfree(vector);
+    for (j = 0; j < SORT_LOOKUP_BATCH; j++)
+        if (lookupkeys[j]) decrRefCount(lookupkeys[j]);
+    zfree(lookupvals);
+    if (sortby) sortPatternFree(&bypattern);
+    for (j = 0; j < getop; j++) sortPatternFree(getpatterns+j);
+    zfree(getpatterns);
 }
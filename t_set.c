@@ -905,7 +905,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
         if (!setobj) {
             zfree(sets);
             if (dstkey) {
-                if (dbDelete(c->db,dstkey)) {
+                if (dbDeleteReplaced(c->db,dstkey)) {
                     signalModifiedKey(c->db,dstkey);
                     server.dirty++;
                 }
@@ -1002,7 +1002,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
         /* Store the resulting set into the target, if the intersection
          * is not an empty set. */
         // 用结果集合代替原有的 dstkey
-        int deleted = dbDelete(c->db,dstkey);
+        int deleted = dbDeleteReplaced(c->db,dstkey);
         if (setTypeSize(dstset) > 0) {
             dbAdd(c->db,dstkey,dstset);
             addReplyLongLong(c,setTypeSize(dstset));
@@ -1204,7 +1204,7 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
     } else {
         /* If we have a target key where to store the resulting set
          * create this key with the result set inside */
-        int deleted = dbDelete(c->db,dstkey);
+        int deleted = dbDeleteReplaced(c->db,dstkey);
         if (setTypeSize(dstset) > 0) {
             dbAdd(c->db,dstkey,dstset);
             addReplyLongLong(c,setTypeSize(dstset));
@@ -0,0 +1,552 @@
+/* tracking.c - Client side caching: keys tracking and invalidation
+ *
+ * Copyright (c) 2019, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* The tracking table is made of a radix tree mapping key names to a radix
+ * tree of client IDs: the clients that fetched the key since the last time
+ * it was invalidated. When a key is modified all the clients in its set
+ * receive an invalidation message and the whole entry is removed, so a
+ * client is tracked again only if it reads the key another time.
+ *
+ * Client IDs are never reused, so the entries of clients that disabled
+ * tracking or disconnected are not removed eagerly: they are just skipped
+ * (and reclaimed) the next time the key is invalidated.
+ *
+ * The table memory is bounded by the 'tracking-table-max-keys' option:
+ * when there are more keys than that, random keys are invalidated ahead of
+ * time in order to free their entries, see trackingLimitUsedSlots(). */
+rax *TrackingTable = NULL;
+uint64_t TrackingTableTotalItems = 0; /* Total number of IDs stored across
+                                         the whole tracking table. This
+                                         gives an hint about the total
+                                         memory we are using. */
+
+/* In broadcasting mode (BCAST) the server does not remember which keys a
+ * client fetched: instead clients subscribe to key name prefixes, and every
+ * key modified during an event loop iteration that matches one of them is
+ * sent to all the subscribers of that prefix in beforeSleep(). The memory
+ * used does not depend on the number of keys clients are caching, only on
+ * the number of prefixes and on the keys modified in a single iteration. */
+rax *PrefixTable = NULL;
+
+typedef struct bcastState {
+    rax *keys;      /* Keys modified in the current event loop cycle. */
+    rax *clients;   /* Clients subscribed to the notification events for this
+                       prefix. */
+} bcastState;
+
+/* Channel used to send invalidation messages to RESP2 clients that are
+ * receiving them via redirection while subscribed to Pub/Sub. */
+robj *TrackingChannelName;
+
+/* Invalidation messages for the client that is executing a command, that
+ * are sent once the command returned, otherwise they would end in the middle
+ * of its reply (for instance of an EXEC). Every element is the key name as
+ * an SDS string, or NULL to invalidate everything. */
+list *TrackingPendingKeys = NULL;
+
+/* Remove the tracking state from the client 'c'. Note that there is not much
+ * to do for us here, if not to decrement the counter of the clients in
+ * tracking mode, because we just store the ID of the client in the tracking
+ * table, so we'll remove the ID reference in a lazy way. Otherwise when a
+ * client with many entries in the table is removed, it would cost a lot of
+ * time to do the cleanup.
+ *
+ * Prefixes in broadcasting mode are instead removed here, since there are
+ * usually very few of them per client. */
+void disableTracking(client *c) {
+    if (!(c->flags & CLIENT_TRACKING)) return;
+
+    if (c->flags & CLIENT_TRACKING_BCAST) {
+        raxIterator ri;
+        raxStart(&ri,c->client_tracking_prefixes);
+        raxSeek(&ri,"^",NULL,0);
+        while(raxNext(&ri)) {
+            bcastState *bs = raxFind(PrefixTable,ri.key,ri.key_len);
+            serverAssert(bs != raxNotFound);
+            raxRemove(bs->clients,(unsigned char*)&c,sizeof(c),NULL);
+            /* Was it the last client? Remove the prefix from the table. */
+            if (raxSize(bs->clients) == 0) {
+                raxFree(bs->clients);
+                raxFree(bs->keys);
+                zfree(bs);
+                raxRemove(PrefixTable,ri.key,ri.key_len,NULL);
+            }
+        }
+        raxStop(&ri);
+        raxFree(c->client_tracking_prefixes);
+        c->client_tracking_prefixes = NULL;
+    }
+
+    c->flags &= ~(CLIENT_TRACKING|CLIENT_TRACKING_BROKEN_REDIR|
+                  CLIENT_TRACKING_BCAST);
+    server.tracking_clients--;
+}
+
+/* Check if any of the prefixes the client 'c' is asking for collides with
+ * one of its own prefixes or with another one in the same request: a key
+ * would be reported twice otherwise. Return 1 if the prefixes are fine,
+ * otherwise 0 is returned after replying with an error to the client. */
+int checkPrefixCollisionsOrReply(client *c, robj **prefixes, size_t numprefix) {
+    for (size_t i = 0; i < numprefix; i++) {
+        sds pi = prefixes[i]->ptr;
+
+        /* Check the prefixes the client is already subscribed to. */
+        if (c->client_tracking_prefixes) {
+            raxIterator ri;
+            raxStart(&ri,c->client_tracking_prefixes);
+            raxSeek(&ri,"^",NULL,0);
+            while(raxNext(&ri)) {
+                size_t minlen = ri.key_len < sdslen(pi) ?
+                                ri.key_len : sdslen(pi);
+                if (!memcmp(ri.key,pi,minlen)) {
+                    addReplyErrorFormat(c,
+                        "Prefix '%s' overlaps with an existing prefix '%.*s'. "
+                        "Prefixes for a single client must not overlap.",
+                        pi,(int)ri.key_len,(char*)ri.key);
+                    raxStop(&ri);
+                    return 0;
+                }
+            }
+            raxStop(&ri);
+        }
+
+        /* Check the other prefixes of this same request. */
+        for (size_t j = i + 1; j < numprefix; j++) {
+            sds pj = prefixes[j]->ptr;
+            size_t minlen = sdslen(pi) < sdslen(pj) ? sdslen(pi) : sdslen(pj);
+            if (!memcmp(pi,pj,minlen)) {
+                addReplyErrorFormat(c,
+                    "Prefix '%s' overlaps with another provided prefix '%s'. "
+                    "Prefixes for a single client must not overlap.",
+                    pi,pj);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Set the client 'c' to track the prefix 'prefix'. If the client 'c' is
+ * already registered for the specified prefix, no operation is performed. */
+void enableBcastTrackingForPrefix(client *c, char *prefix, size_t plen) {
+    bcastState *bs = raxFind(PrefixTable,(unsigned char*)prefix,plen);
+    /* If this is the first client subscribing to such prefix, create
+     * the prefix in the table. */
+    if (bs == raxNotFound) {
+        bs = zmalloc(sizeof(*bs));
+        bs->keys = raxNew();
+        bs->clients = raxNew();
+        raxTryInsert(PrefixTable,(unsigned char*)prefix,plen,bs,NULL);
+    }
+    if (raxTryInsert(bs->clients,(unsigned char*)&c,sizeof(c),NULL,NULL)) {
+        if (c->client_tracking_prefixes == NULL)
+            c->client_tracking_prefixes = raxNew();
+        raxTryInsert(c->client_tracking_prefixes,
+                     (unsigned char*)prefix,plen,NULL,NULL);
+    }
+}
+
+/* Enable the tracking state for the client 'c', and as a side effect allocates
+ * the tracking table if needed. If the 'redirect_to' argument is non zero, the
+ * invalidation messages for this client will be sent to the client ID
+ * specified by the 'redirect_to' argument. Note that if such client will
+ * eventually get freed, we'll send a message to the original client to
+ * inform it of the condition. Multiple clients can redirect the invalidation
+ * messages to the same client ID.
+ *
+ * When 'bcast' is true the client is put in broadcasting mode for the
+ * 'numprefix' prefixes in 'prefix', or for every key if no prefix is
+ * given. */
+void enableTracking(client *c, uint64_t redirect_to, int bcast, robj **prefix, size_t numprefix) {
+    if (!(c->flags & CLIENT_TRACKING)) server.tracking_clients++;
+    c->flags |= CLIENT_TRACKING;
+    c->flags &= ~(CLIENT_TRACKING_BROKEN_REDIR|CLIENT_TRACKING_BCAST);
+    c->client_tracking_redirection = redirect_to;
+
+    if (TrackingTable == NULL) {
+        TrackingTable = raxNew();
+        PrefixTable = raxNew();
+        TrackingChannelName = createStringObject("__redis__:invalidate",20);
+    }
+
+    if (bcast) {
+        c->flags |= CLIENT_TRACKING_BCAST;
+        if (numprefix == 0) enableBcastTrackingForPrefix(c,"",0);
+        for (size_t j = 0; j < numprefix; j++) {
+            sds sdsprefix = prefix[j]->ptr;
+            enableBcastTrackingForPrefix(c,sdsprefix,sdslen(sdsprefix));
+        }
+    }
+}
+
+/* This function is called after the execution of a readonly command in the
+ * case the client 'c' has keys tracking enabled. It will populate the
+ * tracking table with the keys the client fetched, so that when they are
+ * modified the client will receive an invalidation message. */
+void trackingRememberKeys(client *c) {
+    int numkeys;
+    int *keys = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    if (keys == NULL) return;
+
+    for(int j = 0; j < numkeys; j++) {
+        int idx = keys[j];
+        sds sdskey = c->argv[idx]->ptr;
+        rax *ids = raxFind(TrackingTable,(unsigned char*)sdskey,sdslen(sdskey));
+        if (ids == raxNotFound) {
+            ids = raxNew();
+            int inserted = raxTryInsert(TrackingTable,(unsigned char*)sdskey,
+                                        sdslen(sdskey),ids, NULL);
+            serverAssert(inserted == 1);
+        }
+        if (raxTryInsert(ids,(unsigned char*)&c->id,sizeof(c->id),NULL,NULL))
+            TrackingTableTotalItems++;
+    }
+    getKeysFreeResult(keys);
+}
+
+/* Emit the invalidation message for 'keyname' in the output buffer of 'c',
+ * that sendTrackingMessage() already checked to be able to receive it. */
+static void addReplyTrackingMessage(client *c, char *keyname, size_t keylen, int proto) {
+    if (c->resp > 2) {
+        addReplyPushLen(c,2);
+        addReplyBulkCBuffer(c,"invalidate",10);
+    } else {
+        /* Same format of addReplyPubsubMessage(), but the payload is the
+         * array of keys instead of a bulk string. */
+        addReply(c,shared.mbulkhdr[3]);
+        addReply(c,shared.messagebulk);
+        addReplyBulk(c,TrackingChannelName);
+    }
+
+    /* Send the "value" part, which is the array of keys. */
+    if (keyname == NULL) {
+        addReplyNull(c);
+    } else if (proto) {
+        addReplyProto(c,keyname,keylen);
+    } else {
+        addReplyArrayLen(c,1);
+        addReplyBulkCBuffer(c,keyname,keylen);
+    }
+}
+
+/* Send the invalidation message for 'keyname' to the client 'c', or to the
+ * client it is redirecting to. When 'proto' is true 'keyname' is already a
+ * protocol-encoded array of keys (used by the broadcasting mode to build
+ * the message once for all the clients), otherwise it is a single key.
+ * A NULL 'keyname' means "invalidate everything", and is used on flushes.
+ *
+ * If the receiving client is the one executing the current command the
+ * message is queued, see trackingHandlePendingKeyInvalidations(). */
+void sendTrackingMessage(client *c, char *keyname, size_t keylen, int proto) {
+    int using_redirection = 0;
+    if (c->client_tracking_redirection) {
+        client *redir = lookupClientByID(c->client_tracking_redirection);
+        if (!redir) {
+            /* We need to signal to the original connection that we
+             * are unable to send invalidation messages to the redirected
+             * connection, because the client no longer exist. */
+            if (c->resp > 2 && !(c->flags & CLIENT_TRACKING_BROKEN_REDIR)) {
+                addReplyPushLen(c,3);
+                addReplyBulkCBuffer(c,"tracking-redir-broken",21);
+                addReplyLongLong(c,c->client_tracking_redirection);
+            }
+            c->flags |= CLIENT_TRACKING_BROKEN_REDIR;
+            return;
+        }
+        c = redir;
+        using_redirection = 1;
+    }
+
+    /* Only send such info for clients in RESP version 3 or more. However
+     * if redirection is active, and the connection we redirect to is
+     * in Pub/Sub mode, we can support the feature with RESP 2 as well,
+     * by sending Pub/Sub messages in the __redis__:invalidate channel. */
+    if (c->resp <= 2 && !(using_redirection && c->flags & CLIENT_PUBSUB)) {
+        /* If are here, the client is not using RESP3, nor is
+         * redirecting to another client. We can't send anything to
+         * it since RESP2 does not support push messages in the same
+         * connection. */
+        return;
+    }
+
+    /* Broadcast messages are only sent from beforeSleep(), so just single
+     * keys and flushes can be generated while a command is executing. */
+    if (c == server.current_client && !proto) {
+        if (TrackingPendingKeys == NULL) TrackingPendingKeys = listCreate();
+        listAddNodeTail(TrackingPendingKeys,
+                        keyname ? sdsnewlen(keyname,keylen) : NULL);
+        return;
+    }
+    addReplyTrackingMessage(c,keyname,keylen,proto);
+}
+
+/* Send the invalidation messages queued by sendTrackingMessage() while the
+ * current client was executing a command. This is called by
+ * processInputBuffer() once the command returned. If the client was freed
+ * in the meantime the messages are just discarded. */
+void trackingHandlePendingKeyInvalidations(void) {
+    listNode *ln;
+
+    if (TrackingPendingKeys == NULL) return;
+    while ((ln = listFirst(TrackingPendingKeys)) != NULL) {
+        sds key = listNodeValue(ln);
+        if (server.current_client) {
+            addReplyTrackingMessage(server.current_client,key,
+                                    key ? sdslen(key) : 0,0);
+        }
+        sdsfree(key);
+        listDelNode(TrackingPendingKeys,ln);
+    }
+}
+
+/* This function is called when a key is modified in Redis and in the case
+ * we have at least one client with the BCAST mode enabled.
+ * Its goal is to set the key in the right broadcast state if the key
+ * matches one or more prefixes in the prefix table. Later when we
+ * return to the event loop, we'll send invalidation messages to the
+ * clients subscribed to each prefix. */
+void trackingRememberKeyToBroadcast(char *keyname, size_t keylen) {
+    raxIterator ri;
+    raxStart(&ri,PrefixTable);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        if (ri.key_len > keylen) continue;
+        if (ri.key_len != 0 && memcmp(ri.key,keyname,ri.key_len) != 0)
+            continue;
+        bcastState *bs = ri.data;
+        raxTryInsert(bs->keys,(unsigned char*)keyname,keylen,NULL,NULL);
+    }
+    raxStop(&ri);
+}
+
+/* Invalidate the key 'keyname': every client in its set is notified and
+ * the entry is removed from the tracking table. When 'bcast' is true the
+ * key is also queued for the broadcasting clients, this is not wanted when
+ * we are just evicting entries to respect 'tracking-table-max-keys', since
+ * the key was not really modified. */
+void trackingInvalidateKeyRaw(char *keyname, size_t keylen, int bcast) {
+    if (TrackingTable == NULL) return;
+
+    if (bcast && raxSize(PrefixTable) > 0)
+        trackingRememberKeyToBroadcast(keyname,keylen);
+
+    rax *ids = raxFind(TrackingTable,(unsigned char*)keyname,keylen);
+    if (ids == raxNotFound) return;
+
+    raxIterator ri;
+    raxStart(&ri,ids);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        uint64_t id;
+        memcpy(&id,ri.key,sizeof(id));
+        client *target = lookupClientByID(id);
+        /* Note that if the client is in BCAST mode, we don't want to
+         * send invalidation messages that were pending in the case
+         * previously the client was not in BCAST mode. This can happen if
+         * TRACKING is enabled normally, and then the client switches to
+         * BCAST mode. */
+        if (target == NULL ||
+            !(target->flags & CLIENT_TRACKING) ||
+            target->flags & CLIENT_TRACKING_BCAST)
+        {
+            continue;
+        }
+        sendTrackingMessage(target,keyname,keylen,0);
+    }
+    raxStop(&ri);
+
+    /* Free the tracking table: we'll create the radix tree and populate it
+     * again if more keys will be modified in this key. */
+    TrackingTableTotalItems -= raxSize(ids);
+    raxFree(ids);
+    raxRemove(TrackingTable,(unsigned char*)keyname,keylen,NULL);
+}
+
+/* Wrapper called by signalModifiedKey() every time a key is modified, and
+ * when a key is expired or evicted. */
+void trackingInvalidateKey(robj *keyobj) {
+    if (TrackingTable == NULL) return;
+    sds sdskey = keyobj->ptr;
+    trackingInvalidateKeyRaw(sdskey,sdslen(sdskey),1);
+}
+
+/* Free the tracking table and the IDs it references. */
+void freeTrackingRadixTree(void *rt) {
+    raxFree(rt);
+}
+
+/* This function is called when one or all the Redis databases are flushed
+ * (dbid == -1 in case of FLUSHALL). Caching clients are not tracking the
+ * keys of a single DB, so every client in tracking mode receives a "null"
+ * invalidation message telling it to drop its whole cache.
+ *
+ * On FLUSHALL the tracking table is also released, since every key in it
+ * is gone anyway. */
+void trackingInvalidateKeysOnFlush(int dbid) {
+    if (server.tracking_clients) {
+        listNode *ln;
+        listIter li;
+        listRewind(server.clients,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            client *c = listNodeValue(ln);
+            if (c->flags & CLIENT_TRACKING)
+                sendTrackingMessage(c,NULL,0,0);
+        }
+    }
+
+    /* In case of FLUSHALL, reclaim all the memory used by tracking. */
+    if (dbid == -1 && TrackingTable) {
+        raxFreeWithCallback(TrackingTable,freeTrackingRadixTree);
+        TrackingTable = raxNew();
+        TrackingTableTotalItems = 0;
+    }
+}
+
+/* Tracking forces Redis to remember information about which client may have
+ * certain keys. In workloads where there are a lot of reads, but keys are
+ * hardly modified, the amount of information we have to remember server side
+ * could be a lot, with the number of keys being totally not bound.
+ *
+ * So Redis allows the user to configure a maximum number of keys for the
+ * invalidation table. This function makes sure that we don't go over the
+ * specified fill rate: if we are over, we can just evict informations about
+ * a random key, and send invalidation messages to clients like if the key was
+ * modified.
+ *
+ * The work is incremental: at every call we try a limited number of random
+ * keys, and the effort is increased as long as the limit is not honored, so
+ * that a burst of reads can't block the server. */
+void trackingLimitUsedSlots(void) {
+    static unsigned int timeout_counter = 0;
+
+    if (TrackingTable == NULL) return;
+    if (server.tracking_table_max_keys == 0) return; /* No limits set. */
+    size_t max_keys = server.tracking_table_max_keys;
+    if (raxSize(TrackingTable) <= max_keys) {
+        timeout_counter = 0;
+        return; /* Limit already respected. */
+    }
+
+    int effort = 100 * (timeout_counter+1);
+    raxIterator ri;
+    raxStart(&ri,TrackingTable);
+    while(effort > 0) {
+        effort--;
+        raxSeek(&ri,"^",NULL,0);
+        raxRandomWalk(&ri,0);
+        if (raxEOF(&ri)) break;
+        trackingInvalidateKeyRaw((char*)ri.key,ri.key_len,0);
+        if (raxSize(TrackingTable) <= max_keys) {
+            timeout_counter = 0;
+            raxStop(&ri);
+            return; /* Return ASAP: we are again under the limit. */
+        }
+    }
+
+    /* If we reach this point, we were not able to go under the configured
+     * limit using the maximum effort we had for this run. */
+    raxStop(&ri);
+    timeout_counter++;
+}
+
+/* This function will run the prefixes of clients in BCAST mode and
+ * keys that were modified about each prefix, and will send the
+ * notifications to each client in each prefix. The protocol of the
+ * message is generated once per prefix and copied to every client. */
+void trackingBroadcastInvalidationMessages(void) {
+    raxIterator ri, ri2;
+
+    /* Return ASAP if there is nothing to do here. */
+    if (TrackingTable == NULL || !server.tracking_clients) return;
+
+    raxStart(&ri,PrefixTable);
+    raxSeek(&ri,"^",NULL,0);
+    while(raxNext(&ri)) {
+        bcastState *bs = ri.data;
+        if (raxSize(bs->keys)) {
+            /* Create the array reply with the list of keys once, then send
+             * it to all the clients subscribed to this prefix. */
+            char buf[32];
+            size_t len = ll2string(buf,sizeof(buf),raxSize(bs->keys));
+            sds proto = sdsempty();
+            proto = sdsMakeRoomFor(proto,raxSize(bs->keys)*15);
+            proto = sdscatlen(proto,"*",1);
+            proto = sdscatlen(proto,buf,len);
+            proto = sdscatlen(proto,"\r\n",2);
+            raxStart(&ri2,bs->keys);
+            raxSeek(&ri2,"^",NULL,0);
+            while(raxNext(&ri2)) {
+                len = ll2string(buf,sizeof(buf),ri2.key_len);
+                proto = sdscatlen(proto,"$",1);
+                proto = sdscatlen(proto,buf,len);
+                proto = sdscatlen(proto,"\r\n",2);
+                proto = sdscatlen(proto,ri2.key,ri2.key_len);
+                proto = sdscatlen(proto,"\r\n",2);
+            }
+            raxStop(&ri2);
+
+            /* Send this array of keys to every client in the list. */
+            raxStart(&ri2,bs->clients);
+            raxSeek(&ri2,"^",NULL,0);
+            while(raxNext(&ri2)) {
+                client *c;
+                memcpy(&c,ri2.key,sizeof(c));
+                sendTrackingMessage(c,proto,sdslen(proto),1);
+            }
+            raxStop(&ri2);
+
+            /* Clean up: we can remove everything from this state, because we
+             * want to only track the new keys that will be accumulated starting
+             * from now. */
+            sdsfree(proto);
+            raxFree(bs->keys);
+            bs->keys = raxNew();
+        }
+    }
+    raxStop(&ri);
+}
+
+/* This is just used in order to access the amount of used slots in the
+ * tracking table. */
+uint64_t trackingGetTotalItems(void) {
+    return TrackingTableTotalItems;
+}
+
+uint64_t trackingGetTotalKeys(void) {
+    if (TrackingTable == NULL) return 0;
+    return raxSize(TrackingTable);
+}
+
+uint64_t trackingGetTotalPrefixes(void) {
+    if (PrefixTable == NULL) return 0;
+    return raxSize(PrefixTable);
+}